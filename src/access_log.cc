@@ -0,0 +1,429 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "access_log.h"
+#include "crc32.h"
+
+// Fixed size fields are stored big endian, byte by byte.
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    for (int i = 3; i >= 0; --i) {
+        p[i] = v;
+        v >>= 8;
+    }
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+    for (int i = 7; i >= 0; --i) {
+        p[i] = v;
+        v >>= 8;
+    }
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t(p[0]) << 8) | p[1];
+}
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint64_t get64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static void putVarint(std::vector<uint8_t> &buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back(static_cast<uint8_t>(v) | 0x80);
+        v >>= 7;
+    }
+    buf.push_back(static_cast<uint8_t>(v));
+}
+
+static bool getVarint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t b = *p++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int seekFile(FILE *fp, uint64_t offset, int whence) {
+#ifdef WIN32
+    return _fseeki64(fp, offset, whence);
+#else
+    return fseeko(fp, offset, whence);
+#endif
+}
+
+bool AccessLog::isAccessLog(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    uint8_t buf[4];
+    bool rv = fread(buf, sizeof(buf), 1, fp) == 1 && get32(buf) == MAGIC;
+    fclose(fp);
+    return rv;
+}
+
+// ----------------------------------------------------------------------
+// Writing
+// ----------------------------------------------------------------------
+
+AccessLogWriter::AccessLogWriter(const std::string &path, size_t bs)
+    : logPath(path), blockSize(bs ? bs : 4096), file(NULL), offset(0),
+      numKeys(0), blockKeys(0), prevSeqno(0) {
+    block.reserve(blockSize + LOG_ENTRY_BUF_SIZE);
+}
+
+AccessLogWriter::~AccessLogWriter() {
+    if (file != NULL) {
+        // Never committed, the file is of no use to anyone.
+        fclose(file);
+        remove(logPath.c_str());
+    }
+}
+
+void AccessLogWriter::open() {
+    file = fopen(logPath.c_str(), "wb");
+    if (file == NULL) {
+        throw MutationLog::WriteException("Unable to open log file: " +
+                                          logPath + ": " + strerror(errno));
+    }
+    // The header is filled in by commit()
+    uint8_t hdr[AccessLog::HEADER_SIZE];
+    memset(hdr, 0, sizeof(hdr));
+    write(hdr, sizeof(hdr));
+}
+
+void AccessLogWriter::addVBucket(uint16_t vbid,
+                        std::vector<std::pair<uint64_t, std::string> > &keys) {
+    if (index.find(vbid) != index.end()) {
+        throw std::invalid_argument("AccessLogWriter::addVBucket: vbucket " +
+                                    std::to_string(vbid) +
+                                    " is in the log already");
+    }
+    if (keys.empty()) {
+        return;
+    }
+
+    std::sort(keys.begin(), keys.end());
+
+    AccessLog::Section &section = index[vbid];
+    section.offset = offset;
+    for (auto &k : keys) {
+        // prevKey and prevSeqno are reset at the start of a block
+        const std::string &key = k.second;
+        size_t max = std::min(key.length(), prevKey.length());
+        size_t shared = 0;
+        while (shared < max && key[shared] == prevKey[shared]) {
+            ++shared;
+        }
+        putVarint(block, shared);
+        putVarint(block, key.length() - shared);
+        block.insert(block.end(), key.begin() + shared, key.end());
+        putVarint(block, k.first - prevSeqno);
+
+        prevKey = key;
+        prevSeqno = k.first;
+        ++blockKeys;
+        if (block.size() >= blockSize) {
+            flushBlock();
+            ++section.numBlocks;
+        }
+    }
+    if (blockKeys > 0) {
+        flushBlock();
+        ++section.numBlocks;
+    }
+    section.numKeys = keys.size();
+    numKeys += keys.size();
+}
+
+void AccessLogWriter::flushBlock() {
+    uint8_t hdr[AccessLog::BLOCK_HEADER_SIZE];
+    put32(hdr, block.size());
+    put32(hdr + 4, blockKeys);
+    put32(hdr + 8, crc32buf(block.data(), block.size()));
+    write(hdr, sizeof(hdr));
+    write(block.data(), block.size());
+
+    block.clear();
+    blockKeys = 0;
+    prevKey.clear();
+    prevSeqno = 0;
+}
+
+void AccessLogWriter::commit() {
+    if (file == NULL) {
+        throw MutationLog::WriteException("Access log '" + logPath +
+                                          "' is not open");
+    }
+
+    uint64_t indexOffset = offset;
+    std::vector<uint8_t> buf(index.size() * AccessLog::INDEX_ENTRY_SIZE + 4);
+    uint8_t *p = buf.data();
+    for (auto &it : index) {
+        put16(p, it.first);
+        put16(p + 2, 0);
+        put32(p + 4, it.second.numBlocks);
+        put64(p + 8, it.second.offset);
+        put64(p + 16, it.second.numKeys);
+        p += AccessLog::INDEX_ENTRY_SIZE;
+    }
+    put32(p, crc32buf(buf.data(), p - buf.data()));
+    write(buf.data(), buf.size());
+
+    uint8_t hdr[AccessLog::HEADER_SIZE];
+    memset(hdr, 0, sizeof(hdr));
+    put32(hdr, AccessLog::MAGIC);
+    put32(hdr + 4, AccessLog::VERSION);
+    put32(hdr + 8, index.size());
+    put64(hdr + 16, numKeys);
+    put64(hdr + 24, indexOffset);
+    put32(hdr + 36, crc32buf(hdr, 36));
+
+    if (seekFile(file, 0, SEEK_SET) != 0) {
+        throw MutationLog::WriteException("Failed to seek in access log '" +
+                                          logPath + "': " + strerror(errno));
+    }
+    write(hdr, sizeof(hdr));
+
+    bool ok = fflush(file) == 0;
+#ifndef WIN32
+    ok = ok && fsync(fileno(file)) == 0;
+#endif
+    ok = (fclose(file) == 0) && ok;
+    file = NULL;
+    if (!ok) {
+        remove(logPath.c_str());
+        throw MutationLog::WriteException("Failed to sync access log '" +
+                                          logPath + "': " + strerror(errno));
+    }
+}
+
+void AccessLogWriter::write(const void *buf, size_t len) {
+    if (fwrite(buf, len, 1, file) != 1) {
+        throw MutationLog::WriteException("Failed to write access log '" +
+                                          logPath + "': " + strerror(errno));
+    }
+    offset += len;
+}
+
+// ----------------------------------------------------------------------
+// Reading
+// ----------------------------------------------------------------------
+
+AccessLogReader::AccessLogReader(const std::string &path)
+    : logPath(path), file(NULL), fileSize(0), numKeys(0), readOffset(0) {
+    file = fopen(logPath.c_str(), "rb");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            throw MutationLog::FileNotFoundException(logPath);
+        }
+        throw MutationLog::ReadException("Unable to open log file: " +
+                                         logPath + ": " + strerror(errno));
+    }
+
+    try {
+        if (seekFile(file, 0, SEEK_END) != 0) {
+            throw MutationLog::ReadException("Failed to seek in log file: " +
+                                             logPath);
+        }
+#ifdef WIN32
+        fileSize = _ftelli64(file);
+#else
+        fileSize = ftello(file);
+#endif
+
+        uint8_t hdr[AccessLog::HEADER_SIZE];
+        read(0, hdr, sizeof(hdr));
+        if (get32(hdr) != AccessLog::MAGIC ||
+            get32(hdr + 4) != AccessLog::VERSION) {
+            throw MutationLog::ReadException("Not an access log: " + logPath);
+        }
+        if (get32(hdr + 36) != crc32buf(hdr, 36)) {
+            throw MutationLog::CRCReadException();
+        }
+        uint32_t numVBuckets = get32(hdr + 8);
+        numKeys = get64(hdr + 16);
+        uint64_t indexOffset = get64(hdr + 24);
+
+        std::vector<uint8_t> buf(numVBuckets * AccessLog::INDEX_ENTRY_SIZE +
+                                 4);
+        read(indexOffset, buf.data(), buf.size());
+        const uint8_t *p = buf.data();
+        const uint8_t *end = p + numVBuckets * AccessLog::INDEX_ENTRY_SIZE;
+        if (get32(end) != crc32buf(buf.data(), end - buf.data())) {
+            throw MutationLog::CRCReadException();
+        }
+        for (; p < end; p += AccessLog::INDEX_ENTRY_SIZE) {
+            AccessLog::Section &section = index[get16(p)];
+            section.numBlocks = get32(p + 4);
+            section.offset = get64(p + 8);
+            section.numKeys = get64(p + 16);
+            if (section.offset < AccessLog::HEADER_SIZE ||
+                section.offset > indexOffset) {
+                throw MutationLog::ReadException("Bad section offset in " +
+                                                 logPath);
+            }
+        }
+    } catch (...) {
+        fclose(file);
+        throw;
+    }
+}
+
+AccessLogReader::~AccessLogReader() {
+    fclose(file);
+}
+
+size_t AccessLogReader::getNumKeys(uint16_t vbid) const {
+    auto it = index.find(vbid);
+    return it == index.end() ? 0 : it->second.numKeys;
+}
+
+std::vector<uint16_t> AccessLogReader::getVBuckets() const {
+    std::vector<uint16_t> rv;
+    for (auto &it : index) {
+        rv.push_back(it.first);
+    }
+    return rv;
+}
+
+bool AccessLogReader::apply(uint16_t vbid, size_t batchSize, void *arg,
+                            mlCallbackWithQueue mlc) {
+    auto it = index.find(vbid);
+    if (it == index.end()) {
+        return true;
+    }
+
+    std::vector<std::pair<std::string, uint64_t> > batch;
+    batch.reserve(batchSize);
+    uint64_t seen = 0;
+    readOffset = it->second.offset;
+    for (uint32_t i = 0; i < it->second.numBlocks; ++i) {
+        readBlock(batch);
+        if (batch.size() >= batchSize) {
+            seen += batch.size();
+            if (!mlc(vbid, batch, arg)) {
+                return false;
+            }
+            batch.clear();
+        }
+    }
+    seen += batch.size();
+    if (seen != it->second.numKeys) {
+        throw MutationLog::ReadException("Key count mismatch in " + logPath);
+    }
+    return batch.empty() || mlc(vbid, batch, arg);
+}
+
+bool AccessLogReader::apply(uint16_t vbid, void *arg, mlCallback mlc) {
+    auto it = index.find(vbid);
+    if (it == index.end()) {
+        return true;
+    }
+
+    std::vector<std::pair<std::string, uint64_t> > batch;
+    readOffset = it->second.offset;
+    for (uint32_t i = 0; i < it->second.numBlocks; ++i) {
+        readBlock(batch);
+        for (auto &k : batch) {
+            if (!mlc(arg, vbid, k.first)) {
+                return false;
+            }
+        }
+        batch.clear();
+    }
+    return true;
+}
+
+void AccessLogReader::readBlock(
+                        std::vector<std::pair<std::string, uint64_t> > &batch) {
+    uint8_t hdr[AccessLog::BLOCK_HEADER_SIZE];
+    read(readOffset, hdr, sizeof(hdr));
+    uint32_t size = get32(hdr);
+    uint32_t count = get32(hdr + 4);
+    blockBuf.resize(size);
+    read(readOffset + sizeof(hdr), blockBuf.data(), size);
+    if (get32(hdr + 8) != crc32buf(blockBuf.data(), size)) {
+        throw MutationLog::CRCReadException();
+    }
+    readOffset += sizeof(hdr) + size;
+
+    const uint8_t *p = blockBuf.data();
+    const uint8_t *end = p + size;
+    std::string key;
+    uint64_t seqno = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t shared, len, delta;
+        if (!getVarint(p, end, shared) || !getVarint(p, end, len) ||
+            shared > key.length() || len > uint64_t(end - p)) {
+            throw MutationLog::ReadException("Corrupt block in " + logPath);
+        }
+        key.resize(shared);
+        key.append(reinterpret_cast<const char*>(p), len);
+        p += len;
+        if (!getVarint(p, end, delta)) {
+            throw MutationLog::ReadException("Corrupt block in " + logPath);
+        }
+        seqno += delta;
+        batch.push_back(std::make_pair(key, seqno));
+    }
+    if (p != end) {
+        throw MutationLog::ReadException("Corrupt block in " + logPath);
+    }
+}
+
+void AccessLogReader::read(uint64_t at, void *buf, size_t len) {
+    if (at > fileSize || len > fileSize - at) {
+        throw MutationLog::ShortReadException();
+    }
+    if (seekFile(file, at, SEEK_SET) != 0 || fread(buf, len, 1, file) != 1) {
+        throw MutationLog::ShortReadException();
+    }
+}
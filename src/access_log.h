@@ -0,0 +1,185 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_ACCESS_LOG_H_
+#define SRC_ACCESS_LOG_H_ 1
+
+#include "config.h"
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mutation_log.h"
+
+/**
+ * The access log of a shard: the resident keys of each vbucket, sorted by
+ * seqno. Couchstore appends documents in seqno order, so warmup reads
+ * them front to back rather than all over the file.
+ *
+ * The file is a header, a section of blocks per vbucket and an index of
+ * the sections. A block holds its payload size, key count and CRC, then
+ * the keys, each as the length of the prefix it shares with the key
+ * before it, the rest of the key and the seqno delta. The first key of a
+ * block is stored whole so each block decodes on its own. Integers in the
+ * header, index and block headers are in network byte order, those in
+ * the payload are varints.
+ *
+ * The index lets the vbuckets of a shard be loaded by several tasks at
+ * once, each streaming its sections without reading the others.
+ */
+class AccessLog {
+public:
+    //! "ALG2", unlike the version a MutationLog starts with
+    static const uint32_t MAGIC = 0x414c4732;
+    static const uint32_t VERSION = 1;
+    static const size_t HEADER_SIZE = 40;
+    static const size_t INDEX_ENTRY_SIZE = 24;
+    static const size_t BLOCK_HEADER_SIZE = 12;
+
+    //! Where the keys of a vbucket are in the file
+    struct Section {
+        Section() : offset(0), numBlocks(0), numKeys(0) { }
+
+        uint64_t offset;
+        uint32_t numBlocks;
+        uint64_t numKeys;
+    };
+
+    //! True if the file at path exists and is in this format
+    static bool isAccessLog(const std::string &path);
+};
+
+/**
+ * Writes an access log, a vbucket at a time. The file is only complete
+ * once committed, and is removed if the writer goes away before that.
+ *
+ * Failures throw MutationLog::WriteException.
+ */
+class AccessLogWriter {
+public:
+    AccessLogWriter(const std::string &path, size_t blockSize);
+
+    ~AccessLogWriter();
+
+    void open();
+
+    bool isOpen() const {
+        return file != NULL;
+    }
+
+    /**
+     * Write the section of a vbucket. Each vbucket may be added once.
+     *
+     * @param vbid the vbucket
+     * @param keys seqno and key of each resident item, sorted here
+     */
+    void addVBucket(uint16_t vbid,
+                    std::vector<std::pair<uint64_t, std::string> > &keys);
+
+    //! Write the index and header, and sync the file
+    void commit();
+
+    size_t getItemsLogged() const {
+        return numKeys;
+    }
+
+    const std::string &getLogFile() const {
+        return logPath;
+    }
+
+private:
+    void flushBlock();
+    void write(const void *buf, size_t len);
+
+    const std::string logPath;
+    const size_t blockSize;
+    FILE *file;
+    uint64_t offset;
+    uint64_t numKeys;
+    std::map<uint16_t, AccessLog::Section> index;
+    std::vector<uint8_t> block;
+    uint32_t blockKeys;
+    std::string prevKey;
+    uint64_t prevSeqno;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessLogWriter);
+};
+
+/**
+ * Reads an access log back, a vbucket at a time. Nothing but the index is
+ * kept in memory; the keys of a vbucket are decoded block by block and
+ * handed out in batches.
+ *
+ * Failures throw MutationLog::ReadException (or one of its subclasses).
+ * A reader is not shared by threads, every loading task opens its own.
+ */
+class AccessLogReader {
+public:
+    AccessLogReader(const std::string &path);
+
+    ~AccessLogReader();
+
+    //! The number of keys in the log
+    size_t total() const {
+        return numKeys;
+    }
+
+    //! The number of keys of a vbucket
+    size_t getNumKeys(uint16_t vbid) const;
+
+    //! The vbuckets in the log
+    std::vector<uint16_t> getVBuckets() const;
+
+    /**
+     * Pass the keys of a vbucket in seqno order to mlc, in batches of
+     * whole blocks once at least batchSize keys are decoded.
+     *
+     * @return false if the callback asked to stop
+     */
+    bool apply(uint16_t vbid, size_t batchSize, void *arg,
+               mlCallbackWithQueue mlc);
+
+    /**
+     * Pass the keys of a vbucket in seqno order to mlc, one at a time.
+     *
+     * @return false if the callback asked to stop
+     */
+    bool apply(uint16_t vbid, void *arg, mlCallback mlc);
+
+private:
+    /**
+     * Read and check the next block of a section, appending its keys to
+     * the batch.
+     */
+    void readBlock(std::vector<std::pair<std::string, uint64_t> > &batch);
+    void read(uint64_t at, void *buf, size_t len);
+
+    const std::string logPath;
+    FILE *file;
+    uint64_t fileSize;
+    uint64_t numKeys;
+    std::map<uint16_t, AccessLog::Section> index;
+    uint64_t readOffset;
+    std::vector<uint8_t> blockBuf;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessLogReader);
+};
+
+#endif  // SRC_ACCESS_LOG_H_
@@ -19,9 +19,9 @@
 
 #include <iostream>
 
+#include "access_log.h"
 #include "access_scanner.h"
 #include "ep_engine.h"
-#include "mutation_log.h"
 
 class ItemAccessVisitor : public VBucketVisitor {
 public:
@@ -38,11 +38,14 @@ public:
         prev = name + ".old";
         next = name + ".next";
 
-        log = new MutationLog(next, conf.getAlogBlockSize());
-        log->open();
+        log = new AccessLogWriter(next, conf.getAlogBlockSize());
+        try {
+            log->open();
+        } catch (MutationLog::WriteException &e) {
+            LOG(EXTENSION_LOG_WARNING, "Failed to open access log: '%s': %s",
+                next.c_str(), e.what());
+        }
         if (!log->isOpen()) {
-            LOG(EXTENSION_LOG_WARNING, "Failed to open access log: '%s'",
-                next.c_str());
             delete log;
             log = NULL;
         } else {
@@ -63,10 +66,14 @@ public:
     }
 
     void update() {
-        if (log != NULL) {
-            std::list<std::pair<uint64_t, std::string> >::iterator it;
-            for (it = accessed.begin(); it != accessed.end(); ++it) {
-                log->newItem(currentBucket->getId(), it->second, it->first);
+        if (log != NULL && !accessed.empty()) {
+            try {
+                log->addVBucket(currentBucket->getId(), accessed);
+            } catch (MutationLog::WriteException &e) {
+                LOG(EXTENSION_LOG_WARNING, "Failed to write access log: %s",
+                    e.what());
+                delete log;
+                log = NULL;
             }
         }
         accessed.clear();
@@ -86,9 +93,15 @@ public:
         update();
 
         if (log != NULL) {
-            size_t num_items = log->itemsLogged[ML_NEW];
-            log->commit1();
-            log->commit2();
+            size_t num_items = log->getItemsLogged();
+            bool committed = true;
+            try {
+                log->commit();
+            } catch (MutationLog::WriteException &e) {
+                LOG(EXTENSION_LOG_WARNING, "Failed to commit access log: %s",
+                    e.what());
+                committed = false;
+            }
             delete log;
             log = NULL;
             ++stats.alogRuns;
@@ -96,6 +109,11 @@ public:
             stats.alogNumItems.store(num_items);
             stats.accessScannerHisto.add((gethrtime() - taskStart) / 1000);
 
+            if (!committed) {
+                updateStateFinalizer();
+                return;
+            }
+
             if (num_items == 0) {
                 LOG(EXTENSION_LOG_NOTICE, "The new access log file is empty. "
                     "Delete it without replacing the current access log...");
@@ -157,9 +175,9 @@ private:
     std::string name;
     uint16_t shardID;
 
-    std::list<std::pair<uint64_t, std::string> > accessed;
+    std::vector<std::pair<uint64_t, std::string> > accessed;
 
-    MutationLog *log;
+    AccessLogWriter *log;
     AtomicValue<bool> &stateFinalizer;
     AccessScanner &as;
 };
@@ -168,6 +168,17 @@ private:
         return --_rc_refcount;
     }
 
+    // Only take a reference if somebody still holds one.
+    bool _rc_tryincref() const {
+        int rc = _rc_refcount.load();
+        while (rc > 0) {
+            if (_rc_refcount.compare_exchange_weak(rc, rc + 1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     mutable AtomicValue<int> _rc_refcount;
 };
 
@@ -267,6 +278,11 @@ public:
 
     SingleThreadedRCPtr(const SingleThreadedRCPtr<T> &other) : value(other.gimme()) {}
 
+    SingleThreadedRCPtr(SingleThreadedRCPtr<T> &&other) noexcept
+        : value(other.value) {
+        other.value = NULL;
+    }
+
     ~SingleThreadedRCPtr() {
         if (value && static_cast<RCValue *>(value)->_rc_decref() == 0) {
             delete value;
@@ -294,6 +310,15 @@ public:
         return *this;
     }
 
+    SingleThreadedRCPtr<T> & operator =(SingleThreadedRCPtr<T> &&other) noexcept {
+        if (this != &other) {
+            T *moved = other.value;
+            other.value = NULL;
+            swap(moved);
+        }
+        return *this;
+    }
+
     T &operator *() const {
         return *value;
     }
@@ -310,6 +335,19 @@ public:
         return (bool)value;
     }
 
+    /**
+     * Get a pointer to a value that may be released concurrently. The
+     * memory of {v} has to stay valid for the duration of the call
+     * (see ReadEpoch); the result is empty if the value was released.
+     */
+    static SingleThreadedRCPtr<T> tryAcquire(T *v) {
+        SingleThreadedRCPtr<T> rv;
+        if (v && static_cast<RCValue *>(v)->_rc_tryincref()) {
+            rv.value = v;
+        }
+        return rv;
+    }
+
 private:
     T *gimme() const {
         if (value) {
@@ -53,8 +53,10 @@ void ItemResidentCallback::callback(CacheLookup &lookup) {
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(lookup.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num);
+    int key_hash = vb->ht.hash(lookup.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num,
+                                          key_hash, false, true);
     if (v && v->isResident() && v->getBySeqno() == lookup.getBySeqno()) {
         Item* it = v->toItem(false, lookup.getVBucketId());
         lh.unlock();
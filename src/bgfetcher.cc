@@ -46,17 +46,25 @@ void BgFetcher::notifyBGEvent(void) {
     ++stats.numRemainingBgJobs;
     bool inverse = false;
     if (pendingFetch.compare_exchange_strong(inverse, true)) {
-        ExecutorPool::get()->wake(taskId);
+        double delay = store->getBGFetchDelay();
+        if (delay > 0) {
+            // Fetches pile up over the delay (a test feature)
+            ExecutorPool::get()->snooze(taskId, delay);
+        } else {
+            ExecutorPool::get()->wake(taskId);
+        }
     }
 }
 
-size_t BgFetcher::doFetch(VBucket::id_type vbId) {
+size_t BgFetcher::doFetch(VBucket::id_type vbId,
+                          vb_bgfetch_queue_t &items2fetch) {
     hrtime_t startTime(gethrtime());
     LOG(EXTENSION_LOG_DEBUG, "BgFetcher is fetching data, vBucket = %d "
         "numDocs = %" PRIu64 ", startTime = %" PRIu64,
         vbId, uint64_t(items2fetch.size()), startTime/1000000);
 
     shard->getROUnderlying()->getMulti(vbId, items2fetch);
+    hrtime_t diskTime = gethrtime() - startTime;
 
     size_t totalfetches = 0;
     std::vector<bgfetched_item_t> fetchedItems;
@@ -73,16 +81,27 @@ size_t BgFetcher::doFetch(VBucket::id_type vbId) {
     }
 
     if (totalfetches > 0) {
+        stats.bgFetchDiskHisto.add(diskTime / 1000, totalfetches);
         store->completeBGFetchMulti(vbId, fetchedItems, startTime);
         stats.getMultiHisto.add((gethrtime()-startTime)/1000, totalfetches);
     }
 
     // failed requests will get requeued for retry within clearItems()
-    clearItems(vbId);
+    clearItems(items2fetch);
     return totalfetches;
 }
 
-void BgFetcher::clearItems(VBucket::id_type vbId) {
+void BgFetcher::fetchVBucket(VBucket::id_type vbId) {
+    RCPtr<VBucket> vb = shard->getBucket(vbId);
+    vb_bgfetch_queue_t items2fetch;
+    ++stats.bgFetchTasks;
+    if (vb && vb->getBGFetchItems(items2fetch)) {
+        stats.numRemainingBgJobs.fetch_sub(doFetch(vbId, items2fetch));
+    }
+    --numInFlight;
+}
+
+void BgFetcher::clearItems(vb_bgfetch_queue_t &items2fetch) {
     vb_bgfetch_queue_t::iterator itr = items2fetch.begin();
 
     for(; itr != items2fetch.end(); ++itr) {
@@ -128,9 +147,21 @@ bool BgFetcher::run(GlobalTask *task) {
             continue;
         }
         RCPtr<VBucket> vb = shard->getBucket(vbId);
-        if (vb && vb->getBGFetchItems(items2fetch)) {
-            num_fetched_items += doFetch(vbId);
-            items2fetch.clear();
+        if (!vb || !vb->hasPendingBGFetchItems()) {
+            continue;
+        }
+        // A reader task of its own while there are lanes left, so a burst
+        // of misses over many vbuckets does not wait on one reader.
+        if (numInFlight.load() + 1 < parallelism) {
+            ++numInFlight;
+            ExTask task = new VBucketBGFetchTask(&(store->getEPEngine()),
+                                                 this, vbId);
+            ExecutorPool::get()->schedule(task, READER_TASK_IDX);
+            continue;
+        }
+        vb_bgfetch_queue_t items2fetch;
+        if (vb->getBGFetchItems(items2fetch)) {
+            num_fetched_items += doFetch(vbId, items2fetch);
         }
     }
 
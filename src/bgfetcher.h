@@ -47,9 +47,12 @@ public:
      * @param s  The store
      * @param k  The shard to which this background fetcher belongs
      * @param st reference to statistics
+     * @param p  Max number of vbuckets fetched from at once
      */
-    BgFetcher(EventuallyPersistentStore *s, KVShard *k, EPStats &st) :
-        store(s), shard(k), taskId(0), stats(st), pendingFetch(false) {}
+    BgFetcher(EventuallyPersistentStore *s, KVShard *k, EPStats &st,
+              size_t p = 1) :
+        store(s), shard(k), taskId(0), stats(st), parallelism(p),
+        numInFlight(0), pendingFetch(false) {}
     ~BgFetcher() {
         LockHolder lh(queueMutex);
         if (!pendingVbs.empty()) {
@@ -71,17 +74,26 @@ public:
         pendingVbs.insert(vbId);
     }
 
+    /**
+     * Fetch the pending items of a vbucket; run by a VBucketBGFetchTask
+     * next to the fetches of the other vbuckets.
+     */
+    void fetchVBucket(VBucket::id_type vbId);
+
 private:
-    size_t doFetch(VBucket::id_type vbId);
-    void clearItems(VBucket::id_type vbId);
+    size_t doFetch(VBucket::id_type vbId, vb_bgfetch_queue_t &items2fetch);
+    void clearItems(vb_bgfetch_queue_t &items2fetch);
 
     EventuallyPersistentStore *store;
     KVShard *shard;
-    vb_bgfetch_queue_t items2fetch;
     size_t taskId;
     Mutex queueMutex;
     EPStats &stats;
 
+    const size_t parallelism;
+    //! Number of VBucketBGFetchTasks scheduled and not done yet
+    AtomicValue<size_t> numInFlight;
+
     AtomicValue<bool> pendingFetch;
     std::set<VBucket::id_type> pendingVbs;
 };
@@ -19,6 +19,7 @@
 
 #include <platform/checked_snprintf.h>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -122,7 +123,7 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
     }
     queue_dirty_t rv;
 
-    checkpoint_index::iterator it = keyIndex.find(qi->getKey());
+    checkpoint_key_index::iterator it = keyIndex.find(qi->getKey());
 
     // Check if the item is a meta item
     if (qi->isCheckPointMetaItem()) {
@@ -132,7 +133,7 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
         // Check if this checkpoint already had an item for the same key
         if (it != keyIndex.end()) {
             rv = EXISTING_ITEM;
-            std::list<queued_item>::iterator currPos = it->second.position;
+            CheckpointQueue::iterator currPos = toWrite.at(it->second.position);
             uint64_t currMutationId = it->second.mutation_id;
 
             cursor_index::iterator map_it =
@@ -142,7 +143,7 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
                 if (*(map_it->second.currentCheckpoint) == this) {
                     queued_item &tqi = *(map_it->second.currentPos);
                     const std::string &key = tqi->getKey();
-                    checkpoint_index::iterator ita = keyIndex.find(key);
+                    checkpoint_key_index::iterator ita = keyIndex.find(key);
                     if (ita != keyIndex.end() && (!tqi->isCheckPointMetaItem()))
                     {
                         uint64_t mutationId = ita->second.mutation_id;
@@ -163,7 +164,10 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
             }
 
             toWrite.push_back(qi);
-            // Remove the existing item for the same key from the list.
+            // The index must not refer to the key of the item released
+            // by the erase below.
+            it->first.key = &qi->getKey();
+            // Remove the existing item for the same key from the queue.
             toWrite.erase(currPos);
         } else {
             ++numItems;
@@ -174,20 +178,24 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
     }
 
     if (qi->getNKey() > 0) {
-        std::list<queued_item>::iterator last = toWrite.end();
-        // --last is okay as the list is not empty now.
-        index_entry entry = {--last, qi->getBySeqno()};
+        CheckpointQueue::iterator last = toWrite.end();
+        // --last is okay as the queue is not empty now.
+        index_entry entry = {(--last).index(), qi->getBySeqno()};
         // Set the index of the key to the new item that is pushed back into
-        // the list.
+        // the queue.
         if (qi->isCheckPointMetaItem()) {
             // We add a meta item only once to a checkpoint
             metaKeyIndex[qi->getKey()] = entry;
+        } else if (it != keyIndex.end()) {
+            it->second = entry;
         } else {
-            keyIndex[qi->getKey()] = entry;
+            keyIndex.emplace(checkpoint_key(qi->getKey()), entry);
         }
         if (rv == NEW_ITEM) {
-            size_t newEntrySize = qi->getNKey() + sizeof(index_entry) +
-                                  sizeof(queued_item);
+            size_t newEntrySize = qi->isCheckPointMetaItem() ?
+                qi->getNKey() + sizeof(index_entry) + sizeof(queued_item) :
+                sizeof(checkpoint_key) + sizeof(index_entry) +
+                sizeof(queued_item);
             memOverhead += newEntrySize;
             stats.memOverhead.fetch_add(newEntrySize);
             if (stats.memOverhead.load() >= GIGANTOR) {
@@ -199,6 +207,10 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
         }
     }
 
+    if (toWrite.needsCompaction()) {
+        compactQueue(checkpointManager);
+    }
+
     // Notify flusher if in case queued item is a checkpoint meta item
     if (qi->getOperation() == queue_op_checkpoint_start ||
         qi->getOperation() == queue_op_checkpoint_end) {
@@ -211,14 +223,13 @@ queue_dirty_t Checkpoint::queueDirty(const queued_item &qi,
 size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
     size_t numNewItems = 0;
     size_t newEntryMemOverhead = 0;
-    std::list<queued_item>::reverse_iterator rit = pPrevCheckpoint->rbegin();
 
     LOG(EXTENSION_LOG_INFO,
         "Collapse the checkpoint %" PRIu64 " into the checkpoint %" PRIu64
         " for vbucket %d",
         pPrevCheckpoint->getId(), checkpointId, vbucketId);
 
-    std::list<queued_item>::iterator itr = toWrite.begin();
+    CheckpointQueue::iterator itr = toWrite.begin();
     uint64_t seqno = pPrevCheckpoint->getMutationIdForKey("dummy_key", true);
     metaKeyIndex["dummy_key"].mutation_id = seqno;
     (*itr)->setBySeqno(seqno);
@@ -228,30 +239,41 @@ size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
     ++itr;
     (*itr)->setBySeqno(seqno);
 
-    for (; rit != pPrevCheckpoint->rend(); ++rit) {
-        const std::string &key = (*rit)->getKey();
-        if ((*rit)->getOperation() != queue_op_del &&
-            (*rit)->getOperation() != queue_op_set) {
+    // The items taken from the previous checkpoint go in between the
+    // first two meta items and the items of this one, so the queue is
+    // built anew; positions are set by reindex() once it is complete.
+    CheckpointQueue merged;
+    merged.push_back(*toWrite.begin());
+    merged.push_back(*itr);
+    ++itr;
+
+    CheckpointQueue::iterator pit = pPrevCheckpoint->begin();
+    for (; pit != pPrevCheckpoint->end(); ++pit) {
+        const std::string &key = (*pit)->getKey();
+        if ((*pit)->getOperation() != queue_op_del &&
+            (*pit)->getOperation() != queue_op_set) {
             continue;
         }
-        checkpoint_index::iterator it = keyIndex.find(key);
-        if (it == keyIndex.end()) {
-            std::list<queued_item>::iterator pos = toWrite.begin();
-            // Skip the first two meta items
-            ++pos; ++pos;
-            toWrite.insert(pos, *rit);
-            index_entry entry = {--pos, static_cast<int64_t>(pPrevCheckpoint->
+        if (keyIndex.find(key) == keyIndex.end()) {
+            merged.push_back(*pit);
+            index_entry entry = {0, static_cast<int64_t>(pPrevCheckpoint->
                                             getMutationIdForKey(key, false))};
-            keyIndex[key] = entry;
-            newEntryMemOverhead += key.size() + sizeof(index_entry);
+            keyIndex.emplace(checkpoint_key(key), entry);
+            newEntryMemOverhead += sizeof(checkpoint_key) + sizeof(index_entry);
             ++numItems;
             ++numNewItems;
 
             // Update new checkpoint's memory usage
-            incrementMemConsumption((*rit)->size());
+            incrementMemConsumption((*pit)->size());
         }
     }
 
+    for (; itr != toWrite.end(); ++itr) {
+        merged.push_back(*itr);
+    }
+    toWrite.swap(merged);
+    reindex();
+
     /**
      * Update snapshot start of current checkpoint to the first
      * item's sequence number, after merge completed, as items
@@ -272,17 +294,68 @@ size_t Checkpoint::mergePrevCheckpoint(Checkpoint *pPrevCheckpoint) {
 uint64_t Checkpoint::getMutationIdForKey(const std::string &key, bool isMeta)
 {
     uint64_t mid = 0;
-    checkpoint_index& chkIdx = isMeta ? metaKeyIndex : keyIndex;
+    bool found = false;
 
-    checkpoint_index::iterator it = chkIdx.find(key);
-    if (it != chkIdx.end()) {
-        mid = it->second.mutation_id;
+    if (isMeta) {
+        checkpoint_index::iterator it = metaKeyIndex.find(key);
+        if (it != metaKeyIndex.end()) {
+            mid = it->second.mutation_id;
+            found = true;
+        }
     } else {
+        checkpoint_key_index::iterator it = keyIndex.find(key);
+        if (it != keyIndex.end()) {
+            mid = it->second.mutation_id;
+            found = true;
+        }
+    }
+    if (!found) {
         LOG(EXTENSION_LOG_WARNING, "%s not found in chk index", key.c_str());
     }
     return mid;
 }
 
+void Checkpoint::compactQueue(CheckpointManager *checkpointManager) {
+    std::vector<std::pair<CheckpointCursor*, size_t> > moved;
+    cursor_index::iterator map_it = checkpointManager->connCursors.begin();
+    for (; map_it != checkpointManager->connCursors.end(); ++map_it) {
+        CheckpointCursor &cursor = map_it->second;
+        if (*(cursor.currentCheckpoint) == this) {
+            moved.push_back(std::make_pair(&cursor,
+                                           toWrite.rank(cursor.currentPos)));
+        }
+    }
+
+    toWrite.compact();
+
+    for (size_t i = 0; i < moved.size(); ++i) {
+        moved[i].first->currentPos = toWrite.at(moved[i].second);
+    }
+    reindex();
+}
+
+void Checkpoint::reindex() {
+    CheckpointQueue::iterator it = toWrite.begin();
+    for (; it != toWrite.end(); ++it) {
+        const std::string &key = (*it)->getKey();
+        if (key.empty()) {
+            continue;
+        }
+        if ((*it)->isCheckPointMetaItem()) {
+            checkpoint_index::iterator mit = metaKeyIndex.find(key);
+            if (mit != metaKeyIndex.end()) {
+                mit->second.position = it.index();
+            }
+        } else {
+            checkpoint_key_index::iterator kit = keyIndex.find(key);
+            if (kit != keyIndex.end()) {
+                kit->second.position = it.index();
+                kit->first.key = &key;
+            }
+        }
+    }
+}
+
 bool Checkpoint::isEligibleToBeUnreferenced() {
     const std::set<std::string> &cursors = getCursorNameList();
     std::set<std::string>::const_iterator cit = cursors.begin();
@@ -321,6 +394,7 @@ uint64_t CheckpointManager::getOpenCheckpointId_UNLOCKED() {
 
 uint64_t CheckpointManager::getOpenCheckpointId() {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     return getOpenCheckpointId_UNLOCKED();
 }
 
@@ -334,13 +408,14 @@ uint64_t CheckpointManager::getLastClosedCheckpointId_UNLOCKED() {
 
 uint64_t CheckpointManager::getLastClosedCheckpointId() {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     return getLastClosedCheckpointId_UNLOCKED();
 }
 
 void CheckpointManager::setOpenCheckpointId_UNLOCKED(uint64_t id) {
     if (!checkpointList.empty()) {
         // Update the checkpoint_start item with the new Id.
-        std::list<queued_item>::iterator it =
+        CheckpointQueue::iterator it =
             ++(checkpointList.back()->begin());
         (*it)->setRevSeqno(id);
         if (checkpointList.back()->getId() == 0) {
@@ -459,6 +534,7 @@ bool CheckpointManager::closeOpenCheckpoint_UNLOCKED() {
 
 bool CheckpointManager::closeOpenCheckpoint() {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     return closeOpenCheckpoint_UNLOCKED();
 }
 
@@ -468,6 +544,7 @@ bool CheckpointManager::registerCursor(
                             bool alwaysFromBeginning,
                             MustSendCheckpointEnd needsCheckpointEndMetaItem) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     return registerCursor_UNLOCKED(name, checkpointId, alwaysFromBeginning,
                                    needsCheckpointEndMetaItem);
 }
@@ -477,6 +554,7 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(
                             uint64_t startBySeqno,
                             MustSendCheckpointEnd needsCheckPointEndMetaItem) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     if (checkpointList.empty()) {
         throw std::logic_error("CheckpointManager::registerCursorBySeqno: "
                         "checkpointList is empty");
@@ -510,7 +588,7 @@ CursorRegResult CheckpointManager::registerCursorBySeqno(
             result.first = (*itr)->getLowSeqno();
             break;
         } else if (startBySeqno <= en) {
-            std::list<queued_item>::iterator iitr = (*itr)->begin();
+            CheckpointQueue::iterator iitr = (*itr)->begin();
             while (++iitr != (*itr)->end() &&
                     (startBySeqno >=
                      static_cast<uint64_t>((*iitr)->getBySeqno()))) {
@@ -619,7 +697,7 @@ bool CheckpointManager::registerCursor_UNLOCKED(
         (*it)->registerCursorName(name);
     } else {
         size_t offset = 0;
-        std::list<queued_item>::iterator curr;
+        CheckpointQueue::iterator curr;
 
         LOG(EXTENSION_LOG_DEBUG,
             "Checkpoint %" PRIu64 " for vbucket %d exists in memory. "
@@ -741,6 +819,7 @@ size_t CheckpointManager::removeClosedUnrefCheckpoints(
 
     // This function is executed periodically by the non-IO dispatcher.
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     if (!vbucket) {
         throw std::invalid_argument("CheckpointManager::removeCloseUnrefCheckpoints:"
                         " vbucket must be non-NULL");
@@ -966,11 +1045,106 @@ std::vector<std::string> CheckpointManager::getListOfCursorsToDrop() {
 
 bool CheckpointManager::queueDirty(const RCPtr<VBucket> &vb, queued_item& qi,
                                    bool genSeqno) {
-    LockHolder lh(queueLock);
     if (!vb) {
         throw std::invalid_argument("CheckpointManager::queueDirty: vb must "
                         "be non-NULL");
     }
+    if (genSeqno && stagingSize > 0) {
+        // Whether it replaces an item is only known once it is merged, so
+        // the caller always notifies the flusher.
+        stageDirty(*vb, qi);
+        return true;
+    }
+
+    LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
+    return queueDirty_UNLOCKED(*vb, qi, genSeqno, false);
+}
+
+void CheckpointManager::stageDirty(VBucket &vb, queued_item &qi) {
+    const int64_t seqno = ++reservedSeqno;
+    const int64_t size = static_cast<int64_t>(stagingSize);
+    while (seqno - size > mergedSeqno.load(std::memory_order_acquire)) {
+        // The ring is full: merge it if the lock is free, otherwise the
+        // holder of the lock will.
+        LockHolder lh(queueLock, true);
+        if (lh.islocked()) {
+            mergeStaged_UNLOCKED(false);
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    qi->setBySeqno(seqno);
+    StagedItem &slot = staging[seqno % size];
+    slot.item = qi;
+    slot.vb = &vb;
+    slot.seqno.store(seqno, std::memory_order_release);
+
+    LockHolder lh(queueLock, true);
+    if (lh.islocked()) {
+        mergeStaged_UNLOCKED(false);
+    }
+}
+
+void CheckpointManager::mergeStaged_UNLOCKED(bool all) {
+    if (stagingSize == 0) {
+        return;
+    }
+    const int64_t size = static_cast<int64_t>(stagingSize);
+    while (true) {
+        const int64_t next = lastBySeqno + 1;
+        StagedItem &slot = staging[next % size];
+        if (slot.seqno.load(std::memory_order_acquire) != next) {
+            if (all && reservedSeqno.load() >= next) {
+                // Reserved, and about to be written.
+                std::this_thread::yield();
+                continue;
+            }
+            return;
+        }
+
+        queued_item qi(slot.item);
+        VBucket *vb = slot.vb;
+        slot.item.reset();
+        slot.vb = NULL;
+        slot.seqno.store(0);
+        queueDirty_UNLOCKED(*vb, qi, true, true);
+        // Frees the slot for the writer of next + stagingSize.
+        mergedSeqno.store(next, std::memory_order_release);
+    }
+}
+
+void CheckpointManager::setBySeqno_UNLOCKED(int64_t seqno) {
+    if (stagingSize > 0) {
+        // Writers reserve seqnos without the lock: merge what they have
+        // reserved, and retry if one of them reserved another meanwhile.
+        int64_t expected;
+        do {
+            mergeStaged_UNLOCKED(true);
+            expected = lastBySeqno;
+        } while (!reservedSeqno.compare_exchange_strong(expected, seqno));
+        mergedSeqno.store(seqno);
+    }
+    lastBySeqno = seqno;
+}
+
+int64_t CheckpointManager::nextBySeqno() {
+    LockHolder lh(queueLock);
+    if (stagingSize > 0) {
+        int64_t expected;
+        do {
+            mergeStaged_UNLOCKED(true);
+            expected = lastBySeqno;
+        } while (!reservedSeqno.compare_exchange_strong(expected,
+                                                        expected + 1));
+        mergedSeqno.store(expected + 1);
+    }
+    return ++lastBySeqno;
+}
+
+bool CheckpointManager::queueDirty_UNLOCKED(VBucket &vb, queued_item& qi,
+                                            bool genSeqno, bool staged) {
     bool canCreateNewCheckpoint = false;
     if (checkpointList.size() < checkpointConfig.getMaxCheckpoints() ||
         (checkpointList.size() == checkpointConfig.getMaxCheckpoints() &&
@@ -978,20 +1152,20 @@ bool CheckpointManager::queueDirty(const RCPtr<VBucket> &vb, queued_item& qi,
         canCreateNewCheckpoint = true;
     }
 
-    if (vb->getState() == vbucket_state_active && canCreateNewCheckpoint) {
+    if (vb.getState() == vbucket_state_active && canCreateNewCheckpoint) {
         // Only the master active vbucket can create a next open checkpoint.
         checkOpenCheckpoint_UNLOCKED(false, true);
     }
 
     if (checkpointList.back()->getState() == CHECKPOINT_CLOSED) {
-        if (vb->getState() == vbucket_state_active) {
+        if (vb.getState() == vbucket_state_active) {
             addNewCheckpoint_UNLOCKED(checkpointList.back()->getId() + 1);
         } else {
             throw std::logic_error("CheckpointManager::queueDirty: vBucket "
                     "state (which is " +
-                    std::string(VBucket::toString(vb->getState())) +
+                    std::string(VBucket::toString(vb.getState())) +
                     ") is not active. This is not expected. vb:" +
-                    std::to_string(vb->getId()) +
+                    std::to_string(vb.getId()) +
                     " lastBySeqno:" + std::to_string(lastBySeqno) +
                     " genSeqno:" + std::to_string(genSeqno));
         }
@@ -1005,18 +1179,22 @@ bool CheckpointManager::queueDirty(const RCPtr<VBucket> &vb, queued_item& qi,
     }
 
     if (genSeqno) {
-        qi->setBySeqno(++lastBySeqno);
+        // A staged item got its seqno when it was reserved.
+        if (!staged) {
+            qi->setBySeqno(lastBySeqno + 1);
+        }
+        lastBySeqno = qi->getBySeqno();
         checkpointList.back()->setSnapshotEndSeqno(lastBySeqno);
     } else {
-        lastBySeqno = qi->getBySeqno();
+        setBySeqno_UNLOCKED(qi->getBySeqno());
     }
     uint64_t st = checkpointList.back()->getSnapshotStartSeqno();
     uint64_t en = checkpointList.back()->getSnapshotEndSeqno();
     if (!(st <= static_cast<uint64_t>(lastBySeqno) &&
           static_cast<uint64_t>(lastBySeqno) <= en)) {
         throw std::logic_error("CheckpointManager::queueDirty: lastBySeqno "
-                "not in snapshot range. vb:" + std::to_string(vb->getId()) +
-                " state:" + std::string(VBucket::toString(vb->getState())) +
+                "not in snapshot range. vb:" + std::to_string(vb.getId()) +
+                " state:" + std::string(VBucket::toString(vb.getState())) +
                 " snapshotStart:" + std::to_string(st) +
                 " lastBySeqno:" + std::to_string(lastBySeqno) +
                 " snapshotEnd:" + std::to_string(en) +
@@ -1032,10 +1210,13 @@ bool CheckpointManager::queueDirty(const RCPtr<VBucket> &vb, queued_item& qi,
     if (result != EXISTING_ITEM) {
         ++stats.totalEnqueued;
         ++stats.diskQueueSize;
-        vb->doStatsForQueueing(*qi, qi->size());
+        vb.doStatsForQueueing(*qi, qi->size());
 
         // Update the checkpoint's memory usage
         checkpointList.back()->incrementMemConsumption(qi->size());
+    } else {
+        ++stats.totalDeduplicated;
+        ++vb.dirtyQueueDedup;
     }
 
     return result != EXISTING_ITEM;
@@ -1044,7 +1225,16 @@ bool CheckpointManager::queueDirty(const RCPtr<VBucket> &vb, queued_item& qi,
 snapshot_range_t CheckpointManager::getAllItemsForCursor(
                                              const std::string& name,
                                              std::vector<queued_item> &items) {
+    BatchLimit unlimited(0, 0);
+    return getItemsForCursor(name, items, unlimited);
+}
+
+snapshot_range_t CheckpointManager::getItemsForCursor(
+                                             const std::string& name,
+                                             std::vector<queued_item> &items,
+                                             BatchLimit &limit) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     snapshot_range_t range;
     cursor_index::iterator it = connCursors.find(name);
     if (it == connCursors.end()) {
@@ -1053,12 +1243,12 @@ snapshot_range_t CheckpointManager::getAllItemsForCursor(
         return range;
     }
 
-    bool moreItems;
     range.start = (*it->second.currentCheckpoint)->getSnapshotStartSeqno();
     range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
-    while ((moreItems = incrCursor(it->second))) {
+    while (!limit.isReached() && incrCursor(it->second)) {
         queued_item& qi = *(it->second.currentPos);
         items.push_back(qi);
+        limit.add(qi);
 
         if (qi->getOperation() == queue_op_checkpoint_end) {
             range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
@@ -1066,9 +1256,9 @@ snapshot_range_t CheckpointManager::getAllItemsForCursor(
         }
     }
 
-    if (!moreItems) {
-        range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
-    }
+    // Up to the end of the snapshot the cursor is in, even if it stopped
+    // short of it; the items on disk are then those of a partial snapshot.
+    range.end = (*it->second.currentCheckpoint)->getSnapshotEndSeqno();
 
     return range;
 }
@@ -1076,6 +1266,7 @@ snapshot_range_t CheckpointManager::getAllItemsForCursor(
 queued_item CheckpointManager::nextItem(const std::string &name,
                                         bool &isLastMutationItem) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     cursor_index::iterator it = connCursors.find(name);
     if (it == connCursors.end()) {
         LOG(EXTENSION_LOG_WARNING,
@@ -1129,6 +1320,8 @@ void CheckpointManager::clear(RCPtr<VBucket> &vb, uint64_t seqno) {
 }
 
 void CheckpointManager::clear_UNLOCKED(vbucket_state_t vbState, uint64_t seqno) {
+    // Staged items go into the checkpoints about to be removed.
+    setBySeqno_UNLOCKED(seqno);
     std::list<Checkpoint*>::iterator it = checkpointList.begin();
     // Remove all the checkpoints.
     while(it != checkpointList.end()) {
@@ -1137,7 +1330,6 @@ void CheckpointManager::clear_UNLOCKED(vbucket_state_t vbState, uint64_t seqno)
     }
     checkpointList.clear();
     numItems = 0;
-    lastBySeqno = seqno;
     pCursorPreCheckpointId = 0;
 
     uint64_t checkpointId = vbState == vbucket_state_active ? 1 : 0;
@@ -1197,6 +1389,7 @@ bool CheckpointManager::moveCursorToNextCheckpoint(CheckpointCursor &cursor) {
 
 size_t CheckpointManager::getNumOpenChkItems() {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     if (checkpointList.empty()) {
         return 0;
     }
@@ -1230,6 +1423,7 @@ uint64_t CheckpointManager::checkOpenCheckpoint_UNLOCKED(bool forceCreation,
 
 size_t CheckpointManager::getNumItemsForCursor(const std::string &name) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     return getNumItemsForCursor_UNLOCKED(name);
 }
 
@@ -1249,7 +1443,7 @@ size_t CheckpointManager::getNumOfMetaItemsFromCursor(CheckpointCursor &cursor)
     std::list<Checkpoint*>::iterator curr_chk = cursor.currentCheckpoint;
     for (; curr_chk != checkpointList.end(); ++curr_chk) {
         if (curr_chk == cursor.currentCheckpoint) {
-            std::list<queued_item>::iterator curr_pos = cursor.currentPos;
+            CheckpointQueue::iterator curr_pos = cursor.currentPos;
             ++curr_pos;
             if (curr_pos == (*curr_chk)->end()) {
                 continue;
@@ -1288,7 +1482,7 @@ void CheckpointManager::decrCursorFromCheckpointEnd(const std::string &name) {
 
 bool CheckpointManager::isLastMutationItemInCheckpoint(
                                                    CheckpointCursor &cursor) {
-    std::list<queued_item>::iterator it = cursor.currentPos;
+    CheckpointQueue::iterator it = cursor.currentPos;
     ++it;
     if (it == (*(cursor.currentCheckpoint))->end() ||
         (*it)->getOperation() == queue_op_checkpoint_end) {
@@ -1299,6 +1493,7 @@ bool CheckpointManager::isLastMutationItemInCheckpoint(
 
 void CheckpointManager::setBackfillPhase(uint64_t start, uint64_t end) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     setOpenCheckpointId_UNLOCKED(0);
     checkpointList.back()->setSnapshotStartSeqno(start);
     checkpointList.back()->setSnapshotEndSeqno(end);
@@ -1307,6 +1502,7 @@ void CheckpointManager::setBackfillPhase(uint64_t start, uint64_t end) {
 void CheckpointManager::createSnapshot(uint64_t snapStartSeqno,
                                        uint64_t snapEndSeqno) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     if (checkpointList.empty()) {
         throw std::logic_error("CheckpointManager::createSnapshot: "
                         "checkpointList is empty");
@@ -1330,6 +1526,7 @@ void CheckpointManager::createSnapshot(uint64_t snapStartSeqno,
 
 void CheckpointManager::resetSnapshotRange() {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     if (checkpointList.empty()) {
         throw std::logic_error("CheckpointManager::resetSnapshotRange: "
                         "checkpointList is empty");
@@ -1353,6 +1550,7 @@ void CheckpointManager::resetSnapshotRange() {
 
 snapshot_info_t CheckpointManager::getSnapshotInfo() {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     if (checkpointList.empty()) {
         throw std::logic_error("CheckpointManager::getSnapshotInfo: "
                         "checkpointList is empty");
@@ -1383,6 +1581,7 @@ snapshot_info_t CheckpointManager::getSnapshotInfo() {
 void CheckpointManager::checkAndAddNewCheckpoint(uint64_t id,
                                                const RCPtr<VBucket> &vbucket) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
 
     // Ignore CHECKPOINT_START message with ID 0 as 0 is reserved for
     // representing backfill.
@@ -1514,8 +1713,8 @@ putCursorsInCollapsedChk(std::map<std::string, std::pair<uint64_t, bool> > &curs
                          std::list<Checkpoint*>::iterator chkItr) {
     size_t i;
     Checkpoint *chk = *chkItr;
-    std::list<queued_item>::iterator cit = chk->begin();
-    std::list<queued_item>::iterator last = chk->begin();
+    CheckpointQueue::iterator cit = chk->begin();
+    CheckpointQueue::iterator last = chk->begin();
     for (i = 0; cit != chk->end(); ++i, ++cit) {
         uint64_t id = chk->getMutationIdForKey((*cit)->getKey(),
                                                (*cit)->isCheckPointMetaItem());
@@ -1567,13 +1766,14 @@ putCursorsInCollapsedChk(std::map<std::string, std::pair<uint64_t, bool> > &curs
 
 bool CheckpointManager::hasNext(const std::string &name) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     cursor_index::iterator it = connCursors.find(name);
     if (it == connCursors.end() || getOpenCheckpointId_UNLOCKED() == 0) {
         return false;
     }
 
     bool hasMore = true;
-    std::list<queued_item>::iterator curr = it->second.currentPos;
+    CheckpointQueue::iterator curr = it->second.currentPos;
     ++curr;
     if (curr == (*(it->second.currentCheckpoint))->end() &&
         (*(it->second.currentCheckpoint)) == checkpointList.back()) {
@@ -1613,6 +1813,7 @@ queued_item CheckpointManager::createCheckpointItem(uint64_t id, uint16_t vbid,
 
 uint64_t CheckpointManager::createNewCheckpoint() {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     if (checkpointList.back()->getNumItems() > 0) {
         uint64_t chk_id = checkpointList.back()->getId();
         addNewCheckpoint_UNLOCKED(chk_id + 1);
@@ -1647,6 +1848,7 @@ size_t CheckpointManager::getMemoryUsage_UNLOCKED() {
 
 size_t CheckpointManager::getMemoryUsage() {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     return getMemoryUsage_UNLOCKED();
 }
 
@@ -1694,6 +1896,7 @@ CheckpointConfig::CheckpointConfig(EventuallyPersistentEngine &e) {
     itemNumBasedNewCheckpoint = config.isItemNumBasedNewChk();
     keepClosedCheckpoints = config.isKeepClosedChks();
     enableChkMerge = config.isEnableChkMerge();
+    stagingSlots = config.getChkStagingSlots();
 }
 
 bool CheckpointConfig::validateCheckpointMaxItemsParam(size_t
@@ -1763,6 +1966,7 @@ void CheckpointConfig::setMaxCheckpoints(size_t value) {
 
 void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
     LockHolder lh(queueLock);
+    mergeStaged_UNLOCKED(false);
     char buf[256];
 
     try {
@@ -1792,6 +1996,10 @@ void CheckpointManager::addStats(ADD_STAT add_stat, const void *cookie) {
 
         checked_snprintf(buf, sizeof(buf), "vb_%d:mem_usage", vbucketId);
         add_casted_stat(buf, getMemoryUsage_UNLOCKED(), add_stat, cookie);
+        checked_snprintf(buf, sizeof(buf), "vb_%d:num_staged_items",
+                         vbucketId);
+        add_casted_stat(buf, reservedSeqno.load() - mergedSeqno.load(),
+                        add_stat, cookie);
 
         cursor_index::iterator cur_it = connCursors.begin();
         for (; cur_it != connCursors.end(); ++cur_it) {
@@ -28,6 +28,7 @@
 #include <vector>
 
 #include "atomic.h"
+#include "checkpoint_queue.h"
 #include "item.h"
 #include "locks.h"
 #include "stats.h"
@@ -57,7 +58,8 @@ enum checkpoint_state {
  * A checkpoint index entry.
  */
 struct index_entry {
-    std::list<queued_item>::iterator position;
+    //! Slot index of the item in the checkpoint queue
+    size_t position;
     int64_t mutation_id;
 };
 
@@ -71,6 +73,42 @@ typedef struct {
     snapshot_range_t range;
 } snapshot_info_t;
 
+/**
+ * Bounds on a batch of items taken from several queues, and what the
+ * batch holds so far. A bound of 0 means none.
+ */
+class BatchLimit {
+public:
+    BatchLimit(size_t maxItems_, size_t maxBytes_)
+        : maxItems(maxItems_), maxBytes(maxBytes_), numItems(0),
+          numBytes(0) { }
+
+    void add(const queued_item &qi) {
+        ++numItems;
+        numBytes += qi->size();
+    }
+
+    //! True once the batch should take no more items
+    bool isReached() const {
+        return (maxItems > 0 && numItems >= maxItems) ||
+               (maxBytes > 0 && numBytes >= maxBytes);
+    }
+
+    size_t getNumItems() const {
+        return numItems;
+    }
+
+    size_t getNumBytes() const {
+        return numBytes;
+    }
+
+private:
+    const size_t maxItems;
+    const size_t maxBytes;
+    size_t numItems;
+    size_t numBytes;
+};
+
 /**
  * Flag indicating that we must send checkpoint end meta item for the cursor
  */
@@ -84,6 +122,35 @@ enum class MustSendCheckpointEnd {
  */
 typedef std::unordered_map<std::string, index_entry> checkpoint_index;
 
+/**
+ * Key of the checkpoint key index: refers to the key of the queued item
+ * instead of holding a copy of it. It must be repointed at the key of the
+ * item that replaces the indexed one, before the latter is released.
+ */
+struct checkpoint_key {
+    checkpoint_key(const std::string &k) : key(&k) { }
+
+    bool operator==(const checkpoint_key &other) const {
+        return *key == *other.key;
+    }
+
+    // Repointing keeps the hash and equality, so it may change in the map.
+    mutable const std::string *key;
+};
+
+struct checkpoint_key_hash {
+    size_t operator()(const checkpoint_key &k) const {
+        return std::hash<std::string>()(*k.key);
+    }
+};
+
+/**
+ * The checkpoint key index maps the key of a queued mutation to its
+ * checkpoint index_entry.
+ */
+typedef std::unordered_map<checkpoint_key, index_entry, checkpoint_key_hash>
+                                                    checkpoint_key_index;
+
 /**
  * List of pairs containing checkpoint cursor name and corresponding flag
  * indicating whether we must send checkpoint end meta item for the cursor
@@ -116,7 +183,7 @@ public:
 
     CheckpointCursor(const std::string &n,
                      std::list<Checkpoint*>::iterator checkpoint,
-                     std::list<queued_item>::iterator pos,
+                     CheckpointQueue::iterator pos,
                      size_t os,
                      bool beginningOnChkCollapse,
                      MustSendCheckpointEnd needsCheckpointEndMetaItem) :
@@ -154,7 +221,7 @@ public:
 private:
     std::string                      name;
     std::list<Checkpoint*>::iterator currentCheckpoint;
-    std::list<queued_item>::iterator currentPos;
+    CheckpointQueue::iterator        currentPos;
 
     // The offset (in terms of items) this cursor is from the start of the
     // cursors' current checkpoint. Used to calculate how many items this
@@ -332,19 +399,19 @@ public:
         snapEndSeqno = seqno;
     }
 
-    std::list<queued_item>::iterator begin() {
+    CheckpointQueue::iterator begin() {
         return toWrite.begin();
     }
 
-    std::list<queued_item>::iterator end() {
+    CheckpointQueue::iterator end() {
         return toWrite.end();
     }
 
-    std::list<queued_item>::reverse_iterator rbegin() {
+    CheckpointQueue::reverse_iterator rbegin() {
         return toWrite.rbegin();
     }
 
-    std::list<queued_item>::reverse_iterator rend() {
+    CheckpointQueue::reverse_iterator rend() {
         return toWrite.rend();
     }
 
@@ -410,9 +477,9 @@ private:
     checkpoint_state               checkpointState;
     size_t                         numItems;
     std::set<std::string>          cursors; // List of cursors with their unique names.
-    // List is used for queueing mutations as vector incurs shift operations for deduplication.
-    std::list<queued_item>         toWrite;
-    checkpoint_index               keyIndex;
+    // Deduplication clears the slot of the replaced item, nothing shifts.
+    CheckpointQueue                toWrite;
+    checkpoint_key_index           keyIndex;
     /* Index for meta keys like "dummy_key" */
     checkpoint_index               metaKeyIndex;
     size_t                         memOverhead;
@@ -421,6 +488,17 @@ private:
     // the queued items in the given checkpoint.
     size_t                         effectiveMemUsage;
 
+    /**
+     * Close the gaps deduplication left in the queue, moving the cursors
+     * in this checkpoint along with their items.
+     */
+    void compactQueue(CheckpointManager *checkpointManager);
+
+    /**
+     * Point the index entries at the current slots of their items.
+     */
+    void reindex();
+
     friend std::ostream& operator <<(std::ostream& os, const Checkpoint& m);
 };
 
@@ -448,6 +526,9 @@ public:
         lastBySeqno(lastSeqno), lastClosedChkBySeqno(lastSeqno),
         isCollapsedCheckpoint(false),
         pCursorPreCheckpointId(0),
+        stagingSize(config.getStagingSlots()),
+        staging(stagingSize ? new StagedItem[stagingSize] : NULL),
+        reservedSeqno(lastSeqno), mergedSeqno(lastSeqno),
         flusherCB(cb) {
         LockHolder lh(queueLock);
         addNewCheckpoint_UNLOCKED(checkpointId, lastSnapStart, lastSnapEnd);
@@ -545,6 +626,9 @@ public:
      * @param vbucket the vbucket that a new item is pushed into.
      * @param bySeqno the sequence number assigned to this mutation
      * @return true if an item queued increases the size of persistence queue by 1.
+     *         With staging slots configured, a generated seqno is assigned
+     *         without taking queueLock, the item is merged into the open
+     *         checkpoint later and true is always returned.
      */
     bool queueDirty(const RCPtr<VBucket> &vb, queued_item& qi, bool genSeqno);
 
@@ -560,6 +644,16 @@ public:
     snapshot_range_t getAllItemsForCursor(const std::string& name,
                                           std::vector<queued_item> &items);
 
+    /**
+     * Like getAllItemsForCursor, but stops once the given limit is
+     * reached; the cursor is left at the last item taken, so the next call
+     * carries on from there. The range returned is that of the snapshots
+     * the items taken belong to, the last one possibly taken in part.
+     */
+    snapshot_range_t getItemsForCursor(const std::string& name,
+                                       std::vector<queued_item> &items,
+                                       BatchLimit &limit);
+
     /**
      * Return the total number of items (including meta items) that belong to
      * this checkpoint manager.
@@ -678,11 +772,12 @@ public:
 
     void setBySeqno(int64_t seqno) {
         LockHolder lh(queueLock);
-        lastBySeqno = seqno;
+        setBySeqno_UNLOCKED(seqno);
     }
 
     int64_t getHighSeqno() {
         LockHolder lh(queueLock);
+        mergeStaged_UNLOCKED(false);
         return lastBySeqno;
     }
 
@@ -691,15 +786,45 @@ public:
         return lastClosedChkBySeqno;
     }
 
-    int64_t nextBySeqno() {
-        LockHolder lh(queueLock);
-        return ++lastBySeqno;
-    }
+    int64_t nextBySeqno();
 
     static const std::string pCursorName;
 
 private:
 
+    /**
+     * An item queued by a writer that did not take queueLock, waiting in
+     * the staging ring to be merged into the open checkpoint.
+     */
+    struct StagedItem {
+        StagedItem() : seqno(0), vb(NULL) { }
+
+        //! Seqno of the item once it is written, 0 while the slot is free
+        AtomicValue<int64_t> seqno;
+        queued_item          item;
+        VBucket             *vb;
+    };
+
+    bool queueDirty_UNLOCKED(VBucket &vb, queued_item& qi, bool genSeqno,
+                             bool staged);
+
+    /**
+     * Reserve the next seqno for the item and put it into the staging
+     * ring, merging the ring into the open checkpoint if queueLock is free.
+     */
+    void stageDirty(VBucket &vb, queued_item &qi);
+
+    /**
+     * Merge the staged items into the open checkpoint, in seqno order.
+     *
+     * @param all if true, also wait for the items whose seqno is reserved
+     *            but which are still being written; otherwise stop at the
+     *            first of them
+     */
+    void mergeStaged_UNLOCKED(bool all);
+
+    void setBySeqno_UNLOCKED(int64_t seqno);
+
     bool removeCursor_UNLOCKED(const std::string &name);
 
     bool registerCursor_UNLOCKED(
@@ -779,6 +904,15 @@ private:
     uint64_t                 pCursorPreCheckpointId;
     cursor_index             connCursors;
 
+    // Staging ring of chk_staging_slots entries, indexed by seqno. Writers
+    // reserve seqnos from reservedSeqno without queueLock; whoever holds
+    // the lock merges them, and mergedSeqno tells writers which slots are
+    // free again.
+    const size_t                      stagingSize;
+    std::unique_ptr<StagedItem[]>     staging;
+    AtomicValue<int64_t>              reservedSeqno;
+    AtomicValue<int64_t>              mergedSeqno;
+
     FlusherCallback          flusherCB;
 
     friend std::ostream& operator<<(std::ostream& os, const CheckpointManager& m);
@@ -799,18 +933,20 @@ public:
           maxCheckpoints(DEFAULT_MAX_CHECKPOINTS),
           itemNumBasedNewCheckpoint(true),
           keepClosedCheckpoints(false),
-          enableChkMerge(false)
+          enableChkMerge(false),
+          stagingSlots(0)
     { /* empty */ }
 
     CheckpointConfig(rel_time_t period, size_t max_items, size_t max_ckpts,
                      bool item_based_new_ckpt, bool keep_closed_ckpts,
-                     bool enable_ckpt_merge)
+                     bool enable_ckpt_merge, size_t staging_slots = 0)
         : checkpointPeriod(period),
           checkpointMaxItems(max_items),
           maxCheckpoints(max_ckpts),
           itemNumBasedNewCheckpoint(item_based_new_ckpt),
           keepClosedCheckpoints(keep_closed_ckpts),
-          enableChkMerge(enable_ckpt_merge) {}
+          enableChkMerge(enable_ckpt_merge),
+          stagingSlots(staging_slots) {}
 
     CheckpointConfig(EventuallyPersistentEngine &e);
 
@@ -838,6 +974,10 @@ public:
         return enableChkMerge;
     }
 
+    size_t getStagingSlots() const {
+        return stagingSlots;
+    }
+
 protected:
     friend class CheckpointConfigChangeListener;
     friend class EventuallyPersistentEngine;
@@ -879,6 +1019,9 @@ private:
     bool keepClosedCheckpoints;
     // Flag indicating if merging closed checkpoints is enabled or not.
     bool enableChkMerge;
+    // Number of items writers can queue into a checkpoint manager without
+    // taking its lock, 0 if they always take it.
+    size_t stagingSlots;
 };
 
 #endif  // SRC_CHECKPOINT_H_
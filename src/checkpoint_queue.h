@@ -0,0 +1,254 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_CHECKPOINT_QUEUE_H_
+#define SRC_CHECKPOINT_QUEUE_H_ 1
+
+#include "config.h"
+
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include "item.h"
+
+/**
+ * The queue of items of a checkpoint.
+ *
+ * Items are kept in fixed size blocks of slots which never move, so a
+ * position in the queue is a plain slot index that stays valid while
+ * items are appended. Removing an item (deduplication) only clears its
+ * slot; iteration skips cleared slots. Once cleared slots outnumber the
+ * items, compact() closes the gaps, which moves items to other indices.
+ *
+ * The iterators behave like those of the std::list this replaces, except
+ * that an end() iterator held while an item is appended refers to the new
+ * item afterwards.
+ */
+class CheckpointQueue {
+public:
+    //! Slots per block; 4KiB of queued_items
+    static const size_t BLOCK_SIZE = 512;
+
+    class iterator : public std::iterator<std::bidirectional_iterator_tag,
+                                          queued_item> {
+    public:
+        iterator() : queue(NULL), pos(0) { }
+
+        iterator(const CheckpointQueue *q, size_t p) : queue(q), pos(p) { }
+
+        queued_item &operator*() const {
+            return queue->slot(pos);
+        }
+
+        queued_item *operator->() const {
+            return &queue->slot(pos);
+        }
+
+        iterator &operator++() {
+            pos = queue->nextLive(pos);
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator rv(*this);
+            ++*this;
+            return rv;
+        }
+
+        iterator &operator--() {
+            pos = queue->prevLive(pos);
+            return *this;
+        }
+
+        iterator operator--(int) {
+            iterator rv(*this);
+            --*this;
+            return rv;
+        }
+
+        bool operator==(const iterator &other) const {
+            return pos == other.pos && queue == other.queue;
+        }
+
+        bool operator!=(const iterator &other) const {
+            return !(*this == other);
+        }
+
+        //! The slot index this iterator refers to
+        size_t index() const {
+            return pos;
+        }
+
+    private:
+        const CheckpointQueue *queue;
+        size_t pos;
+    };
+
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+
+    CheckpointQueue() : tail(0), live(0) { }
+
+    iterator begin() const {
+        size_t p = 0;
+        while (p < tail && !slot(p)) {
+            ++p;
+        }
+        return iterator(this, p);
+    }
+
+    iterator end() const {
+        return iterator(this, tail);
+    }
+
+    reverse_iterator rbegin() const {
+        return reverse_iterator(end());
+    }
+
+    reverse_iterator rend() const {
+        return reverse_iterator(begin());
+    }
+
+    //! Get an iterator to the given slot index
+    iterator at(size_t index) const {
+        return iterator(this, index);
+    }
+
+    queued_item &back() const {
+        return *--end();
+    }
+
+    void push_back(const queued_item &qi) {
+        if (tail == blocks.size() * BLOCK_SIZE) {
+            blocks.emplace_back(new queued_item[BLOCK_SIZE]);
+        }
+        slot(tail++) = qi;
+        ++live;
+    }
+
+    void pop_back() {
+        erase(--end());
+    }
+
+    /**
+     * Remove the item at the given position. Iterators to other items
+     * stay valid.
+     */
+    void erase(iterator it) {
+        slot(it.index()).reset();
+        --live;
+        // Keep the last slot in use, so appending stays O(1) for end().
+        while (tail > 0 && !slot(tail - 1)) {
+            --tail;
+        }
+    }
+
+    bool empty() const {
+        return live == 0;
+    }
+
+    //! Number of items in the queue
+    size_t size() const {
+        return live;
+    }
+
+    //! Number of slots cleared by erase() and not compacted yet
+    size_t getNumCleared() const {
+        return tail - live;
+    }
+
+    //! True once the cleared slots are worth a compact()
+    bool needsCompaction() const {
+        return getNumCleared() >= BLOCK_SIZE && getNumCleared() > live;
+    }
+
+    /**
+     * Number of items before the given position; the index the item
+     * there gets from compact().
+     */
+    size_t rank(iterator it) const {
+        size_t n = 0;
+        for (size_t p = 0; p < it.index() && p < tail; ++p) {
+            if (slot(p)) {
+                ++n;
+            }
+        }
+        return n;
+    }
+
+    /**
+     * Move all items to the front, in order, and release the blocks no
+     * longer needed. Invalidates every position held.
+     */
+    void compact() {
+        size_t to = 0;
+        for (size_t p = 0; p < tail; ++p) {
+            if (slot(p)) {
+                if (p != to) {
+                    slot(to).reset(slot(p));
+                    slot(p).reset();
+                }
+                ++to;
+            }
+        }
+        tail = to;
+        blocks.resize((tail + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    }
+
+    void swap(CheckpointQueue &other) {
+        blocks.swap(other.blocks);
+        std::swap(tail, other.tail);
+        std::swap(live, other.live);
+    }
+
+    //! Bytes held by the blocks
+    size_t getMemorySize() const {
+        return blocks.size() * BLOCK_SIZE * sizeof(queued_item);
+    }
+
+private:
+    queued_item &slot(size_t p) const {
+        return blocks[p / BLOCK_SIZE][p % BLOCK_SIZE];
+    }
+
+    size_t nextLive(size_t p) const {
+        do {
+            ++p;
+        } while (p < tail && !slot(p));
+        return p;
+    }
+
+    size_t prevLive(size_t p) const {
+        while (p > 0) {
+            --p;
+            if (slot(p)) {
+                break;
+            }
+        }
+        return p;
+    }
+
+    std::vector<std::unique_ptr<queued_item[]> > blocks;
+    //! Slots handed out, the index end() refers to
+    size_t tail;
+    //! Slots holding an item
+    size_t live;
+
+    DISALLOW_COPY_AND_ASSIGN(CheckpointQueue);
+};
+
+#endif  // SRC_CHECKPOINT_QUEUE_H_
@@ -151,8 +151,31 @@ struct GetMultiCbCtx {
     CouchKVStore &cks;
     uint16_t vbId;
     vb_bgfetch_queue_t &fetches;
+    //! Copies of the docinfos found, their docs are read afterwards
+    std::vector<DocInfo *> found;
 };
 
+/**
+ * A copy of a docinfo, which outlives the lookup it came from; released
+ * by free().
+ */
+static DocInfo *copyDocInfo(const DocInfo *info) {
+    DocInfo *docinfo = static_cast<DocInfo *>(calloc(1, sizeof(DocInfo) +
+                                                     info->id.size +
+                                                     info->rev_meta.size));
+    if (!docinfo) {
+        return NULL;
+    }
+    *docinfo = *info;
+    char *extra = reinterpret_cast<char *>(docinfo) + sizeof(DocInfo);
+    memcpy(extra, info->id.buf, info->id.size);
+    docinfo->id.buf = extra;
+    extra += info->id.size;
+    memcpy(extra, info->rev_meta.buf, info->rev_meta.size);
+    docinfo->rev_meta.buf = extra;
+    return docinfo;
+}
+
 struct StatResponseCtx {
 public:
     StatResponseCtx(std::map<std::pair<uint16_t, uint16_t>, vbucket_state> &sm,
@@ -173,9 +196,10 @@ struct AllKeysCtx {
 };
 
 CouchRequest::CouchRequest(const Item &it, uint64_t rev,
-                           MutationRequestCallback &cb, bool del)
+                           MutationRequestCallback &cb, bool del,
+                           DocPresence docPresence)
     : IORequest(it.getVBucketId(), cb, del, it.getKey()), value(it.getValue()),
-      fileRevNum(rev)
+      fileRevNum(rev), presence(docPresence)
 {
     uint64_t cas = htonll(it.getCas());
     uint32_t flags = it.getFlags();
@@ -249,7 +273,8 @@ CouchRequest::CouchRequest(const Item &it, uint64_t rev,
 
 CouchKVStore::CouchKVStore(KVStoreConfig &config, bool read_only) :
     KVStore(config, read_only), dbname(config.getDBName()),
-    intransaction(false), backfillCounter(0)
+    intransaction(false), dbCacheMax(config.getDbHandleCacheSize()),
+    backfillCounter(0)
 {
     createDataDir(dbname);
     statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
@@ -265,6 +290,8 @@ CouchKVStore::CouchKVStore(KVStoreConfig &config, bool read_only) :
     cachedDocCount.assign(numDbFiles, Couchbase::RelaxedAtomic<size_t>(-1));
     cachedDeleteCount.assign(numDbFiles, Couchbase::RelaxedAtomic<size_t>(-1));
     cachedVBStates.assign(numDbFiles, nullptr);
+    dbCacheIndex.assign(numDbFiles, dbCache.end());
+    vbTxns.resize(numDbFiles);
 
     initialize();
 }
@@ -272,10 +299,12 @@ CouchKVStore::CouchKVStore(KVStoreConfig &config, bool read_only) :
 CouchKVStore::CouchKVStore(const CouchKVStore &copyFrom) :
     KVStore(copyFrom), dbname(copyFrom.dbname),
     dbFileRevMap(copyFrom.dbFileRevMap), numDbFiles(copyFrom.numDbFiles),
-    intransaction(false)
+    intransaction(false), dbCacheMax(copyFrom.dbCacheMax)
 {
     createDataDir(dbname);
     statCollectingFileOps = getCouchstoreStatsOps(&st.fsStats);
+    dbCacheIndex.assign(numDbFiles, dbCache.end());
+    vbTxns.resize(numDbFiles);
 }
 
 void CouchKVStore::initialize() {
@@ -315,6 +344,10 @@ void CouchKVStore::initialize() {
 CouchKVStore::~CouchKVStore() {
     close();
 
+    for (auto &cached : dbCache) {
+        closeDatabaseHandle(cached.db);
+    }
+
     for (std::vector<vbucket_state *>::iterator it = cachedVBStates.begin();
          it != cachedVBStates.end(); it++) {
         vbucket_state *vbstate = *it;
@@ -338,6 +371,7 @@ void CouchKVStore::reset(uint16_t vbucketId) {
         cachedDeleteCount[vbucketId] = 0;
 
         //Unlink the couchstore file upon reset
+        invalidateDB(vbucketId);
         unlinkCouchFile(vbucketId, dbFileRevMap[vbucketId]);
         setVBucketState(vbucketId, *state, NULL, true);
         updateDbFileMap(vbucketId, 1);
@@ -347,12 +381,14 @@ void CouchKVStore::reset(uint16_t vbucketId) {
     }
 }
 
-void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb) {
+void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb,
+                       DocPresence presence) {
     if (isReadOnly()) {
         throw std::logic_error("CouchKVStore::set: Not valid on a read-only "
                         "object.");
     }
-    if (!intransaction) {
+    VBTransaction &txn = vbTxns[itm.getVBucketId()];
+    if (!txn.active && !intransaction) {
         throw std::invalid_argument("CouchKVStore::set: intransaction must be "
                         "true to perform a set operation.");
     }
@@ -363,18 +399,20 @@ void CouchKVStore::set(const Item &itm, Callback<mutation_result> &cb) {
 
     // each req will be de-allocated after commit
     requestcb.setCb = &cb;
-    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, deleteItem);
-    pendingReqsQ.push_back(req);
+    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, deleteItem,
+                                         presence);
+    (txn.active ? txn.reqs : pendingReqsQ).push_back(req);
 }
 
 void CouchKVStore::get(const std::string &key, uint16_t vb,
                        Callback<GetValue> &cb, bool fetchDelete) {
     Db *db = NULL;
     GetValue rv;
-    uint64_t fileRev = dbFileRevMap[vb];
+    uint64_t fileRev;
 
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errCode = acquireDB(vb, &db,
+                                           COUCHSTORE_OPEN_FLAG_RDONLY,
+                                           fileRev);
     if (errCode != COUCHSTORE_SUCCESS) {
         ++st.numGetFailure;
         LOG(EXTENSION_LOG_WARNING,
@@ -387,7 +425,8 @@ void CouchKVStore::get(const std::string &key, uint16_t vb,
     }
 
     getWithHeader(db, key, vb, cb, fetchDelete);
-    closeDatabaseHandle(db);
+    // A read-only handle is no use to the writer.
+    releaseDB(vb, fileRev, db, isReadOnly());
 }
 
 void CouchKVStore::getWithHeader(void *dbHandle, const std::string &key,
@@ -451,11 +490,12 @@ void CouchKVStore::getWithHeader(void *dbHandle, const std::string &key,
 
 void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
     int numItems = itms.size();
-    uint64_t fileRev = dbFileRevMap[vb];
+    uint64_t fileRev;
 
     Db *db = NULL;
-    couchstore_error_t errCode = openDB(vb, fileRev, &db,
-                                        COUCHSTORE_OPEN_FLAG_RDONLY);
+    couchstore_error_t errCode = acquireDB(vb, &db,
+                                           COUCHSTORE_OPEN_FLAG_RDONLY,
+                                           fileRev);
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
             "Failed to open database for data fetch, "
@@ -487,6 +527,18 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
 
     errCode = couchstore_docinfos_by_id(db, ids, itms.size(),
                                         0, getMultiCbC, &ctx);
+    // The docs are read in the order they are in the file rather than by
+    // key, so the reads go one way through it.
+    std::sort(ctx.found.begin(), ctx.found.end(),
+              [](const DocInfo *a, const DocInfo *b) {
+                  return a->bp < b->bp;
+              });
+    for (auto docinfo : ctx.found) {
+        if (errCode == COUCHSTORE_SUCCESS) {
+            readMultiDoc(db, docinfo, &ctx);
+        }
+        free(docinfo);
+    }
     if (errCode != COUCHSTORE_SUCCESS) {
         st.numGetFailure.fetch_add(numItems);
         for (itr = itms.begin(); itr != itms.end(); ++itr) {
@@ -503,17 +555,19 @@ void CouchKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
             }
         }
     }
-    closeDatabaseHandle(db);
+    // A read-only handle is no use to the writer.
+    releaseDB(vb, fileRev, db, isReadOnly() && errCode == COUCHSTORE_SUCCESS);
     delete []ids;
 }
 
-void CouchKVStore::del(const Item &itm,
-                       Callback<int> &cb) {
+void CouchKVStore::del(const Item &itm, Callback<int> &cb,
+                       DocPresence presence) {
     if (isReadOnly()) {
         throw std::logic_error("CouchKVStore::del: Not valid on a read-only "
                         "object.");
     }
-    if (!intransaction) {
+    VBTransaction &txn = vbTxns[itm.getVBucketId()];
+    if (!txn.active && !intransaction) {
         throw std::invalid_argument("CouchKVStore::del: intransaction must be "
                         "true to perform a delete operation.");
     }
@@ -521,8 +575,9 @@ void CouchKVStore::del(const Item &itm,
     uint64_t fileRev = dbFileRevMap[itm.getVBucketId()];
     MutationRequestCallback requestcb;
     requestcb.delCb = &cb;
-    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, true);
-    pendingReqsQ.push_back(req);
+    CouchRequest *req = new CouchRequest(itm, fileRev, requestcb, true,
+                                         presence);
+    (txn.active ? txn.reqs : pendingReqsQ).push_back(req);
 }
 
 void CouchKVStore::delVBucket(uint16_t vbucket) {
@@ -531,16 +586,20 @@ void CouchKVStore::delVBucket(uint16_t vbucket) {
                         "read-only object.");
     }
 
+    invalidateDB(vbucket);
     unlinkCouchFile(vbucket, dbFileRevMap[vbucket]);
 
+    // Seqnos of a new vbucket start over too
+    uint64_t resetGeneration = 0;
     if (cachedVBStates[vbucket]) {
+        resetGeneration = cachedVBStates[vbucket]->resetGeneration + 1;
         delete cachedVBStates[vbucket];
     }
 
     std::string failovers("[{\"id\":0, \"seq\":0}]");
     cachedVBStates[vbucket] = new vbucket_state(vbucket_state_dead, 0, 0, 0, 0,
                                                 0, 0, 0, INITIAL_DRIFT,
-                                                failovers);
+                                                failovers, resetGeneration);
     updateDbFileMap(vbucket, 1);
 }
 
@@ -612,6 +671,28 @@ static std::string getDBFileName(const std::string &dbname,
     return ss.str();
 }
 
+/*
+ * Sync a database file through a handle of its own. The handles couchstore
+ * commits through are closed by then, and any descriptor of a file flushes
+ * all of its dirty pages.
+ */
+static couchstore_error_t syncDBFile(const std::string &filename) {
+    couchstore_error_info_t errinfo;
+    const couch_file_ops *ops = couchstore_get_default_file_ops();
+    couch_file_handle handle = ops->constructor(&errinfo, ops->cookie);
+    if (handle == NULL) {
+        return COUCHSTORE_ERROR_ALLOC_FAIL;
+    }
+    couchstore_error_t errCode = ops->open(&errinfo, &handle,
+                                           filename.c_str(), O_RDWR);
+    if (errCode == COUCHSTORE_SUCCESS) {
+        errCode = ops->sync(&errinfo, handle);
+        ops->close(&errinfo, handle);
+    }
+    ops->destructor(&errinfo, handle);
+    return errCode;
+}
+
 static int edit_docinfo_hook(DocInfo **info, const sized_buf *item) {
     if ((*info)->rev_meta.size == DEFAULT_META_LEN) {
         // Metadata doesn't have flex_meta_code, datatype and
@@ -825,6 +906,19 @@ bool CouchKVStore::compactDB(compaction_ctx *hook_ctx,
     // Close the source Database File once compaction is done
     closeDatabaseHandle(compactdb);
 
+    // The stale file is removed below, the compacted one must not be lost
+    // after that.
+    if (configuration.isGroupSync()) {
+        errCode = syncDBFile(compact_file);
+        if (errCode != COUCHSTORE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING,
+                "Failed to sync compacted file '%s', error=%s",
+                compact_file.c_str(), couchstore_strerror(errCode));
+            removeCompactFile(compact_file);
+            return false;
+        }
+    }
+
     // Rename the .compact file to one with the next revision number
     new_file = getDBFileName(dbname, vbid, new_rev);
     if (rename(compact_file.c_str(), new_file.c_str()) != 0) {
@@ -905,8 +999,13 @@ bool CouchKVStore::setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
     dbFileName = dbname + "/" + id.str() + ".couch." + rev.str();
 
     couchstore_error_t errorCode;
-    errorCode = openDB(vbucketId, fileRev, &db,
-            (uint64_t)COUCHSTORE_OPEN_FLAG_CREATE, &newFileRev, reset);
+    if (reset) {
+        errorCode = openDB(vbucketId, fileRev, &db,
+                (uint64_t)COUCHSTORE_OPEN_FLAG_CREATE, &newFileRev, reset);
+    } else {
+        errorCode = acquireDB(vbucketId, &db,
+                (uint64_t)COUCHSTORE_OPEN_FLAG_CREATE, newFileRev);
+    }
     if (errorCode != COUCHSTORE_SUCCESS) {
         ++st.numVbSetFailure;
         LOG(EXTENSION_LOG_WARNING,
@@ -925,7 +1024,7 @@ bool CouchKVStore::setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
         LOG(EXTENSION_LOG_WARNING,
                 "Failed to save local doc, name=%s",
                 dbFileName.c_str());
-        closeDatabaseHandle(db);
+        releaseDB(vbucketId, fileRev, db, false);
         return false;
     }
 
@@ -936,9 +1035,10 @@ bool CouchKVStore::setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
                 "Commit failed, vbid=%u rev=%" PRIu64 " error=%s [%s]",
                 vbucketId, fileRev, couchstore_strerror(errorCode),
                 couchkvstore_strerrno(db, errorCode).c_str());
-        closeDatabaseHandle(db);
+        releaseDB(vbucketId, fileRev, db, false);
         return false;
     }
+    addUnsyncedFile(vbucketId);
     if (kvcb) {
         DbInfo info;
         couchstore_db_info(db, &info);
@@ -946,7 +1046,7 @@ bool CouchKVStore::setVBucketState(uint16_t vbucketId, vbucket_state &vbstate,
         kvctx.fileSize = info.file_size;
         kvcb->callback(kvctx);
     }
-    closeDatabaseHandle(db);
+    releaseDB(vbucketId, fileRev, db);
 
     return true;
 }
@@ -989,7 +1089,7 @@ bool CouchKVStore::commit(Callback<kvstats_ctx> *cb) {
     }
 
     if (intransaction) {
-        if (commit2couchstore(cb)) {
+        if (commit2couchstore(pendingReqsQ, cb)) {
             intransaction = false;
         }
     }
@@ -997,6 +1097,74 @@ bool CouchKVStore::commit(Callback<kvstats_ctx> *cb) {
     return !intransaction;
 }
 
+bool CouchKVStore::beginVBucket(uint16_t vbid) {
+    if (isReadOnly()) {
+        throw std::logic_error("CouchKVStore::beginVBucket: Not valid on a "
+                        "read-only object.");
+    }
+    vbTxns[vbid].active = true;
+    return true;
+}
+
+bool CouchKVStore::commitVBucket(uint16_t vbid, Callback<kvstats_ctx> *cb) {
+    if (isReadOnly()) {
+        throw std::logic_error("CouchKVStore::commitVBucket: Not valid on a "
+                        "read-only object.");
+    }
+
+    VBTransaction &txn = vbTxns[vbid];
+    if (txn.active) {
+        if (commit2couchstore(txn.reqs, cb)) {
+            txn.active = false;
+        }
+    }
+
+    return !txn.active;
+}
+
+bool CouchKVStore::sync() {
+    if (isReadOnly()) {
+        throw std::logic_error("CouchKVStore::sync: Not valid on a read-only "
+                        "object.");
+    }
+
+    std::set<std::string> files;
+    {
+        LockHolder lh(unsyncedLock);
+        files.swap(unsyncedFiles);
+    }
+    if (files.empty()) {
+        return true;
+    }
+
+    hrtime_t start = gethrtime();
+    bool success = true;
+    for (auto &file : files) {
+        couchstore_error_t errCode = syncDBFile(file);
+        if (errCode == COUCHSTORE_ERROR_NO_SUCH_FILE) {
+            // Replaced by compaction (synced then) or the vbucket is gone.
+            continue;
+        } else if (errCode != COUCHSTORE_SUCCESS) {
+            LOG(EXTENSION_LOG_WARNING, "Failed to sync '%s', error=%s",
+                file.c_str(), couchstore_strerror(errCode));
+            LockHolder lh(unsyncedLock);
+            unsyncedFiles.insert(file);
+            success = false;
+        }
+    }
+    st.groupSyncHisto.add((gethrtime() - start) / 1000);
+    st.groupSizeHisto.add(files.size());
+
+    return success;
+}
+
+void CouchKVStore::addUnsyncedFile(uint16_t vbid) {
+    if (configuration.isGroupSync()) {
+        LockHolder lh(unsyncedLock);
+        unsyncedFiles.insert(getDBFileName(dbname, vbid, dbFileRevMap[vbid]));
+    }
+}
+
 void CouchKVStore::addStats(const std::string &prefix,
                             ADD_STAT add_stat,
                             const void *c) {
@@ -1038,6 +1206,25 @@ void CouchKVStore::addStats(const std::string &prefix,
             st.fsStatsCompaction.totalBytesRead, add_stat, c);
     addStat(prefix_str, "io_compaction_write_bytes",
             st.fsStatsCompaction.totalBytesWritten, add_stat, c);
+
+    const size_t hits = st.numDbCacheHits.load();
+    const size_t lookups = hits + st.numDbCacheMisses.load();
+    addStat(prefix_str, "db_handle_cache_hits", hits, add_stat, c);
+    addStat(prefix_str, "db_handle_cache_misses", st.numDbCacheMisses,
+            add_stat, c);
+    const size_t ratio = lookups ? hits * 100 / lookups : 0;
+    addStat(prefix_str, "db_handle_cache_hit_ratio", ratio, add_stat, c);
+    size_t numCached;
+    {
+        LockHolder lh(dbCacheLock);
+        numCached = dbCache.size();
+    }
+    addStat(prefix_str, "db_handles_open", numCached, add_stat, c);
+    addStat(prefix_str, "vbstate_writes", st.numVBStateWrites, add_stat, c);
+    addStat(prefix_str, "docinfo_lookups", st.numDocInfoLookups,
+            add_stat, c);
+    addStat(prefix_str, "docinfo_lookups_skipped",
+            st.numDocInfoLookupsSkipped, add_stat, c);
 }
 
 void CouchKVStore::addTimingStats(const std::string &prefix,
@@ -1054,6 +1241,8 @@ void CouchKVStore::addTimingStats(const std::string &prefix,
     addStat(prefix_str, "writeTime",   st.writeTimeHisto,   add_stat, c);
     addStat(prefix_str, "writeSize",   st.writeSizeHisto,   add_stat, c);
     addStat(prefix_str, "bulkSize",    st.batchSize,        add_stat, c);
+    addStat(prefix_str, "groupCommitSize", st.groupSizeHisto, add_stat, c);
+    addStat(prefix_str, "groupCommitSync", st.groupSyncHisto, add_stat, c);
 
     // Couchstore file ops stats
     addStat(prefix_str, "fsReadTime",  st.fsStats.readTimeHisto,  add_stat, c);
@@ -1280,6 +1469,9 @@ void CouchKVStore::updateDbFileMap(uint16_t vbucketId, uint64_t newFileRev) {
         return;
     }
 
+    if (dbFileRevMap[vbucketId] != newFileRev) {
+        invalidateDB(vbucketId);
+    }
     dbFileRevMap[vbucketId] = newFileRev;
 }
 
@@ -1714,10 +1906,11 @@ int CouchKVStore::recordDbDump(Db *db, DocInfo *docinfo, void *ctx) {
     return COUCHSTORE_SUCCESS;
 }
 
-bool CouchKVStore::commit2couchstore(Callback<kvstats_ctx> *cb) {
+bool CouchKVStore::commit2couchstore(std::vector<CouchRequest *> &reqs,
+                                     Callback<kvstats_ctx> *cb) {
     bool success = true;
 
-    size_t pendingCommitCnt = pendingReqsQ.size();
+    size_t pendingCommitCnt = reqs.size();
     if (pendingCommitCnt == 0) {
         return success;
     }
@@ -1725,17 +1918,19 @@ bool CouchKVStore::commit2couchstore(Callback<kvstats_ctx> *cb) {
     Doc **docs = new Doc *[pendingCommitCnt];
     DocInfo **docinfos = new DocInfo *[pendingCommitCnt];
 
-    if (pendingReqsQ[0] == nullptr) {
+    if (reqs[0] == nullptr) {
         throw std::logic_error("CouchKVStore::commit2couchstore: "
-                        "pendingReqsQ[0] is NULL");
+                        "reqs[0] is NULL");
     }
-    uint16_t vbucket2flush = pendingReqsQ[0]->getVBucketId();
-    uint64_t fileRev = pendingReqsQ[0]->getRevNum();
+    uint16_t vbucket2flush = reqs[0]->getVBucketId();
+    uint64_t fileRev = reqs[0]->getRevNum();
+    kvstats_ctx kvctx;
+    kvctx.vbucket = vbucket2flush;
     for (size_t i = 0; i < pendingCommitCnt; ++i) {
-        CouchRequest *req = pendingReqsQ[i];
+        CouchRequest *req = reqs[i];
         if (req == nullptr) {
             throw std::logic_error("CouchKVStore::commit2couchstore: "
-                                       "pendingReqsQ["
+                                       "reqs["
                                        + std::to_string(i) + "] is NULL");
         }
         docs[i] = (Doc *)req->getDbDoc();
@@ -1744,14 +1939,18 @@ bool CouchKVStore::commit2couchstore(Callback<kvstats_ctx> *cb) {
             throw std::logic_error(
                     "CouchKVStore::commit2couchstore: "
                     "mismatch between vbucket2flush (which is "
-                    + std::to_string(vbucket2flush) + ") and pendingReqsQ["
+                    + std::to_string(vbucket2flush) + ") and reqs["
                     + std::to_string(i) + "] (which is "
                     + std::to_string(req->getVBucketId()) + ")");
         }
+        // What the flusher already knows needs no lookup in saveDocs().
+        if (req->getPresence() != DocPresence::UNKNOWN) {
+            kvctx.keyStats[req->getKey()] = std::make_pair(
+                    req->getPresence() == DocPresence::ON_DISK,
+                    !req->isDelete());
+        }
     }
 
-    kvstats_ctx kvctx;
-    kvctx.vbucket = vbucket2flush;
     // flush all
     couchstore_error_t errCode = saveDocs(vbucket2flush, fileRev, docs,
                                           docinfos, pendingCommitCnt,
@@ -1765,13 +1964,13 @@ bool CouchKVStore::commit2couchstore(Callback<kvstats_ctx> *cb) {
     if (cb) {
         cb->callback(kvctx);
     }
-    commitCallback(pendingReqsQ, kvctx, errCode);
+    commitCallback(reqs, kvctx, errCode);
 
     // clean up
     for (size_t i = 0; i < pendingCommitCnt; ++i) {
-        delete pendingReqsQ[i];
+        delete reqs[i];
     }
-    pendingReqsQ.clear();
+    reqs.clear();
     delete [] docs;
     delete [] docinfos;
     return success;
@@ -1808,7 +2007,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
 
     Db *db = NULL;
     uint64_t newFileRev;
-    errCode = openDB(vbid, fileRev, &db, 0, &newFileRev);
+    errCode = acquireDB(vbid, &db, 0, newFileRev);
     if (errCode != COUCHSTORE_SUCCESS) {
         LOG(EXTENSION_LOG_WARNING,
                 "Failed to open database, vbucketId = %d "
@@ -1824,17 +2023,24 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
         }
 
         uint64_t maxDBSeqno = 0;
+        size_t numIds = 0;
         sized_buf *ids = new sized_buf[docCount];
         for (size_t idx = 0; idx < docCount; idx++) {
-            ids[idx] = docinfos[idx]->id;
             maxDBSeqno = std::max(maxDBSeqno, docinfos[idx]->db_seq);
-            std::string key(ids[idx].buf, ids[idx].size);
-            kvctx.keyStats[key] = std::make_pair(false,
-                    !docinfos[idx]->deleted);
+            std::string key(docinfos[idx]->id.buf, docinfos[idx]->id.size);
+            // Only keys nobody could tell about are read from the file.
+            if (kvctx.keyStats.emplace(key, std::make_pair(false,
+                            !docinfos[idx]->deleted)).second) {
+                ids[numIds++] = docinfos[idx]->id;
+            }
+        }
+        if (numIds > 0) {
+            couchstore_docinfos_by_id(db, ids, (unsigned) numIds, 0,
+                    readDocInfos, &kvctx);
         }
-        couchstore_docinfos_by_id(db, ids, (unsigned) docCount, 0,
-                readDocInfos, &kvctx);
         delete[] ids;
+        st.numDocInfoLookups.fetch_add(numIds);
+        st.numDocInfoLookupsSkipped.fetch_add(docCount - numIds);
 
         hrtime_t cs_begin = gethrtime();
         uint64_t flags = COMPRESS_DOC_BODIES | COUCHSTORE_SEQUENCE_AS_IS;
@@ -1847,7 +2053,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
                     "numDocs = %" PRIu64 " error=%s [%s]\n",
                     uint64_t(docCount), couchstore_strerror(errCode),
                     couchkvstore_strerrno(db, errCode).c_str());
-            closeDatabaseHandle(db);
+            releaseDB(vbid, newFileRev, db, false);
             return errCode;
         }
 
@@ -1856,7 +2062,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
             LOG(EXTENSION_LOG_WARNING, "Failed to save local docs to "
                 "database, error=%s [%s]", couchstore_strerror(errCode),
                 couchkvstore_strerrno(db, errCode).c_str());
-                closeDatabaseHandle(db);
+                releaseDB(vbid, newFileRev, db, false);
                 return errCode;
         }
 
@@ -1868,11 +2074,12 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
                     "couchstore_commit failed, error=%s [%s]",
                     couchstore_strerror(errCode),
                     couchkvstore_strerrno(db, errCode).c_str());
-            closeDatabaseHandle(db);
+            releaseDB(vbid, newFileRev, db, false);
             return errCode;
         }
 
         st.batchSize.add(docCount);
+        addUnsyncedFile(vbid);
 
         // retrieve storage system stats for file fragmentation computation
         couchstore_db_info(db, &info);
@@ -1889,7 +2096,7 @@ couchstore_error_t CouchKVStore::saveDocs(uint16_t vbid, uint64_t rev,
         }
         state->highSeqno = info.last_sequence;
 
-        closeDatabaseHandle(db);
+        releaseDB(vbid, newFileRev, db);
     }
 
     /* update stat */
@@ -1909,6 +2116,7 @@ void CouchKVStore::remVBucketFromDbFileMap(uint16_t vbucketId) {
     }
 
     // just reset revision number of the requested vbucket
+    invalidateDB(vbucketId);
     dbFileRevMap[vbucketId] = 1;
 }
 
@@ -1970,6 +2178,7 @@ ENGINE_ERROR_CODE CouchKVStore::readVBState(Db *db, uint16_t vbId) {
     uint64_t lastSnapEnd = 0;
     uint64_t maxCas = 0;
     int64_t driftCounter = INITIAL_DRIFT;
+    uint64_t resetGeneration = 0;
 
     DbInfo info;
     errCode = couchstore_db_info(db, &info);
@@ -2024,6 +2233,8 @@ ENGINE_ERROR_CODE CouchKVStore::readVBState(Db *db, uint16_t vbId) {
                                 cJSON_GetObjectItem(jsonObj, "max_cas"));
         const std::string driftCount = getJSONObjString(
                                 cJSON_GetObjectItem(jsonObj, "drift_counter"));
+        const std::string resetGen = getJSONObjString(
+                                cJSON_GetObjectItem(jsonObj, "reset_generation"));
         cJSON *failover_json = cJSON_GetObjectItem(jsonObj, "failover_table");
         if (vb_state.compare("") == 0 || checkpoint_id.compare("") == 0
                 || max_deleted_seqno.compare("") == 0) {
@@ -2068,6 +2279,10 @@ ENGINE_ERROR_CODE CouchKVStore::readVBState(Db *db, uint16_t vbId) {
                 parseInt64(driftCount.c_str(), &driftCounter);
             }
 
+            if (resetGen.compare("") != 0) {
+                parseUint64(resetGen.c_str(), &resetGeneration);
+            }
+
             if (failover_json) {
                 char* json = cJSON_PrintUnformatted(failover_json);
                 failovers.assign(json);
@@ -2083,7 +2298,7 @@ ENGINE_ERROR_CODE CouchKVStore::readVBState(Db *db, uint16_t vbId) {
                                              maxDeletedSeqno, highSeqno,
                                              purgeSeqno, lastSnapStart,
                                              lastSnapEnd, maxCas, driftCounter,
-                                             failovers);
+                                             failovers, resetGeneration);
 
     return couchErr2EngineErr(errCode);
 }
@@ -2099,6 +2314,8 @@ couchstore_error_t CouchKVStore::saveVBState(Db *db, vbucket_state &vbState) {
               << ",\"snap_end\": \"" << vbState.lastSnapEnd << "\""
               << ",\"max_cas\": \"" << vbState.maxCas << "\""
               << ",\"drift_counter\": \"" << vbState.driftCounter << "\""
+              << ",\"reset_generation\": \""
+              << vbState.resetGeneration << "\""
               << "}";
 
     LocalDoc lDoc;
@@ -2115,6 +2332,8 @@ couchstore_error_t CouchKVStore::saveVBState(Db *db, vbucket_state &vbState) {
             "couchstore_save_local_document failed "
             "error=%s [%s]\n", couchstore_strerror(errCode),
             couchkvstore_strerrno(db, errCode).c_str());
+    } else {
+        ++st.numVBStateWrites;
     }
     return errCode;
 }
@@ -2131,10 +2350,8 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx) {
 
     std::string keyStr(docinfo->id.buf, docinfo->id.size);
     GetMultiCbCtx *cbCtx = static_cast<GetMultiCbCtx *>(ctx);
-    CouchKVStoreStats &st = cbCtx->cks.getCKVStoreStat();
 
-    vb_bgfetch_queue_t::iterator qitr = cbCtx->fetches.find(keyStr);
-    if (qitr == cbCtx->fetches.end()) {
+    if (cbCtx->fetches.find(keyStr) == cbCtx->fetches.end()) {
         // this could be a serious race condition in couchstore,
         // log a warning message and continue
         LOG(EXTENSION_LOG_WARNING,
@@ -2144,6 +2361,26 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx) {
         return 0;
     }
 
+    DocInfo *copy = copyDocInfo(docinfo);
+    if (copy) {
+        cbCtx->found.push_back(copy);
+    } else {
+        LOG(EXTENSION_LOG_WARNING, "Failed to allocate docinfo, vBucket=%d "
+            "key=%s", cbCtx->vbId, keyStr.c_str());
+        cbCtx->cks.getCKVStoreStat().numGetFailure++;
+        for (auto fetch : cbCtx->fetches[keyStr].bgfetched_list) {
+            fetch->value.setStatus(ENGINE_ENOMEM);
+        }
+    }
+    return 0;
+}
+
+void CouchKVStore::readMultiDoc(Db *db, DocInfo *docinfo, void *ctx) {
+    std::string keyStr(docinfo->id.buf, docinfo->id.size);
+    GetMultiCbCtx *cbCtx = static_cast<GetMultiCbCtx *>(ctx);
+    CouchKVStoreStats &st = cbCtx->cks.getCKVStoreStat();
+
+    vb_bgfetch_queue_t::iterator qitr = cbCtx->fetches.find(keyStr);
     vb_bgfetch_item_ctx_t& bg_itm_ctx = (*qitr).second;
     bool meta_only = bg_itm_ctx.isMetaOnly;
 
@@ -2177,13 +2414,11 @@ int CouchKVStore::getMultiCb(Db *db, DocInfo *docinfo, void *ctx) {
         }
     }
     if (!return_val_ownership_transferred) {
-        LOG(EXTENSION_LOG_WARNING, "CouchKVStore::getMultiCb called with zero"
-            "items in bgfetched_list, vBucket=%d key=%s",
+        LOG(EXTENSION_LOG_WARNING, "CouchKVStore::readMultiDoc called with "
+            "zero items in bgfetched_list, vBucket=%d key=%s",
             cbCtx->vbId, keyStr.c_str());
         delete returnVal.getValue();
     }
-
-    return 0;
 }
 
 
@@ -2197,6 +2432,109 @@ void CouchKVStore::closeDatabaseHandle(Db *db) {
     st.numClose++;
 }
 
+couchstore_error_t CouchKVStore::acquireDB(uint16_t vbid, Db **db,
+                                           uint64_t options,
+                                           uint64_t &fileRev) {
+    fileRev = dbFileRevMap[vbid];
+
+    if (dbCacheMax > 0) {
+        CachedDb cached;
+        bool found = false;
+        {
+            LockHolder lh(dbCacheLock);
+            std::list<CachedDb>::iterator it = dbCacheIndex[vbid];
+            if (it != dbCache.end()) {
+                cached = *it;
+                dbCache.erase(it);
+                dbCacheIndex[vbid] = dbCache.end();
+                found = true;
+            }
+        }
+        if (found) {
+            // The file may have been compacted, or written to through
+            // another handle (reader and writer have handles of their own).
+            struct stat fst;
+            std::string file = getDBFileName(dbname, vbid, cached.fileRev);
+            if (cached.fileRev == fileRev &&
+                stat(file.c_str(), &fst) == 0 &&
+                static_cast<uint64_t>(fst.st_size) == cached.fileSize &&
+                static_cast<uint64_t>(fst.st_ino) == cached.fileIno) {
+                ++st.numDbCacheHits;
+                *db = cached.db;
+                return COUCHSTORE_SUCCESS;
+            }
+            closeDatabaseHandle(cached.db);
+        }
+        ++st.numDbCacheMisses;
+    }
+
+    return openDB(vbid, fileRev, db, options, &fileRev);
+}
+
+void CouchKVStore::releaseDB(uint16_t vbid, uint64_t fileRev, Db *db,
+                             bool reusable) {
+    if (dbCacheMax == 0 || !reusable || fileRev != dbFileRevMap[vbid]) {
+        closeDatabaseHandle(db);
+        return;
+    }
+
+    // Remember what the file looks like now, a later change through
+    // another handle leaves the header this one has behind.
+    DbInfo info;
+    struct stat fst;
+    std::string file = getDBFileName(dbname, vbid, fileRev);
+    if (couchstore_db_info(db, &info) != COUCHSTORE_SUCCESS ||
+        stat(file.c_str(), &fst) != 0 ||
+        static_cast<uint64_t>(fst.st_size) != info.file_size) {
+        closeDatabaseHandle(db);
+        return;
+    }
+
+    CachedDb cached;
+    cached.vbid = vbid;
+    cached.fileRev = fileRev;
+    cached.db = db;
+    cached.fileSize = info.file_size;
+    cached.fileIno = fst.st_ino;
+
+    std::vector<Db *> evicted;
+    {
+        LockHolder lh(dbCacheLock);
+        std::list<CachedDb>::iterator it = dbCacheIndex[vbid];
+        if (it != dbCache.end()) {
+            // Another handle was released meanwhile, keep the newer one.
+            evicted.push_back(it->db);
+            dbCache.erase(it);
+        }
+        dbCache.push_front(cached);
+        dbCacheIndex[vbid] = dbCache.begin();
+        while (dbCache.size() > dbCacheMax) {
+            evicted.push_back(dbCache.back().db);
+            dbCacheIndex[dbCache.back().vbid] = dbCache.end();
+            dbCache.pop_back();
+        }
+    }
+    for (auto evictedDb : evicted) {
+        closeDatabaseHandle(evictedDb);
+    }
+}
+
+void CouchKVStore::invalidateDB(uint16_t vbid) {
+    Db *db = NULL;
+    {
+        LockHolder lh(dbCacheLock);
+        std::list<CachedDb>::iterator it = dbCacheIndex[vbid];
+        if (it != dbCache.end()) {
+            db = it->db;
+            dbCache.erase(it);
+            dbCacheIndex[vbid] = dbCache.end();
+        }
+    }
+    if (db) {
+        closeDatabaseHandle(db);
+    }
+}
+
 ENGINE_ERROR_CODE CouchKVStore::couchErr2EngineErr(couchstore_error_t errCode) {
     switch (errCode) {
     case COUCHSTORE_SUCCESS:
@@ -2332,6 +2670,9 @@ RollbackResult CouchKVStore::rollback(uint16_t vbid, uint64_t rollbackSeqno,
     dbFileName << dbname << "/" << vbid << ".couch." << fileRev;
     couchstore_error_t errCode;
 
+    // The file is rewound below, a kept handle would miss that.
+    invalidateDB(vbid);
+
     errCode = openDB(vbid, fileRev, &db,
                      (uint64_t) COUCHSTORE_OPEN_FLAG_RDONLY);
 
@@ -22,7 +22,9 @@
 #include "libcouchstore/couch_db.h"
 #include <relaxed_atomic.h>
 
+#include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -51,8 +53,12 @@ public:
       numLoadedVb(0), numGetFailure(0), numSetFailure(0),
       numDelFailure(0), numOpenFailure(0), numVbSetFailure(0),
       io_num_read(0), io_num_write(0), io_read_bytes(0), io_write_bytes(0),
+      numDbCacheHits(0), numDbCacheMisses(0),
+      numVBStateWrites(0),
+      numDocInfoLookups(0), numDocInfoLookupsSkipped(0),
       readSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
-      writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25) {
+      writeSizeHisto(ExponentialGenerator<size_t>(1, 2), 25),
+      groupSizeHisto(ExponentialGenerator<size_t>(1, 2), 12) {
     }
 
     void reset() {
@@ -65,6 +71,11 @@ public:
         numDelFailure.store(0);
         numOpenFailure.store(0);
         numVbSetFailure.store(0);
+        numDbCacheHits.store(0);
+        numDbCacheMisses.store(0);
+        numVBStateWrites.store(0);
+        numDocInfoLookups.store(0);
+        numDocInfoLookupsSkipped.store(0);
 
         readTimeHisto.reset();
         readSizeHisto.reset();
@@ -76,6 +87,8 @@ public:
         commitHisto.reset();
         saveDocsHisto.reset();
         batchSize.reset();
+        groupSyncHisto.reset();
+        groupSizeHisto.reset();
         fsStats.reset();
     }
 
@@ -104,6 +117,18 @@ public:
     //! Number of bytes written (key + value + application rev metadata)
     AtomicValue<size_t> io_write_bytes;
 
+    //! Number of database handles taken from the handle cache
+    AtomicValue<size_t> numDbCacheHits;
+    //! Number of database handles opened, the cache had none to use
+    AtomicValue<size_t> numDbCacheMisses;
+    //! Number of vbucket state local docs written
+    AtomicValue<size_t> numVBStateWrites;
+
+    //! Number of keys whose previous revision was looked up before a save
+    AtomicValue<size_t> numDocInfoLookups;
+    //! Number of keys saved without that lookup, the flusher knew already
+    AtomicValue<size_t> numDocInfoLookupsSkipped;
+
     /* for flush and vb delete, no error handling in CouchKVStore, such
      * failure should be tracked in MC-engine  */
 
@@ -127,6 +152,10 @@ public:
     Histogram<size_t> batchSize;
     //Time spent in vbucket snapshot
     Histogram<hrtime_t> snapshotHisto;
+    // Time spent in sync() rounds
+    Histogram<hrtime_t> groupSyncHisto;
+    // Number of files synced per sync() round
+    Histogram<size_t> groupSizeHisto;
 
     // Stats from the underlying OS file operations done by couchstore.
     CouchstoreStats fsStats;
@@ -154,9 +183,10 @@ public:
      * @param rev vbucket database revision number
      * @param cb persistence callback
      * @param del flag indicating if it is an item deletion or not
+     * @param presence whether the document is known to be stored already
      */
     CouchRequest(const Item &it, uint64_t rev, MutationRequestCallback &cb,
-                 bool del);
+                 bool del, DocPresence presence = DocPresence::UNKNOWN);
 
     virtual ~CouchRequest() {}
 
@@ -228,10 +258,20 @@ public:
         return key;
     }
 
+    /**
+     * What the flusher knew about the document being stored already
+     *
+     * @return presence of the document in the database file
+     */
+    DocPresence getPresence(void) const {
+        return presence;
+    }
+
 protected:
     value_t value;
     uint8_t meta[COUCHSTORE_METADATA_SIZE];
     uint64_t fileRevNum;
+    DocPresence presence;
     Doc dbDoc;
     DocInfo dbDocInfo;
 };
@@ -291,6 +331,28 @@ public:
      */
     bool commit(Callback<kvstats_ctx> *cb);
 
+    /**
+     * Begin a transaction of the writes to one vbucket. The transactions
+     * of different vbuckets may run from different threads.
+     *
+     * @return true if the transaction is started successfully
+     */
+    bool beginVBucket(uint16_t vbid);
+
+    /**
+     * Commit the transaction of a vbucket (unless not currently in one).
+     *
+     * @return true if the commit is completed successfully.
+     */
+    bool commitVBucket(uint16_t vbid, Callback<kvstats_ctx> *cb);
+
+    /**
+     * Sync the files written since the last call, in one round.
+     *
+     * @return false if a file fails to sync
+     */
+    bool sync();
+
     /**
      * Rollback a transaction (unless not currently in one).
      */
@@ -316,8 +378,10 @@ public:
      *
      * @param itm instance representing the document to be inserted or updated
      * @param cb callback instance for SET
+     * @param presence whether the document is known to be stored already
      */
-    void set(const Item &itm, Callback<mutation_result> &cb);
+    void set(const Item &itm, Callback<mutation_result> &cb,
+             DocPresence presence = DocPresence::UNKNOWN);
 
     /**
      * Retrieve the document with a given key from the underlying storage system.
@@ -348,8 +412,10 @@ public:
      *
      * @param itm instance representing the document to be deleted
      * @param cb callback instance for DELETE
+     * @param presence whether the document is known to be stored already
      */
-    void del(const Item &itm, Callback<int> &cb);
+    void del(const Item &itm, Callback<int> &cb,
+             DocPresence presence = DocPresence::UNKNOWN);
 
     /**
      * Delete a given vbucket database instance from the underlying storage system
@@ -459,6 +525,7 @@ public:
     static int recordDbDump(Db *db, DocInfo *docinfo, void *ctx);
     static int recordDbStat(Db *db, DocInfo *docinfo, void *ctx);
     static int getMultiCb(Db *db, DocInfo *docinfo, void *ctx);
+    static void readMultiDoc(Db *db, DocInfo *docinfo, void *ctx);
     ENGINE_ERROR_CODE readVBState(Db *db, uint16_t vbId);
 
     couchstore_error_t fetchDoc(Db *db, DocInfo *docinfo,
@@ -498,7 +565,8 @@ protected:
     void operator=(const CouchKVStore &from);
 
     void close();
-    bool commit2couchstore(Callback<kvstats_ctx> *cb);
+    bool commit2couchstore(std::vector<CouchRequest *> &reqs,
+                           Callback<kvstats_ctx> *cb);
 
     uint64_t checkNewRevNum(std::string &dbname, bool newFile = false);
     void populateFileNameMap(std::vector<std::string> &filenames,
@@ -517,10 +585,44 @@ protected:
     void commitCallback(std::vector<CouchRequest *> &committedReqs,
                         kvstats_ctx &kvctx,
                         couchstore_error_t errCode);
+    /**
+     * Write the _local/vbstate doc. The flusher writes it with every
+     * commit whatever it holds, as the snapshot range and max_cas move
+     * with every batch; snapshotVBucket() only gets here when the state
+     * or the failover table changed.
+     */
     couchstore_error_t saveVBState(Db *db, vbucket_state &vbState);
     void setDocsCommitted(uint16_t docs);
     void closeDatabaseHandle(Db *db);
 
+    /**
+     * Note the current file of a vbucket, committed to, for the next
+     * sync() when group sync is on.
+     */
+    void addUnsyncedFile(uint16_t vbid);
+
+    /**
+     * Get a handle of the current file of a vbucket: the one the handle
+     * cache keeps if the file did not change since, else a new one.
+     *
+     * @param fileRev set to the revision of the file the handle is of
+     */
+    couchstore_error_t acquireDB(uint16_t vbid, Db **db, uint64_t options,
+                                 uint64_t &fileRev);
+
+    /**
+     * Give back a handle from acquireDB(). It is kept open for the next
+     * operation unless the cache is full of more recently used ones, or
+     * an operation on it failed (reusable false).
+     */
+    void releaseDB(uint16_t vbid, uint64_t fileRev, Db *db,
+                   bool reusable = true);
+
+    /**
+     * Close the cached handle of a vbucket, its file is replaced or gone.
+     */
+    void invalidateDB(uint16_t vbid);
+
     /**
      * Unlink selected couch file, which will be removed by the OS,
      * once all its references close.
@@ -550,6 +652,16 @@ protected:
     std::vector<CouchRequest *> pendingReqsQ;
     bool intransaction;
 
+    /* transaction of a vbucket begun by beginVBucket(); only touched by
+       the flusher of the vbucket */
+    struct VBTransaction {
+        VBTransaction() : active(false) { }
+
+        bool active;
+        std::vector<CouchRequest *> reqs;
+    };
+    std::vector<VBTransaction> vbTxns;
+
     /* all stats */
     CouchKVStoreStats   st;
 
@@ -580,6 +692,26 @@ protected:
     /* pending file deletions */
     AtomicQueue<std::string> pendingFileDeletions;
 
+    /* files committed to and not synced yet, if group sync is on */
+    std::set<std::string> unsyncedFiles;
+    Mutex unsyncedLock;
+
+    /* database handle kept open between operations */
+    struct CachedDb {
+        uint16_t vbid;
+        uint64_t fileRev;
+        Db *db;
+        // identity of the file when the handle was released
+        uint64_t fileSize;
+        uint64_t fileIno;
+    };
+    /* open handles, most recently used first; a handle in use is not in */
+    std::list<CachedDb> dbCache;
+    /* position of each vbucket's handle in dbCache, or dbCache.end() */
+    std::vector<std::list<CachedDb>::iterator> dbCacheIndex;
+    size_t dbCacheMax;
+    Mutex dbCacheLock;
+
     AtomicValue<size_t> backfillCounter;
     std::map<size_t, Db*> backfills;
     Mutex backfillLock;
@@ -57,8 +57,10 @@ void CacheCallback::callback(CacheLookup &lookup) {
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(lookup.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num, false, false);
+    int key_hash = vb->ht.hash(lookup.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num,
+                                          key_hash, false, false);
     if (v && v->isResident() && v->getBySeqno() == lookup.getBySeqno()) {
         ActiveStream* as = static_cast<ActiveStream*>(stream_.get());
         Item* it;
@@ -39,6 +39,7 @@
 #include "ext_meta_parser.h"
 #include "failover-table.h"
 #include "flusher.h"
+#include "ht_snapshot.h"
 #include "htresizer.h"
 #include "kvshard.h"
 #include "kvstore.h"
@@ -113,6 +114,8 @@ public:
             store.setExpiryPagerSleeptime(value);
         } else if (key.compare("expiry_port") == 0) {
             store.setExpiryPort(value);
+        } else if (key.compare("expiry_notify_queue_cap") == 0) {
+            store.setExpiryNotifyQueueCap(value);
         } else if (key.compare("exp_pager_initial_run_time") == 0) {
             store.setExpiryPagerTasktime(value);
         } else if (key.compare("alog_sleep_time") == 0) {
@@ -170,6 +173,8 @@ public:
     virtual void stringValueChanged(const std::string &key, const char* value) {
         if (key.compare("expiry_host") == 0) {
             store.setExpiryHost(value);
+        } else if (key.compare("expiry_format") == 0) {
+            store.setExpiryFormat(value);
         } else {
             LOG(EXTENSION_LOG_WARNING,
                 "Failed to change value for unknown variable, %s\n",
@@ -288,7 +293,7 @@ EventuallyPersistentStore::EventuallyPersistentStore(
     bgFetchQueue(0),
     diskFlushAll(false), bgFetchDelay(0),
     backfillMemoryThreshold(0.95),
-    statsSnapshotTaskId(0), lastTransTimePerItem(0)
+    statsSnapshotTaskId(0), htSnapshotTaskId(0), lastTransTimePerItem(0)
 {
     cachedResidentRatio.activeRatio.store(0);
     cachedResidentRatio.replicaRatio.store(0);
@@ -304,6 +309,20 @@ EventuallyPersistentStore::EventuallyPersistentStore(
         accessLog.push_back(shardlog);
     }
 
+    expiryNotifier = new ExpiryNotifier(engine, stats,
+                                        config.getMaxNumShards(),
+                                        config.getExpiryNotifyQueueCap());
+    expiryIndexEnabled = config.isExpIndexEnabled();
+
+    flusherGroupSync = config.isFlusherGroupSync();
+    flusherGroupSyncMax = std::max(config.getFlusherGroupSyncMax(),
+                                   static_cast<size_t>(1));
+    unsyncedVbs.resize(config.getMaxNumShards());
+    flusherCoalesceMaxAge =
+        static_cast<hrtime_t>(config.getFlusherCoalesceMaxAge()) * 1000000;
+    flusherBatchMaxItems = config.getFlusherBatchMaxItems();
+    flusherBatchMaxBytes = config.getFlusherBatchMaxBytes();
+
     storageProperties = new StorageProperties(true, true, true, true);
 
     stats.schedulingHisto = new Histogram<hrtime_t>[GlobalTask::allTaskIds.size()];
@@ -447,6 +466,8 @@ bool EventuallyPersistentStore::initialize() {
 
     LockHolder elh(expiryPager.mutex);
     expiryPager.enabled = config.isExpPagerEnabled();
+    expiryPager.indexSleeptime = config.getExpIndexStime();
+    scheduleExpiryIndexPager();
     elh.unlock();
 
     size_t expiryPagerSleeptime = config.getExpPagerStime();
@@ -467,7 +488,16 @@ bool EventuallyPersistentStore::initialize() {
     setExpiryPort(expiryPort);
     config.addValueChangedListener("expiry_port",
                                    new EPStoreValueChangeListener(*this));
-
+    config.addValueChangedListener("expiry_notify_queue_cap",
+                                   new EPStoreValueChangeListener(*this));
+    setExpiryFormat(config.getExpiryFormat());
+    config.addValueChangedListener("expiry_format",
+                                   new EPStoreValueChangeListener(*this));
+    if (!config.getExpiryJournalPath().empty()) {
+        expiryNotifier->openJournal(config.getExpiryJournalPath(),
+                                    config.getExpiryJournalMaxSize());
+    }
+    expiryNotifier->start();
 
     float flusherMinSleepTime = config.getFlusherMinSleepTime();
     setFlusherMinSleepTime(flusherMinSleepTime);
@@ -502,10 +532,12 @@ bool EventuallyPersistentStore::initialize() {
 EventuallyPersistentStore::~EventuallyPersistentStore() {
     stopWarmup();
     stopBgFetcher();
+    expiryNotifier->stop();
     ExecutorPool::get()->stopTaskGroup(engine.getTaskable().getGID(), NONIO_TASK_IDX,
                                        stats.forceShutdown);
 
     ExecutorPool::get()->cancel(statsSnapshotTaskId);
+    ExecutorPool::get()->cancel(htSnapshotTaskId);
 
     LockHolder lh(accessScanner.mutex);
     ExecutorPool::get()->cancel(accessScanner.task);
@@ -513,6 +545,12 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
 
     stopFlusher();
 
+    // Everything is persisted by now, so the snapshot restores in full.
+    if (!stats.forceShutdown && warmupTask->isComplete() &&
+        engine.getConfiguration().isHtSnapshot()) {
+        snapshotHashTables();
+    }
+
     ExecutorPool::get()->unregisterTaskable(engine.getTaskable(),
                                             stats.forceShutdown);
 
@@ -523,6 +561,7 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
     delete conflictResolver;
     delete warmupTask;
     delete storageProperties;
+    delete expiryNotifier;
     defragmenterTask.reset();
 
     std::vector<MutationLog*>::iterator it;
@@ -643,8 +682,10 @@ EventuallyPersistentStore::deleteExpiredItem(uint16_t vbid, std::string &key,
         ReaderLockHolder rlh(vb->getStateLock());
         if (vb->getState() == vbucket_state_active) {
             int bucket_num(0);
-            LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-            StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+            int key_hash = vb->ht.hash(key);
+            LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+            StoredValue *v = vb->ht.unlocked_find(key, bucket_num, key_hash,
+                                                  true, false);
             if (v) {
                 if (v->isTempNonExistentItem() || v->isTempDeletedItem()) {
                     // This is a temporary item whose background fetch for metadata
@@ -652,15 +693,16 @@ EventuallyPersistentStore::deleteExpiredItem(uint16_t vbid, std::string &key,
 
                     LOG(EXTENSION_LOG_WARNING, "%s: key[%s] temporary--can not properly notify its expiration. Not notifying at all!", __func__, key.c_str()); /// @TODO maybe wait for it to load all the way and only then report?
                 
-                    bool deleted = vb->ht.unlocked_del(key, bucket_num);
+                    bool deleted = vb->ht.unlocked_del(key, bucket_num,
+                                                       key_hash);
                     if (!deleted) {
                         throw std::logic_error("EPStore::deleteExpiredItem: "
                                 "Failed to delete key '" + key + "' from bucket "
                                 + std::to_string(bucket_num));
                     }
                 } else if (v->isExpired(startTime) && !v->isDeleted()) {
-                    expiryPager.channel.sendNotification(engine.getName(), v);
-                
+                    expiryNotifier->notify(vbid, *v);
+
                     vb->ht.unlocked_softDelete(v, 0, getItemEvictionPolicy());
                     v->setCas(vb->nextHLCCas());
                     queueDirty(vb, v, &lh, NULL, false);
@@ -678,7 +720,8 @@ EventuallyPersistentStore::deleteExpiredItem(uint16_t vbid, std::string &key,
                         if (rv == ADD_NOMEM) {
                             return;
                         }
-                        v = vb->ht.unlocked_find(key, bucket_num, true, false);
+                        v = vb->ht.unlocked_find(key, bucket_num, key_hash,
+                                                 true, false);
                         v->setDeleted();
                         v->setRevSeqno(revSeqno);
                         vb->ht.unlocked_softDelete(v, 0, eviction_policy);
@@ -703,14 +746,56 @@ EventuallyPersistentStore::deleteExpiredItems(std::list<std::pair<uint16_t,
     }
 }
 
+bool EventuallyPersistentStore::deleteExpiredItemsFromIndex(uint16_t vbid,
+                                                            time_t startTime,
+                                                            size_t limit) {
+    RCPtr<VBucket> vb = getVBucket(vbid);
+    if (!vb) {
+        return false;
+    }
+
+    // Obtain reader access to the VB state change lock so that
+    // the VB can't switch state whilst we're processing
+    ReaderLockHolder rlh(vb->getStateLock());
+    if (vb->getState() != vbucket_state_active) {
+        // Only the active expires items. A replica keeps its entries,
+        // kept up to date by the deletes it receives, for when it is
+        // promoted.
+        return false;
+    }
+
+    std::vector<std::string> keys;
+    bool more = vb->expiryIndex.popDue(startTime, keys, limit);
+
+    for (auto &key : keys) {
+        int bucket_num(0);
+        int key_hash = vb->ht.hash(key);
+        LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, key_hash, false,
+                                              false);
+        if (v && !v->isTempItem() && v->isExpired(startTime)) {
+            expiryNotifier->notify(vbid, *v);
+
+            vb->ht.unlocked_softDelete(v, 0, getItemEvictionPolicy());
+            v->setCas(vb->nextHLCCas());
+            queueDirty(vb, v, &lh, NULL, false);
+            incExpirationStat(vb, EXP_BY_PAGER);
+        } else {
+            ++stats.expiryIndexStale;
+        }
+    }
+    return more;
+}
+
 StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> &vb,
                                                         const std::string &key,
                                                         int bucket_num,
+                                                        int key_hash,
                                                         bool wantDeleted,
                                                         bool trackReference,
                                                         bool queueExpired) {
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, wantDeleted,
-                                          trackReference);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, key_hash,
+                                          wantDeleted, trackReference);
     if (v && !v->isDeleted() && !v->isTempItem()) {
         // In the deleted case, we ignore expiration time.
         if (v->isExpired(ep_real_time())) {
@@ -719,7 +804,7 @@ StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> &vb,
             }
             // queueDirty only allowed on active VB
             if (queueExpired && vb->getState() == vbucket_state_active) {
-                expiryPager.channel.sendNotification(engine.getName(), v);
+                expiryNotifier->notify(vb->getId(), *v);
                 incExpirationStat(vb, EXP_BY_ACCESS);
                 vb->ht.unlocked_softDelete(v, 0, eviction_policy);
                 v->setCas(vb->nextHLCCas());
@@ -739,8 +824,10 @@ bool EventuallyPersistentStore::isMetaDataResident(RCPtr<VBucket> &vb,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, false, false);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, key_hash, false,
+                                          false);
 
     if (v && !v->isTempItem()) {
         return true;
@@ -761,8 +848,10 @@ protocol_binary_response_status EventuallyPersistentStore::evictKey(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, force, false);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash, force,
+                                     false);
 
     protocol_binary_response_status rv(PROTOCOL_BINARY_RESPONSE_SUCCESS);
 
@@ -858,8 +947,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &itm,
 
     bool cas_op = (itm.getCas() != 0);
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num,
+    int key_hash = vb->ht.hash(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, key_hash,
                                           /*wantsDeleted*/true,
                                           /*trackReference*/false);
     if (v && v->isLocked(ep_current_time()) &&
@@ -962,9 +1052,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::add(const Item &itm,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true,
-                                          false);
+    int key_hash = vb->ht.hash(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, key_hash,
+                                          true, false);
 
     bool maybeKeyExists = true;
     if ((v == nullptr || v->isTempInitialItem()) &&
@@ -1028,9 +1119,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::replace(const Item &itm,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true,
-                                          false);
+    int key_hash = vb->ht.hash(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, key_hash,
+                                          true, false);
     if (v) {
         if (v->isDeleted() || v->isTempDeletedItem() ||
             v->isTempNonExistentItem()) {
@@ -1126,9 +1218,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::addTAPBackfillItem(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true,
-                                          false);
+    int key_hash = vb->ht.hash(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, key_hash,
+                                          true, false);
 
     // Note that this function is only called on replica or pending vbuckets.
     if (v && v->isLocked(ep_current_time())) {
@@ -1484,6 +1577,7 @@ bool EventuallyPersistentStore::completeVBucketDeletion(uint16_t vbid,
         lh.unlock();
         LockHolder vlh(vb_mutexes[vbid]);
         getRWUnderlying(vbid)->delVBucket(vbid);
+        HashTableSnapshot::remove(engine.getConfiguration().getDbname(), vbid);
         vbMap.setBucketDeletion(vbid, false);
         vbMap.setBucketCreation(vbid, false);
         vbMap.setPersistenceSeqno(vbid, 0);
@@ -1818,6 +1912,40 @@ void EventuallyPersistentStore::snapshotStats() {
     getOneRWUnderlying()->snapshotStats(snap.smap);
 }
 
+void EventuallyPersistentStore::snapshotHashTables() {
+    LockHolder lh(htSnapshotMutex);
+    const std::string &dbname = engine.getConfiguration().getDbname();
+    hrtime_t start = gethrtime();
+    size_t numVbs = 0;
+    size_t numItems = 0;
+
+    for (auto vbid : vbMap.getBuckets()) {
+        RCPtr<VBucket> vb = getVBucket(vbid);
+        if (!vb || vb->getState() == vbucket_state_dead) {
+            continue;
+        }
+        uint64_t resetGeneration = 0;
+        {
+            LockHolder vlh(vb_mutexes[vbid]);
+            vbucket_state *vbs = getRWUnderlying(vbid)->getVBucketState(vbid);
+            if (vbs) {
+                resetGeneration = vbs->resetGeneration;
+            }
+        }
+        ssize_t n = HashTableSnapshot::write(dbname, *vb, resetGeneration);
+        if (n >= 0) {
+            ++numVbs;
+            numItems += n;
+        }
+    }
+
+    hrtime_t spent = gethrtime() - start;
+    stats.htSnapshotHisto.add(spent / 1000);
+    LOG(EXTENSION_LOG_NOTICE, "Wrote hash table snapshots of %" PRIu64
+        " vbuckets with %" PRIu64 " items in %s", uint64_t(numVbs),
+        uint64_t(numItems), hrtime2text(spent).c_str());
+}
+
 void EventuallyPersistentStore::updateBGStats(const hrtime_t init,
                                               const hrtime_t start,
                                               const hrtime_t stop) {
@@ -1865,8 +1993,9 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
     if (vb) {
         ReaderLockHolder rlh(vb->getStateLock());
         int bucket_num(0);
-        LockHolder hlh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+        int key_hash = vb->ht.hash(key);
+        LockHolder hlh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+        StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash, true);
         if (isMeta) {
             if ((v && v->unlocked_restoreMeta(gcb.val.getValue(),
                                               gcb.val.getStatus(), vb->ht))
@@ -1985,8 +2114,9 @@ void EventuallyPersistentStore::completeBGFetchMulti(uint16_t vbId,
         {   //locking scope
             ReaderLockHolder rlh(vb->getStateLock());
             int bucket = 0;
-            LockHolder blh = vb->ht.getLockedBucket(key, &bucket);
-            StoredValue *v = fetchValidValue(vb, key, bucket, true);
+            int key_hash = vb->ht.hash(key);
+            LockHolder blh = vb->ht.getLockedBucket(key_hash, &bucket);
+            StoredValue *v = fetchValidValue(vb, key, bucket, key_hash, true);
             if (bgitem->metaDataOnly) {
                 if ((v && v->unlocked_restoreMeta(fetchedValue, status, vb->ht))
                     || ENGINE_KEY_ENOENT == status) {
@@ -2150,9 +2280,22 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
 
     const bool trackReference = (options & TRACK_REFERENCE);
 
+    if (vb->ht.hasOptimisticReads()) {
+        // Hits on resident items don't need the bucket lock.
+        int64_t bySeqno(0);
+        uint8_t nru(0);
+        Item *itm = vb->ht.optimisticGet(key, vbucket,
+                                         options & HIDE_LOCKED_CAS,
+                                         trackReference, bySeqno, nru);
+        if (itm) {
+            return GetValue(itm, ENGINE_SUCCESS, bySeqno, false, nru);
+        }
+    }
+
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true,
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash, true,
                                      trackReference);
     if (v) {
         if (v->isDeleted()) {
@@ -2164,7 +2307,7 @@ GetValue EventuallyPersistentStore::getInternal(const std::string &key,
             // if the get were issued over an item that doesn't
             // exist, then we dont preserve a temp item.
             if (options & DELETE_TEMP) {
-                vb->ht.unlocked_del(key, bucket_num);
+                vb->ht.unlocked_del(key, bucket_num, key_hash);
             }
             GetValue rv;
             return rv;
@@ -2272,8 +2415,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getMetaData(
 
     int bucket_num(0);
     deleted = 0;
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true,
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, key_hash, true,
                                           trackReferenced);
 
     if (v) {
@@ -2361,9 +2505,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::setWithMeta(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, true,
-                                          false);
+    int key_hash = vb->ht.hash(itm.getKey());
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(itm.getKey(), bucket_num, key_hash,
+                                          true, false);
 
     bool maybeKeyExists = true;
     if (!force) {
@@ -2485,8 +2630,9 @@ GetValue EventuallyPersistentStore::getAndUpdateTtl(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempDeletedItem() ||
@@ -2550,8 +2696,9 @@ EventuallyPersistentStore::statsVKey(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempDeletedItem() ||
@@ -2608,8 +2755,10 @@ void EventuallyPersistentStore::completeStatsVKey(const void* cookie,
         RCPtr<VBucket> vb = getVBucket(vbid);
         if (vb) {
             int bucket_num(0);
-            LockHolder hlh = vb->ht.getLockedBucket(key, &bucket_num);
-            StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+            int key_hash = vb->ht.hash(key);
+            LockHolder hlh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+            StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash,
+                                             true);
             if (v && v->isTempInitialItem()) {
                 if (gcb.val.getStatus() == ENGINE_SUCCESS) {
                     v->unlocked_restoreValue(gcb.val.getValue(), vb->ht);
@@ -2654,8 +2803,9 @@ GetValue EventuallyPersistentStore::getLocked(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempNonExistentItem() ||
@@ -2722,8 +2872,9 @@ EventuallyPersistentStore::unlockKey(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash, true);
 
     if (v) {
         if (v->isDeleted() || v->isTempNonExistentItem() ||
@@ -2767,8 +2918,9 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::getKeyStats(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash, true);
 
     if (v) {
         if ((v->isDeleted() && !wantsDeleted) ||
@@ -2810,8 +2962,9 @@ std::string EventuallyPersistentStore::validateKey(const std::string &key,
                                                    Item &diskItem) {
     int bucket_num(0);
     RCPtr<VBucket> vb = getVBucket(vbucket);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = fetchValidValue(vb, key, bucket_num, true,
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = fetchValidValue(vb, key, bucket_num, key_hash, true,
                                      false, true);
 
     if (v) {
@@ -2823,7 +2976,7 @@ std::string EventuallyPersistentStore::validateKey(const std::string &key,
         if (diskItem.getFlags() != v->getFlags()) {
             return "flags_mismatch";
         } else if (v->isResident() && memcmp(diskItem.getData(),
-                                             v->getValue()->getData(),
+                                             v->getValueView().data,
                                              diskItem.getNBytes())) {
             return "data_mismatch";
         } else {
@@ -2862,8 +3015,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, key_hash, true,
+                                          false);
     if (!v || v->isDeleted() || v->isTempItem()) {
         if (eviction_policy == VALUE_ONLY) {
             return ENGINE_KEY_ENOENT;
@@ -2887,7 +3042,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
                         // Delete a temp non-existent item to ensure that
                         // if a delete were issued over an item that doesn't
                         // exist, then we don't preserve a temp item.
-                        vb->ht.unlocked_del(key, bucket_num);
+                        vb->ht.unlocked_del(key, bucket_num, key_hash);
                     }
                     return ENGINE_KEY_ENOENT;
                 }
@@ -2904,7 +3059,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
                         if (rv == ADD_NOMEM) {
                             return ENGINE_ENOMEM;
                         }
-                        v = vb->ht.unlocked_find(key, bucket_num, true, false);
+                        v = vb->ht.unlocked_find(key, bucket_num, key_hash,
+                                                 true, false);
                         v->setDeleted();
                     } else {
                         return ENGINE_KEY_ENOENT;
@@ -2916,7 +3072,7 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteItem(const std::string &key,
                         // Delete a temp non-existent item to ensure that
                         // if a delete were issued over an item that doesn't
                         // exist, then we don't preserve a temp item.
-                        vb->ht.unlocked_del(key, bucket_num);
+                        vb->ht.unlocked_del(key, bucket_num, key_hash);
                     }
                     return ENGINE_KEY_ENOENT;
                 }
@@ -3021,8 +3177,10 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteWithMeta(
     }
 
     int bucket_num(0);
-    LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true, false);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, key_hash, true,
+                                          false);
     if (!force) { // Need conflict resolution.
         if (v)  {
             if (v->isTempInitialItem()) {
@@ -3055,7 +3213,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteWithMeta(
                 if (rv == ADD_NOMEM) {
                     return ENGINE_ENOMEM;
                 }
-                v = vb->ht.unlocked_find(key, bucket_num, true, false);
+                v = vb->ht.unlocked_find(key, bucket_num, key_hash, true,
+                                         false);
                 v->setDeleted();
             }
         }
@@ -3068,7 +3227,8 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::deleteWithMeta(
             if (rv == ADD_NOMEM) {
                 return ENGINE_ENOMEM;
             }
-            v = vb->ht.unlocked_find(key, bucket_num, true, false);
+            v = vb->ht.unlocked_find(key, bucket_num, key_hash, true,
+                                     false);
             v->setDeleted();
             v->setCas(*cas);
         } else if (v->isTempInitialItem()) {
@@ -3178,11 +3338,12 @@ public:
     void callback(mutation_result &value) {
         if (value.first == 1) {
             int bucket_num(0);
-            LockHolder lh = vbucket->ht.getLockedBucket(queuedItem->getKey(),
-                                                        &bucket_num);
+            int key_hash = vbucket->ht.hash(queuedItem->getKey());
+            LockHolder lh = vbucket->ht.getLockedBucket(key_hash, &bucket_num);
             StoredValue *v = store.fetchValidValue(vbucket,
                                                    queuedItem->getKey(),
-                                                   bucket_num, true, false);
+                                                   bucket_num, key_hash,
+                                                   true, false);
             if (v) {
                 if (v->getCas() == cas) {
                     // mark this item clean only if current and stored cas
@@ -3212,12 +3373,13 @@ public:
             // we do not know the rowid of this object.
             if (value.first == 0) {
                 int bucket_num(0);
-                LockHolder lh = vbucket->ht.getLockedBucket(
-                                           queuedItem->getKey(), &bucket_num);
+                int key_hash = vbucket->ht.hash(queuedItem->getKey());
+                LockHolder lh = vbucket->ht.getLockedBucket(key_hash,
+                                                            &bucket_num);
                 StoredValue *v = store.fetchValidValue(vbucket,
                                                        queuedItem->getKey(),
-                                                       bucket_num, true,
-                                                       false);
+                                                       bucket_num, key_hash,
+                                                       true, false);
                 if (v) {
                     std::stringstream ss;
                     ss << "Persisting ``" << queuedItem->getKey() << "'' on vb"
@@ -3263,11 +3425,12 @@ public:
             // We have successfully removed an item from the disk, we
             // may now remove it from the hash table.
             int bucket_num(0);
-            LockHolder lh = vbucket->ht.getLockedBucket(queuedItem->getKey(),
-                                                        &bucket_num);
+            int key_hash = vbucket->ht.hash(queuedItem->getKey());
+            LockHolder lh = vbucket->ht.getLockedBucket(key_hash, &bucket_num);
             StoredValue *v = store.fetchValidValue(vbucket,
                                                    queuedItem->getKey(),
-                                                   bucket_num, true, false);
+                                                   bucket_num, key_hash,
+                                                   true, false);
             // Delete the item in the hash table iff:
             //  1. Item is existent in hashtable, and deleted flag is true
             //  2. rev seqno of queued item matches rev seqno of hash table item
@@ -3275,7 +3438,7 @@ public:
                 (queuedItem->getRevSeqno() == v->getRevSeqno())) {
                 bool newCacheItem = v->isNewCacheItem();
                 bool deleted = vbucket->ht.unlocked_del(queuedItem->getKey(),
-                                                        bucket_num);
+                                                        bucket_num, key_hash);
                 if (!deleted) {
                     throw std::logic_error("PersistenceCallback:callback: "
                             "Failed to delete key '" + queuedItem->getKey() +
@@ -3368,6 +3531,9 @@ void EventuallyPersistentStore::flushOneDeleteAll() {
         if (vb) {
             LockHolder lh(vb_mutexes[vb->getId()]);
             getRWUnderlying(vb->getId())->reset(i);
+            // Seqnos start over, so the snapshot could pass for new data
+            HashTableSnapshot::remove(engine.getConfiguration().getDbname(),
+                                      i);
         }
     }
 
@@ -3375,7 +3541,7 @@ void EventuallyPersistentStore::flushOneDeleteAll() {
     setFlushAllComplete();
 }
 
-int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
+int EventuallyPersistentStore::flushVBucket(uint16_t vbid, bool mayDefer) {
     KVShard *shard = vbMap.getShardByVbId(vbid);
     if (diskFlushAll && !flushAllTaskCtx.delayFlushAll) {
         if (shard->getId() == EP_PRIMARY_SHARD) {
@@ -3391,6 +3557,8 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
     }
 
     int items_flushed = 0;
+    size_t items_deduped = 0;
+    bool moreItems = false;
     rel_time_t flush_start = ep_current_time();
 
     RCPtr<VBucket> vb = vbMap.getBucket(vbid);
@@ -3400,22 +3568,44 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
             return RETRY_FLUSH_VBUCKET; // to avoid blocking flusher
         }
 
+        // Let rewrites of hot keys coalesce in the checkpoints for a while,
+        // unless somebody waits on persistence or memory runs short.
+        if (mayDefer && flusherCoalesceMaxAge > 0 &&
+            vb->dirtyQueueSize.load() > 0 && vb->rejectQueue.empty() &&
+            vb->getHighPriorityChkSize() == 0 &&
+            stats.getTotalMemoryUsed() < stats.mem_high_wat.load() &&
+            vb->deferFlush(gethrtime(), flusherCoalesceMaxAge)) {
+            return DEFER_FLUSH_VBUCKET;
+        }
+
         std::vector<queued_item> items;
         KVStore *rwUnderlying = getRWUnderlying(vbid);
+        BatchLimit limit(flusherBatchMaxItems, flusherBatchMaxBytes);
 
         while (!vb->rejectQueue.empty()) {
             items.push_back(vb->rejectQueue.front());
+            limit.add(vb->rejectQueue.front());
             vb->rejectQueue.pop();
         }
 
         const std::string cursor(CheckpointManager::pCursorName);
-        vb->getBackfillItems(items);
+        vb->getBackfillItems(items, limit);
 
         snapshot_range_t range;
-        range = vb->checkpointManager.getAllItemsForCursor(cursor, items);
+        range = vb->checkpointManager.getItemsForCursor(cursor, items, limit);
+        // The rest is written by the next batches, each committed on its
+        // own, so a long queue is not held in memory twice at once.
+        moreItems = limit.isReached();
+        if (moreItems) {
+            ++stats.flusherBatchesSplit;
+        }
 
         if (!items.empty()) {
-            while (!rwUnderlying->begin()) {
+            // Run by a vbucket flush task, next to the other vbuckets of
+            // the shard.
+            bool perVBucket = shard->getFlusher()->isParallel();
+            while (!(perVBucket ? rwUnderlying->beginVBucket(vbid)
+                                : rwUnderlying->begin())) {
                 ++stats.beginFailed;
                 LOG(EXTENSION_LOG_WARNING, "Failed to start a transaction!!! "
                     "Retry in 1 sec ...");
@@ -3427,7 +3617,9 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
             uint64_t maxSeqno = 0;
             uint64_t maxCas = 0;
             uint64_t maxDeletedRevSeqno = 0;
-            std::list<PersistenceCallback*>& pcbs = rwUnderlying->getPersistenceCbList();
+            std::list<PersistenceCallback*> vbPcbs;
+            std::list<PersistenceCallback*>& pcbs = perVBucket ? vbPcbs :
+                rwUnderlying->getPersistenceCbList();
             std::vector<queued_item>::iterator it = items.begin();
             for(; it != items.end(); ++it) {
                 if ((*it)->getOperation() != queue_op_set &&
@@ -3449,6 +3641,7 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
                     }
                     ++stats.flusher_todo;
                 } else {
+                    ++items_deduped;
                     stats.decrDiskQueueSize(1);
                     vb->doStatsForFlushing(*(*it), (*it)->size());
                 }
@@ -3464,25 +3657,32 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
                     }
                 }
 
-                std::string failovers = vb->failovers->toJSON();
                 vbucket_state vbState(vb->getState(),
                                       vbMap.getPersistenceCheckpointId(vbid),
                                       maxDeletedRevSeqno, vb->getHighSeqno(),
                                       vb->getPurgeSeqno(), range.start,
                                       range.end, maxCas, vb->getDriftCounter(),
-                                      failovers);
+                                      vb->getFailoversJSON());
 
                 if (rwUnderlying->snapshotVBucket(vb->getId(), vbState,
                                                   NULL, false) != true) {
+                    if (perVBucket) {
+                        commitPending(rwUnderlying, pcbs, true, vbid);
+                    }
                     return RETRY_FLUSH_VBUCKET;
                 }
             }
 
-            //commit all mutations to disk if the commit interval is zero
-            if (decrCommitInterval(shard->getId()) == 0) {
+            if (perVBucket) {
+                commitPending(rwUnderlying, pcbs, true, vbid);
+            } else if (decrCommitInterval(shard->getId()) == 0) {
+                //commit all mutations to disk if the commit interval is zero
                 commit(shard->getId());
             }
 
+            vb->adaptCoalesceDelay(items_flushed, items_deduped,
+                                   flusherCoalesceMaxAge);
+
             hrtime_t end = gethrtime();
             uint64_t trans_time = (end - flush_start) / 1000000;
 
@@ -3493,11 +3693,15 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
                                                 - flush_start);
             stats.flusher_todo.store(0);
             if (vb->rejectQueue.empty()) {
-                vb->setPersistedSnapshot(range.start, range.end);
-                uint64_t highSeqno = rwUnderlying->getLastPersistedSeqno(vbid);
-                if (highSeqno > 0 &&
-                    highSeqno != vbMap.getPersistenceSeqno(vbid)) {
-                    vbMap.setPersistenceSeqno(vbid, highSeqno);
+                if (flusherGroupSync) {
+                    // Reported by syncFlushed() once on disk.
+                    LockHolder ulh(unsyncedLock);
+                    UnsyncedVBucket &unsynced =
+                        unsyncedVbs[shard->getId()][vbid];
+                    unsynced.vb = vb;
+                    unsynced.range = range;
+                } else {
+                    setPersistedRange(vb, range, rwUnderlying);
                 }
             }
         }
@@ -3508,16 +3712,13 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
             wakeUpCheckpointRemover();
         }
 
-        if (vb->rejectQueue.empty()) {
-            vb->checkpointManager.itemsPersisted();
-            uint64_t seqno = vbMap.getPersistenceSeqno(vbid);
-            uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
-            vb->notifyOnPersistence(engine, seqno, true);
-            vb->notifyOnPersistence(engine, chkid, false);
-            if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
-                vbMap.setPersistenceCheckpointId(vbid, chkid);
-            }
-        } else {
+        if (!vb->rejectQueue.empty()) {
+            return RETRY_FLUSH_VBUCKET;
+        }
+        if (!flusherGroupSync || !isUnsynced(shard->getId(), vbid)) {
+            notifyPersisted(vb);
+        }
+        if (moreItems) {
             return RETRY_FLUSH_VBUCKET;
         }
     }
@@ -3525,14 +3726,85 @@ int EventuallyPersistentStore::flushVBucket(uint16_t vbid) {
     return items_flushed;
 }
 
+void EventuallyPersistentStore::setPersistedRange(RCPtr<VBucket> &vb,
+                                                  const snapshot_range_t &range,
+                                                  KVStore *rwUnderlying) {
+    uint16_t vbid = vb->getId();
+    vb->setPersistedSnapshot(range.start, range.end);
+    uint64_t highSeqno = rwUnderlying->getLastPersistedSeqno(vbid);
+    if (highSeqno > 0 &&
+        highSeqno != vbMap.getPersistenceSeqno(vbid)) {
+        vbMap.setPersistenceSeqno(vbid, highSeqno);
+    }
+}
+
+void EventuallyPersistentStore::notifyPersisted(RCPtr<VBucket> &vb) {
+    uint16_t vbid = vb->getId();
+    vb->checkpointManager.itemsPersisted();
+    uint64_t seqno = vbMap.getPersistenceSeqno(vbid);
+    uint64_t chkid = vb->checkpointManager.getPersistenceCursorPreChkId();
+    vb->notifyOnPersistence(engine, seqno, true);
+    vb->notifyOnPersistence(engine, chkid, false);
+    if (chkid > 0 && chkid != vbMap.getPersistenceCheckpointId(vbid)) {
+        vbMap.setPersistenceCheckpointId(vbid, chkid);
+    }
+}
+
+void EventuallyPersistentStore::syncFlushed(uint16_t shardId) {
+    // Only what was committed before the sync, vbucket flush tasks may be
+    // adding more meanwhile.
+    std::map<uint16_t, UnsyncedVBucket> unsynced;
+    {
+        LockHolder lh(unsyncedLock);
+        unsynced.swap(unsyncedVbs[shardId]);
+    }
+    if (unsynced.empty()) {
+        return;
+    }
+
+    KVStore *rwUnderlying = getRWUnderlyingByShard(shardId);
+    while (!rwUnderlying->sync()) {
+        ++stats.commitFailed;
+        LOG(EXTENSION_LOG_WARNING, "Flusher sync failed!!! Retry in "
+            "1 sec...\n");
+        sleep(1);
+    }
+
+    std::map<uint16_t, UnsyncedVBucket>::iterator it = unsynced.begin();
+    while (it != unsynced.end()) {
+        LockHolder lh(vb_mutexes[it->first], true /*tryLock*/);
+        if (!lh.islocked()) {
+            // Being compacted or flushed; synced already, reported by the
+            // next round unless flushed again meanwhile.
+            LockHolder ulh(unsyncedLock);
+            unsyncedVbs[shardId].insert(*it);
+            ++it;
+            continue;
+        }
+        // Unless deleted (or recreated) meanwhile.
+        if (vbMap.getBucket(it->first).get() == it->second.vb.get()) {
+            setPersistedRange(it->second.vb, it->second.range, rwUnderlying);
+            notifyPersisted(it->second.vb);
+        }
+        ++it;
+    }
+}
+
 void EventuallyPersistentStore::commit(uint16_t shardId) {
     KVStore *rwUnderlying = getRWUnderlyingByShard(shardId);
-    std::list<PersistenceCallback *>& pcbs = rwUnderlying->getPersistenceCbList();
+    commitPending(rwUnderlying, rwUnderlying->getPersistenceCbList(), false, 0);
+}
+
+void EventuallyPersistentStore::commitPending(
+                                    KVStore *rwUnderlying,
+                                    std::list<PersistenceCallback *> &pcbs,
+                                    bool vbucketOnly, uint16_t vbid) {
     BlockTimer timer(&stats.diskCommitHisto, "disk_commit", stats.timingLog);
     hrtime_t commit_start = gethrtime();
 
     KVStatsCallback cb(this);
-    while (!rwUnderlying->commit(&cb)) {
+    while (!(vbucketOnly ? rwUnderlying->commitVBucket(vbid, &cb)
+                         : rwUnderlying->commit(&cb))) {
         ++stats.commitFailed;
         LOG(EXTENSION_LOG_WARNING, "Flusher commit failed!!! Retry in "
             "1 sec...\n");
@@ -3589,18 +3861,44 @@ EventuallyPersistentStore::flushOneDelOrSet(const queued_item &qi,
                          stats.timingLog);
         PersistenceCallback *cb =
             new PersistenceCallback(qi, vb, *this, stats, qi->getCas());
-        rwUnderlying->set(*qi, *cb);
+        rwUnderlying->set(*qi, *cb, getDocPresence(vb, qi->getKey()));
         return cb;
     } else {
         BlockTimer timer(&stats.diskDelHisto, "disk_delete",
                          stats.timingLog);
         PersistenceCallback *cb =
             new PersistenceCallback(qi, vb, *this, stats, 0);
-        rwUnderlying->del(*qi, *cb);
+        rwUnderlying->del(*qi, *cb, getDocPresence(vb, qi->getKey()));
         return cb;
     }
 }
 
+DocPresence EventuallyPersistentStore::getDocPresence(RCPtr<VBucket> &vb,
+                                                      const std::string &key) {
+    // Only the flusher writes the database file, and the persistence
+    // callbacks of the previous batch have cleared the new cache item bit
+    // of everything it wrote.
+    int bucket_num(0);
+    int key_hash = vb->ht.hash(key);
+    LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+    StoredValue *v = vb->ht.unlocked_find(key, bucket_num, key_hash, true,
+                                          false);
+    if (!v || v->isTempItem()) {
+        return DocPresence::UNKNOWN;
+    }
+    if (!v->isNewCacheItem()) {
+        return DocPresence::ON_DISK;
+    }
+    lh.unlock();
+
+    // A new cache item in full eviction mode may have been evicted from an
+    // older one, the bloom filter tells if there may be one on disk.
+    if (eviction_policy == VALUE_ONLY || !vb->maybeKeyExistsInFilter(key)) {
+        return DocPresence::NOT_ON_DISK;
+    }
+    return DocPresence::UNKNOWN;
+}
+
 void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
                                            StoredValue* v,
                                            LockHolder *plh,
@@ -3643,6 +3941,16 @@ void EventuallyPersistentStore::queueDirty(RCPtr<VBucket> &vb,
             *seqno = v->getBySeqno();
         }
 
+        if (expiryIndexEnabled) {
+            // Under the bucket lock, so the index sees the mutations of a
+            // key in seqno order. Moves or drops the entry of the key too.
+            if (qi->isDeleted()) {
+                vb->expiryIndex.remove(qi->getKey());
+            } else {
+                vb->expiryIndex.add(qi->getKey(), qi->getExptime());
+            }
+        }
+
         if (plh) {
             plh->unlock();
         }
@@ -3699,6 +4007,13 @@ void EventuallyPersistentStore::warmupCompleted() {
     ExecutorPool *iom = ExecutorPool::get();
     ExTask task = new StatSnap(&engine, 0, false);
     statsSnapshotTaskId = iom->schedule(task, WRITER_TASK_IDX);
+
+    Configuration &config = engine.getConfiguration();
+    if (config.isHtSnapshot() && config.getHtSnapshotInterval() > 0) {
+        task = new HashTableSnapshotTask(*this,
+                                         config.getHtSnapshotInterval());
+        htSnapshotTaskId = iom->schedule(task, AUXIO_TASK_IDX);
+    }
 }
 
 bool EventuallyPersistentStore::maybeEnableTraffic()
@@ -3810,6 +4125,7 @@ void EventuallyPersistentStore::enableExpiryPager() {
                                               expiryPager.sleeptime);
         expiryPager.task = ExecutorPool::get()->schedule(expTask,
                                                          NONIO_TASK_IDX);
+        scheduleExpiryIndexPager();
     } else {
         LOG(EXTENSION_LOG_DEBUG, "Expiry Pager already enabled!");
     }
@@ -3819,24 +4135,52 @@ void EventuallyPersistentStore::disableExpiryPager() {
     LockHolder lh(expiryPager.mutex);
     if (expiryPager.enabled) {
         ExecutorPool::get()->cancel(expiryPager.task);
+        ExecutorPool::get()->cancel(expiryPager.indexTask);
         expiryPager.enabled = false;
     } else {
         LOG(EXTENSION_LOG_DEBUG, "Expiry Pager already disabled!");
     }
 }
 
+void EventuallyPersistentStore::scheduleExpiryIndexPager() {
+    // Expires items just like the full-scan pager, so exp_pager_enabled
+    // turns both on and off.
+    if (!expiryIndexEnabled || !expiryPager.enabled) {
+        return;
+    }
+    ExecutorPool::get()->cancel(expiryPager.indexTask);
+    ExTask task = new ExpiryIndexPager(&engine, stats,
+                                       expiryPager.indexSleeptime);
+    expiryPager.indexTask = ExecutorPool::get()->schedule(task,
+                                                          NONIO_TASK_IDX);
+}
+
 void EventuallyPersistentStore::setExpiryHost(std::string val) {
     LockHolder lh(expiryPager.mutex);
 
     expiryPager.host = val;
-    expiryPager.channel.open(expiryPager.host, expiryPager.port);
+    expiryNotifier->open(expiryPager.host, expiryPager.port);
 }
 
 void EventuallyPersistentStore::setExpiryPort(size_t val) {
     LockHolder lh(expiryPager.mutex);
 
     expiryPager.port = static_cast<int>(val);
-    expiryPager.channel.open(expiryPager.host, expiryPager.port);
+    expiryNotifier->open(expiryPager.host, expiryPager.port);
+}
+
+void EventuallyPersistentStore::setExpiryNotifyQueueCap(size_t val) {
+    expiryNotifier->setQueueCap(val);
+}
+
+void EventuallyPersistentStore::setExpiryFormat(const std::string &val) {
+    ExpiryChannel::Format format;
+    if (ExpiryChannel::parseFormat(val, format)) {
+        expiryNotifier->setFormat(format);
+    } else {
+        LOG(EXTENSION_LOG_WARNING, "Unknown expiry_format %s, ignored",
+            val.c_str());
+    }
 }
 
 void EventuallyPersistentStore::setFlusherMinSleepTime(float val) {
@@ -4148,10 +4492,11 @@ public:
         if (gcb.val.getStatus() == ENGINE_SUCCESS) {
             Item *it = gcb.val.getValue();
             if (it->isDeleted()) {
-                LockHolder lh = vb->ht.getLockedBucket(it->getKey(),
-                        &bucket_num);
+                int key_hash = vb->ht.hash(it->getKey());
+                LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
 
-                bool ret = vb->ht.unlocked_del(it->getKey(), bucket_num);
+                bool ret = vb->ht.unlocked_del(it->getKey(), bucket_num,
+                                               key_hash);
                 if(!ret) {
                     setStatus(ENGINE_KEY_ENOENT);
                 } else {
@@ -4169,8 +4514,10 @@ public:
             }
             delete it;
         } else if (gcb.val.getStatus() == ENGINE_KEY_ENOENT) {
-            LockHolder lh = vb->ht.getLockedBucket(itm->getKey(), &bucket_num);
-            bool ret = vb->ht.unlocked_del(itm->getKey(), bucket_num);
+            int key_hash = vb->ht.hash(itm->getKey());
+            LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+            bool ret = vb->ht.unlocked_del(itm->getKey(), bucket_num,
+                                           key_hash);
             if (!ret) {
                 setStatus(ENGINE_KEY_ENOENT);
             } else {
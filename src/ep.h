@@ -25,7 +25,7 @@
 #include "task_type.h"
 #include "vbucket.h"
 #include "vbucketmap.h"
-#include "expiry_channel.h"
+#include "expiry_notifier.h"
 #include "utility.h"
 
 class ExtendedMetaData;
@@ -455,6 +455,12 @@ public:
      */
     void snapshotStats(void);
 
+    /**
+     * Write the hash table snapshot of every vbucket, for the next
+     * warmup to restore.
+     */
+    void snapshotHashTables(void);
+
     /**
      * Enqueue a background fetch for a key.
      *
@@ -682,6 +688,23 @@ public:
     void deleteExpiredItems(std::list<std::pair<uint16_t, std::string> > &,
                             exp_type_t);
 
+    /**
+     * Expire the items of the given vbucket whose expiry index entries
+     * are due. Stale entries (item gone, deleted or re-set with another
+     * expiry time) are skipped.
+     *
+     * @param vbid the vbucket to expire items in
+     * @param startTime items expiring before this time are due
+     * @param limit max number of index entries to process
+     * @return true if the vbucket has more due entries left
+     */
+    bool deleteExpiredItemsFromIndex(uint16_t vbid, time_t startTime,
+                                     size_t limit);
+
+    bool isExpiryIndexEnabled() const {
+        return expiryIndexEnabled;
+    }
+
 
     /**
      * Get the memoized storage properties from the DB.kv
@@ -742,6 +765,12 @@ public:
     void setExpiryPagerSleeptime(size_t val);
     void setExpiryHost(std::string val);
     void setExpiryPort(size_t val);
+    void setExpiryNotifyQueueCap(size_t val);
+    void setExpiryFormat(const std::string &val);
+
+    ExpiryNotifier& getExpiryNotifier() {
+        return *expiryNotifier;
+    }
     void setFlusherMinSleepTime(float val);
 
     void setExpiryPagerTasktime(ssize_t val);
@@ -814,12 +843,36 @@ public:
     /**
      * Flushes all items waiting for persistence in a given vbucket
      * @param vbid The id of the vbucket to flush
-     * @return The number of items flushed
+     * @param mayDefer whether the writes may be held back for coalescing
+     *                 (flusher_coalesce_max_age)
+     * @return The number of items flushed, RETRY_FLUSH_VBUCKET or
+     *         DEFER_FLUSH_VBUCKET
      */
-    int flushVBucket(uint16_t vbid);
+    int flushVBucket(uint16_t vbid, bool mayDefer = false);
 
     void commit(uint16_t shardId);
 
+    /**
+     * Sync the files of the vbuckets flushed by the given shard since the
+     * last call, then report those vbuckets persisted (flusher_group_sync).
+     * Writes must have been committed.
+     */
+    void syncFlushed(uint16_t shardId);
+
+    //! Number of vbuckets of the shard flushed and waiting for syncFlushed()
+    size_t getNumUnsynced(uint16_t shardId) {
+        LockHolder lh(unsyncedLock);
+        return unsyncedVbs[shardId].size();
+    }
+
+    bool isFlusherGroupSync() {
+        return flusherGroupSync;
+    }
+
+    size_t getFlusherGroupSyncMax() {
+        return flusherGroupSyncMax;
+    }
+
     void addKVStoreStats(ADD_STAT add_stat, const void* cookie);
 
     void addKVStoreTimingStats(ADD_STAT add_stat, const void* cookie);
@@ -912,6 +965,12 @@ protected:
     void warmupCompleted();
     void stopWarmup(void);
 
+    /**
+     * Schedule the ExpiryIndexPager, if the index and the expiry pager are
+     * enabled. Must be called with expiryPager.mutex held.
+     */
+    void scheduleExpiryIndexPager();
+
     void scheduleVBDeletion(RCPtr<VBucket> &vb,
                             const void* cookie,
                             double delay = 0);
@@ -962,8 +1021,10 @@ protected:
         }
 
         int bucket_num(0);
-        LockHolder lh = vb->ht.getLockedBucket(key, &bucket_num);
-        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true);
+        int key_hash = vb->ht.hash(key);
+        LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, key_hash, true,
+                                              true);
 
         if (v) {
             std::mem_fun(f)(v);
@@ -975,8 +1036,15 @@ protected:
     PersistenceCallback* flushOneDelOrSet(const queued_item &qi,
                                           RCPtr<VBucket> &vb);
 
+    /**
+     * Whether the key is in the vbucket's database file, as far as the
+     * hash table and the bloom filter can tell without reading the file.
+     */
+    DocPresence getDocPresence(RCPtr<VBucket> &vb, const std::string &key);
+
     StoredValue *fetchValidValue(RCPtr<VBucket> &vb, const std::string &key,
-                                 int bucket_num, bool wantsDeleted=false,
+                                 int bucket_num, int key_hash,
+                                 bool wantsDeleted=false,
                                  bool trackReference=true, bool queueExpired=true);
 
     GetValue getInternal(const std::string &key, uint16_t vbucket,
@@ -993,6 +1061,33 @@ protected:
 
     uint16_t decrCommitInterval(uint16_t shardId);
 
+    /**
+     * Commit the writes pending in a KVStore, retrying until that
+     * succeeds, then free their persistence callbacks. Only the
+     * transaction of the given vbucket if vbucketOnly is set (the
+     * vbucket flush tasks of flusher_parallelism).
+     */
+    void commitPending(KVStore *rwUnderlying,
+                       std::list<PersistenceCallback *> &pcbs,
+                       bool vbucketOnly, uint16_t vbid);
+
+    bool isUnsynced(uint16_t shardId, uint16_t vbid) {
+        LockHolder lh(unsyncedLock);
+        return unsyncedVbs[shardId].count(vbid) != 0;
+    }
+
+    /**
+     * Set the persisted snapshot and seqno of a vbucket after a flush.
+     */
+    void setPersistedRange(RCPtr<VBucket> &vb, const snapshot_range_t &range,
+                           KVStore *rwUnderlying);
+
+    /**
+     * Let the checkpoints and the clients waiting on persistence of a
+     * vbucket know about what was flushed.
+     */
+    void notifyPersisted(RCPtr<VBucket> &vb);
+
     friend class Warmup;
     friend class Flusher;
     friend class BGFetchCallback;
@@ -1023,6 +1118,25 @@ protected:
     Mutex                          *vb_mutexes;
     AtomicValue<bool>              *schedule_vbstate_persist;
     std::vector<MutationLog*>       accessLog;
+    ExpiryNotifier                 *expiryNotifier;
+    bool                            expiryIndexEnabled;
+
+    /* A vbucket flushed and not synced yet (flusher_group_sync) */
+    struct UnsyncedVBucket {
+        RCPtr<VBucket> vb;
+        snapshot_range_t range;
+    };
+    bool                            flusherGroupSync;
+    size_t                          flusherGroupSyncMax;
+    /* Bound of the write coalescing delay of the vbuckets, in ns */
+    hrtime_t                        flusherCoalesceMaxAge;
+    /* Bounds of the batch of a vbucket written at once, 0 for none */
+    size_t                          flusherBatchMaxItems;
+    size_t                          flusherBatchMaxBytes;
+    /* Per shard, touched by the flusher of the shard and its vbucket
+       flush tasks (flusher_parallelism). Taken after a vb_mutex. */
+    std::vector<std::map<uint16_t, UnsyncedVBucket> > unsyncedVbs;
+    Mutex                           unsyncedLock;
 
     AtomicValue<size_t> bgFetchQueue;
 
@@ -1037,13 +1151,16 @@ protected:
     uint32_t bgFetchDelay;
     double backfillMemoryThreshold;
     struct ExpiryPagerDelta {
-        ExpiryPagerDelta() : sleeptime(0), port(0), task(0), enabled(true) {}
+        ExpiryPagerDelta() : sleeptime(0), port(0), task(0), indexSleeptime(0),
+                             indexTask(0), enabled(true) {}
         Mutex mutex;
         size_t sleeptime;
         std::string host;
         int port;
-        ExpiryChannel channel;
         size_t task;
+        //! Of the ExpiryIndexPager, scheduled only with the index enabled
+        size_t indexSleeptime;
+        size_t indexTask;
         bool enabled;
     } expiryPager;
     struct ALogTask {
@@ -1060,6 +1177,10 @@ protected:
         AtomicValue<size_t> replicaRatio;
     } cachedResidentRatio;
     size_t statsSnapshotTaskId;
+    size_t htSnapshotTaskId;
+    // Serializes the periodic hash table snapshots with the one taken on
+    // shutdown
+    Mutex htSnapshotMutex;
     AtomicValue<size_t> lastTransTimePerItem;
     item_eviction_policy_t eviction_policy;
 
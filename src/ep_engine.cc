@@ -489,6 +489,11 @@ extern "C" {
                 validate(vsize, static_cast<uint64_t>(0),
                          static_cast<uint64_t>(std::numeric_limits<uint16_t>::max()));
                 e->getConfiguration().setExpiryPort((size_t)vsize);
+            } else if (strcmp(keyz, "expiry_format") == 0) {
+                e->getConfiguration().setExpiryFormat(valz);
+            } else if (strcmp(keyz, "expiry_notify_queue_cap") == 0) {
+                e->getConfiguration().setExpiryNotifyQueueCap(
+                        std::stoull(valz));
             } else if (strcmp(keyz, "exp_pager_initial_run_time") == 0) {
                 e->getConfiguration().setExpPagerInitialRunTime(
                         std::stoll(valz));
@@ -1990,7 +1995,7 @@ EventuallyPersistentEngine::EventuallyPersistentEngine(
     dcpConnMap_(NULL),
     dcpFlowControlManager_(NULL),
     tapConnMap(NULL) ,
-    tapConfig(NULL), checkpointConfig(NULL),
+    tapConfig(NULL), checkpointConfig(NULL), blobArena(NULL),
     trafficEnabled(false), flushAllEnabled(false), startupTime(0),
     taskable(this)
 {
@@ -2122,6 +2127,14 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     // Start updating the variables from the config!
     HashTable::setDefaultNumBuckets(configuration.getHtSize());
     HashTable::setDefaultNumLocks(configuration.getHtLocks());
+    HashTable::setDefaultHashFunction(configuration.getHtHashFunction());
+    HashTable::setDefaultIndex(configuration.getHtIndex());
+    HashTable::setDefaultOptimisticReads(configuration.isHtOptimisticReads());
+    HashTable::setDefaultSlabAllocator(configuration.isSlabAllocator());
+    if (configuration.isSlabAllocator()) {
+        blobArena = new SlabArena(stats);
+    }
+    StoredValue::setInlineValueSize(configuration.getHtInlineValueSize());
     StoredValue::setMutationMemoryThreshold(
                                       configuration.getMutationMemThreshold());
 
@@ -3162,8 +3175,15 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
 
     add_casted_stat("ep_total_enqueued",
                     epstats.totalEnqueued, add_stat, cookie);
+    add_casted_stat("ep_total_deduplicated",
+                    epstats.totalDeduplicated, add_stat, cookie);
     add_casted_stat("ep_total_persisted",
                     epstats.totalPersisted, add_stat, cookie);
+    size_t persisted = epstats.totalPersisted.load();
+    add_casted_stat("ep_mutations_per_persist", persisted == 0 ? 0.0 :
+                    static_cast<double>(epstats.totalEnqueued.load() +
+                                        epstats.totalDeduplicated.load()) /
+                    persisted, add_stat, cookie);
     add_casted_stat("ep_item_flush_failed",
                     epstats.flushFailed, add_stat, cookie);
     add_casted_stat("ep_item_commit_failed",
@@ -3176,6 +3196,43 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_expired_pager", epstats.expired_pager,
                     add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_queue_size",
+                    epstore->getExpiryNotifier().getQueueSize(),
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_queued", epstats.expiryNotifyQueued,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_sent", epstats.expiryNotifySent,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_dropped", epstats.expiryNotifyDropped,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_overflow", epstats.expiryNotifyOverflow,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_failed", epstats.expiryNotifyFailed,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_batches", epstats.expiryNotifyBatches,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_replayed", epstats.expiryNotifyReplayed,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_seqno",
+                    epstore->getExpiryNotifier().getSeqno(),
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_notify_acked_seqno",
+                    epstore->getExpiryNotifier().getAckedSeqno(),
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_journal_size",
+                    epstore->getExpiryNotifier().getJournalSize(),
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_index_size", epstats.expiryIndexSize,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_index_memory", epstats.expiryIndexMemory,
+                    add_stat, cookie);
+    add_casted_stat("ep_expiry_index_stale", epstats.expiryIndexStale,
+                    add_stat, cookie);
+    add_casted_stat("ep_ht_resizing", epstats.htResizing, add_stat, cookie);
+    add_casted_stat("ep_ht_buckets_migrated", epstats.htBucketsMigrated,
+                    add_stat, cookie);
+    add_casted_stat("ep_ht_optimistic_conflicts",
+                    epstats.htOptimisticConflicts, add_stat, cookie);
     add_casted_stat("ep_item_flush_expired",
                     epstats.flushExpired, add_stat, cookie);
     add_casted_stat("ep_queue_size",
@@ -3191,6 +3248,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_commit_num", epstats.flusherCommits,
                     add_stat, cookie);
+    add_casted_stat("ep_flusher_batches_split", epstats.flusherBatchesSplit,
+                    add_stat, cookie);
     add_casted_stat("ep_commit_time",
                     epstats.commit_time, add_stat, cookie);
     add_casted_stat("ep_commit_time_total",
@@ -3452,6 +3511,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     add_casted_stat("ep_storedval_overhead", "unknown", add_stat, cookie);
 #endif
     add_casted_stat("ep_storedval_num", stats.numStoredVal, add_stat, cookie);
+    add_casted_stat("ep_slab_reserved_bytes", stats.slabReservedBytes,
+                    add_stat, cookie);
+    add_casted_stat("ep_slab_used_bytes", stats.slabUsedBytes,
+                    add_stat, cookie);
     add_casted_stat("ep_overhead", stats.memOverhead, add_stat, cookie);
     add_casted_stat("ep_item_num", stats.numItem, add_stat, cookie);
     add_casted_stat("ep_total_cache_size",
@@ -3477,6 +3540,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     add_stat, cookie);
     add_casted_stat("ep_bg_remaining_jobs", epstats.numRemainingBgJobs,
                     add_stat, cookie);
+    add_casted_stat("ep_bg_fetch_tasks", epstats.bgFetchTasks,
+                    add_stat, cookie);
     add_casted_stat("ep_max_bg_remaining_jobs", epstats.maxRemainingBgJobs,
                     add_stat, cookie);
     add_casted_stat("ep_tap_bg_fetched", stats.numTapBGFetched,
@@ -3717,6 +3782,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doMemoryStats(const void *cookie,
     add_casted_stat("ep_storedval_overhead", "unknown", add_stat, cookie);
 #endif
     add_casted_stat("ep_storedval_num", stats.numStoredVal, add_stat, cookie);
+    add_casted_stat("ep_slab_reserved_bytes", stats.slabReservedBytes,
+                    add_stat, cookie);
+    add_casted_stat("ep_slab_used_bytes", stats.slabUsedBytes,
+                    add_stat, cookie);
     add_casted_stat("ep_item_num", stats.numItem, add_stat, cookie);
 
     std::map<std::string, size_t> alloc_stats;
@@ -3828,6 +3897,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
                     error.what());
             }
 
+            // Read before visitDepth(), which waits for a resize to end.
+            size_t resizeTarget = vb->ht.getResizeTarget();
+            size_t resizeMigrated = vb->ht.getResizeMigrated();
+
             HashTableDepthStatVisitor depthVisitor;
             vb->ht.visitDepth(depthVisitor);
 
@@ -3851,6 +3924,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
                 add_casted_stat(buf, depthVisitor.size, add_stat, cookie);
                 checked_snprintf(buf, sizeof(buf), "vb_%d:resized", vbid);
                 add_casted_stat(buf, vb->ht.getNumResizes(), add_stat, cookie);
+                checked_snprintf(buf, sizeof(buf), "vb_%d:resize_target",
+                                 vbid);
+                add_casted_stat(buf, resizeTarget, add_stat, cookie);
+                checked_snprintf(buf, sizeof(buf), "vb_%d:resize_migrated",
+                                 vbid);
+                add_casted_stat(buf, resizeMigrated, add_stat, cookie);
                 checked_snprintf(buf, sizeof(buf), "vb_%d:mem_size", vbid);
                 add_casted_stat(buf, vb->ht.memSize, add_stat, cookie);
                 checked_snprintf(buf, sizeof(buf), "vb_%d:mem_size_counted",
@@ -4367,6 +4446,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
                                                            ADD_STAT add_stat) {
     add_casted_stat("bg_wait", stats.bgWaitHisto, add_stat, cookie);
     add_casted_stat("bg_load", stats.bgLoadHisto, add_stat, cookie);
+    add_casted_stat("bg_fetch_disk", stats.bgFetchDiskHisto, add_stat, cookie);
     add_casted_stat("set_with_meta", stats.setWithMetaHisto, add_stat, cookie);
     add_casted_stat("bg_tap_wait", stats.tapBgWaitHisto, add_stat, cookie);
     add_casted_stat("bg_tap_load", stats.tapBgLoadHisto, add_stat, cookie);
@@ -4374,6 +4454,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doTimingStats(const void *cookie,
 
     // Vbucket visitors
     add_casted_stat("access_scanner", stats.accessScannerHisto, add_stat, cookie);
+    add_casted_stat("ht_snapshot", stats.htSnapshotHisto, add_stat, cookie);
     add_casted_stat("checkpoint_remover", stats.checkpointRemoverHisto, add_stat, cookie);
     add_casted_stat("item_pager", stats.itemPagerHisto, add_stat, cookie);
     add_casted_stat("expiry_pager", stats.expiryPagerHisto, add_stat, cookie);
@@ -6518,6 +6599,20 @@ EventuallyPersistentEngine::~EventuallyPersistentEngine() {
     delete tapConfig;
     delete checkpointConfig;
     delete replicationThrottle;
+    if (blobArena) {
+        // Let go of the Blobs of retired values first.
+        ReadEpoch::drain();
+        size_t live = blobArena->getUsedBytes();
+        if (live != 0) {
+            LOG(EXTENSION_LOG_WARNING, "%" PRIu64 " bytes of blobs outlive "
+                "the bucket, no longer accounted for", uint64_t(live));
+            blobArena->detach();
+        }
+        // Goes once the last Blob in it does.
+        blobArena->abandon();
+    }
+    // Nothing of this bucket may be left for ReadEpoch to release later.
+    ReadEpoch::drain();
 }
 
 const std::string& EpEngineTaskable::getName() const {
@@ -717,6 +717,13 @@ public:
         return &info.info;
     }
 
+    /**
+     * Get the arena this bucket's Blobs are allocated from, NULL if none.
+     */
+    SlabArena *getBlobArena() {
+        return blobArena;
+    }
+
     EPStats &getEpStats() {
         return stats;
     }
@@ -1032,6 +1039,7 @@ protected:
     TapConnMap *tapConnMap;
     TapConfig *tapConfig;
     CheckpointConfig *checkpointConfig;
+    SlabArena *blobArena;
     std::string name;
     size_t maxItemSize;
     size_t getlDefaultTimeout;
@@ -25,14 +25,14 @@
 #include <errno.h>
 #include <netdb.h>
 
-#include <sstream>
+#include <inttypes.h>
 
-#include <cJSON.h>
+#include <JSON_checker.h>
 
 static const size_t MAX_PACKET_SIZE=65000;
 
 
-ExpiryChannel::ExpiryChannel(): mSocket(-1) {
+ExpiryChannel::ExpiryChannel(): mSocket(-1), mFormat(JSON) {
 }
 
 ExpiryChannel::~ExpiryChannel() {
@@ -97,111 +97,246 @@ bool ExpiryChannel::open(const std::string& dstAddr, const int dstPort) {
 	return true;
 }
 
-void ExpiryChannel::sendNotification(const std::string& name, const StoredValue* v) {
-	if(!isConnected()) {
-//		LOG(EXTENSION_LOG_WARNING, "%s[%s.%s], but there is no connection (not configured? failed to open?), bailing out...", __func__, name.c_str(), v->getKey().c_str());
-		return;
+bool ExpiryChannel::parseFormat(const std::string& name, Format& format) {
+	if(name == "json") {
+		format = JSON;
+	} else if(name == "binary") {
+		format = BINARY;
+	} else {
+		return false;
 	}
-	if(!v) {
-		LOG(EXTENSION_LOG_WARNING, "%s[%s]: called without StoredValue, bailing out...", __func__, name.c_str());
-		return;
+	return true;
+}
+
+static void appendNumber(std::string& out, uint64_t n) {
+	char buf[24];
+	const int len = snprintf(buf, sizeof(buf), "%" PRIu64, n);
+	out.append(buf, len);
+}
+
+// true if s is well-formed UTF-8 (no overlongs, surrogates or code points past U+10FFFF)
+static bool isUtf8(const char* s, size_t len) {
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(s);
+	const unsigned char* end = p + len;
+	while(p < end) {
+		const unsigned char c = *p++;
+		if(c < 0x80) {
+			continue;
+		}
+		size_t n;
+		unsigned char lo = 0x80, hi = 0xbf; // bounds of the first continuation byte
+		if(c >= 0xc2 && c <= 0xdf) {
+			n = 1;
+		} else if(c >= 0xe0 && c <= 0xef) {
+			n = 2;
+			if(c == 0xe0) lo = 0xa0;
+			if(c == 0xed) hi = 0x9f;
+		} else if(c >= 0xf0 && c <= 0xf4) {
+			n = 3;
+			if(c == 0xf0) lo = 0x90;
+			if(c == 0xf4) hi = 0x8f;
+		} else {
+			return false;
+		}
+		if(static_cast<size_t>(end - p) < n || *p < lo || *p > hi) {
+			return false;
+		}
+		for(p++, n--; n > 0; p++, n--) {
+			if((*p & 0xc0) != 0x80) {
+				return false;
+			}
+		}
 	}
-/*
-{
-  "bucket": "<STYPE>",
-  "id": "<SID>",
-  "expiry": "<EXPIRES>",
-  "cas": "<CAS value (version)>",
-  "flags": <flags>,
-  "body": <PAYLOAD in BOX format>  // datatype==0? "string", datatype==1(JSON) {...}
+	return true;
 }
-*/
-	cJSON* root = cJSON_CreateObject();
-	cJSON_AddStringToObject(root, "bucket", name.c_str());
-	cJSON_AddStringToObject(root, "id", v->getKey().c_str());
-	cJSON_AddNumberToObject(root, "expiry", v->getExptime());
-	//int64->double possibly loses precision, fatal for 'cas', not doing that for now, not really needed // cJSON_AddNumberToObject(root, "cas", v->getCas());
-	cJSON_AddNumberToObject(root, "flags", v->getFlags());
-
-	const value_t& d = v->getValue();
-	uint8_t t = d->getDataType();
-	const std::string sbody(d->to_s());
-	switch(t) {
-		case PROTOCOL_BINARY_DATATYPE_JSON: {
-			cJSON* jbody = cJSON_Parse(sbody.c_str());
-			if (jbody)
-				cJSON_AddItemToObject(root, "body", jbody); // assumes responsibility
-			else
-				LOG(EXTENSION_LOG_WARNING, "%s[%s.%s]: reported its type as JSON but can not parse it, bailing out...", __func__, name.c_str(), v->getKey().c_str());
-			break;
+
+// appends s as a quoted JSON string; bytes >= 0x80 are passed through as-is
+// when s is UTF-8 and escaped as \u00XX (read as Latin-1) otherwise
+static void appendJsonString(std::string& out, const char* s, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	const bool utf8 = isUtf8(s, len);
+	out.push_back('"');
+	const char* run = s;
+	for(const char* p = s; p < s + len; p++) {
+		const unsigned char c = static_cast<unsigned char>(*p);
+		if(c >= 0x20 && c != '"' && c != '\\' && (c < 0x80 || utf8)) {
+			continue;
 		}
-		case PROTOCOL_BINARY_RAW_BYTES: {
-			cJSON_AddStringToObject(root, "body", sbody.c_str());
-			break;
+		out.append(run, p - run);
+		run = p + 1;
+		switch(c) {
+			case '"': out.append("\\\""); break;
+			case '\\': out.append("\\\\"); break;
+			case '\n': out.append("\\n"); break;
+			case '\r': out.append("\\r"); break;
+			case '\t': out.append("\\t"); break;
+			default: {
+				const char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+				out.append(esc, sizeof(esc));
+				break;
+			}
+		}
+	}
+	out.append(run, s + len - run);
+	out.push_back('"');
+}
+
+void ExpiryChannel::encodeJson(const std::string& name, const ExpiryNotification& n,
+							   std::string& out) {
+	out.append("{\"bucket\":");
+	appendJsonString(out, name.data(), name.size());
+	out.append(",\"id\":");
+	appendJsonString(out, n.key.data(), n.key.size());
+	out.append(",\"expiry\":");
+	appendNumber(out, n.exptime);
+	out.append(",\"cas\":\"");
+	appendNumber(out, n.cas);
+	out.append("\",\"flags\":");
+	appendNumber(out, n.flags);
+	out.append(",\"seqno\":");
+	appendNumber(out, n.seqno);
+	if(n.replay) {
+		out.append(",\"replay\":true");
+	}
+
+	if(n.value.get()) {
+		const uint8_t t = n.value->getDataType();
+		switch(t) {
+			case PROTOCOL_BINARY_DATATYPE_JSON:
+				out.append(",\"body\":");
+				if(checkUTF8JSON(reinterpret_cast<const unsigned char*>(n.value->getData()),
+								 n.value->vlength())) {
+					out.append(n.value->getData(), n.value->vlength());
+				} else {
+					// the datatype can come from the client as is, so a broken
+					// document would break the whole datagram; sent as a string
+					LOG(EXTENSION_LOG_DEBUG, "%s[%s.%s]: body is not valid JSON, sending it as a string", __func__, name.c_str(), n.key.c_str());
+					appendJsonString(out, n.value->getData(), n.value->vlength());
+				}
+				break;
+			case PROTOCOL_BINARY_RAW_BYTES:
+				out.append(",\"body\":");
+				appendJsonString(out, n.value->getData(), n.value->vlength());
+				break;
+			default:
+				LOG(EXTENSION_LOG_WARNING, "%s[%s.%s]: can not handle its type[%d] (it's neither RAW=0 nor JSON=1), sending without body", __func__, name.c_str(), n.key.c_str(), t);
+				break;
 		}
-		default:
-			LOG(EXTENSION_LOG_WARNING, "%s[%s.%s]: can not handle its type[%d] (it's neither RAW=0 nor JSON=1), sending without body", __func__, name.c_str(), v->getKey().c_str(), t);
-			break;
+	} // else value is not resident (full eviction), sending without body
+	out.push_back('}');
+}
+
+static void appendBE(std::string& out, uint64_t v, size_t bytes) {
+	char buf[8];
+	for(size_t i = 0; i < bytes; i++) {
+		buf[i] = static_cast<char>(v >> (8 * (bytes - 1 - i)));
+	}
+	out.append(buf, bytes);
+}
+
+void ExpiryChannel::encodeBinary(const std::string& name, const ExpiryNotification& n,
+								 std::string& out) {
+	const char* body = NULL;
+	size_t bodyLen = 0;
+	uint8_t t = 0xff;
+	if(n.value.get()) {
+		t = n.value->getDataType();
+		body = n.value->getData();
+		bodyLen = n.value->vlength();
 	}
 
-	char* json_cstr = cJSON_PrintUnformatted(root);
-	cJSON_Delete(root);
+	out.push_back(static_cast<char>(n.replay ? binaryReplayMagic : binaryMagic));
+	out.push_back(static_cast<char>(t));
+	appendBE(out, name.size(), 2);
+	appendBE(out, n.key.size(), 2);
+	appendBE(out, n.exptime, 4);
+	appendBE(out, n.flags, 4);
+	appendBE(out, n.cas, 8);
+	appendBE(out, n.seqno, 8);
+	appendBE(out, bodyLen, 4);
+	out.append(name);
+	out.append(n.key);
+	if(bodyLen) {
+		out.append(body, bodyLen);
+	}
+}
 
-	if (!json_cstr) {
-		LOG(EXTENSION_LOG_WARNING, "%s[%s.%s]: failed to serialize to json. Had good type[%u] (RAW=0, JSON=1), bailing out...", __func__, name.c_str(), v->getKey().c_str(), (unsigned)t);
-		return;
+bool ExpiryChannel::encode(const std::string& name, const ExpiryNotification& n,
+						   std::string& out) {
+	out.clear(); // keeps capacity
+	if(mFormat == BINARY) {
+		encodeBinary(name, n, out);
+	} else {
+		encodeJson(name, n, out);
 	}
-	size_t json_length = strlen(json_cstr);
-	if (json_length > MAX_PACKET_SIZE) {
-		LOG(EXTENSION_LOG_WARNING, "%s[%s.%s]: serialized to json_length[%zu], which is more than MAX_PACKET_SIZE[%zu], bailing out...", __func__, name.c_str(), v->getKey().c_str(), json_length, MAX_PACKET_SIZE);
-		cJSON_Free(json_cstr);
-		return;
+
+	if(out.size() > MAX_PACKET_SIZE) {
+		LOG(EXTENSION_LOG_WARNING, "%s[%s.%s]: encoded to length[%zu], which is more than MAX_PACKET_SIZE[%zu], bailing out...", __func__, name.c_str(), n.key.c_str(), out.size(), MAX_PACKET_SIZE);
+		return false;
+	}
+	return true;
+}
+
+size_t ExpiryChannel::sendBatch(const std::vector<std::string>& datagrams, size_t count) {
+	if(!isConnected() || count == 0) {
+		return 0;
+	}
+	if(count > datagrams.size()) {
+		count = datagrams.size();
+	}
+	if(mMsgs.size() < count) {
+		mMsgs.resize(count);
+		mIovs.resize(count);
+	}
+	for(size_t i = 0; i < count; i++) {
+		mIovs[i].iov_base = const_cast<char*>(datagrams[i].data());
+		mIovs[i].iov_len = datagrams[i].size();
+		memset(&mMsgs[i], 0, sizeof(mMsgs[i]));
+		mMsgs[i].msg_hdr.msg_iov = &mIovs[i];
+		mMsgs[i].msg_hdr.msg_iovlen = 1;
 	}
 
 	// here discovered errno==ECONNREFUSED to be returned if PREVIOUS message to that destination was not delivered
 	// (came ICMP with error as a reply to PREVIOUS message)
 	// official way to deal with it is to retry that case
 	// here discovered errno==EINTR also for previous message, tried 1.1.1.1
-// think there was a race to handle this data from 4 threads
-// must rework this if we want that warning back
-// but, as comments below go, that warning is false, so replaced it to truer one
-//	static struct previous_tag {
-//		std::string name;
-//		std::string key;
-//	} previous;
-	ssize_t written = -1;
-	for(int attempt = 0; attempt < 2; attempt++) {
-		written = send(mSocket, json_cstr, json_length, 0);
-		if(written < 0 && (errno == ECONNREFUSED || errno == EINTR)) {
-			// "probably" because it could be like this:
-			// 1. send(key1). previous.key:=key1
-			// 2. no ICMP error received yet
-			// 3. remote server started OK
-			// 4. send(key2). previous.key:=key2
-			// 5. ICMP error arrives (relating to key1 received)
-			// 6. send(key3) detects problem, but reports previous.key==key2 instead of key1
-			//
-			// due to this mess, maybe we should remove this confusing warning
-			// leaving it here for now to see if we will ever see that
-//			LOG(EXTENSION_LOG_WARNING, "%s[%s.%s]: probably this notification was not delivered. errno[%d]",
-//				__func__, previous.name.c_str(), previous.key.c_str(), errno);
-
-			// actually can not say from which bucket so will just give a general warning
-			LOG(EXTENSION_LOG_WARNING, "%s[can not say, which bucket/key, sorry about that]: Previous notification was not delivered. errno[%d]",
-				__func__, errno);
+	// sendmmsg reports such an error only for the first datagram of a call, so a retry
+	// resumes from the datagram that hit it
+	size_t pos = 0;
+	size_t sent = 0;
+	int retries = 0;
+	while(pos < count) {
+		const int rc = sendmmsg(mSocket, &mMsgs[pos], count - pos, 0);
+		if(rc < 0) {
+			if((errno == ECONNREFUSED || errno == EINTR) && retries++ < 2) {
+				// actually can not say from which bucket so will just give a general warning
+				LOG(EXTENSION_LOG_WARNING, "%s[can not say, which bucket/key, sorry about that]: Previous notification was not delivered. errno[%d]",
+					__func__, errno);
+				continue;
+			}
+			LOG(EXTENSION_LOG_WARNING, "%s: datagram[%zu] of count[%zu], length[%zu] was not sent. errno[%d]",
+				__func__, pos, count, datagrams[pos].size(), errno);
+			// skip the offending datagram, keep the rest of the batch
+			pos++;
 			continue;
 		}
-		break;
-	}
-	if(json_length != static_cast<size_t>(written)) {
-		LOG(EXTENSION_LOG_WARNING, "%s[%s.%s]: json_length[%zu] != written[%zd] errno[%d]",
-			__func__, name.c_str(), v->getKey().c_str(), json_length, written, errno);
+		pos += rc;
+		sent += rc;
 	}
+	return sent;
+}
 
-	cJSON_Free(json_cstr);
-
-//	previous.name = name;
-//	previous.key = v->getKey();
+ssize_t ExpiryChannel::receive(char* buf, size_t len) {
+	if(!isConnected()) {
+		return 0;
+	}
+	// a pending error (typically ECONNREFUSED from an earlier send) is
+	// consumed by recv, so it is passed on rather than lost
+	const ssize_t rc = recv(mSocket, buf, len, MSG_DONTWAIT);
+	if(rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+	return rc;
 }
 
 void ExpiryChannel::close() {
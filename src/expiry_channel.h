@@ -21,7 +21,41 @@
 #include "config.h"
 #include "stored-value.h"
 
+#include <sys/socket.h>
+
 #include <string>
+#include <vector>
+
+/**
+ * Minimal snapshot of an expired item, taken under the hash-bucket lock
+ * and formatted later, off the front-end path, by the ExpiryNotifier.
+ * The value is shared with the StoredValue by reference, not copied,
+ * unless the StoredValue keeps it inline.
+ * The sequence number is assigned when the notification is sent.
+ */
+struct ExpiryNotification {
+	ExpiryNotification(uint16_t vb, const StoredValue& v)
+		: key(v.getKey()), value(v.getValue()), cas(v.getCas()),
+		  seqno(0), exptime(v.getExptime()), flags(v.getFlags()),
+		  vbid(vb), replay(false) {}
+
+	/**
+	 * A notification replayed from the ExpiryJournal, which only knows
+	 * the key and the sequence number.
+	 */
+	ExpiryNotification(uint16_t vb, const std::string& k, uint64_t s)
+		: key(k), cas(0), seqno(s), exptime(0), flags(0), vbid(vb),
+		  replay(true) {}
+
+	std::string key;
+	value_t value;
+	uint64_t cas;
+	uint64_t seqno;
+	uint32_t exptime;
+	uint32_t flags;
+	uint16_t vbid;
+	bool replay;
+};
 
 /**
  * @brief  Expiry Channel using UDP to
@@ -31,6 +65,48 @@
  */
 class ExpiryChannel {
 public:
+	/**
+	 * Wire format of the datagrams (expiry_format).
+	 *
+	 * JSON: one object per datagram
+	 * {"bucket":"<name>","id":"<key>","expiry":<exptime>,"cas":"<cas>",
+	 *  "flags":<flags>,"seqno":<seqno>[,"replay":true],"body":<value>}
+	 * cas is a decimal string so no 64-bit precision is lost; body is the
+	 * document itself for JSON values, a string for raw ones (and JSON
+	 * ones that fail validation) and absent when the value is not
+	 * resident or of another datatype. Strings that are not UTF-8 have
+	 * their bytes >= 0x80 escaped as \u00XX. Replayed
+	 * notifications only carry bucket, id and seqno.
+	 *
+	 * BINARY: fixed header followed by the variable parts, integers in
+	 * network byte order
+	 *   uint8  magic (binaryMagic, binaryReplayMagic if replayed)
+	 *   uint8  datatype of body (0xff: no body)
+	 *   uint16 bucket name length
+	 *   uint16 key length
+	 *   uint32 exptime
+	 *   uint32 flags
+	 *   uint64 cas
+	 *   uint64 seqno
+	 *   uint32 body length
+	 *   bucket name, key, body
+	 */
+	enum Format {
+		JSON,
+		BINARY
+	};
+
+	static const uint8_t binaryMagic = 0xe1;
+	static const uint8_t binaryReplayMagic = 0xe2;
+	static const size_t binaryHeaderSize = 34;
+
+	/**
+	 * @param name format name as in the configuration ("json", "binary")
+	 * @param format parsed format
+	 * @return false if the name is not known
+	 */
+	static bool parseFormat(const std::string& name, Format& format);
+
 	ExpiryChannel();
 	virtual ~ExpiryChannel();
 	
@@ -43,11 +119,42 @@ public:
 	bool open(const std::string& dstAddr,
 			 const int dstPort);
 	
+	void setFormat(Format f) {
+		mFormat = f;
+	}
+
+	Format getFormat() const {
+		return mFormat;
+	}
+
+	/**
+	 * Format expiration info into a datagram, in the current format.
+	 * Does not allocate once out has grown to the largest datagram.
+	 * @param name bucket name
+	 * @param n expired item snapshot
+	 * @param out datagram (reused between calls to keep its capacity)
+	 * @return true if out holds a datagram ready to be sent
+	 */
+	bool encode(const std::string& name, const ExpiryNotification& n,
+				std::string& out);
+
+	/**
+	 * Send a batch of datagrams with as few syscalls as possible (sendmmsg)
+	 * @param datagrams datagrams to send
+	 * @param count number of leading datagrams to send
+	 * @return number of datagrams handed to the kernel
+	 */
+	size_t sendBatch(const std::vector<std::string>& datagrams, size_t count);
+
 	/**
-	 * Send expiration info
-	 * @param v Stored value to send
+	 * Read a datagram sent back by the consumer, without blocking
+	 * @param buf buffer to read into
+	 * @param len size of buf
+	 * @return length of the datagram, 0 if there is none, -1 with errno
+	 *         set on an error (ECONNREFUSED: an earlier datagram was
+	 *         refused, the error is consumed by reporting it)
 	 */
-	void sendNotification(const std::string& name, const StoredValue* v);
+	ssize_t receive(char* buf, size_t len);
 
 	/**
 	 * Close channel, cleanup
@@ -57,7 +164,15 @@ public:
 	const bool isConnected() const;
 	
 private:
+	void encodeJson(const std::string& name, const ExpiryNotification& n,
+					std::string& out);
+	void encodeBinary(const std::string& name, const ExpiryNotification& n,
+					  std::string& out);
+
 	int mSocket;
+	Format mFormat;
+	std::vector<struct mmsghdr> mMsgs;
+	std::vector<struct iovec> mIovs;
 };
 
 #endif  // SRC_EXPIRY_CHANNEL_H_
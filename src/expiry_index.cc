@@ -0,0 +1,137 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include "expiry_index.h"
+#include "locks.h"
+
+// Rough per-slot overhead of a std::map node holding a std::unordered_set
+static const size_t SLOT_OVERHEAD = 96;
+// Rough overhead of the hash nodes of an entry, in the key map and a slot
+static const size_t NODE_OVERHEAD = 4 * sizeof(void*) + sizeof(uint32_t);
+
+size_t ExpiryIndex::entrySize(const std::string &key) {
+    return sizeof(std::string) + key.size() + NODE_OVERHEAD;
+}
+
+void ExpiryIndex::add(const std::string &key, uint32_t exptime) {
+    if (exptime == 0) {
+        remove(key);
+        return;
+    }
+
+    LockHolder lh(mutex);
+    ssize_t entries = 0;
+    ssize_t bytes = 0;
+    auto it = expiries.find(key);
+    if (it != expiries.end()) {
+        if (it->second == exptime) {
+            return;
+        }
+        // Moves to another slot
+        auto &slot = slots[it->second];
+        slot.erase(&it->first);
+        if (slot.empty()) {
+            slots.erase(it->second);
+            bytes -= SLOT_OVERHEAD;
+        }
+        it->second = exptime;
+    } else {
+        it = expiries.insert(std::make_pair(key, exptime)).first;
+        ++entries;
+        bytes += entrySize(key);
+    }
+
+    auto &slot = slots[exptime];
+    if (slot.empty()) {
+        bytes += SLOT_OVERHEAD;
+    }
+    slot.insert(&it->first);
+    updateStats(entries, bytes);
+}
+
+void ExpiryIndex::remove(const std::string &key) {
+    if (numEntries.load() == 0) {
+        return;
+    }
+
+    LockHolder lh(mutex);
+    auto it = expiries.find(key);
+    if (it != expiries.end()) {
+        updateStats(-1, -static_cast<ssize_t>(unlocked_erase(it)));
+    }
+}
+
+size_t ExpiryIndex::unlocked_erase(expiry_map_t::iterator it) {
+    size_t freed = entrySize(it->first);
+    auto slot = slots.find(it->second);
+    slot->second.erase(&it->first);
+    if (slot->second.empty()) {
+        slots.erase(slot);
+        freed += SLOT_OVERHEAD;
+    }
+    expiries.erase(it);
+    return freed;
+}
+
+bool ExpiryIndex::popDue(time_t asOf, std::vector<std::string> &keys,
+                         size_t limit) {
+    size_t popped = 0;
+    size_t freed = 0;
+
+    LockHolder lh(mutex);
+    auto it = slots.begin();
+    while (it != slots.end() && static_cast<time_t>(it->first) < asOf &&
+           popped < limit) {
+        auto &slot = it->second;
+        while (!slot.empty() && popped < limit) {
+            const std::string *key = *slot.begin();
+            slot.erase(slot.begin());
+            freed += entrySize(*key);
+            keys.push_back(*key);
+            expiries.erase(expiries.find(*key));
+            ++popped;
+        }
+        if (slot.empty()) {
+            freed += SLOT_OVERHEAD;
+            it = slots.erase(it);
+        }
+    }
+    bool more = it != slots.end() && static_cast<time_t>(it->first) < asOf;
+
+    updateStats(-static_cast<ssize_t>(popped), -static_cast<ssize_t>(freed));
+    return more;
+}
+
+void ExpiryIndex::clear() {
+    LockHolder lh(mutex);
+    slots.clear();
+    expiries.clear();
+    size_t freed = memUsed.exchange(0);
+    stats.expiryIndexSize.fetch_sub(numEntries.exchange(0));
+    stats.expiryIndexMemory.fetch_sub(freed);
+    stats.memOverhead.fetch_sub(freed);
+}
+
+void ExpiryIndex::updateStats(ssize_t entries, ssize_t bytes) {
+    numEntries.fetch_add(entries);
+    memUsed.fetch_add(bytes);
+    stats.expiryIndexSize.fetch_add(entries);
+    stats.expiryIndexMemory.fetch_add(bytes);
+    stats.memOverhead.fetch_add(bytes);
+}
@@ -0,0 +1,119 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_EXPIRY_INDEX_H_
+#define SRC_EXPIRY_INDEX_H_ 1
+
+#include "config.h"
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "atomic.h"
+#include "mutex.h"
+#include "stats.h"
+
+/**
+ * Per-vbucket index of keys by expiry time, so expired items can be found
+ * without walking the whole HashTable.
+ *
+ * Keys are bucketed by their expiry second in an ordered map, which makes
+ * insertion O(log(distinct expiry seconds)) and popping the due keys
+ * proportional to their number. A key has at most one entry: a mutation
+ * with another expiry time moves it to the new slot, and one without an
+ * expiry time (or a delete) removes it, so the index is bounded by the
+ * number of items rather than the write rate.
+ *
+ * Entries may still be stale when popped - the item may have been
+ * evicted, or changed by a path that does not maintain the index - so
+ * whoever pops them must re-check the item under the hash-bucket lock
+ * before expiring it.
+ */
+class ExpiryIndex {
+public:
+    ExpiryIndex(EPStats &st) : stats(st), numEntries(0), memUsed(0) {}
+
+    ~ExpiryIndex() {
+        clear();
+    }
+
+    /**
+     * Record that the given key expires at the given time, replacing the
+     * entry of the key if any.
+     *
+     * @param key the key of the item
+     * @param exptime the absolute expiry time of the item (0 removes the
+     *                entry of the key)
+     */
+    void add(const std::string &key, uint32_t exptime);
+
+    /**
+     * Drop the entry of the given key, if any.
+     */
+    void remove(const std::string &key);
+
+    /**
+     * Remove and return the keys due to expire before the given time.
+     *
+     * @param asOf keys with an expiry time less than this are due
+     * @param keys output vector to append the due keys to
+     * @param limit max number of keys to pop
+     * @return true if more due keys remain in the index
+     */
+    bool popDue(time_t asOf, std::vector<std::string> &keys, size_t limit);
+
+    /**
+     * Drop all entries.
+     */
+    void clear();
+
+    //! Number of entries (keys) in the index
+    size_t size() const {
+        return numEntries.load();
+    }
+
+    //! Approximate memory used by the index
+    size_t memorySize() const {
+        return memUsed.load();
+    }
+
+private:
+    typedef std::unordered_map<std::string, uint32_t> expiry_map_t;
+
+    static size_t entrySize(const std::string &key);
+
+    //! Take the entry out of its slot and the key map, returns its size
+    size_t unlocked_erase(expiry_map_t::iterator it);
+
+    void updateStats(ssize_t entries, ssize_t bytes);
+
+    EPStats &stats;
+    Mutex mutex;
+    //! The expiry time of each key
+    expiry_map_t expiries;
+    //! The keys due at each second, pointing to the keys of expiries
+    std::map<uint32_t, std::unordered_set<const std::string*> > slots;
+    AtomicValue<size_t> numEntries;
+    AtomicValue<size_t> memUsed;
+
+    DISALLOW_COPY_AND_ASSIGN(ExpiryIndex);
+};
+
+#endif  // SRC_EXPIRY_INDEX_H_
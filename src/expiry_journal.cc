@@ -0,0 +1,185 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "ep_engine.h"
+#include "expiry_journal.h"
+
+// Seconds until a failed rotation or reopen is tried again
+static const rel_time_t RETRY_INTERVAL = 60;
+
+ExpiryJournal::ExpiryJournal(const std::string &p, size_t max)
+    : path(p), oldPath(p + ".old"), maxSize(max), log(new MutationLog(p)),
+      lastSeqno(0), oldSeqno(0), retryTime(0) {
+}
+
+uint64_t ExpiryJournal::open() {
+    uint64_t seqno = 0;
+    MutationLog old(oldPath);
+    if (old.exists()) {
+        try {
+            old.open(true);
+            seqno = highestSeqno(old);
+        } catch (MutationLog::ReadException &e) {
+            LOG(EXTENSION_LOG_WARNING, "Error reading old expiry journal "
+                "'%s': %s", oldPath.c_str(), e.what());
+        }
+    }
+
+    oldSeqno = seqno;
+
+    log->open();
+    lastSeqno = std::max(seqno, highestSeqno(*log));
+    return lastSeqno;
+}
+
+void ExpiryJournal::append(uint16_t vbid, const std::string &key,
+                           uint64_t seqno) {
+    if (!log->isOpen()) {
+        // failed to reopen, see flush()
+        return;
+    }
+    log->newItem(vbid, key, seqno);
+    lastSeqno = seqno;
+}
+
+void ExpiryJournal::flush() {
+    if (!log->isOpen()) {
+        if (log->isEnabled() && ep_current_time() >= retryTime) {
+            reopen();
+        }
+        return;
+    }
+    log->flush();
+    if (log->isEnabled() && getSize() >= maxSize &&
+        ep_current_time() >= retryTime) {
+        rotate();
+    }
+}
+
+void ExpiryJournal::rotate() {
+    log->close();
+    if (rename(path.c_str(), oldPath.c_str()) != 0) {
+        // Keep appending to the current one rather than losing what the
+        // consumer may still ask for.
+        LOG(EXTENSION_LOG_WARNING, "Failed to rotate expiry journal '%s': "
+            "%s, retrying in %u seconds", path.c_str(), strerror(errno),
+            RETRY_INTERVAL);
+        retryTime = ep_current_time() + RETRY_INTERVAL;
+    } else {
+        LOG(EXTENSION_LOG_INFO, "Rotated expiry journal '%s'", path.c_str());
+        oldSeqno = lastSeqno;
+    }
+    reopen();
+}
+
+void ExpiryJournal::trim(uint64_t acked) {
+    if (oldSeqno == 0 || acked < oldSeqno) {
+        return;
+    }
+    if (remove(oldPath.c_str()) != 0 && errno != ENOENT) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to remove acknowledged expiry "
+            "journal '%s': %s", oldPath.c_str(), strerror(errno));
+        return;
+    }
+    LOG(EXTENSION_LOG_INFO, "Removed acknowledged expiry journal '%s'",
+        oldPath.c_str());
+    oldSeqno = 0;
+}
+
+void ExpiryJournal::reopen() {
+    try {
+        log->open();
+    } catch (MutationLog::ReadException &e) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to reopen expiry journal '%s': "
+            "%s, retrying in %u seconds", path.c_str(), e.what(),
+            RETRY_INTERVAL);
+        retryTime = ep_current_time() + RETRY_INTERVAL;
+    }
+}
+
+size_t ExpiryJournal::replay(uint64_t from, uint64_t to, size_t limit,
+                             const ReplayCallback &cb) {
+    size_t count = 0;
+    MutationLog old(oldPath);
+    if (old.exists()) {
+        try {
+            old.open(true);
+            count += replayLog(old, from, to, limit, cb);
+        } catch (MutationLog::ReadException &e) {
+            LOG(EXTENSION_LOG_WARNING, "Error replaying old expiry journal "
+                "'%s': %s", oldPath.c_str(), e.what());
+        }
+    }
+
+    if (count < limit && log->isOpen()) {
+        log->flush();
+        try {
+            count += replayLog(*log, from, to, limit - count, cb);
+        } catch (MutationLog::ReadException &e) {
+            LOG(EXTENSION_LOG_WARNING, "Error replaying expiry journal "
+                "'%s': %s", path.c_str(), e.what());
+        }
+    }
+    return count;
+}
+
+size_t ExpiryJournal::replayLog(MutationLog &l, uint64_t from, uint64_t to,
+                                size_t limit, const ReplayCallback &cb) {
+    size_t count = 0;
+    for (MutationLog::iterator it = l.begin();
+         it != l.end() && count < limit; ++it) {
+        const MutationLogEntry *e = *it;
+        if (e->type() != ML_NEW) {
+            continue;
+        }
+        uint64_t seqno = e->rowid();
+        if (seqno > to) {
+            // entries are appended in sequence number order
+            break;
+        }
+        if (seqno >= from) {
+            cb(e->vbucket(), e->key(), seqno);
+            ++count;
+        }
+    }
+    return count;
+}
+
+uint64_t ExpiryJournal::highestSeqno(MutationLog &l) {
+    uint64_t seqno = 0;
+    if (!l.isOpen()) {
+        return seqno;
+    }
+    try {
+        for (MutationLog::iterator it = l.begin(); it != l.end(); ++it) {
+            const MutationLogEntry *e = *it;
+            if (e->type() == ML_NEW) {
+                seqno = std::max(seqno, e->rowid());
+            }
+        }
+    } catch (MutationLog::ReadException &e) {
+        // a torn last block, everything before it is still good
+        LOG(EXTENSION_LOG_WARNING, "Error reading expiry journal '%s': %s",
+            l.getLogFile().c_str(), e.what());
+    }
+    return seqno;
+}
@@ -0,0 +1,122 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_EXPIRY_JOURNAL_H_
+#define SRC_EXPIRY_JOURNAL_H_ 1
+
+#include "config.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "mutation_log.h"
+
+/**
+ * On-disk record of the expiry notifications sent, so a consumer that
+ * missed some (it was down, datagrams were lost) can ask for them again
+ * instead of having the whole dataset re-scanned.
+ *
+ * The journal is a MutationLog: every notification is an ML_NEW entry
+ * whose rowid is the notification sequence number, so it shares the
+ * block format and CRC checks of the access log. Only the vbucket, key
+ * and sequence number are kept; the value is gone by the time anybody
+ * asks for a replay.
+ *
+ * When the journal grows beyond maxSize it is moved to "<path>.old" and
+ * a new one is started, so at most two generations are kept on disk. If
+ * it can't be moved the journal keeps growing and the rotation is tried
+ * again a minute later. The old generation is removed as soon as the
+ * consumer acknowledged all of its notifications.
+ *
+ * Not thread safe, only used from the ExpiryNotifierTask.
+ */
+class ExpiryJournal {
+public:
+    typedef std::function<void(uint16_t vbid, const std::string &key,
+                               uint64_t seqno)> ReplayCallback;
+
+    /**
+     * @param path the journal file
+     * @param maxSize size at which the journal is rotated
+     */
+    ExpiryJournal(const std::string &path, size_t maxSize);
+
+    /**
+     * Open the journal, creating it if needed.
+     *
+     * @return the highest sequence number found in the journal (0 if none)
+     */
+    uint64_t open();
+
+    bool isOpen() const {
+        return log->isOpen();
+    }
+
+    /**
+     * Record a notification. Buffered until flush(), dropped while the
+     * journal could not be reopened.
+     */
+    void append(uint16_t vbid, const std::string &key, uint64_t seqno);
+
+    /**
+     * Write out the buffered entries and rotate the journal if it grew
+     * too big.
+     */
+    void flush();
+
+    /**
+     * Call cb for every journaled notification with a sequence number
+     * in [from, to], oldest generation first.
+     *
+     * @param limit max number of entries to hand to cb
+     * @return number of entries handed to cb
+     */
+    size_t replay(uint64_t from, uint64_t to, size_t limit,
+                  const ReplayCallback &cb);
+
+    /**
+     * Drop what the consumer acknowledged: the old generation once it
+     * holds nothing past the given sequence number.
+     */
+    void trim(uint64_t acked);
+
+    size_t getSize() const {
+        return log->logSize.load();
+    }
+
+private:
+    size_t replayLog(MutationLog &l, uint64_t from, uint64_t to,
+                     size_t limit, const ReplayCallback &cb);
+    uint64_t highestSeqno(MutationLog &l);
+    void rotate();
+    void reopen();
+
+    const std::string path;
+    const std::string oldPath;
+    const size_t maxSize;
+    std::unique_ptr<MutationLog> log;
+    //! Highest sequence number appended, and the one in the old generation
+    uint64_t lastSeqno;
+    uint64_t oldSeqno;
+    //! No rotation or reopen is tried before this time after one failed
+    rel_time_t retryTime;
+
+    DISALLOW_COPY_AND_ASSIGN(ExpiryJournal);
+};
+
+#endif  // SRC_EXPIRY_JOURNAL_H_
@@ -0,0 +1,231 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <cinttypes>
+#include <climits>
+#include <cerrno>
+#include <cstdio>
+#include <queue>
+
+#include "ep_engine.h"
+#include "executorpool.h"
+#include "expiry_notifier.h"
+#include "tasks.h"
+
+const size_t ExpiryNotifier::maxBatchSize = 64;
+const size_t ExpiryNotifier::maxReplay = 10000;
+
+// How often the consumer's acks and replay requests are looked at
+static const double CONTROL_POLL_INTERVAL = 1.0;
+
+ExpiryNotifier::ExpiryNotifier(EventuallyPersistentEngine &e, EPStats &st,
+                               size_t numShards, size_t cap)
+    : engine(e), stats(st), taskId(0), queueCap(cap), numQueued(0),
+      connected(false), pendingNotify(false), datagrams(maxBatchSize),
+      lastSeqno(0), ackedSeqno(0), journalSize(0) {
+    if (numShards == 0) {
+        numShards = 1;
+    }
+    for (size_t i = 0; i < numShards; ++i) {
+        queues.emplace_back(new AtomicQueue<ExpiryNotification>());
+    }
+}
+
+void ExpiryNotifier::start() {
+    bool inverse = false;
+    pendingNotify.compare_exchange_strong(inverse, true);
+    ExTask task = new ExpiryNotifierTask(&engine, this);
+    taskId = task->getId();
+    ExecutorPool::get()->schedule(task, NONIO_TASK_IDX);
+}
+
+void ExpiryNotifier::stop() {
+    bool inverse = true;
+    pendingNotify.compare_exchange_strong(inverse, false);
+    ExecutorPool::get()->cancel(taskId);
+}
+
+bool ExpiryNotifier::open(const std::string &host, int port) {
+    LockHolder lh(channelMutex);
+    bool rv = channel.open(host, port);
+    connected.store(channel.isConnected());
+    return rv;
+}
+
+bool ExpiryNotifier::openJournal(const std::string &path, size_t maxSize) {
+    std::unique_ptr<ExpiryJournal> j(new ExpiryJournal(path, maxSize));
+    try {
+        lastSeqno.store(j->open());
+    } catch (MutationLog::ReadException &e) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to open expiry journal '%s': %s",
+            path.c_str(), e.what());
+        return false;
+    }
+    if (!j->isOpen()) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to open expiry journal '%s'",
+            path.c_str());
+        return false;
+    }
+    LOG(EXTENSION_LOG_NOTICE, "Expiry journal '%s' opened at seqno %" PRIu64,
+        path.c_str(), lastSeqno.load());
+    journalSize.store(j->getSize());
+    journal = std::move(j);
+    return true;
+}
+
+void ExpiryNotifier::setFormat(ExpiryChannel::Format format) {
+    LockHolder lh(channelMutex);
+    channel.setFormat(format);
+}
+
+void ExpiryNotifier::notify(uint16_t vbid, const StoredValue &v) {
+    if (!connected.load()) {
+        // not configured or failed to open, nobody to tell
+        return;
+    }
+
+    if (numQueued.fetch_add(1) >= queueCap.load()) {
+        // never numbered, so neither journaled nor seen as a gap
+        numQueued.fetch_sub(1);
+        ++stats.expiryNotifyOverflow;
+        return;
+    }
+
+    ExpiryNotification n(vbid, v);
+    queues[vbid % queues.size()]->push(n);
+    ++stats.expiryNotifyQueued;
+
+    bool inverse = false;
+    if (pendingNotify.compare_exchange_strong(inverse, true)) {
+        ExecutorPool::get()->wake(taskId);
+    }
+}
+
+bool ExpiryNotifier::run(GlobalTask *task) {
+    bool inverse = true;
+    pendingNotify.compare_exchange_strong(inverse, false);
+
+    std::queue<ExpiryNotification> pending;
+    for (auto &q : queues) {
+        q->getAll(pending);
+    }
+    numQueued.fetch_sub(pending.size());
+
+    LockHolder lh(channelMutex);
+    const std::string &name = engine.getName();
+    size_t count = 0;
+    while (!pending.empty()) {
+        ExpiryNotification &n = pending.front();
+        n.seqno = ++lastSeqno;
+        if (journal) {
+            journal->append(n.vbid, n.key, n.seqno);
+        }
+        if (!channel.isConnected()) {
+            ++stats.expiryNotifyDropped;
+        } else if (channel.encode(name, n, datagrams[count])) {
+            if (++count == maxBatchSize) {
+                sendPending(count);
+                count = 0;
+            }
+        } else {
+            ++stats.expiryNotifyFailed;
+        }
+        pending.pop();
+    }
+    sendPending(count);
+
+    if (journal) {
+        journal->flush();
+        journalSize.store(journal->getSize());
+        handleControl(name);
+    }
+    lh.unlock();
+
+    if (!pendingNotify.load()) {
+        // with a journal keep polling for the consumer's requests
+        task->snooze(journal ? CONTROL_POLL_INTERVAL : INT_MAX);
+
+        if (pendingNotify.load()) {
+            // check again a new notification could have arrived
+            // right before calling above snooze()
+            task->snooze(0);
+        }
+    }
+    return true;
+}
+
+void ExpiryNotifier::sendPending(size_t count) {
+    if (count == 0) {
+        return;
+    }
+    size_t sent = channel.sendBatch(datagrams, count);
+    stats.expiryNotifySent.fetch_add(sent);
+    stats.expiryNotifyFailed.fetch_add(count - sent);
+    ++stats.expiryNotifyBatches;
+}
+
+void ExpiryNotifier::handleControl(const std::string &name) {
+    char buf[128];
+    ssize_t len;
+    while ((len = channel.receive(buf, sizeof(buf) - 1)) != 0) {
+        if (len < 0) {
+            if (errno != ECONNREFUSED) {
+                break;
+            }
+            // An ICMP error for an earlier datagram, the socket goes on
+            LOG(EXTENSION_LOG_WARNING, "An expiry notification sent was not "
+                "delivered, the consumer refused it");
+            continue;
+        }
+        buf[len] = '\0';
+        uint64_t from, to;
+        if (sscanf(buf, "ack %" SCNu64, &from) == 1) {
+            if (from > ackedSeqno.load()) {
+                journal->trim(from);
+                ackedSeqno.store(from);
+            }
+        } else if (sscanf(buf, "replay %" SCNu64 " %" SCNu64,
+                          &from, &to) == 2) {
+            replay(name, from, to);
+        } else {
+            LOG(EXTENSION_LOG_WARNING, "Ignoring unknown expiry consumer "
+                "request of length %zu", len);
+        }
+    }
+}
+
+void ExpiryNotifier::replay(const std::string &name, uint64_t from,
+                            uint64_t to) {
+    size_t count = 0;
+    size_t replayed = journal->replay(from, to, maxReplay,
+            [this, &name, &count](uint16_t vbid, const std::string &key,
+                                  uint64_t seqno) {
+                ExpiryNotification n(vbid, key, seqno);
+                if (channel.encode(name, n, datagrams[count])) {
+                    if (++count == maxBatchSize) {
+                        sendPending(count);
+                        count = 0;
+                    }
+                } else {
+                    ++stats.expiryNotifyFailed;
+                }
+            });
+    sendPending(count);
+    stats.expiryNotifyReplayed.fetch_add(replayed);
+}
@@ -0,0 +1,161 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_EXPIRY_NOTIFIER_H_
+#define SRC_EXPIRY_NOTIFIER_H_ 1
+
+#include "config.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "atomicqueue.h"
+#include "expiry_channel.h"
+#include "expiry_journal.h"
+#include "stats.h"
+
+// Forward declarations.
+class EventuallyPersistentEngine;
+class GlobalTask;
+
+/**
+ * Pipeline that takes expiry notifications off the front-end path.
+ *
+ * Whoever expires an item (pager, compactor, access) only snapshots it
+ * into a per-shard AtomicQueue while holding the hash-bucket lock. A
+ * NONIO ExpiryNotifierTask later drains all queues, formats the datagrams
+ * and hands them to the ExpiryChannel in sendmmsg batches.
+ *
+ * The number of queued notifications is bounded by
+ * expiry_notify_queue_cap; anything above it is dropped before it gets
+ * a sequence number, so the consumer can't see the gap, and is counted
+ * in ep_expiry_notify_overflow.
+ *
+ * Every notification sent gets the next per-bucket sequence number. With
+ * an expiry journal configured the notifications are also journaled, and
+ * the consumer may send plain text datagrams back on the same socket:
+ *   "ack <seqno>"          everything up to seqno was received, the
+ *                          journal may drop it
+ *   "replay <from> <to>"   send the journaled notifications again
+ * Replays are bounded by maxReplay per request; the consumer asks again
+ * from where the previous one ended.
+ */
+class ExpiryNotifier {
+public:
+    //! Max datagrams handed to the kernel by a single sendmmsg call
+    static const size_t maxBatchSize;
+    //! Max notifications resent for a single replay request
+    static const size_t maxReplay;
+
+    /**
+     * Construct an ExpiryNotifier
+     *
+     * @param e the engine (whose name goes into every notification)
+     * @param st reference to statistics
+     * @param numShards number of per-shard queues
+     * @param cap max number of queued notifications
+     */
+    ExpiryNotifier(EventuallyPersistentEngine &e, EPStats &st,
+                   size_t numShards, size_t cap);
+
+    void start(void);
+    void stop(void);
+    bool run(GlobalTask *task);
+
+    /**
+     * (Re)open the underlying channel.
+     *
+     * @return true if the channel is connected
+     */
+    bool open(const std::string &host, int port);
+
+    /**
+     * Journal notifications to the given file and serve replay requests
+     * from it. Must be called before start().
+     *
+     * @param path the journal file
+     * @param maxSize size at which the journal is rotated
+     * @return true if the journal could be opened
+     */
+    bool openJournal(const std::string &path, size_t maxSize);
+
+    /**
+     * Queue an expiry notification for the given item. Expected to be
+     * called with the hash-bucket lock held; does no I/O.
+     *
+     * @param vbid vbucket the item belongs to (selects the shard queue)
+     * @param v the expired item
+     */
+    void notify(uint16_t vbid, const StoredValue &v);
+
+    void setQueueCap(size_t cap) {
+        queueCap.store(cap);
+    }
+
+    //! Switch the wire format; takes effect from the next batch
+    void setFormat(ExpiryChannel::Format format);
+
+    //! Number of notifications waiting to be sent
+    size_t getQueueSize(void) const {
+        return numQueued.load();
+    }
+
+    //! Sequence number of the last notification sent
+    uint64_t getSeqno(void) const {
+        return lastSeqno.load();
+    }
+
+    //! Highest sequence number acknowledged by the consumer
+    uint64_t getAckedSeqno(void) const {
+        return ackedSeqno.load();
+    }
+
+    size_t getJournalSize(void) const {
+        return journalSize.load();
+    }
+
+private:
+    void sendPending(size_t count);
+    void handleControl(const std::string &name);
+    void replay(const std::string &name, uint64_t from, uint64_t to);
+
+    EventuallyPersistentEngine &engine;
+    EPStats &stats;
+    size_t taskId;
+
+    std::vector<std::unique_ptr<AtomicQueue<ExpiryNotification> > > queues;
+    AtomicValue<size_t> queueCap;
+    AtomicValue<size_t> numQueued;
+    AtomicValue<bool> connected;
+    AtomicValue<bool> pendingNotify;
+
+    //! Guards channel and datagrams; only the notifier task sends
+    Mutex channelMutex;
+    ExpiryChannel channel;
+    std::vector<std::string> datagrams;
+
+    //! Only accessed by the notifier task once started
+    std::unique_ptr<ExpiryJournal> journal;
+    AtomicValue<uint64_t> lastSeqno;
+    AtomicValue<uint64_t> ackedSeqno;
+    AtomicValue<size_t> journalSize;
+
+    DISALLOW_COPY_AND_ASSIGN(ExpiryNotifier);
+};
+
+#endif  // SRC_EXPIRY_NOTIFIER_H_
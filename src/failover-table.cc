@@ -26,14 +26,15 @@
 #undef STATWRITER_NAMESPACE
 
 FailoverTable::FailoverTable(size_t capacity)
-    : max_entries(capacity), provider(true) {
+    : max_entries(capacity), provider(true), generation(1) {
     createEntry(0);
     cacheTableJSON();
 }
 
 FailoverTable::FailoverTable(const std::string& json, size_t capacity)
     : max_entries(capacity),
-      provider(true) {
+      provider(true),
+      generation(1) {
     if (!loadFromJSON(json)) {
         throw std::invalid_argument("FailoverTable(): unable to load from "
                 "JSON file '" + json + "'");
@@ -214,7 +215,10 @@ void FailoverTable::cacheTableJSON() {
         cJSON_AddItemToArray(list, obj);
     }
     char* json = cJSON_PrintUnformatted(list);
-    cachedTableJSON = json;
+    if (cachedTableJSON != json) {
+        cachedTableJSON = json;
+        ++generation;
+    }
     free(json);
     cJSON_Delete(list);
 }
@@ -314,6 +318,7 @@ bool FailoverTable::loadFromJSON(const std::string& json) {
     if (parsed) {
         ret = loadFromJSON(parsed);
         cachedTableJSON = json;
+        ++generation;
         cJSON_Delete(parsed);
     }
 
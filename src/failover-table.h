@@ -126,6 +126,14 @@ class FailoverTable {
      */
     std::string toJSON();
 
+    /**
+     * Returns the number of times the table changed, so a copy taken with
+     * toJSON() is known to be current while this stays the same
+     */
+    uint64_t getGeneration() {
+        return generation.load();
+    }
+
     /**
      * Adds stats for this failover table
      *
@@ -171,6 +179,7 @@ class FailoverTable {
     size_t max_entries;
     Couchbase::RandomGenerator provider;
     std::string cachedTableJSON;
+    AtomicValue<uint64_t> generation;
     AtomicValue<uint64_t> latest_uuid;
 
     DISALLOW_COPY_AND_ASSIGN(FailoverTable);
@@ -23,6 +23,12 @@
 
 #include <sstream>
 
+// How long the flusher waits for a VBucketFlushTask at most; they wake it
+// when done, this only bounds the wait should a wake be missed.
+static const double VB_FLUSH_WAIT_TIME = 0.01;
+// How often the vbuckets held back for write coalescing are looked at, when
+// there is nothing else to flush.
+static const double DEFER_POLL_TIME = 0.001;
 
 bool Flusher::stop(bool isForceShutdown) {
     forceShutdownReceived = isForceShutdown;
@@ -187,7 +193,12 @@ bool Flusher::step(GlobalTask *task) {
             if (tosleep > 0) {
                 store->commit(shard->getId());
                 resetCommitInterval();
+                store->syncFlushed(shard->getId());
                 task->snooze(tosleep);
+            } else if (awaitingFlushes) {
+                task->snooze(VB_FLUSH_WAIT_TIME);
+            } else if (onlyDeferred()) {
+                task->snooze(DEFER_POLL_TIME);
             }
         }
         return true;
@@ -202,6 +213,7 @@ bool Flusher::step(GlobalTask *task) {
         completeFlush();
         store->commit(shard->getId());
         resetCommitInterval();
+        store->syncFlushed(shard->getId());
         LOG(EXTENSION_LOG_DEBUG, "Flusher stopped");
         transition_state(stopped);
         return false;
@@ -219,6 +231,9 @@ bool Flusher::step(GlobalTask *task) {
 void Flusher::completeFlush() {
     while(!canSnooze()) {
         flushVB();
+        if (awaitingFlushes) {
+            usleep(1000);
+        }
     }
 }
 
@@ -250,6 +265,15 @@ void Flusher::flushVB(void) {
         return;
     }
 
+    if (isParallel()) {
+        collectFlushed();
+        if (store->diskFlushAll && !inFlight.empty()) {
+            // The disk flush runs alone, once the tasks are done.
+            awaitingFlushes = true;
+            return;
+        }
+    }
+
     if (lpVbs.empty()) {
         if (hpVbs.empty()) {
             doHighPriority = false;
@@ -259,6 +283,10 @@ void Flusher::flushVB(void) {
             for (auto vbid : shard->getVBucketsSortedByState()) {
                 lpVbs.push(vbid);
             }
+            // All of them are looked at again anyway.
+            deferredVbs.clear();
+        } else {
+            requeueDeferred();
         }
     }
 
@@ -276,22 +304,137 @@ void Flusher::flushVB(void) {
     }
 
     if (hpVbs.empty() && lpVbs.empty()) {
-        LOG(EXTENSION_LOG_INFO, "Trying to flush but no vbucket exist");
+        awaitingFlushes = !inFlight.empty();
+        if (!awaitingFlushes) {
+            LOG(EXTENSION_LOG_INFO, "Trying to flush but no vbucket exist");
+        }
         return;
+    } else if (isParallel() && !store->diskFlushAll) {
+        dispatchVBuckets();
     } else if (!hpVbs.empty()) {
         uint16_t vbid = hpVbs.front();
         hpVbs.pop();
         if (store->flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
             hpVbs.push(vbid);
         }
+        // Somebody waits on these, don't hold them for the others.
+        if (hpVbs.empty()) {
+            syncFlushed();
+        }
     } else {
         if (doHighPriority && --numHighPriority == 0) {
             doHighPriority = false;
         }
         uint16_t vbid = lpVbs.front();
         lpVbs.pop();
-        if (store->flushVBucket(vbid) == RETRY_FLUSH_VBUCKET) {
+        int rv = store->flushVBucket(vbid, _state == running);
+        if (rv == RETRY_FLUSH_VBUCKET) {
             lpVbs.push(vbid);
+        } else if (rv == DEFER_FLUSH_VBUCKET) {
+            deferredVbs.insert(vbid);
+        }
+        if (lpVbs.empty()) {
+            syncFlushed();
         }
     }
+
+    if (store->getNumUnsynced(shard->getId()) >=
+        store->getFlusherGroupSyncMax()) {
+        syncFlushed();
+    }
+}
+
+void Flusher::syncFlushed() {
+    if (store->getNumUnsynced(shard->getId()) == 0) {
+        return;
+    }
+    if (currCommitInterval != initCommitInterval) {
+        store->commit(shard->getId());
+        resetCommitInterval();
+    }
+    store->syncFlushed(shard->getId());
+}
+
+void Flusher::flushVBucket(uint16_t vbid, bool highPriority) {
+    int rv = store->flushVBucket(vbid, !highPriority && _state == running);
+    // Woken under the lock: the flusher may stop and go as soon as it
+    // collects the vbucket, but not before the lock is let go of.
+    LockHolder lh(flushedLock);
+    flushedVbs.push_back(FlushedVBucket(vbid, highPriority, rv));
+    wake();
+}
+
+void Flusher::requeueDeferred() {
+    for (auto vbid : deferredVbs) {
+        lpVbs.push(vbid);
+    }
+    deferredVbs.clear();
+}
+
+void Flusher::dispatchVBuckets() {
+    // Somebody waits on the high priority vbuckets, still they leave a
+    // lane to the others.
+    size_t hpLanes = lpVbs.empty() ? parallelism : parallelism - 1;
+    size_t dispatched = dispatchFrom(hpVbs, hpLanes, true);
+    dispatched += dispatchFrom(lpVbs, parallelism, false);
+    awaitingFlushes = dispatched == 0 && !inFlight.empty();
+}
+
+size_t Flusher::dispatchFrom(std::queue<uint16_t> &vbs, size_t lanes,
+                             bool highPriority) {
+    size_t dispatched = 0;
+    // One task per vbucket at a time keeps its writes in order; a vbucket
+    // still in flight waits at the back of the queue.
+    for (size_t n = vbs.size(); n > 0 && inFlight.size() < parallelism; --n) {
+        if (highPriority && numHpInFlight >= lanes) {
+            break;
+        }
+        uint16_t vbid = vbs.front();
+        vbs.pop();
+        if (!inFlight.insert(vbid).second) {
+            vbs.push(vbid);
+            continue;
+        }
+        if (highPriority) {
+            ++numHpInFlight;
+        } else if (doHighPriority && --numHighPriority == 0) {
+            doHighPriority = false;
+        }
+        ExTask task = new VBucketFlushTask(ObjectRegistry::getCurrentEngine(),
+                                           this, vbid, highPriority);
+        ExecutorPool::get()->schedule(task, WRITER_TASK_IDX);
+        ++dispatched;
+    }
+    return dispatched;
+}
+
+void Flusher::collectFlushed() {
+    std::vector<FlushedVBucket> flushed;
+    {
+        LockHolder lh(flushedLock);
+        flushed.swap(flushedVbs);
+    }
+
+    bool hpDone = false;
+    bool lpDone = false;
+    for (auto &f : flushed) {
+        inFlight.erase(f.vbid);
+        if (f.highPriority) {
+            --numHpInFlight;
+            hpDone = true;
+        } else {
+            lpDone = true;
+        }
+        if (f.result == RETRY_FLUSH_VBUCKET) {
+            (f.highPriority ? hpVbs : lpVbs).push(f.vbid);
+        } else if (f.result == DEFER_FLUSH_VBUCKET) {
+            deferredVbs.insert(f.vbid);
+        }
+    }
+
+    // As the serial flusher does, once all of a kind are flushed.
+    if ((hpDone && hpVbs.empty() && numHpInFlight == 0) ||
+        (lpDone && lpVbs.empty() && inFlight.size() == numHpInFlight)) {
+        syncFlushed();
+    }
 }
@@ -23,7 +23,9 @@
 #include <list>
 #include <map>
 #include <queue>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "ep.h"
 #include "executorthread.h"
@@ -31,6 +33,7 @@
 
 #define NO_VBUCKETS_INSTANTIATED 0xFFFF
 #define RETRY_FLUSH_VBUCKET (-1)
+#define DEFER_FLUSH_VBUCKET (-2)
 
 enum flusher_state {
     initializing,
@@ -51,13 +54,17 @@ class KVShard;
 class Flusher {
 public:
 
-    Flusher(EventuallyPersistentStore *st, KVShard *k, uint16_t commitInt) :
+    Flusher(EventuallyPersistentStore *st, KVShard *k, uint16_t commitInt,
+            size_t par = 1) :
         store(st), _state(initializing), taskId(0), minSleepTime(0.1),
         initCommitInterval(commitInt), currCommitInterval(commitInt),
         forceShutdownReceived(false), doHighPriority(false), numHighPriority(0),
-        pendingMutation(false), shard(k) { }
+        pendingMutation(false), parallelism(par), numHpInFlight(0),
+        awaitingFlushes(false), shard(k) { }
 
     ~Flusher() {
+        // Lets the last VBucketFlushTask finish waking us
+        LockHolder lh(flushedLock);
         if (_state != stopped) {
             LOG(EXTENSION_LOG_WARNING, "Flusher being destroyed in state %s",
                 stateName(_state));
@@ -98,10 +105,35 @@ public:
         currCommitInterval = initCommitInterval;
     }
 
+    //! True if vbuckets are flushed by tasks of their own (flusher_parallelism)
+    bool isParallel() const {
+        return parallelism > 1;
+    }
+
+    /**
+     * Flush a vbucket the flusher dispatched to a VBucketFlushTask, then
+     * hand it back to the flusher.
+     */
+    void flushVBucket(uint16_t vbid, bool highPriority);
+
 private:
     bool transition_state(enum flusher_state to);
     void flushVB();
     void completeFlush();
+    /**
+     * Commit what is pending and sync the vbuckets flushed so far as one
+     * group (flusher_group_sync).
+     */
+    void syncFlushed();
+    /**
+     * Start a VBucketFlushTask for each queued vbucket not in flight yet,
+     * as long as lanes are free.
+     */
+    void dispatchVBuckets();
+    size_t dispatchFrom(std::queue<uint16_t> &vbs, size_t lanes,
+                        bool highPriority);
+    //! Take back the vbuckets the VBucketFlushTasks are done with
+    void collectFlushed();
     void initialize();
     void schedule_UNLOCKED();
     double getMinSleepTime();
@@ -109,9 +141,22 @@ private:
     const char * stateName(enum flusher_state st) const;
 
     bool canSnooze(void) {
-        return lpVbs.empty() && hpVbs.empty() && !pendingMutation.load();
+        return lpVbs.empty() && hpVbs.empty() && !pendingMutation.load() &&
+            inFlight.empty() && deferredVbs.empty();
     }
 
+    //! Nothing to flush but vbuckets held back for write coalescing
+    bool onlyDeferred(void) {
+        return lpVbs.empty() && hpVbs.empty() && !pendingMutation.load() &&
+            !deferredVbs.empty();
+    }
+
+    /**
+     * Queue the vbuckets held back for write coalescing again, once the
+     * low priority queue is empty.
+     */
+    void requeueDeferred();
+
     EventuallyPersistentStore   *store;
     AtomicValue<enum flusher_state> _state;
 
@@ -127,10 +172,32 @@ private:
     AtomicValue<bool> forceShutdownReceived;
     std::queue<uint16_t> hpVbs;
     std::queue<uint16_t> lpVbs;
+    //! Vbuckets whose writes are held back for coalescing, see flushVBucket()
+    std::set<uint16_t> deferredVbs;
     bool doHighPriority;
     size_t numHighPriority;
     AtomicValue<bool> pendingMutation;
 
+    /* A vbucket a VBucketFlushTask is done with */
+    struct FlushedVBucket {
+        FlushedVBucket(uint16_t vb, bool hp, int rv)
+            : vbid(vb), highPriority(hp), result(rv) { }
+
+        uint16_t vbid;
+        bool highPriority;
+        //! What EventuallyPersistentStore::flushVBucket() returned
+        int result;
+    };
+    //! Max number of VBucketFlushTasks running at once
+    size_t parallelism;
+    //! Vbuckets a VBucketFlushTask runs for, at most one each
+    std::set<uint16_t> inFlight;
+    size_t numHpInFlight;
+    //! Nothing to dispatch until a VBucketFlushTask is done
+    bool awaitingFlushes;
+    Mutex flushedLock;
+    std::vector<FlushedVBucket> flushedVbs;
+
     KVShard *shard;
 
     DISALLOW_COPY_AND_ASSIGN(Flusher);
@@ -304,6 +304,7 @@ ENGINE_ERROR_CODE ForestKVStore::readVBState(uint16_t vbId) {
     uint64_t lastSnapEnd = 0;
     uint64_t maxCas = 0;
     int64_t driftCounter = INITIAL_DRIFT;
+    uint64_t resetGeneration = 0;
 
     fdb_kvs_info kvsInfo;
     fdb_kvs_handle *kvsHandle = getKvsHandle(vbId, handleType::READER);
@@ -365,6 +366,9 @@ ENGINE_ERROR_CODE ForestKVStore::readVBState(uint16_t vbId) {
         const std::string driftCount = getJSONObjString(
                                  cJSON_GetObjectItem(jsonObj, "drift_counter"));
 
+        const std::string resetGen = getJSONObjString(
+                                 cJSON_GetObjectItem(jsonObj, "reset_generation"));
+
         cJSON *failover_json = cJSON_GetObjectItem(jsonObj, "failover_table");
         if (vb_state.compare("") == 0 || checkpoint_id.compare("") == 0
                || max_deleted_seqno.compare("") == 0) {
@@ -395,6 +399,10 @@ ENGINE_ERROR_CODE ForestKVStore::readVBState(uint16_t vbId) {
                 parseInt64(driftCount.c_str(), &driftCounter);
             }
 
+            if (resetGen.compare("")) {
+                parseUint64(resetGen.c_str(), &resetGeneration);
+            }
+
             if (failover_json) {
                 char* json = cJSON_PrintUnformatted(failover_json);
                 failovers.assign(json);
@@ -414,7 +422,7 @@ ENGINE_ERROR_CODE ForestKVStore::readVBState(uint16_t vbId) {
                                              maxDeletedSeqno, highSeqno, 0,
                                              lastSnapStart, lastSnapEnd,
                                              maxCas, driftCounter,
-                                             failovers);
+                                             failovers, resetGeneration);
     fdb_doc_free(statDoc);
     return forestErr2EngineErr(status);
 }
@@ -458,14 +466,17 @@ void ForestKVStore::delVBucket(uint16_t vbucket) {
             fdb_error_msg(status));
     }
 
+    // Seqnos of a new vbucket start over too
+    uint64_t resetGeneration = 0;
     if (cachedVBStates[vbucket]) {
+        resetGeneration = cachedVBStates[vbucket]->resetGeneration + 1;
         delete cachedVBStates[vbucket];
     }
 
     std::string failovers("[{\"id\":0, \"seq\":0}]");
     cachedVBStates[vbucket] = new vbucket_state(vbucket_state_dead, 0, 0, 0, 0,
                                                 0, 0, 0, INITIAL_DRIFT,
-                                                failovers);
+                                                failovers, resetGeneration);
 
     vbucket_state *state = cachedVBStates[vbucket];
     std::string stateStr = state->toJSON();
@@ -835,7 +846,8 @@ static void populateMetaData(const Item &itm, uint8_t *meta, bool deletion) {
     memcpy(meta + 30, &confresmode, CONFLICT_RES_META_LEN);
 }
 
-void ForestKVStore::set(const Item &itm, Callback<mutation_result> &cb) {
+void ForestKVStore::set(const Item &itm, Callback<mutation_result> &cb,
+                        DocPresence) {
     if (isReadOnly()) {
         throw std::logic_error("ForestKVStore::set: Not valid on a read-only "
                         "object.");
@@ -979,7 +991,7 @@ void ForestKVStore::getMulti(uint16_t vb, vb_bgfetch_queue_t &itms) {
     }
 }
 
-void ForestKVStore::del(const Item &itm, Callback<int> &cb) {
+void ForestKVStore::del(const Item &itm, Callback<int> &cb, DocPresence) {
     if (isReadOnly()) {
         throw std::logic_error("ForestKVStore::del: Not valid on a read-only "
                         "object.");
@@ -142,8 +142,10 @@ class ForestKVStore : public KVStore
      *
      * @param itm instance representing the document to be inserted or updated
      * @param cb callback instance for SET
+     * @param presence whether the document is known to be stored already
      */
-    void set(const Item &itm, Callback<mutation_result> &cb);
+    void set(const Item &itm, Callback<mutation_result> &cb,
+             DocPresence presence = DocPresence::UNKNOWN);
 
     /**
      * Retrieve the document with a given key from the underlying storage system.
@@ -174,8 +176,10 @@ class ForestKVStore : public KVStore
      *
      * @param itm instance representing the document to be deleted
      * @param cb callback instance for DELETE
+     * @param presence whether the document is known to be stored already
      */
-    void del(const Item &itm, Callback<int> &cb);
+    void del(const Item &itm, Callback<int> &cb,
+             DocPresence presence = DocPresence::UNKNOWN);
 
     /**
      * Delete a given vbucket database instance from the
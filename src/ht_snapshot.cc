@@ -0,0 +1,350 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "crc32.h"
+#include "ep.h"
+#include "ep_engine.h"
+#include "ht_snapshot.h"
+
+static const size_t BLOCK_SIZE = 1024 * 1024;
+
+/**
+ * Appends the items of a hash table to the blocks of a snapshot file.
+ */
+class SnapshotVisitor : public HashTableVisitor {
+public:
+    SnapshotVisitor(FILE *f) : fp(f), maxSeqno(0), numItems(0), numBlocks(0),
+                               error(false) {
+        block.reserve(BLOCK_SIZE);
+    }
+
+    void visit(StoredValue *v) {
+        if (v->isTempItem()) {
+            return;
+        }
+        maxSeqno = std::max(maxSeqno, static_cast<uint64_t>(v->getBySeqno()));
+        if (v->isDeleted()) {
+            return;
+        }
+
+        HashTableSnapshot::Record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.cas = v->getCas();
+        rec.revSeqno = v->getRevSeqno();
+        rec.bySeqno = v->getBySeqno();
+        rec.exptime = v->getExptime();
+        rec.flags = v->getFlags();
+        rec.keyLen = v->getKeyLen();
+        rec.nru = v->getNRUValue();
+        rec.conflictResMode = v->getConflictResMode();
+
+        StoredValue::ValueView value = v->getValueView();
+        if (v->isResident() && value.data) {
+            rec.resident = 1;
+            rec.extLen = value.extLen;
+            rec.valueLen = value.len;
+        }
+
+        append(&rec, sizeof(rec));
+        append(v->getKeyBytes(), rec.keyLen);
+        if (rec.resident) {
+            append(value.extMeta, rec.extLen);
+            append(value.data, rec.valueLen);
+        }
+        ++numItems;
+
+        if (block.size() >= BLOCK_SIZE) {
+            flush();
+        }
+    }
+
+    bool shouldContinue() {
+        return !error;
+    }
+
+    //! Write out the block being filled, true unless a write failed
+    bool flush() {
+        if (!error && !block.empty()) {
+            HashTableSnapshot::BlockHeader bh;
+            bh.size = block.size();
+            bh.crc = crc32buf(block.data(), block.size());
+            if (fwrite(&bh, sizeof(bh), 1, fp) != 1 ||
+                fwrite(block.data(), block.size(), 1, fp) != 1) {
+                error = true;
+            }
+            ++numBlocks;
+            block.clear();
+        }
+        return !error;
+    }
+
+    uint64_t maxSeqno;
+    uint64_t numItems;
+    uint64_t numBlocks;
+
+private:
+    void append(const void *p, size_t len) {
+        const uint8_t *b = static_cast<const uint8_t*>(p);
+        block.insert(block.end(), b, b + len);
+    }
+
+    FILE *fp;
+    std::vector<uint8_t> block;
+    bool error;
+};
+
+static uint32_t headerCrc(const HashTableSnapshot::Header &hdr) {
+    uint8_t *p = reinterpret_cast<uint8_t*>(
+                                const_cast<HashTableSnapshot::Header*>(&hdr));
+    return crc32buf(p, offsetof(HashTableSnapshot::Header, crc));
+}
+
+std::string HashTableSnapshot::getFileName(const std::string &dir,
+                                           uint16_t vbid) {
+    std::stringstream ss;
+    ss << dir << "/" << vbid << ".ht_snapshot";
+    return ss.str();
+}
+
+ssize_t HashTableSnapshot::write(const std::string &dir, VBucket &vb,
+                                 uint64_t resetGeneration) {
+    std::string name = getFileName(dir, vb.getId());
+    std::string next = name + ".next";
+
+    FILE *fp = fopen(next.c_str(), "wb");
+    if (fp == NULL) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to open hash table snapshot "
+            "'%s': %s", next.c_str(), strerror(errno));
+        return -1;
+    }
+
+    Header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MAGIC;
+    hdr.vbid = vb.getId();
+    hdr.vbUuid = vb.failovers->getLatestUUID();
+    hdr.resetGeneration = resetGeneration;
+    // Any item changed from here on has a higher seqno.
+    hdr.startSeqno = vb.getHighSeqno();
+
+    SnapshotVisitor visitor(fp);
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    if (ok) {
+        vb.ht.visit(visitor);
+        ok = visitor.flush();
+    }
+    if (ok) {
+        hdr.maxSeqno = std::max(visitor.maxSeqno, hdr.startSeqno);
+        hdr.numItems = visitor.numItems;
+        hdr.numBlocks = visitor.numBlocks;
+        hdr.crc = headerCrc(hdr);
+        ok = fseek(fp, 0, SEEK_SET) == 0 &&
+             fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+             fflush(fp) == 0;
+    }
+#ifndef WIN32
+    if (ok) {
+        ok = fsync(fileno(fp)) == 0;
+    }
+#endif
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+#ifdef WIN32
+    if (ok) {
+        ::remove(name.c_str());
+    }
+#endif
+    if (ok && rename(next.c_str(), name.c_str()) != 0) {
+        ok = false;
+    }
+
+    if (!ok) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to write hash table snapshot "
+            "'%s': %s", next.c_str(), strerror(errno));
+        ::remove(next.c_str());
+        return -1;
+    }
+    return hdr.numItems;
+}
+
+void HashTableSnapshot::remove(const std::string &dir, uint16_t vbid) {
+    ::remove(getFileName(dir, vbid).c_str());
+}
+
+HashTableSnapshot::HashTableSnapshot(const std::string &dir, uint16_t vbid)
+    : fileName(getFileName(dir, vbid)), data(NULL), size(0), valid(false) {
+    struct stat st;
+    if (stat(fileName.c_str(), &st) != 0 ||
+        st.st_size < static_cast<off_t>(sizeof(Header))) {
+        return;
+    }
+    size = st.st_size;
+
+#ifdef WIN32
+    FILE *fp = fopen(fileName.c_str(), "rb");
+    if (fp == NULL) {
+        return;
+    }
+    uint8_t *buf = static_cast<uint8_t*>(malloc(size));
+    if (buf != NULL && fread(buf, size, 1, fp) != 1) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    data = buf;
+#else
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        LOG(EXTENSION_LOG_WARNING, "Failed to map hash table snapshot "
+            "'%s': %s", fileName.c_str(), strerror(errno));
+        return;
+    }
+    // The records are read once, front to back.
+    madvise(p, size, MADV_SEQUENTIAL);
+    data = static_cast<const uint8_t*>(p);
+#endif
+
+    if (data != NULL) {
+        valid = verify();
+        if (!valid) {
+            LOG(EXTENSION_LOG_WARNING, "Ignoring corrupt hash table snapshot "
+                "'%s'", fileName.c_str());
+        }
+    }
+}
+
+HashTableSnapshot::~HashTableSnapshot() {
+    if (data != NULL) {
+#ifdef WIN32
+        free(const_cast<uint8_t*>(data));
+#else
+        munmap(const_cast<uint8_t*>(data), size);
+#endif
+    }
+}
+
+bool HashTableSnapshot::verify() {
+    const Header &hdr = getHeader();
+    if (hdr.magic != MAGIC || hdr.crc != headerCrc(hdr)) {
+        return false;
+    }
+
+    size_t offset = sizeof(Header);
+    uint64_t numBlocks = 0;
+    while (offset < size) {
+        BlockHeader bh;
+        if (size - offset < sizeof(bh)) {
+            return false;
+        }
+        memcpy(&bh, data + offset, sizeof(bh));
+        offset += sizeof(bh);
+        if (size - offset < bh.size ||
+            crc32buf(const_cast<uint8_t*>(data + offset), bh.size) != bh.crc) {
+            return false;
+        }
+        offset += bh.size;
+        ++numBlocks;
+    }
+    return numBlocks == hdr.numBlocks;
+}
+
+bool HashTableSnapshot::load(VBucket &vb, item_eviction_policy_t policy,
+                             bool expiryIndex) {
+    size_t offset = sizeof(Header);
+    while (offset < size) {
+        BlockHeader bh;
+        memcpy(&bh, data + offset, sizeof(bh));
+        offset += sizeof(bh);
+
+        const uint8_t *p = data + offset;
+        const uint8_t *end = p + bh.size;
+        offset += bh.size;
+        while (p < end) {
+            Record rec;
+            if (static_cast<size_t>(end - p) < sizeof(rec)) {
+                return false;
+            }
+            memcpy(&rec, p, sizeof(rec));
+            p += sizeof(rec);
+            if (static_cast<size_t>(end - p) <
+                size_t(rec.keyLen) + rec.extLen + rec.valueLen) {
+                return false;
+            }
+            const char *key = reinterpret_cast<const char*>(p);
+            p += rec.keyLen;
+            uint8_t extMeta[256];
+            memcpy(extMeta, p, rec.extLen);
+            p += rec.extLen;
+            const char *value = reinterpret_cast<const char*>(p);
+            p += rec.valueLen;
+
+            Item itm(key, rec.keyLen, rec.flags, rec.exptime,
+                     rec.resident ? value : NULL, rec.valueLen,
+                     rec.extLen ? extMeta : NULL, rec.extLen, rec.cas,
+                     rec.bySeqno, vb.getId(), rec.revSeqno, rec.nru,
+                     rec.conflictResMode);
+            switch (vb.ht.insert(itm, policy, false, !rec.resident)) {
+            case NOMEM:
+                return false;
+            case NOT_FOUND:
+                if (rec.exptime != 0 && expiryIndex) {
+                    vb.expiryIndex.add(itm.getKey(), rec.exptime);
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+HashTableSnapshotTask::HashTableSnapshotTask(EventuallyPersistentStore &st,
+                                             double sleeptime)
+    : GlobalTask(&st.getEPEngine(), TaskId::HashTableSnapshotTask, sleeptime,
+                 false),
+      store(st),
+      sleepTime(sleeptime) { }
+
+bool HashTableSnapshotTask::run() {
+    store.snapshotHashTables();
+    ExecutorPool::get()->snooze(uid, sleepTime);
+    return true;
+}
@@ -0,0 +1,164 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_HT_SNAPSHOT_H_
+#define SRC_HT_SNAPSHOT_H_ 1
+
+#include "config.h"
+
+#include <string>
+
+#include "tasks.h"
+#include "vbucket.h"
+
+class EventuallyPersistentStore;
+
+/**
+ * A flat image of the hash table of a vbucket, which lets a restart
+ * rebuild the hash table without reading every document back from
+ * couchstore.
+ *
+ * The file is a header followed by blocks of records, each block with a
+ * CRC of its own. A record is the fixed size metadata of an item followed
+ * by its key, extended meta data and value (if resident). Fields are in
+ * host byte order, the file is only read back on the box it was written.
+ *
+ * Items keep changing while the hash table is visited, so the snapshot is
+ * stamped with the high seqno of the vbucket when the visit started and
+ * the highest seqno it saw. A restore is only correct once the latter is
+ * persisted, and has to replay the couchstore changes after the former.
+ */
+class HashTableSnapshot {
+public:
+    //! "HTS2"
+    static const uint32_t MAGIC = 0x48545332;
+
+    struct Header {
+        uint32_t magic;
+        uint16_t vbid;
+        uint16_t reserved;
+        uint64_t vbUuid;
+        //! Reset generation of the vbucket state on disk
+        uint64_t resetGeneration;
+        //! High seqno of the vbucket when the visit started
+        uint64_t startSeqno;
+        //! Highest seqno of the items visited, deleted ones included
+        uint64_t maxSeqno;
+        uint64_t numItems;
+        uint64_t numBlocks;
+        //! CRC of the fields above
+        uint32_t crc;
+        uint32_t reserved2;
+    };
+
+    struct Record {
+        uint64_t cas;
+        uint64_t revSeqno;
+        int64_t bySeqno;
+        uint32_t exptime;
+        uint32_t flags;
+        uint32_t valueLen;
+        uint8_t keyLen;
+        uint8_t extLen;
+        uint8_t nru;
+        uint8_t conflictResMode;
+        uint8_t resident;
+        uint8_t reserved[7];
+    };
+
+    //! Size and CRC of the records following
+    struct BlockHeader {
+        uint32_t size;
+        uint32_t crc;
+    };
+
+    /**
+     * Write the snapshot of a vbucket to its file in dir, replacing the
+     * previous one once complete.
+     *
+     * @param dir the data directory
+     * @param vb the vbucket
+     * @param resetGeneration reset generation of its state on disk; a
+     *        flush_all resets the data files, but keeps the failover log
+     * @return the number of items written, or -1 on failure
+     */
+    static ssize_t write(const std::string &dir, VBucket &vb,
+                         uint64_t resetGeneration);
+
+    //! Remove the snapshot of a vbucket, if any
+    static void remove(const std::string &dir, uint16_t vbid);
+
+    static std::string getFileName(const std::string &dir, uint16_t vbid);
+
+    /**
+     * Map the snapshot of a vbucket. It is usable only if the file exists
+     * and all of its checksums match.
+     */
+    HashTableSnapshot(const std::string &dir, uint16_t vbid);
+
+    ~HashTableSnapshot();
+
+    bool isValid() const {
+        return valid;
+    }
+
+    const Header &getHeader() const {
+        return *reinterpret_cast<const Header*>(data);
+    }
+
+    /**
+     * Insert the items of the snapshot into the hash table of a vbucket.
+     *
+     * @param vb the vbucket to restore
+     * @param policy the item eviction policy of the bucket
+     * @param expiryIndex true if items with a TTL go in the expiry index
+     * @return false if the hash table ran out of memory, or a record
+     *         did not fit its block
+     */
+    bool load(VBucket &vb, item_eviction_policy_t policy, bool expiryIndex);
+
+private:
+    bool verify();
+
+    std::string fileName;
+    const uint8_t *data;
+    size_t size;
+    bool valid;
+
+    DISALLOW_COPY_AND_ASSIGN(HashTableSnapshot);
+};
+
+/**
+ * Writes the hash table snapshots of all vbuckets every
+ * ht_snapshot_interval seconds.
+ */
+class HashTableSnapshotTask : public GlobalTask {
+public:
+    HashTableSnapshotTask(EventuallyPersistentStore &st, double sleeptime);
+
+    bool run();
+
+    std::string getDescription() {
+        return "Writing hash table snapshots";
+    }
+
+private:
+    EventuallyPersistentStore &store;
+    double sleepTime;
+};
+
+#endif  // SRC_HT_SNAPSHOT_H_
@@ -23,6 +23,12 @@
 AtomicValue<uint64_t> Item::casCounter(1);
 const uint32_t Item::metaDataSize(2*sizeof(uint32_t) + 2*sizeof(uint64_t) + 2);
 
+void *Blob::allocate(size_t len) {
+    SlabArena *arena = ObjectRegistry::getBlobArena();
+    void *p = arena ? arena->allocate(len) : NULL;
+    return p ? p : ::operator new(len);
+}
+
 /**
  * Append another item to this item
  *
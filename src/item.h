@@ -33,6 +33,8 @@
 #include "locks.h"
 #include "mutex.h"
 #include "objectregistry.h"
+#include "read_epoch.h"
+#include "slab_arena.h"
 #include "stats.h"
 
 enum queue_operation {
@@ -72,7 +74,7 @@ public:
     static Blob* New(const char *start, const size_t len, uint8_t *ext_meta,
                      uint8_t ext_len) {
         size_t total_len = len + sizeof(Blob) + FLEX_DATA_OFFSET + ext_len;
-        Blob *t = new (::operator new(total_len)) Blob(start, len, ext_meta,
+        Blob *t = new (allocate(total_len)) Blob(start, len, ext_meta,
                                                        ext_len);
         return t;
     }
@@ -89,7 +91,7 @@ public:
      */
     static Blob* New(const size_t len, uint8_t *ext_meta, uint8_t ext_len) {
         size_t total_len = len + sizeof(Blob) + FLEX_DATA_OFFSET + ext_len;
-        Blob *t = new (::operator new(total_len)) Blob(NULL, len, ext_meta,
+        Blob *t = new (allocate(total_len)) Blob(NULL, len, ext_meta,
                                                        ext_len);
         return t;
     }
@@ -105,7 +107,7 @@ public:
      */
     static Blob* New(const size_t len, uint8_t ext_len) {
         size_t total_len = len + sizeof(Blob) + FLEX_DATA_OFFSET + ext_len;
-        Blob *t = new (::operator new(total_len)) Blob(len, ext_len);
+        Blob *t = new (allocate(total_len)) Blob(len, ext_len);
         return t;
     }
 
@@ -113,7 +115,7 @@ public:
      * Creates an exact copy of the specified Blob.
      */
     static Blob* Copy(const Blob& other) {
-        Blob *t = new (::operator new(other.getSize())) Blob(other);
+        Blob *t = new (allocate(other.getSize())) Blob(other);
         return t;
     }
 
@@ -214,7 +216,11 @@ public:
     // This is necessary for making C++ happy when I'm doing a
     // placement new on fairly "normal" c++ heap allocations, just
     // with variable-sized objects.
-    void operator delete(void* p) { ::operator delete(p); }
+    // Optimistic hash table readers may still be looking at the blob, so
+    // the memory goes through ReadEpoch (a plain free unless enabled).
+    void operator delete(void* p) {
+        ReadEpoch::retire(p, SlabArena::deallocate);
+    }
 
     ~Blob() {
         ObjectRegistry::onDeleteBlob(this);
@@ -222,6 +228,12 @@ public:
 
 private:
 
+    /**
+     * Get memory for a Blob of the given total size, from the current
+     * engine's slab arena when it has one.
+     */
+    static void *allocate(size_t len);
+
     /* Constructor.
      * @param start If non-NULL, pointer to array which will be copied into
      *              the newly-created Blob.
@@ -362,3 +362,31 @@ void ExpiredItemPager::updateExpPagerTime(double sleepSecs) {
     _waketime.tv_sec += sleepSecs;
     stats.expPagerTime.store(_waketime.tv_sec);
 }
+
+const size_t ExpiryIndexPager::batchSize = 1000;
+
+ExpiryIndexPager::ExpiryIndexPager(EventuallyPersistentEngine *e,
+                                   EPStats &st, size_t stime) :
+    GlobalTask(e, TaskId::ExpiryIndexPager,
+               static_cast<double>(stime), false),
+    engine(e),
+    stats(st),
+    sleepTime(static_cast<double>(stime)) {
+}
+
+bool ExpiryIndexPager::run(void) {
+    EventuallyPersistentStore *store = engine->getEpStore();
+    time_t startTime = ep_real_time();
+    bool more = false;
+
+    std::vector<VBucketMap::id_type> vbs = store->getVBuckets().getBuckets();
+    for (auto vbid : vbs) {
+        if (store->deleteExpiredItemsFromIndex(vbid, startTime, batchSize)) {
+            more = true;
+        }
+    }
+
+    // Yield between batches, but come straight back if anything is left
+    snooze(more ? 0 : sleepTime);
+    return true;
+}
@@ -118,4 +118,37 @@ private:
     std::shared_ptr<AtomicValue<bool>>   available;
 };
 
+/**
+ * Dispatcher job expiring the items found due in the vbuckets' expiry
+ * indexes, without visiting the rest of the HashTable. Runs along with
+ * the ExpiredItemPager; replicas keep their entries until promoted.
+ */
+class ExpiryIndexPager : public GlobalTask {
+public:
+
+    /**
+     * Construct an ExpiryIndexPager.
+     *
+     * @param e the engine (whose store we'll expire items in)
+     * @param st the stats
+     * @param stime number of seconds to wait between runs
+     */
+    ExpiryIndexPager(EventuallyPersistentEngine *e, EPStats &st,
+                     size_t stime);
+
+    bool run(void);
+
+    std::string getDescription() {
+        return std::string("Expiring due items from the expiry index.");
+    }
+
+private:
+    //! Max number of index entries processed per vbucket per run
+    static const size_t batchSize;
+
+    EventuallyPersistentEngine     *engine;
+    EPStats                        &stats;
+    double                          sleepTime;
+};
+
 #endif  // SRC_ITEM_PAGER_H_
@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <functional>
 
 #include "bgfetcher.h"
@@ -38,18 +39,25 @@ KVShard::KVShard(uint16_t id, EventuallyPersistentStore &store) :
 
     std::string backend = kvConfig.getBackend();
     uint16_t commitInterval = 1;
+    size_t flusherParallelism = 1;
 
     if (backend.compare("couchdb") == 0) {
         rwUnderlying = KVStoreFactory::create(kvConfig, false);
         roUnderlying = KVStoreFactory::create(kvConfig, true);
+        // Its transactions are per vbucket, those of different vbuckets
+        // can be written at once.
+        flusherParallelism = std::max(config.getFlusherParallelism(),
+                                      static_cast<size_t>(1));
     } else if (backend.compare("forestdb") == 0) {
         rwUnderlying = KVStoreFactory::create(kvConfig);
         roUnderlying = rwUnderlying;
         commitInterval = config.getMaxVbuckets()/config.getMaxNumShards();
     }
 
-    flusher = new Flusher(&store, this, commitInterval);
-    bgFetcher = new BgFetcher(&store, this, stats);
+    flusher = new Flusher(&store, this, commitInterval, flusherParallelism);
+    bgFetcher = new BgFetcher(&store, this, stats,
+                              std::max(config.getBgFetchParallelism(),
+                                       static_cast<size_t>(1)));
 }
 
 KVShard::~KVShard() {
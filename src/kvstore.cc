@@ -17,8 +17,10 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <map>
 #include <string>
+#include <vector>
 #include <fcntl.h>
 
 #include "common.h"
@@ -34,15 +36,20 @@ using namespace CouchbaseDirectoryUtilities;
 
 KVStoreConfig::KVStoreConfig(Configuration& config, uint16_t shardid)
     : maxVBuckets(config.getMaxVbuckets()), maxShards(config.getMaxNumShards()),
-      dbname(config.getDbname()), backend(config.getBackend()), shardId(shardid) {
+      dbname(config.getDbname()), backend(config.getBackend()), shardId(shardid),
+      groupSync(config.isFlusherGroupSync()),
+      dbHandleCacheSize(config.getDbHandleCacheSize()) {
 
 }
 KVStoreConfig::KVStoreConfig(uint16_t _maxVBuckets, uint16_t _maxShards,
                              const std::string& _dbname,
                              const std::string& _backend,
-                             uint16_t _shardId)
+                             uint16_t _shardId,
+                             bool _groupSync,
+                             size_t _dbHandleCacheSize)
     : maxVBuckets(_maxVBuckets), maxShards(_maxShards), dbname(_dbname),
-      backend(_backend), shardId(_shardId) {
+      backend(_backend), shardId(_shardId), groupSync(_groupSync),
+      dbHandleCacheSize(_dbHandleCacheSize) {
 
 }
 
@@ -60,6 +67,107 @@ KVStore *KVStoreFactory::create(KVStoreConfig &config, bool read_only) {
     return ret;
 }
 
+// Below this many items a plain sort is as quick.
+static const size_t RADIX_SORT_MIN_ITEMS = 256;
+
+namespace {
+/* The 8 bytes of a key past the prefix all keys of the batch share, most
+ * significant first and zero padded, and where the item is in the batch.
+ * Ordering by word orders by key, but for keys with the same word.
+ */
+struct KeyWord {
+    uint64_t word;
+    size_t index;
+};
+}
+
+static uint64_t keyWord(const std::string &key, size_t offset) {
+    uint64_t word = 0;
+    for (size_t i = offset; i < offset + 8; ++i) {
+        word <<= 8;
+        if (i < key.size()) {
+            word |= static_cast<unsigned char>(key[i]);
+        }
+    }
+    return word;
+}
+
+void KVStore::optimizeWrites(std::vector<queued_item> &items) {
+    if (isReadOnly()) {
+        throw std::logic_error("KVStore::optimizeWrites: Not valid on a "
+                "read-only object");
+    }
+    if (items.empty()) {
+        return;
+    }
+
+    CompareQueuedItemsBySeqnoAndKey cq;
+    const size_t n = items.size();
+    if (n < RADIX_SORT_MIN_ITEMS) {
+        std::sort(items.begin(), items.end(), cq);
+        return;
+    }
+
+    // Keys often share a prefix, which tells nothing apart.
+    const std::string &first = items[0]->getKey();
+    size_t common = first.size();
+    for (size_t i = 1; i < n && common > 0; ++i) {
+        const std::string &key = items[i]->getKey();
+        size_t len = std::min(common, key.size());
+        size_t j = 0;
+        while (j < len && key[j] == first[j]) {
+            ++j;
+        }
+        common = j;
+    }
+
+    std::vector<KeyWord> words(n);
+    for (size_t i = 0; i < n; ++i) {
+        words[i].word = keyWord(items[i]->getKey(), common);
+        words[i].index = i;
+    }
+
+    // LSD radix sort a byte at a time, skipping bytes all words share.
+    std::vector<KeyWord> sorted(n);
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < n; ++i) {
+            ++offsets[(words[i].word >> shift) & 0xff];
+        }
+        if (offsets[(words[0].word >> shift) & 0xff] == n) {
+            continue;
+        }
+        size_t total = 0;
+        for (size_t b = 0; b < 256; ++b) {
+            size_t count = offsets[b];
+            offsets[b] = total;
+            total += count;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            sorted[offsets[(words[i].word >> shift) & 0xff]++] = words[i];
+        }
+        words.swap(sorted);
+    }
+
+    std::vector<queued_item> ordered;
+    ordered.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        ordered.push_back(std::move(items[words[i].index]));
+    }
+    items.swap(ordered);
+
+    // Items with the same word, a key and its older revisions mostly.
+    size_t start = 0;
+    for (size_t i = 1; i <= n; ++i) {
+        if (i == n || words[i].word != words[start].word) {
+            if (i - start > 1) {
+                std::sort(items.begin() + start, items.begin() + i, cq);
+            }
+            start = i;
+        }
+    }
+}
+
 void KVStore::createDataDir(const std::string& dbname) {
     if (!mkdirp(dbname.c_str())) {
         if (errno != EEXIST) {
@@ -183,6 +291,7 @@ std::string vbucket_state::toJSON() const {
               << ",\"snap_end\": \"" << lastSnapEnd << "\""
               << ",\"max_cas\": \"" << maxCas << "\""
               << ",\"drift_counter\": \"" << driftCounter << "\""
+              << ",\"reset_generation\": \"" << resetGeneration << "\""
               << "}";
 
     return jsonState.str();
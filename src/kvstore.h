@@ -135,11 +135,13 @@ struct vbucket_state {
                   uint64_t _maxDelSeqNum, int64_t _highSeqno,
                   uint64_t _purgeSeqno, uint64_t _lastSnapStart,
                   uint64_t _lastSnapEnd, uint64_t _maxCas,
-                  uint64_t _driftCounter, std::string& _failovers) :
+                  uint64_t _driftCounter, const std::string& _failovers,
+                  uint64_t _resetGeneration = 0) :
         state(_state), checkpointId(_chkid), maxDeletedSeqno(_maxDelSeqNum),
         highSeqno(_highSeqno), purgeSeqno(_purgeSeqno),
         lastSnapStart(_lastSnapStart), lastSnapEnd(_lastSnapEnd),
-        maxCas(_maxCas), driftCounter(_driftCounter),failovers(_failovers) { }
+        maxCas(_maxCas), driftCounter(_driftCounter),failovers(_failovers),
+        resetGeneration(_resetGeneration) { }
 
     vbucket_state(const vbucket_state& vbstate) {
         state = vbstate.state;
@@ -152,6 +154,7 @@ struct vbucket_state {
         lastSnapEnd = vbstate.lastSnapEnd;
         maxCas = vbstate.maxCas;
         driftCounter = vbstate.driftCounter;
+        resetGeneration = vbstate.resetGeneration;
     }
 
     std::string toJSON() const;
@@ -179,6 +182,7 @@ struct vbucket_state {
         maxCas = 0;
         driftCounter = INITIAL_DRIFT;
         failovers.assign("[{\"id\":0, \"seq\":0}]");
+        ++resetGeneration;
     }
 
     vbucket_state_t state;
@@ -191,6 +195,8 @@ struct vbucket_state {
     uint64_t maxCas;
     int64_t driftCounter;
     std::string failovers;
+    // Bumped by every reset, as seqnos start over from 0 then
+    uint64_t resetGeneration;
 };
 
 struct DBFileInfo {
@@ -220,6 +226,17 @@ enum class ValueFilter {
     VALUES_DECOMPRESSED
 };
 
+/**
+ * What the caller of KVStore::set() or KVStore::del() knows about the key
+ * being in the store already. A store may look the key up only when it is
+ * UNKNOWN.
+ */
+enum class DocPresence {
+    UNKNOWN,
+    ON_DISK,
+    NOT_ON_DISK
+};
+
 class ScanContext {
 public:
     ScanContext(std::shared_ptr<Callback<GetValue> > cb,
@@ -314,7 +331,9 @@ public:
     KVStoreConfig(uint16_t _maxVBuckets, uint16_t _maxShards,
                   const std::string& _dbname,
                   const std::string& _backend,
-                  uint16_t _shardId);
+                  uint16_t _shardId,
+                  bool _groupSync = false,
+                  size_t _dbHandleCacheSize = 0);
 
     uint16_t getMaxVBuckets() {
         return maxVBuckets;
@@ -336,12 +355,24 @@ public:
         return shardId;
     }
 
+    //! True if written files are synced by KVStore::sync() (flusher_group_sync)
+    bool isGroupSync() {
+        return groupSync;
+    }
+
+    //! Max number of database handles a store keeps open between operations
+    size_t getDbHandleCacheSize() {
+        return dbHandleCacheSize;
+    }
+
 private:
     uint16_t maxVBuckets;
     uint16_t maxShards;
     std::string dbname;
     std::string backend;
     uint16_t shardId;
+    bool groupSync;
+    size_t dbHandleCacheSize;
 };
 
 class IORequest {
@@ -453,6 +484,40 @@ public:
      */
     virtual bool commit(Callback<kvstats_ctx> *cb) = 0;
 
+    /**
+     * Begin a transaction of the writes to one vbucket, which is committed
+     * by commitVBucket() independently of the other vbuckets. Stores which
+     * can do so allow the transactions of different vbuckets to run from
+     * different threads (flusher_parallelism).
+     *
+     * @return false if we cannot begin a transaction
+     */
+    virtual bool beginVBucket(uint16_t vbid) {
+        (void)vbid;
+        return begin();
+    }
+
+    /**
+     * Commit the transaction of a vbucket begun by beginVBucket().
+     *
+     * @return false if the commit fails
+     */
+    virtual bool commitVBucket(uint16_t vbid, Callback<kvstats_ctx> *cb) {
+        (void)vbid;
+        return commit(cb);
+    }
+
+    /**
+     * Make everything committed since the last call durable, for stores
+     * which do not sync on commit (KVStoreConfig::isGroupSync()).
+     *
+     * @return false if the sync fails; what is not synced yet is retried
+     *         by the next call
+     */
+    virtual bool sync() {
+        return true;
+    }
+
     /**
      * Rollback the current transaction.
      */
@@ -467,7 +532,8 @@ public:
      * Set an item into the kv store.
      */
     virtual void set(const Item &item,
-                     Callback<mutation_result> &cb) = 0;
+                     Callback<mutation_result> &cb,
+                     DocPresence presence = DocPresence::UNKNOWN) = 0;
 
     /**
      * Get an item from the kv store.
@@ -489,7 +555,8 @@ public:
     /**
      * Delete an item from the kv store.
      */
-    virtual void del(const Item &itm, Callback<int> &cb) = 0;
+    virtual void del(const Item &itm, Callback<int> &cb,
+                     DocPresence presence = DocPresence::UNKNOWN) = 0;
 
     /**
      * Delete a given vbucket database.
@@ -567,19 +634,13 @@ public:
     /**
      * This method is called before persisting a batch of data if you'd like to
      * do stuff to them that might improve performance at the IO layer.
+     *
+     * Orders the items as CompareQueuedItemsBySeqnoAndKey does: by key, the
+     * latest revision of a key first. Large batches are radix sorted on
+     * a word taken from their keys, only keys with the same word are
+     * compared in full.
      */
-    void optimizeWrites(std::vector<queued_item> &items) {
-        if (isReadOnly()) {
-            throw std::logic_error("KVStore::optimizeWrites: Not valid on a "
-                    "read-only object");
-        }
-        if (items.empty()) {
-            return;
-        }
-
-        CompareQueuedItemsBySeqnoAndKey cq;
-        std::sort(items.begin(), items.end(), cq);
-    }
+    void optimizeWrites(std::vector<queued_item> &items);
 
     std::list<PersistenceCallback *>& getPersistenceCbList() {
         return pcbs;
@@ -20,6 +20,7 @@
 #include "threadlocal.h"
 #include "ep_engine.h"
 #include "objectregistry.h"
+#include "slab_arena.h"
 #include "stored-value.h"
 
 static ThreadLocal<EventuallyPersistentEngine*> *th;
@@ -33,6 +34,17 @@ extern "C" {
 
 static get_allocation_size getAllocSize = defaultGetAllocSize;
 
+/*
+ * The allocator can only tell about its own allocations, slots within
+ * an arena's chunk are sized by the arena.
+ */
+static size_t getObjectAllocSize(const void *p) {
+    if (SlabArena::owns(p)) {
+        return SlabArena::getSlotSize(p);
+    }
+    return getAllocSize(p);
+}
+
 
 
 /**
@@ -76,7 +88,7 @@ void ObjectRegistry::onCreateBlob(const Blob *blob)
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
        EPStats &stats = engine->getEpStats();
-       size_t size = getAllocSize(blob);
+       size_t size = getObjectAllocSize(blob);
        if (size == 0) {
            size = blob->getSize();
        } else {
@@ -93,7 +105,7 @@ void ObjectRegistry::onDeleteBlob(const Blob *blob)
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
        EPStats &stats = engine->getEpStats();
-       size_t size = getAllocSize(blob);
+       size_t size = getObjectAllocSize(blob);
        if (size == 0) {
            size = blob->getSize();
        } else {
@@ -110,7 +122,7 @@ void ObjectRegistry::onCreateStoredValue(const StoredValue *sv)
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
        EPStats &stats = engine->getEpStats();
-       size_t size = getAllocSize(sv);
+       size_t size = getObjectAllocSize(sv);
        if (size == 0) {
            size = sv->getObjectSize();
        } else {
@@ -126,7 +138,7 @@ void ObjectRegistry::onDeleteStoredValue(const StoredValue *sv)
    EventuallyPersistentEngine *engine = th->get();
    if (verifyEngine(engine)) {
        EPStats &stats = engine->getEpStats();
-       size_t size = getAllocSize(sv);
+       size_t size = getObjectAllocSize(sv);
        if (size == 0) {
            size = sv->getObjectSize();
        } else {
@@ -162,6 +174,11 @@ EventuallyPersistentEngine *ObjectRegistry::getCurrentEngine() {
     return th->get();
 }
 
+SlabArena *ObjectRegistry::getBlobArena() {
+    EventuallyPersistentEngine *engine = th->get();
+    return engine ? engine->getBlobArena() : NULL;
+}
+
 EventuallyPersistentEngine *ObjectRegistry::onSwitchThread(
                                             EventuallyPersistentEngine *engine,
                                             bool want_old_thread_local)
@@ -24,6 +24,7 @@
 class EventuallyPersistentEngine;
 class Blob;
 class Item;
+class SlabArena;
 class StoredValue;
 
 extern "C" {
@@ -47,6 +48,12 @@ public:
 
     static EventuallyPersistentEngine *getCurrentEngine();
 
+    /**
+     * Get the arena Blobs of the current engine are allocated from, NULL
+     * if they come from the general purpose allocator.
+     */
+    static SlabArena *getBlobArena();
+
     static EventuallyPersistentEngine *onSwitchThread(EventuallyPersistentEngine *engine,
                                                       bool want_old_thread_local = false);
 
@@ -0,0 +1,176 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <thread>
+
+#include "objectregistry.h"
+#include "read_epoch.h"
+#include "threadlocal.h"
+
+// Retired allocations a slot collects before it tries to release some
+static const size_t RECLAIM_THRESHOLD = 64;
+
+/*
+ * Per-thread state; one cache line each so entering a Guard only writes
+ * to memory nobody else writes to.
+ */
+struct alignas(64) ReadEpoch::Slot {
+    Slot() : epoch(0), depth(0), reclaimAt(RECLAIM_THRESHOLD) {}
+
+    //! Epoch the owner entered its outermost Guard at, 0 outside of one
+    AtomicValue<uint64_t> epoch;
+    //! Guard nesting depth, only touched by the owner
+    size_t                depth;
+
+    //! Protects retired and reclaimAt, drain() reaches into every slot
+    Mutex                 mutex;
+    std::vector<Retired>  retired;
+    size_t                reclaimAt;
+};
+
+AtomicValue<bool> ReadEpoch::enabled(false);
+// 0 is reserved for "not in a Guard"
+AtomicValue<uint64_t> ReadEpoch::globalEpoch(1);
+AtomicValue<size_t> ReadEpoch::numPending(0);
+AtomicValue<size_t> ReadEpoch::numSlots(0);
+
+ReadEpoch::Slot ReadEpoch::slots[MAX_THREADS];
+ReadEpoch::Slot ReadEpoch::orphanSlot;
+ThreadLocalPtr<ReadEpoch::Slot> ReadEpoch::threadSlot;
+
+ReadEpoch::Guard::Guard() : slot(NULL) {
+    if (!isEnabled()) {
+        return;
+    }
+    Slot *s = mySlot();
+    if (s == &orphanSlot) {
+        return;
+    }
+    if (s->depth++ == 0) {
+        // Must be visible before anything the reader loads next.
+        s->epoch.store(globalEpoch.load());
+    }
+    slot = s;
+}
+
+ReadEpoch::Guard::~Guard() {
+    if (slot && --slot->depth == 0) {
+        slot->epoch.store(0, std::memory_order_release);
+    }
+}
+
+void ReadEpoch::enable() {
+    enabled.store(true);
+}
+
+ReadEpoch::Slot *ReadEpoch::mySlot() {
+    Slot *s = threadSlot;
+    if (s == NULL) {
+        size_t i = numSlots++;
+        s = i < MAX_THREADS ? &slots[i] : &orphanSlot;
+        threadSlot = s;
+    }
+    return s;
+}
+
+void ReadEpoch::retire(void *p, release_fn fn) {
+    if (p == NULL) {
+        return;
+    }
+    if (!isEnabled()) {
+        fn(p);
+        return;
+    }
+
+    // The epoch is read after p was unlinked: readers that entered
+    // with a later one cannot have seen it.
+    Retired r = { p, fn, globalEpoch.load(),
+                  ObjectRegistry::getCurrentEngine() };
+    ++numPending;
+
+    Slot *s = mySlot();
+    LockHolder lh(s->mutex);
+    s->retired.push_back(r);
+    if (s->retired.size() >= s->reclaimAt) {
+        // New readers start in a new epoch, so everything retired so far
+        // becomes releasable once the current readers are gone.
+        ++globalEpoch;
+        reclaim(s->retired, oldestActive());
+        // Don't rescan on every call while a slow reader holds things up.
+        s->reclaimAt = std::max(RECLAIM_THRESHOLD, s->retired.size() * 2);
+    }
+}
+
+void ReadEpoch::drain() {
+    if (!isEnabled()) {
+        return;
+    }
+
+    const uint64_t e = ++globalEpoch;
+    const size_t n = std::min(numSlots.load(), static_cast<size_t>(MAX_THREADS));
+    for (size_t i = 0; i < n; ++i) {
+        while (true) {
+            uint64_t active = slots[i].epoch.load();
+            if (active == 0 || active >= e) {
+                break;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        LockHolder lh(slots[i].mutex);
+        reclaim(slots[i].retired, e);
+    }
+    LockHolder lh(orphanSlot.mutex);
+    reclaim(orphanSlot.retired, e);
+}
+
+uint64_t ReadEpoch::oldestActive() {
+    uint64_t oldest = globalEpoch.load();
+    const size_t n = std::min(numSlots.load(), static_cast<size_t>(MAX_THREADS));
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t active = slots[i].epoch.load();
+        if (active != 0 && active < oldest) {
+            oldest = active;
+        }
+    }
+    return oldest;
+}
+
+void ReadEpoch::reclaim(std::vector<Retired> &list, uint64_t safe) {
+    size_t kept = 0;
+    for (size_t i = 0; i < list.size(); ++i) {
+        if (list[i].epoch < safe) {
+            release(list[i]);
+        } else {
+            list[kept++] = list[i];
+        }
+    }
+    numPending.fetch_sub(list.size() - kept);
+    list.resize(kept);
+}
+
+void ReadEpoch::release(const Retired &r) {
+    EventuallyPersistentEngine *old =
+        ObjectRegistry::onSwitchThread(r.engine, true);
+    r.release(r.ptr);
+    ObjectRegistry::onSwitchThread(old);
+}
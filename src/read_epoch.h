@@ -0,0 +1,127 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_READ_EPOCH_H_
+#define SRC_READ_EPOCH_H_ 1
+
+#include "config.h"
+
+#include <vector>
+
+#include "atomic.h"
+#include "mutex.h"
+#include "threadlocal.h"
+
+// Forward declarations.
+class EventuallyPersistentEngine;
+
+/**
+ * Epoch based reclamation for readers that walk hash table memory without
+ * holding the hash bucket lock (HashTable::optimisticGet).
+ *
+ * A reader enters a Guard, which publishes the global epoch in the
+ * thread's slot. Memory that was unlinked is handed to retire() instead
+ * of being freed; it is only released once every reader that was active
+ * when it was retired has left its Guard, so a reader may follow a
+ * pointer it loaded without a lock for as long as it stays in the Guard.
+ * What it reads there may be stale and has to be validated separately.
+ *
+ * Reclamation is off until enable() is called; retire() then frees
+ * immediately and Guards protect nothing.
+ */
+class ReadEpoch {
+    struct Slot;
+
+public:
+    typedef void (*release_fn)(void *p);
+
+    /**
+     * RAII marker of a read-side critical section. Nests.
+     */
+    class Guard {
+    public:
+        Guard();
+        ~Guard();
+
+        /**
+         * False if reclamation is disabled or the calling thread could
+         * not be given a slot; the caller must take its locks then.
+         */
+        bool entered() const {
+            return slot != NULL;
+        }
+
+    private:
+        Slot *slot;
+        DISALLOW_COPY_AND_ASSIGN(Guard);
+    };
+
+    /**
+     * Start deferring releases handed to retire(). Cannot be undone.
+     */
+    static void enable();
+
+    static bool isEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Release p with the given function once no reader can hold it any
+     * more. The engine current at the time of the call is switched to
+     * for the release, so memory accounting isn't affected by when (or
+     * by which thread) it happens.
+     */
+    static void retire(void *p, release_fn release);
+
+    /**
+     * Wait for the readers active now and release everything retired
+     * so far.
+     */
+    static void drain();
+
+    /**
+     * Get the number of retired allocations not released yet.
+     */
+    static size_t getNumPending() {
+        return numPending.load();
+    }
+
+private:
+    struct Retired {
+        void *ptr;
+        release_fn release;
+        uint64_t epoch;
+        EventuallyPersistentEngine *engine;
+    };
+
+    static Slot *mySlot();
+    static void reclaim(std::vector<Retired> &list, uint64_t safe);
+    static uint64_t oldestActive();
+    static void release(const Retired &r);
+
+    static AtomicValue<bool>     enabled;
+    static AtomicValue<uint64_t> globalEpoch;
+    static AtomicValue<size_t>   numPending;
+    static AtomicValue<size_t>   numSlots;
+
+    static Slot                  slots[MAX_THREADS];
+    //! Used by threads beyond MAX_THREADS; only for retiring.
+    static Slot                  orphanSlot;
+    static ThreadLocalPtr<Slot>  threadSlot;
+};
+
+#endif  // SRC_READ_EPOCH_H_
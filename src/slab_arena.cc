@@ -0,0 +1,384 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+
+#include "objectregistry.h"
+#include "read_epoch.h"
+#include "slab_arena.h"
+#include "stats.h"
+
+// Chunks are 16KiB and aligned to that; an arena per vbucket must not
+// hold on to much while its vbucket is small.
+static const size_t CHUNK_SHIFT = 14;
+static const size_t CHUNK_SIZE = static_cast<size_t>(1) << CHUNK_SHIFT;
+
+// Size classes: 16 byte steps up to 512 (StoredValues and small values),
+// then 64 byte steps up to 1KiB and 128 byte steps up to 2KiB.
+static const size_t NUM_CLASSES = 48;
+static const size_t MAX_SLOT_SIZE = 2048;
+
+static size_t classSize(size_t i) {
+    if (i < 32) {
+        return (i + 1) * 16;
+    } else if (i < 40) {
+        return 512 + (i - 31) * 64;
+    }
+    return 1024 + (i - 39) * 128;
+}
+
+static size_t classFor(size_t len) {
+    if (len <= 512) {
+        return len == 0 ? 0 : (len - 1) / 16;
+    } else if (len <= 1024) {
+        return 32 + (len - 513) / 64;
+    }
+    return 40 + (len - 1025) / 128;
+}
+
+/*
+ * Which chunk sized pieces of the address space are chunks, so any
+ * pointer can be checked before its chunk header is looked at. Two
+ * levels of bitmaps over 48 bits of address space; leaves are allocated
+ * on first use and never freed.
+ */
+static const size_t ADDRESS_BITS = 48;
+static const size_t LEAF_BITS = 18;
+static const size_t ROOT_SIZE =
+    static_cast<size_t>(1) << (ADDRESS_BITS - CHUNK_SHIFT - LEAF_BITS);
+static const size_t LEAF_WORDS = (static_cast<size_t>(1) << LEAF_BITS) / 64;
+
+static AtomicValue<AtomicValue<uint64_t>*> chunkMap[ROOT_SIZE];
+
+static bool markChunk(const void *chunk, bool owned) {
+    const uintptr_t idx = reinterpret_cast<uintptr_t>(chunk) >> CHUNK_SHIFT;
+    const uintptr_t root = idx >> LEAF_BITS;
+    if (root >= ROOT_SIZE) {
+        return false;
+    }
+    AtomicValue<uint64_t> *leaf = chunkMap[root].load();
+    if (leaf == NULL) {
+        // Shared by every bucket, so not charged to any of them.
+        EventuallyPersistentEngine *old =
+            ObjectRegistry::onSwitchThread(NULL, true);
+        AtomicValue<uint64_t> *fresh = new AtomicValue<uint64_t>[LEAF_WORDS]();
+        ObjectRegistry::onSwitchThread(old);
+        if (chunkMap[root].compare_exchange_strong(leaf, fresh)) {
+            leaf = fresh;
+        } else {
+            delete []fresh;
+        }
+    }
+    const size_t bit = idx & ((static_cast<size_t>(1) << LEAF_BITS) - 1);
+    const uint64_t mask = static_cast<uint64_t>(1) << (bit & 63);
+    if (owned) {
+        leaf[bit >> 6].fetch_or(mask);
+    } else {
+        leaf[bit >> 6].fetch_and(~mask);
+    }
+    return true;
+}
+
+static void *allocChunkMemory() {
+#ifdef WIN32
+    return _aligned_malloc(CHUNK_SIZE, CHUNK_SIZE);
+#else
+    void *p;
+    if (posix_memalign(&p, CHUNK_SIZE, CHUNK_SIZE) != 0) {
+        return NULL;
+    }
+    return p;
+#endif
+}
+
+static void freeChunkMemory(void *p) {
+#ifdef WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+/*
+ * Header at the start of every chunk, the slots follow it.
+ */
+struct SlabArena::Chunk {
+    SlabArena *arena;
+    SizeClass *cls;
+    //! Neighbours among the chunks of the class with free slots
+    Chunk *prev;
+    Chunk *next;
+    //! Neighbours among all chunks of the class
+    Chunk *allPrev;
+    Chunk *allNext;
+    //! Slots freed and not reused yet, linked through their first word
+    void *freeList;
+    //! First slot never handed out
+    char *bump;
+    size_t inUse;
+    bool listed;
+};
+
+struct SlabArena::SizeClass {
+    SizeClass() : slotSize(0), partial(NULL), all(NULL) {}
+
+    Mutex mutex;
+    size_t slotSize;
+    //! Chunks with free slots, the one allocate() takes from first
+    Chunk *partial;
+    Chunk *all;
+};
+
+SlabArena::Chunk *SlabArena::chunkOf(const void *p) {
+    return reinterpret_cast<Chunk *>(
+        reinterpret_cast<uintptr_t>(p) & ~(CHUNK_SIZE - 1));
+}
+
+bool SlabArena::isFull(const Chunk *c, size_t slotSize) {
+    return c->freeList == NULL &&
+        c->bump + slotSize > reinterpret_cast<const char *>(c) + CHUNK_SIZE;
+}
+
+SlabArena::SlabArena(EPStats &st)
+    : stats(&st), engine(ObjectRegistry::getCurrentEngine()),
+      classes(new SizeClass[NUM_CLASSES]), refs(1), reserved(0), used(0),
+      numDropped(0) {
+    for (size_t i = 0; i < NUM_CLASSES; ++i) {
+        classes[i].slotSize = classSize(i);
+    }
+}
+
+SlabArena::~SlabArena() {
+    for (size_t i = 0; i < NUM_CLASSES; ++i) {
+        Chunk *c = classes[i].all;
+        while (c) {
+            Chunk *next = c->allNext;
+            releaseChunk(c);
+            c = next;
+        }
+    }
+    delete []classes;
+    // What is left was dropped by the owner.
+    EPStats *st = stats.load();
+    if (st) {
+        st->slabUsedBytes.fetch_sub(used.load());
+    }
+}
+
+size_t SlabArena::getMaxSlotSize() {
+    return MAX_SLOT_SIZE;
+}
+
+void *SlabArena::allocate(size_t len) {
+    if (len > MAX_SLOT_SIZE) {
+        return NULL;
+    }
+    SizeClass &cls = classes[classFor(len)];
+    void *p;
+    {
+        LockHolder lh(cls.mutex);
+        Chunk *c = cls.partial;
+        if (c == NULL) {
+            c = newChunk(cls);
+            if (c == NULL) {
+                return NULL;
+            }
+        }
+        if (c->freeList) {
+            p = c->freeList;
+            c->freeList = *static_cast<void **>(p);
+        } else {
+            p = c->bump;
+            c->bump += cls.slotSize;
+        }
+        ++c->inUse;
+        if (isFull(c, cls.slotSize)) {
+            cls.partial = c->next;
+            if (c->next) {
+                c->next->prev = NULL;
+            }
+            c->next = NULL;
+            c->listed = false;
+        }
+    }
+    ++refs;
+    used.fetch_add(cls.slotSize);
+    // Not detached while its owner still allocates
+    stats.load()->slabUsedBytes.fetch_add(cls.slotSize);
+    return p;
+}
+
+SlabArena::Chunk *SlabArena::newChunk(SizeClass &cls) {
+    EventuallyPersistentEngine *old =
+        ObjectRegistry::onSwitchThread(engine.load(), true);
+    void *mem = allocChunkMemory();
+    if (mem && !markChunk(mem, true)) {
+        // Beyond the addresses the chunk map covers.
+        freeChunkMemory(mem);
+        mem = NULL;
+    }
+    ObjectRegistry::onSwitchThread(old);
+    if (mem == NULL) {
+        return NULL;
+    }
+
+    Chunk *c = static_cast<Chunk *>(mem);
+    c->arena = this;
+    c->cls = &cls;
+    c->prev = NULL;
+    c->next = NULL;
+    c->allPrev = NULL;
+    c->allNext = cls.all;
+    if (cls.all) {
+        cls.all->allPrev = c;
+    }
+    cls.all = c;
+    c->freeList = NULL;
+    // Slots keep the 16 byte alignment of the chunk.
+    c->bump = static_cast<char *>(mem) + ((sizeof(Chunk) + 15) & ~15);
+    c->inUse = 0;
+    c->listed = true;
+    cls.partial = c;
+
+    reserved.fetch_add(CHUNK_SIZE);
+    stats.load()->slabReservedBytes.fetch_add(CHUNK_SIZE);
+    return c;
+}
+
+void SlabArena::releaseChunk(Chunk *c) {
+    EventuallyPersistentEngine *old =
+        ObjectRegistry::onSwitchThread(engine.load(), true);
+    markChunk(c, false);
+    freeChunkMemory(c);
+    ObjectRegistry::onSwitchThread(old);
+    reserved.fetch_sub(CHUNK_SIZE);
+    EPStats *st = stats.load();
+    if (st) {
+        st->slabReservedBytes.fetch_sub(CHUNK_SIZE);
+    }
+}
+
+void SlabArena::deallocate(void *p) {
+    if (p == NULL) {
+        return;
+    }
+    if (!owns(p)) {
+        ::operator delete(p);
+        return;
+    }
+    Chunk *c = chunkOf(p);
+    c->arena->deallocateSlot(c, p);
+}
+
+void SlabArena::deallocateSlot(Chunk *c, void *p) {
+    SizeClass &cls = *c->cls;
+    bool release = false;
+    {
+        LockHolder lh(cls.mutex);
+        *static_cast<void **>(p) = c->freeList;
+        c->freeList = p;
+        --c->inUse;
+        if (!c->listed) {
+            c->next = cls.partial;
+            if (cls.partial) {
+                cls.partial->prev = c;
+            }
+            cls.partial = c;
+            c->listed = true;
+        }
+        if (c->inUse == 0 && (cls.partial != c || c->next != NULL)) {
+            // Empty, and not the only chunk left to allocate from.
+            if (c->prev) {
+                c->prev->next = c->next;
+            } else {
+                cls.partial = c->next;
+            }
+            if (c->next) {
+                c->next->prev = c->prev;
+            }
+            if (c->allPrev) {
+                c->allPrev->allNext = c->allNext;
+            } else {
+                cls.all = c->allNext;
+            }
+            if (c->allNext) {
+                c->allNext->allPrev = c->allPrev;
+            }
+            release = true;
+        }
+    }
+    used.fetch_sub(cls.slotSize);
+    EPStats *st = stats.load();
+    if (st) {
+        st->slabUsedBytes.fetch_sub(cls.slotSize);
+    }
+    if (release) {
+        releaseChunk(c);
+    }
+    unref(1);
+}
+
+bool SlabArena::owns(const void *p) {
+    const uintptr_t idx = reinterpret_cast<uintptr_t>(p) >> CHUNK_SHIFT;
+    const uintptr_t root = idx >> LEAF_BITS;
+    if (root >= ROOT_SIZE) {
+        return false;
+    }
+    const AtomicValue<uint64_t> *leaf =
+        chunkMap[root].load(std::memory_order_acquire);
+    if (leaf == NULL) {
+        return false;
+    }
+    const size_t bit = idx & ((static_cast<size_t>(1) << LEAF_BITS) - 1);
+    return (leaf[bit >> 6].load(std::memory_order_relaxed) >> (bit & 63)) & 1;
+}
+
+size_t SlabArena::getSlotSize(const void *p) {
+    return chunkOf(p)->cls->slotSize;
+}
+
+void SlabArena::abandon(size_t dropped) {
+    // Readers in a ReadEpoch::Guard may still be looking at the dropped
+    // objects, their slots are given up only after them.
+    numDropped = dropped;
+    ReadEpoch::retire(this, releaseOwner);
+}
+
+void SlabArena::detach() {
+    EPStats *st = stats.exchange(NULL);
+    if (st) {
+        // Taken back here as nothing is taken back later
+        st->slabUsedBytes.fetch_sub(used.load());
+        st->slabReservedBytes.fetch_sub(reserved.load());
+    }
+    engine.store(NULL);
+}
+
+void SlabArena::releaseOwner(void *arena) {
+    SlabArena *a = static_cast<SlabArena *>(arena);
+    a->unref(a->numDropped + 1);
+}
+
+void SlabArena::unref(size_t n) {
+    if (refs.fetch_sub(n) == n) {
+        // Nothing left in here: every chunk goes, without a look at the
+        // slots in it.
+        delete this;
+    }
+}
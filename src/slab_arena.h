@@ -0,0 +1,139 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2016 Teligent
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+#ifndef SRC_SLAB_ARENA_H_
+#define SRC_SLAB_ARENA_H_ 1
+
+#include "config.h"
+
+#include "atomic.h"
+#include "mutex.h"
+
+// Forward declarations.
+class EPStats;
+class EventuallyPersistentEngine;
+
+/**
+ * Size class allocator for StoredValue and Blob objects (slab_allocator).
+ *
+ * Memory is taken from the system in aligned chunks; every chunk holds
+ * slots of a single size class, so objects of similar size share chunks
+ * instead of being scattered by the general purpose allocator, and a
+ * freed slot is reused by the next object of its class. The chunk of
+ * any pointer is found by masking it, which is how deallocate() finds
+ * the arena without being told.
+ *
+ * An arena lives until it has been abandon()ed by its owner and the last
+ * of its objects is gone. An owner dropping all of its objects at once
+ * (a hash table of a deleted vbucket) passes their number to abandon()
+ * and skips freeing them one by one: the chunks are released wholesale.
+ * An owner going away together with the stats and engine the arena
+ * accounts to detach()es it first if objects may outlive it.
+ */
+class SlabArena {
+public:
+    /**
+     * Create an arena accounting to the given stats. Chunks are allocated
+     * and released on behalf of the engine current at construction.
+     */
+    SlabArena(EPStats &st);
+
+    /**
+     * Get a slot of at least len bytes.
+     *
+     * @return NULL if len is beyond the largest size class, the caller
+     *         must use the general purpose allocator then
+     */
+    void *allocate(size_t len);
+
+    /**
+     * Give up the owner's reference. The arena is released once the
+     * objects still live in it are deallocated.
+     *
+     * @param dropped number of objects the owner destroyed without
+     *                deallocating them; their slots are not touched again
+     */
+    void abandon(size_t dropped = 0);
+
+    /**
+     * Stop accounting to the stats and the engine given at construction,
+     * for when they go away before the objects still live in the arena.
+     */
+    void detach();
+
+    /**
+     * Release memory obtained from allocate() of any arena, or from
+     * ::operator new.
+     */
+    static void deallocate(void *p);
+
+    /**
+     * True if p was handed out by an arena.
+     */
+    static bool owns(const void *p);
+
+    /**
+     * Get the size of the slot p is in, p must be owned by an arena.
+     */
+    static size_t getSlotSize(const void *p);
+
+    /**
+     * Get the largest request a slot is handed out for.
+     */
+    static size_t getMaxSlotSize();
+
+    //! Bytes in chunks this arena holds
+    size_t getReservedBytes() const {
+        return reserved.load();
+    }
+
+    //! Bytes in slots handed out and not deallocated yet
+    size_t getUsedBytes() const {
+        return used.load();
+    }
+
+private:
+    struct Chunk;
+    struct SizeClass;
+
+    ~SlabArena();
+
+    void deallocateSlot(Chunk *c, void *p);
+    Chunk *newChunk(SizeClass &cls);
+    void releaseChunk(Chunk *c);
+    void unref(size_t n);
+
+    static Chunk *chunkOf(const void *p);
+    static bool isFull(const Chunk *c, size_t slotSize);
+    static void releaseOwner(void *arena);
+
+    //! NULL once detached
+    AtomicValue<EPStats *> stats;
+    AtomicValue<EventuallyPersistentEngine *> engine;
+
+    SizeClass *classes;
+    //! Live objects, plus one for the owner until abandon()
+    AtomicValue<size_t> refs;
+    AtomicValue<size_t> reserved;
+    AtomicValue<size_t> used;
+    //! Objects given up by abandon() without being deallocated
+    size_t numDropped;
+
+    DISALLOW_COPY_AND_ASSIGN(SlabArena);
+};
+
+#endif  // SRC_SLAB_ARENA_H_
@@ -54,17 +54,32 @@ public:
         diskQueueSize(0),
         flusher_todo(0),
         flusherCommits(0),
+        flusherBatchesSplit(0),
         cumulativeFlushTime(0),
         cumulativeCommitTime(0),
         tooYoung(0),
         tooOld(0),
         totalPersisted(0),
         totalEnqueued(0),
+        totalDeduplicated(0),
         flushFailed(0),
         flushExpired(0),
         expired_access(0),
         expired_compactor(0),
         expired_pager(0),
+        expiryNotifyQueued(0),
+        expiryNotifySent(0),
+        expiryNotifyDropped(0),
+        expiryNotifyOverflow(0),
+        expiryNotifyFailed(0),
+        expiryNotifyBatches(0),
+        expiryNotifyReplayed(0),
+        expiryIndexSize(0),
+        expiryIndexMemory(0),
+        expiryIndexStale(0),
+        htResizing(0),
+        htBucketsMigrated(0),
+        htOptimisticConflicts(0),
         beginFailed(0),
         commitFailed(0),
         dirtyAge(0),
@@ -92,6 +107,8 @@ public:
         numStoredVal(0),
         totalStoredValSize(0),
         storedValOverhead(0),
+        slabReservedBytes(0),
+        slabUsedBytes(0),
         memOverhead(0),
         numItem(0),
         totalMemory(0),
@@ -107,6 +124,7 @@ public:
         bg_fetched(0),
         bg_meta_fetched(0),
         numRemainingBgJobs(0),
+        bgFetchTasks(0),
         bgNumOperations(0),
         maxRemainingBgJobs(0),
         bgWait(0),
@@ -219,6 +237,8 @@ public:
     AtomicValue<size_t> flusher_todo;
     //! Number of transaction commits.
     AtomicValue<size_t> flusherCommits;
+    //! Number of flush batches cut short by the batch limits.
+    AtomicValue<size_t> flusherBatchesSplit;
     //! Total time spent flushing.
     AtomicValue<size_t> cumulativeFlushTime;
     //! Total time spent committing.
@@ -231,6 +251,8 @@ public:
     AtomicValue<size_t> totalPersisted;
     //! Cumulative number of items added to the queue.
     AtomicValue<size_t> totalEnqueued;
+    //! Number of mutations replacing an item still queued for persistence.
+    AtomicValue<size_t> totalDeduplicated;
     //! Number of times an item flush failed.
     AtomicValue<size_t> flushFailed;
     //! Number of times an item is not flushed due to the item's expiry
@@ -249,6 +271,35 @@ public:
     //! Number of times an object was expired by pager.
     AtomicValue<size_t> expired_pager;
 
+    //! Number of expiry notifications queued for sending.
+    AtomicValue<size_t> expiryNotifyQueued;
+    //! Number of expiry notifications handed to the kernel.
+    AtomicValue<size_t> expiryNotifySent;
+    //! Number of expiry notifications not sent as the channel was down.
+    AtomicValue<size_t> expiryNotifyDropped;
+    //! Number of expiry notifications dropped, unnumbered, by the queue cap.
+    AtomicValue<size_t> expiryNotifyOverflow;
+    //! Number of expiry notifications that failed to format or send.
+    AtomicValue<size_t> expiryNotifyFailed;
+    //! Number of sendmmsg batches issued for expiry notifications.
+    AtomicValue<size_t> expiryNotifyBatches;
+    //! Number of expiry notifications resent from the journal.
+    AtomicValue<size_t> expiryNotifyReplayed;
+
+    //! Number of entries in all vbuckets' expiry indexes.
+    AtomicValue<size_t> expiryIndexSize;
+    //! Memory used by all vbuckets' expiry indexes.
+    AtomicValue<size_t> expiryIndexMemory;
+    //! Number of due expiry index entries whose item was gone or changed.
+    AtomicValue<size_t> expiryIndexStale;
+
+    //! Number of hash tables being resized right now.
+    AtomicValue<size_t> htResizing;
+    //! Number of hash buckets moved over by hash table resizes.
+    AtomicValue<size_t> htBucketsMigrated;
+    //! Number of optimistic gets that gave up on concurrent writers.
+    AtomicValue<size_t> htOptimisticConflicts;
+
     //! Number of times we failed to start a transaction
     AtomicValue<size_t> beginFailed;
     //! Number of times a commit failed.
@@ -305,6 +356,10 @@ public:
     AtomicValue<size_t> totalStoredValSize;
     //! Total size of StoredVal memory overhead
     AtomicValue<size_t> storedValOverhead;
+    //! Bytes in the chunks of the slab arenas
+    AtomicValue<size_t> slabReservedBytes;
+    //! Bytes in slab arena slots handed out
+    AtomicValue<size_t> slabUsedBytes;
     //! Amount of memory used to track items and what-not.
     AtomicValue<size_t> memOverhead;
     //! Total number of Item objects
@@ -342,6 +397,8 @@ public:
     AtomicValue<size_t> bg_meta_fetched;
     //! Number of remaining bg fetch jobs.
     AtomicValue<size_t> numRemainingBgJobs;
+    //! Number of vbuckets fetched from by a task of their own
+    AtomicValue<size_t> bgFetchTasks;
     //! The number of samples the bgWaitDelta and bgLoadDelta contains of
     AtomicValue<size_t> bgNumOperations;
     //! Max number of individual background fetch jobs that we've seen in the queue
@@ -371,6 +428,9 @@ public:
     //! Histogram of background wait loads.
     Histogram<hrtime_t> bgLoadHisto;
 
+    //! Histogram of the time background fetches wait for the batch read.
+    Histogram<hrtime_t> bgFetchDiskHisto;
+
     //! Max wall time of deleting a vbucket
     AtomicValue<hrtime_t> vbucketDelMaxWalltime;
     //! Total wall time of deleting vbuckets
@@ -381,6 +441,8 @@ public:
 
     //! Histogram of access scanner run times
     Histogram<hrtime_t> accessScannerHisto;
+    //! Histogram of the times to write all hash table snapshots
+    Histogram<hrtime_t> htSnapshotHisto;
     //! Historgram of checkpoint remover run times
     Histogram<hrtime_t> checkpointRemoverHisto;
     //! Histogram of item pager run times
@@ -580,6 +642,7 @@ public:
         numFailedEjects.store(0);
         numNotMyVBuckets.store(0);
         bg_fetched.store(0);
+        bgFetchTasks.store(0);
         bgNumOperations.store(0);
         bgWait.store(0);
         bgLoad.store(0);
@@ -614,8 +677,10 @@ public:
         pendingOpsHisto.reset();
         bgWaitHisto.reset();
         bgLoadHisto.reset();
+        bgFetchDiskHisto.reset();
         setWithMetaHisto.reset();
         accessScannerHisto.reset();
+        htSnapshotHisto.reset();
         checkpointRemoverHisto.reset();
         itemPagerHisto.reset();
         expiryPagerHisto.reset();
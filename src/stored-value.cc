@@ -17,8 +17,10 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <limits>
 #include <string>
+#include <vector>
 
 #include "stored-value.h"
 
@@ -28,11 +30,22 @@
 
 size_t HashTable::defaultNumBuckets = DEFAULT_HT_SIZE;
 size_t HashTable::defaultNumLocks = 193;
+ht_hash_function_t HashTable::defaultHashFunction = HT_HASH_MURMUR3;
+ht_index_t HashTable::defaultIndex = HT_INDEX_CHAINED;
+bool HashTable::defaultOptimisticReads = false;
+bool HashTable::defaultSlabAllocator = false;
 double StoredValue::mutation_mem_threshold = 0.9;
+size_t StoredValue::inlineValueSize = 0;
 const int64_t StoredValue::state_deleted_key = -3;
 const int64_t StoredValue::state_non_existent_key = -4;
 const int64_t StoredValue::state_temp_init = -5;
 
+// Attempts optimisticGet() makes before leaving it to the locked path
+static const int OPTIMISTIC_GET_ATTEMPTS = 4;
+// Values optimisticGet() looks at in a bucket before giving up; a bucket
+// changing underneath could otherwise keep it walking
+static const size_t OPTIMISTIC_GET_MAX_DEPTH = 256;
+
 static ssize_t prime_size_table[] = {
     3, 7, 13, 23, 47, 97, 193, 383, 769, 1531, 3079, 6143, 12289, 24571, 49157,
     98299, 196613, 393209, 786433, 1572869, 3145721, 6291449, 12582917,
@@ -42,9 +55,9 @@ static ssize_t prime_size_table[] = {
 
 bool StoredValue::ejectValue(HashTable &ht, item_eviction_policy_t policy) {
     if (eligibleForEviction(policy)) {
-        reduceCacheSize(ht, value->length());
+        VersionWriteGuard vg(writeVersion());
+        reduceCacheSize(ht, valuelen());
         markNotResident();
-        value = NULL;
         return true;
     }
     return false;
@@ -52,12 +65,14 @@ bool StoredValue::ejectValue(HashTable &ht, item_eviction_policy_t policy) {
 
 void StoredValue::referenced() {
     if (nru > MIN_NRU_VALUE) {
+        VersionWriteGuard vg(writeVersion());
         --nru;
     }
 }
 
 void StoredValue::setNRUValue(uint8_t nru_val) {
     if (nru_val <= MAX_NRU_VALUE) {
+        VersionWriteGuard vg(writeVersion());
         nru = nru_val;
     }
 }
@@ -65,6 +80,7 @@ void StoredValue::setNRUValue(uint8_t nru_val) {
 uint8_t StoredValue::incrNRUValue() {
     uint8_t ret = MAX_NRU_VALUE;
     if (nru < MAX_NRU_VALUE) {
+        VersionWriteGuard vg(writeVersion());
         ret = ++nru;
     }
     return ret;
@@ -78,6 +94,7 @@ bool StoredValue::unlocked_restoreValue(Item *itm, HashTable &ht) {
     if (isResident() || isDeleted()) {
         return false;
     }
+    VersionWriteGuard vg(writeVersion());
 
     if (isTempInitialItem()) { // Regular item with the full eviction
         --ht.numTempItems;
@@ -99,8 +116,8 @@ bool StoredValue::unlocked_restoreValue(Item *itm, HashTable &ht) {
     }
     deleted = false;
     conflictResMode = itm->getConflictResMode();
-    value = itm->getValue();
-    increaseCacheSize(ht, value->length());
+    assignValue(itm->getValue());
+    increaseCacheSize(ht, valuelen());
     return true;
 }
 
@@ -110,6 +127,7 @@ bool StoredValue::unlocked_restoreMeta(Item *itm, ENGINE_ERROR_CODE status,
         return true;
     }
 
+    VersionWriteGuard vg(writeVersion());
     switch(status) {
     case ENGINE_SUCCESS:
         cas = itm->getCas();
@@ -166,26 +184,13 @@ bool HashTable::unlocked_ejectItem(StoredValue*& vptr,
                                             vptr->metaDataSize());
             StoredValue::reduceCacheSize(*this, vptr->size());
 
-            int bucket_num = getBucketForHash(hash(vptr->getKey()));
-            StoredValue *v = values[bucket_num];
             // Remove the item from the hash table.
-            if (v == vptr) {
-                values[bucket_num] = v->next;
-            } else {
-                while (v->next) {
-                    if (v->next == vptr) {
-                        v->next = v->next->next;
-                        break;
-                    } else {
-                        v = v->next;
-                    }
-                }
-            }
+            unlinkValue(vptr, getBucketForHash(vptr->getKeyHash()));
 
             if (vptr->isResident()) {
                 ++stats.numValueEjects;
             }
-            if (!vptr->isResident() && !v->isTempItem()) {
+            if (!vptr->isResident() && !vptr->isTempItem()) {
                 decrNumNonResidentItems(); // Decrement because the item is
                                            // fully evicted.
             }
@@ -214,17 +219,18 @@ mutation_type_t HashTable::insert(Item &itm, item_eviction_policy_t policy,
     }
 
     int bucket_num(0);
-    LockHolder lh = getLockedBucket(itm.getKey(), &bucket_num);
-    StoredValue *v = unlocked_find(itm.getKey(), bucket_num, true, false);
+    int h = hash(itm.getKey());
+    LockHolder lh = getLockedBucket(h, &bucket_num);
+    StoredValue *v = unlocked_find(itm.getKey(), bucket_num, h, true, false);
 
     if (v == NULL) {
-        v = valFact(itm, values[bucket_num], *this);
+        v = valFact(itm, NULL, *this);
         v->markClean();
         if (partial) {
             v->markNotResident();
             ++numNonResidentItems;
         }
-        values[bucket_num] = v;
+        linkValue(v, bucket_num);
         ++numItems;
         v->setNewCacheItem(false);
     } else {
@@ -236,6 +242,7 @@ mutation_type_t HashTable::insert(Item &itm, item_eviction_policy_t policy,
         // Verify that the CAS isn't changed
         if (v->getCas() != itm.getCas()) {
             if (v->getCas() == 0) {
+                VersionWriteGuard vg(v->writeVersion());
                 v->cas = itm.getCas();
                 v->flags = itm.getFlags();
                 v->exptime = itm.getExptime();
@@ -297,6 +304,39 @@ void HashTable::setDefaultNumLocks(size_t to) {
     }
 }
 
+/**
+ * Set the default hashtable hash function.
+ */
+void HashTable::setDefaultHashFunction(const std::string &name) {
+    if (name == "djb2") {
+        defaultHashFunction = HT_HASH_DJB2;
+    } else if (name == "murmur3") {
+        defaultHashFunction = HT_HASH_MURMUR3;
+    }
+}
+
+/**
+ * Set the default hashtable bucket index.
+ */
+void HashTable::setDefaultIndex(const std::string &name) {
+    if (name == "chained") {
+        defaultIndex = HT_INDEX_CHAINED;
+    } else if (name == "tagged") {
+        defaultIndex = HT_INDEX_TAGGED;
+    }
+}
+
+/**
+ * Set whether new hashtables support optimistic reads.
+ */
+void HashTable::setDefaultOptimisticReads(bool to) {
+    defaultOptimisticReads = to;
+}
+
+void HashTable::setDefaultSlabAllocator(bool to) {
+    defaultSlabAllocator = to;
+}
+
 HashTableStatVisitor HashTable::clear(bool deactivate) {
     HashTableStatVisitor rv;
 
@@ -307,17 +347,36 @@ HashTableStatVisitor HashTable::clear(bool deactivate) {
                     "non-active object");
         }
     }
+    LockHolder rlh(resizeMutex);
     MultiLockHolder mlh(mutexes, n_locks);
+    VersionWriteGuard tg(stripeVersions ? &tableVersion : NULL);
     if (deactivate) {
         setActiveState(false);
     }
+    // With an arena the StoredValues are only destroyed, their memory
+    // goes with the arena's chunks.
+    size_t dropped = 0;
+    SlabArena *a = arena;
     for (int i = 0; i < (int)size; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
+        forEachInBucket(i, [&rv, &dropped, a](StoredValue *v) {
             rv.visit(v);
-            values[i] = v->next;
-            delete v;
-        }
+            if (a) {
+                v->~StoredValue();
+                ++dropped;
+            } else {
+                delete v;
+            }
+            return true;
+        });
+        values[i] = NULL;
+    }
+    if (arena) {
+        arena->abandon(dropped);
+        arena = deactivate ? NULL : new SlabArena(stats);
+        valFact.setArena(arena);
+    }
+    if (groups) {
+        std::memset(groups, 0, size * sizeof(HashTagGroup));
     }
 
     stats.currentSize.fetch_sub(rv.memSize - rv.valSize);
@@ -349,12 +408,12 @@ void HashTable::resize(size_t newSize) {
         return;
     }
 
-    MultiLockHolder mlh(mutexes, n_locks);
+    LockHolder rlh(resizeMutex);
     if (visitors.load() > 0) {
         // Do not allow a resize while any visitors are actually
         // processing.  The next attempt will have to pick it up.  New
-        // visitors cannot start doing meaningful work (we own all
-        // locks at this point).
+        // visitors cannot start doing meaningful work (they register
+        // under resizeMutex, which we hold until the resize is over).
         return;
     }
 
@@ -365,32 +424,106 @@ void HashTable::resize(size_t newSize) {
     if (!newValues) {
         return;
     }
+    HashTagGroup *newGroups = NULL;
+    if (groups) {
+        newGroups = static_cast<HashTagGroup*>(calloc(newSize,
+                                                      sizeof(HashTagGroup)));
+        if (!newGroups) {
+            free(newValues);
+            return;
+        }
+    }
 
     stats.memOverhead.fetch_sub(memorySize());
     ++numResizes;
+    ++stats.htResizing;
+
+    // Both tables exist from here on; nothing has moved yet so every
+    // bucket number handed out so far stays valid.
+    nextValues = newValues;
+    nextGroups = newGroups;
+    migrated.store(0);
+    nextSize.store(newSize);
+    stats.memOverhead.fetch_add(memorySize());
+
+    // Move existing records into the new space, one bucket at a time.
+    const size_t oldSize = size;
+    for (size_t i = 0; i < oldSize; i++) {
+        migrateBucket(i);
+    }
+
+    MultiLockHolder mlh(mutexes, n_locks);
+    stats.memOverhead.fetch_sub(memorySize());
 
-    // Set the new size so all the hashy stuff works.
-    size_t oldSize = size;
+    // values (and groups) still point to the old (now empty) table,
+    // which optimistic readers may still be looking at.
+    VersionWriteGuard tg(stripeVersions ? &tableVersion : NULL);
+    ReadEpoch::retire(values, free);
+    values = nextValues;
+    ReadEpoch::retire(groups, free);
+    groups = nextGroups;
     size.store(newSize);
+    nextValues = NULL;
+    nextGroups = NULL;
+    nextSize.store(0);
+    migrated.store(0);
 
-    // Move existing records into the new space.
-    for (size_t i = 0; i < oldSize; i++) {
-        while (values[i]) {
-            StoredValue *v = values[i];
-            values[i] = v->next;
+    stats.memOverhead.fetch_add(memorySize());
+    --stats.htResizing;
+}
+
+void HashTable::migrateBucket(size_t bucket_num) {
+    const size_t next = nextSize;
 
-            int newBucket = getBucketForHash(hash(v->getKeyBytes(),
-                                                  v->getKeyLen()));
-            v->next = newValues[newBucket];
-            newValues[newBucket] = v;
+    // Lock the bucket and every bucket its values move to. The latter
+    // are only known once the bucket is locked, so start with its own
+    // lock and take the missing ones (in order) until nothing is missing.
+    std::vector<size_t> locks(1, bucket_num % n_locks);
+    while (true) {
+        for (auto l : locks) {
+            mutexes[l].lock();
+        }
+        std::vector<size_t> missing;
+        forEachInBucket(bucket_num, [this, next, &locks, &missing]
+                                    (StoredValue *v) {
+            size_t l = (abs(v->getKeyHash() % static_cast<int>(next)))
+                       % n_locks;
+            if (!std::binary_search(locks.begin(), locks.end(), l) &&
+                std::find(missing.begin(), missing.end(), l) ==
+                    missing.end()) {
+                missing.push_back(l);
+            }
+            return true;
+        });
+        if (missing.empty()) {
+            break;
+        }
+        for (auto l : locks) {
+            mutexes[l].unlock();
         }
+        locks.insert(locks.end(), missing.begin(), missing.end());
+        std::sort(locks.begin(), locks.end());
     }
 
-    // values still points to the old (now empty) table.
-    free(values);
-    values = newValues;
+    {
+        // Optimistic readers of the old bucket must not trust a walk
+        // that raced with the values being relinked.
+        VersionWriteGuard sg(stripeVersion(bucket_num));
+        forEachInBucket(bucket_num, [this, next](StoredValue *v) {
+            linkValue(v, size + abs(v->getKeyHash() % static_cast<int>(next)));
+            return true;
+        });
+        values[bucket_num] = NULL;
+        if (groups) {
+            std::memset(&groups[bucket_num], 0, sizeof(HashTagGroup));
+        }
+        migrated.store(bucket_num + 1);
+    }
+    ++stats.htBucketsMigrated;
 
-    stats.memOverhead.fetch_add(memorySize());
+    for (auto l : locks) {
+        mutexes[l].unlock();
+    }
 }
 
 static size_t distance(size_t a, size_t b) {
@@ -411,8 +544,10 @@ void HashTable::resize() {
     int i(0);
     size_t new_size(0);
 
-    // Figure out where in the prime table we are.
-    ssize_t target(static_cast<ssize_t>(ni));
+    // Figure out where in the prime table we are. A tagged index keeps a
+    // few values per bucket in its group, so it wants fewer buckets.
+    ssize_t target(static_cast<ssize_t>(groups ? ni / HashTagGroup::targetLoad
+                                               : ni));
     for (i = 0; prime_size_table[i] > 0 && prime_size_table[i] < target; ++i) {
         // Just looking...
     }
@@ -429,7 +564,7 @@ void HashTable::resize() {
         new_size = size;
     } else {
         // Somewhere in the middle, use the one we're closer to.
-        new_size = nearest(ni, prime_size_table[i-1], prime_size_table[i]);
+        new_size = nearest(target, prime_size_table[i-1], prime_size_table[i]);
     }
 
     resize(new_size);
@@ -440,10 +575,10 @@ void HashTable::visit(HashTableVisitor &visitor) {
         return;
     }
 
-    // Acquire one (any) of the mutexes before incrementing {visitors}, this
-    // prevents any race between this visitor and the HashTable resizer.
+    // Acquire resizeMutex before incrementing {visitors}, this prevents
+    // any race between this visitor and the HashTable resizer.
     // See comments in pauseResumeVisit() for further details.
-    LockHolder lh(mutexes[0]);
+    LockHolder lh(resizeMutex);
     VisitorTracker vt(&visitors);
     lh.unlock();
 
@@ -456,25 +591,25 @@ void HashTable::visit(HashTableVisitor &visitor) {
             // on front-end threads.
             LockHolder lh(mutexes[l]);
 
-            StoredValue *v = values[i];
-            if (v) {
-                // TODO: Perf: This check seems costly - do we think it's still
-                // worth keeping?
-                auto hashbucket = getBucketForHash(hash(v->getKeyBytes(),
-                                                        v->getKeyLen()));
-                if (i != hashbucket) {
-                    throw std::logic_error("HashTable::visit: inconsistency "
-                            "between StoredValue's calculated hashbucket "
-                            "(which is " + std::to_string(hashbucket) +
-                            ") and bucket is is located in (which is " +
-                            std::to_string(i) + ")");
+            bool first = true;
+            forEachInBucket(i, [this, i, &first, &visitor](StoredValue *v) {
+                if (first) {
+                    // TODO: Perf: This check seems costly - do we think it's
+                    // still worth keeping?
+                    auto hashbucket = getBucketForHash(v->getKeyHash());
+                    if (i != hashbucket) {
+                        throw std::logic_error("HashTable::visit: "
+                                "inconsistency between StoredValue's "
+                                "calculated hashbucket (which is " +
+                                std::to_string(hashbucket) +
+                                ") and bucket is is located in (which is " +
+                                std::to_string(i) + ")");
+                    }
+                    first = false;
                 }
-            }
-            while (v) {
-                StoredValue *tmp = v->next;
                 visitor.visit(v);
-                v = tmp;
-            }
+                return true;
+            });
             ++visited;
         }
         lh.unlock();
@@ -487,32 +622,33 @@ void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
         return;
     }
     size_t visited = 0;
+    LockHolder rlh(resizeMutex);
     VisitorTracker vt(&visitors);
+    rlh.unlock();
 
     for (int l = 0; l < static_cast<int>(n_locks); l++) {
         LockHolder lh(mutexes[l]);
         for (int i = l; i < static_cast<int>(size); i+= n_locks) {
             size_t depth = 0;
-            StoredValue *p = values[i];
-            if (p) {
-                // TODO: Perf: This check seems costly - do we think it's still
-                // worth keeping?
-                auto hashbucket = getBucketForHash(hash(p->getKeyBytes(),
-                                                        p->getKeyLen()));
-                if (i != hashbucket) {
-                    throw std::logic_error("HashTable::visit: inconsistency "
-                            "between StoredValue's calculated hashbucket "
-                            "(which is " + std::to_string(hashbucket) +
-                            ") and bucket it is located in (which is " +
-                            std::to_string(i) + ")");
-                }
-            }
             size_t mem(0);
-            while (p) {
+            forEachInBucket(i, [this, i, &depth, &mem](StoredValue *p) {
+                if (depth == 0) {
+                    // TODO: Perf: This check seems costly - do we think it's
+                    // still worth keeping?
+                    auto hashbucket = getBucketForHash(p->getKeyHash());
+                    if (i != hashbucket) {
+                        throw std::logic_error("HashTable::visit: "
+                                "inconsistency between StoredValue's "
+                                "calculated hashbucket (which is " +
+                                std::to_string(hashbucket) +
+                                ") and bucket it is located in (which is " +
+                                std::to_string(i) + ")");
+                    }
+                }
                 depth++;
                 mem += p->size();
-                p = p->next;
-            }
+                return true;
+            });
             visitor.visit(i, depth, mem);
             ++visited;
         }
@@ -538,9 +674,10 @@ HashTable::pauseResumeVisit(PauseResumeHashTableVisitor& visitor,
     // the HashTable may be changed (by the Resizer task) between us first
     // reading it to calculate the starting hash_bucket, and then reading it
     // inside the inner for() loop. To prevent this race, we explicitly acquire
-    // (any) mutex, increment {visitors} and then release the mutex. This
-    //avoids the race as if visitors >0 then Resizer will not attempt to resize.
-    LockHolder lh(mutexes[0]);
+    // resizeMutex, increment {visitors} and then release the mutex. This
+    // avoids the race as if visitors >0 then Resizer will not attempt to
+    // resize, and a resize in progress holds resizeMutex until it is done.
+    LockHolder lh(resizeMutex);
     VisitorTracker vt(&visitors);
     lh.unlock();
 
@@ -565,12 +702,10 @@ HashTable::pauseResumeVisit(PauseResumeHashTableVisitor& visitor,
         for (; !paused && hash_bucket < size; hash_bucket += n_locks) {
             LockHolder lh(mutexes[lock]);
 
-            StoredValue *v = values[hash_bucket];
-            while (!paused && v) {
-                StoredValue *tmp = v->next;
-                paused = !visitor.visit(*v);
-                v = tmp;
-            }
+            paused = !forEachInBucket(hash_bucket,
+                                      [&visitor](StoredValue *v) {
+                return visitor.visit(*v);
+            });
         }
 
         // If the visitor paused us before we visited all hash buckets owned
@@ -643,8 +778,8 @@ add_type_t HashTable::unlocked_add(int &bucket_num,
                     return ADD_TMP_AND_BG_FETCH;
                 }
             }
-            v = valFact(itm, values[bucket_num], *this, isDirty);
-            values[bucket_num] = v;
+            v = valFact(itm, NULL, *this, isDirty);
+            linkValue(v, bucket_num);
 
             if (v->isTempItem()) {
                 ++numTempItems;
@@ -711,6 +846,10 @@ void StoredValue::setMutationMemoryThreshold(double memThreshold) {
     }
 }
 
+void StoredValue::setInlineValueSize(size_t to) {
+    inlineValueSize = to;
+}
+
 void StoredValue::increaseCacheSize(HashTable &ht, size_t by) {
     ht.cacheSize.fetch_add(by);
     ht.memSize.fetch_add(by);
@@ -747,9 +886,20 @@ bool StoredValue::hasAvailableSpace(EPStats &st, const Item &itm,
 }
 
 Item* StoredValue::toItem(bool lck, uint16_t vbucket) const {
-    Item* itm = new Item(getKey(), getFlags(), getExptime(), value,
-                         lck ? static_cast<uint64_t>(-1) : getCas(),
-                         bySeqno, vbucket, getRevSeqno());
+    uint64_t cas = lck ? static_cast<uint64_t>(-1) : getCas();
+    Item* itm;
+    if (inlineLen != 0) {
+        // Straight from the inline bytes, sparing getValue()'s extra Blob
+        ValueView view = getValueView();
+        itm = new Item(getKeyBytes(), getKeyLen(), getFlags(), getExptime(),
+                       view.data, view.len,
+                       reinterpret_cast<uint8_t *>(
+                           const_cast<char *>(view.extMeta)),
+                       view.extLen, cas, bySeqno, vbucket, getRevSeqno());
+    } else {
+        itm = new Item(getKey(), getFlags(), getExptime(), value, cas,
+                       bySeqno, vbucket, getRevSeqno());
+    }
 
     itm->setNRUValue(nru);
 
@@ -771,35 +921,215 @@ Item* StoredValue::toValuelessItem(uint16_t vbucket) const {
 }
 
 void StoredValue::reallocate() {
+    if (inlineLen != 0) {
+        // Moves with the StoredValue itself.
+        return;
+    }
     // Allocate a new Blob for this stored value; copy the existing Blob to
     // the new one and free the old.
     value_t new_val(Blob::Copy(*value));
+    VersionWriteGuard vg(writeVersion());
     value.reset(new_val);
 }
 
-Item *HashTable::getRandomKeyFromSlot(int slot) {
-    LockHolder lh = getLockedBucket(slot);
-    StoredValue *v = values[slot];
+StoredValue* StoredValueFactory::newStoredValue(const Item &itm,
+                                                StoredValue *n, HashTable &ht,
+                                                bool setDirty) {
+    const std::string &key = itm.getKey();
+    if (key.length() >= 256) {
+        throw std::invalid_argument("StoredValueFactory::newStoredValue: "
+                "item key length (which is " + std::to_string(key.length()) +
+                "is greater than 256");
+    }
 
-    while (v) {
-        if (!v->isTempItem() && !v->isDeleted() && v->isResident()) {
-            return v->toItem(false, 0);
+    // Room for the value after the key if it is small enough; it is
+    // reused by later values that fit.
+    uint8_t capacity = 0;
+    const value_t &val = itm.getValue();
+    if (val.get() != NULL &&
+        val->vlength() <= StoredValue::getInlineValueSize() &&
+        val->length() <= std::numeric_limits<uint8_t>::max()) {
+        capacity = static_cast<uint8_t>(val->length());
+    }
+
+    size_t len = StoredValue::allocSize(key.length(), capacity);
+
+    void *mem = arena ? arena->allocate(len) : NULL;
+    if (mem == NULL) {
+        mem = ::operator new(len);
+    }
+    StoredValue *t = new (mem)
+                     StoredValue(itm, n, *stats, ht, setDirty, capacity);
+    std::memcpy(t->keybytes, key.data(), key.length());
+    t->keyHash = static_cast<uint32_t>(ht.hash(key));
+    t->optimisticReads = ht.hasOptimisticReads();
+    return t;
+}
+
+Item *HashTable::optimisticGet(const std::string &key, uint16_t vbucket,
+                               bool hideLockedCas, bool trackReference,
+                               int64_t &bySeqno, uint8_t &nru) {
+    if (!stripeVersions || !isActive()) {
+        return NULL;
+    }
+    // Nothing read below is freed before the guard is left.
+    ReadEpoch::Guard guard;
+    if (!guard.entered()) {
+        return NULL;
+    }
+
+    const int h = hash(key);
+    for (int attempt = 0; attempt < OPTIMISTIC_GET_ATTEMPTS; ++attempt) {
+        // Take a consistent snapshot of the bucket arrays. The next* ones
+        // are published before nextSize when a resize starts.
+        const uint32_t tv = tableVersion.load(std::memory_order_acquire);
+        const int sz = static_cast<int>(size.load());
+        const int next = static_cast<int>(nextSize.load());
+        StoredValue **vals = values;
+        HashTagGroup *grps = groups;
+        StoredValue **nextVals = nextValues;
+        HashTagGroup *nextGrps = nextGroups;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ((tv & 1) || tableVersion.load(std::memory_order_relaxed) != tv) {
+            continue;
+        }
+
+        // Same choice of bucket as getBucketForHash().
+        int bucket = abs(h % sz);
+        const bool moved = next != 0 &&
+                           static_cast<size_t>(bucket) < migrated.load();
+        if (moved) {
+            bucket = abs(h % next);
+            vals = nextVals;
+            grps = nextGrps;
+        }
+        AtomicValue<uint32_t> &stripe =
+            stripeVersions[bucket % n_locks].version;
+        const uint32_t sv = stripe.load(std::memory_order_acquire);
+        if ((sv & 1) || (!moved && next != 0 &&
+                         static_cast<size_t>(bucket) < migrated.load())) {
+            // Being changed, or migrated since we looked.
+            continue;
+        }
+
+        StoredValue *v = NULL;
+        size_t depth = 0;
+        if (grps) {
+            const HashTagGroup &g = grps[bucket];
+            uint64_t m = g.match(HashTagGroup::tagForHash(h));
+            while (m && !v) {
+                StoredValue *slot = g.slots[HashTagGroup::slotOf(m)];
+                if (slot && slot->hasKey(key)) {
+                    v = slot;
+                }
+                m &= m - 1;
+            }
+        }
+        for (StoredValue *p = v ? NULL : vals[bucket]; p; p = p->next) {
+            if (++depth > OPTIMISTIC_GET_MAX_DEPTH) {
+                return NULL;
+            }
+            if (p->hasKey(key)) {
+                v = p;
+                break;
+            }
+        }
+        if (v == NULL) {
+            // Misses may need a background fetch or a temp item.
+            return NULL;
+        }
+
+        const uint32_t vv = v->version.load(std::memory_order_acquire);
+        if (vv & 1) {
+            continue;
+        }
+        if (v->deleted || v->isTempItem() || v->isExpired(ep_real_time()) ||
+            (trackReference && v->nru > MIN_NRU_VALUE)) {
+            // The locked path deals with these.
+            return NULL;
+        }
+        Blob *blob = v->value.get();
+        // An inline value may be half overwritten, copy it out now and
+        // only trust it once the version checks out.
+        char inlineBytes[std::numeric_limits<uint8_t>::max()];
+        const uint8_t inlineLen = v->inlineLen;
+        const uint8_t inlineExtLen = v->inlineExtLen;
+        if (inlineLen != 0 && inlineLen <= v->inlineCap &&
+            inlineExtLen + FLEX_DATA_OFFSET <= inlineLen) {
+            std::memcpy(inlineBytes, v->getInlineBytes(), inlineLen);
+        }
+        const uint64_t cas = v->cas;
+        const uint64_t revSeqno = v->revSeqno;
+        const int64_t seqno = v->bySeqno;
+        const rel_time_t lockExpiry = v->lock_expiry;
+        const time_t exptime = v->exptime;
+        const uint32_t flags = v->flags;
+        const uint8_t nruValue = v->nru;
+        const uint8_t conflictResMode = v->conflictResMode;
+        if (blob == NULL && inlineLen == 0) {
+            return NULL;
+        }
+
+        // Take our reference before checking whether the blob still is
+        // the value's; a released one cannot be taken.
+        value_t val;
+        if (blob != NULL) {
+            val = value_t::tryAcquire(blob);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ((blob != NULL && !val) ||
+            v->version.load(std::memory_order_relaxed) != vv ||
+            stripe.load(std::memory_order_relaxed) != sv ||
+            tableVersion.load(std::memory_order_relaxed) != tv) {
+            continue;
         }
-        v = v->next;
+
+        if (blob == NULL) {
+            val.reset(StoredValue::newBlobFromInline(inlineBytes, inlineLen,
+                                                     inlineExtLen));
+        }
+
+        const bool locked = hideLockedCas && lockExpiry != 0 &&
+                            ep_current_time() <= lockExpiry;
+        bySeqno = seqno;
+        nru = nruValue;
+        return new Item(key, flags, exptime, val,
+                        locked ? static_cast<uint64_t>(-1) : cas,
+                        seqno, vbucket, revSeqno, nruValue, conflictResMode);
     }
 
+    ++stats.htOptimisticConflicts;
     return NULL;
 }
 
+Item *HashTable::getRandomKeyFromSlot(int slot) {
+    LockHolder lh = getLockedBucket(slot);
+    if (static_cast<size_t>(slot) >= size + nextSize) {
+        // A resize finished meanwhile.
+        return NULL;
+    }
+    Item *rv = NULL;
+    forEachInBucket(slot, [&rv](StoredValue *v) {
+        if (!v->isTempItem() && !v->isDeleted() && v->isResident()) {
+            rv = v->toItem(false, 0);
+            return false;
+        }
+        return true;
+    });
+
+    return rv;
+}
+
 Item* HashTable::getRandomKey(long rnd) {
-    /* Try to locate a partition */
-    size_t start = rnd % size;
+    /* Try to locate a partition, in both tables while resizing */
+    size_t slots = size + nextSize;
+    size_t start = rnd % slots;
     size_t curr = start;
     Item *ret;
 
     do {
         ret = getRandomKeyFromSlot(curr++);
-        if (curr == size) {
+        if (curr == slots) {
             curr = 0;
         }
     } while (ret == NULL && curr != start);
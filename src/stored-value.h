@@ -20,22 +20,63 @@
 
 #include "config.h"
 
+#include <cstddef>
+#include <limits>
+
 #include "item_pager.h"
+#include "murmurhash3.h"
+#include "read_epoch.h"
+#include "slab_arena.h"
 #include "utility.h"
 
 // Forward declaration for StoredValue
 class HashTable;
 class StoredValueFactory;
 
+/**
+ * Writer side of a seqlock version: the version is odd while the data
+ * it covers is being changed, so an optimistic reader can tell that what
+ * it read may be torn. Guards nest, only the outermost one bumps the
+ * version, and a NULL version makes it a no-op. Writers still need their
+ * own lock between themselves.
+ */
+class VersionWriteGuard {
+public:
+    explicit VersionWriteGuard(AtomicValue<uint32_t> *v) : version(NULL) {
+        if (v == NULL) {
+            return;
+        }
+        uint32_t cur = v->load(std::memory_order_relaxed);
+        if (!(cur & 1)) {
+            v->store(cur + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            version = v;
+        }
+    }
+
+    ~VersionWriteGuard() {
+        if (version) {
+            version->store(version->load(std::memory_order_relaxed) + 1,
+                           std::memory_order_release);
+        }
+    }
+
+private:
+    //! The version this guard made odd, NULL if it didn't
+    AtomicValue<uint32_t> *version;
+    DISALLOW_COPY_AND_ASSIGN(VersionWriteGuard);
+};
+
 /**
  * In-memory storage for an item.
  */
 class StoredValue {
 public:
 
+    // Released through ReadEpoch, see HashTable::optimisticGet().
     void operator delete(void* p) {
-        ::operator delete(p);
-     }
+        ReadEpoch::retire(p, SlabArena::deallocate);
+    }
 
     uint8_t getNRUValue();
 
@@ -90,6 +131,7 @@ public:
     }
 
     void setConflictResMode(enum conflict_resolution_mode conflict_res_mode) {
+        VersionWriteGuard vg(writeVersion());
         conflictResMode = static_cast<uint8_t>(conflict_res_mode);
     }
 
@@ -133,6 +175,14 @@ public:
         return keylen;
     }
 
+    /**
+     * Get the hash of the key, as computed by the owning HashTable when
+     * this StoredValue was created.
+     */
+    int getKeyHash() const {
+        return static_cast<int>(keyHash);
+    }
+
     /**
      * True of this item is for the given key.
      *
@@ -152,12 +202,58 @@ public:
     }
 
     /**
-     * Get this item's value.
+     * Get this item's value, for callers that keep a reference to it. A
+     * value kept inline is copied into a new Blob; callers only reading
+     * the value should use getValueView() instead.
      */
-    const value_t &getValue() const {
+    value_t getValue() const {
+        if (inlineLen != 0) {
+            return value_t(newBlobFromInline(getInlineBytes(), inlineLen,
+                                             inlineExtLen));
+        }
         return value;
     }
 
+    /**
+     * A borrowed view of the value, valid while the hash bucket lock is
+     * held and the value is left unchanged.
+     */
+    struct ValueView {
+        const char *data;
+        size_t len;
+        const char *extMeta;
+        uint8_t extLen;
+    };
+
+    /**
+     * Get a view of this item's value without copying it; all fields are
+     * zero if there is no value.
+     */
+    ValueView getValueView() const {
+        ValueView view = {NULL, 0, NULL, 0};
+        if (inlineLen != 0) {
+            const char *bytes = getInlineBytes() + FLEX_DATA_OFFSET;
+            view.extLen = inlineExtLen;
+            view.extMeta = inlineExtLen > 0 ? bytes : NULL;
+            view.data = bytes + inlineExtLen;
+            view.len = inlineLen - FLEX_DATA_OFFSET - inlineExtLen;
+        } else if (value.get() != NULL) {
+            view.extLen = value->getExtLen();
+            view.extMeta = value->getExtMeta();
+            view.data = value->getData();
+            view.len = value->vlength();
+        }
+        return view;
+    }
+
+    /**
+     * True if the value is kept in this StoredValue's own allocation
+     * rather than in a Blob of its own.
+     */
+    bool isValueInline() const {
+        return inlineLen != 0;
+    }
+
     /**
      * Get the expiration time of this item.
      *
@@ -168,6 +264,7 @@ public:
     }
 
     void setExptime(time_t tim) {
+        VersionWriteGuard vg(writeVersion());
         exptime = tim;
         markDirty();
     }
@@ -185,6 +282,7 @@ public:
      * Set the client-defined flags for this item.
      */
     void setFlags(uint32_t fl) {
+        VersionWriteGuard vg(writeVersion());
         flags = fl;
     }
 
@@ -196,9 +294,10 @@ public:
      * @param preserveSeqno Preserve the revision sequence number from the item.
      */
     void setValue(Item &itm, HashTable &ht, bool preserveSeqno) {
+        VersionWriteGuard vg(writeVersion());
         size_t currSize = size();
         reduceCacheSize(ht, currSize);
-        value = itm.getValue();
+        assignValue(itm.getValue());
         deleted = false;
         flags = itm.getFlags();
         bySeqno = itm.getBySeqno();
@@ -232,6 +331,7 @@ public:
             throw std::logic_error("StoredValue::resetValue: Not possible to "
                     "reset the value of a deleted item");
         }
+        VersionWriteGuard vg(writeVersion());
         markNotResident();
         // item no longer resident once reset the value
         deleted = true;
@@ -276,6 +376,7 @@ public:
      * This is a NOOP for small item types.
      */
     void setCas(uint64_t c) {
+        VersionWriteGuard vg(writeVersion());
         cas = c;
     }
 
@@ -285,6 +386,7 @@ public:
      * This is a NOOP for small item types.
      */
     void lock(rel_time_t expiry) {
+        VersionWriteGuard vg(writeVersion());
         lock_expiry = expiry;
     }
 
@@ -292,6 +394,7 @@ public:
      * Unlock this item.
      */
     void unlock() {
+        VersionWriteGuard vg(writeVersion());
         lock_expiry = 0;
     }
 
@@ -325,18 +428,21 @@ public:
             throw std::invalid_argument("StoredValue::setBySeqno: to "
                     "(which is " + std::to_string(to) + ") must be positive");
         }
+        VersionWriteGuard vg(writeVersion());
         bySeqno = to;
     }
 
     // Marks the stored item as deleted.
     void setDeleted()
     {
+        VersionWriteGuard vg(writeVersion());
         bySeqno = state_deleted_key;
     }
 
     // Marks the stored item as non-existent.
     void setNonExistent()
     {
+        VersionWriteGuard vg(writeVersion());
         bySeqno = state_non_existent_key;
     }
 
@@ -375,7 +481,7 @@ public:
         if (isDeleted() || !isResident()) {
             return 0;
         }
-        return value->length();
+        return inlineLen != 0 ? inlineLen : value->length();
     }
 
     /**
@@ -399,6 +505,7 @@ public:
      */
     bool isLocked(rel_time_t curtime) {
         if (lock_expiry == 0 || (curtime > lock_expiry)) {
+            // Both values read as unlocked, no need to bump the version.
             lock_expiry = 0;
             return false;
         }
@@ -409,11 +516,13 @@ public:
      * True if this value is resident in memory currently.
      */
     bool isResident() const {
-        return value.get() != NULL;
+        return value.get() != NULL || inlineLen != 0;
     }
 
     void markNotResident() {
+        VersionWriteGuard vg(writeVersion());
         value.reset();
+        inlineLen = 0;
     }
 
     /**
@@ -431,6 +540,7 @@ public:
             return;
         }
 
+        VersionWriteGuard vg(writeVersion());
         reduceCacheSize(ht, valuelen());
         resetValue();
         markDirty();
@@ -445,6 +555,7 @@ public:
      * Set a new revision sequence number.
      */
     void setRevSeqno(uint64_t s) {
+        VersionWriteGuard vg(writeVersion());
         revSeqno = s;
     }
 
@@ -506,7 +617,17 @@ public:
     }
 
     size_t getObjectSize() const {
-        return (sizeof(StoredValue) - sizeof(keybytes)) + keylen;
+        return allocSize(keylen, inlineCap);
+    }
+
+    /**
+     * Set the largest value (in bytes, not counting its extended meta data)
+     * a new StoredValue keeps inline, 0 to keep every value in a Blob.
+     */
+    static void setInlineValueSize(size_t to);
+
+    static size_t getInlineValueSize() {
+        return inlineValueSize;
     }
 
     /**
@@ -518,9 +639,13 @@ public:
 private:
 
     StoredValue(const Item &itm, StoredValue *n, EPStats &stats, HashTable &ht,
-                bool setDirty = true) :
-        value(itm.getValue()), next(n), bySeqno(itm.getBySeqno()),
-        flags(itm.getFlags()) {
+                bool setDirty = true, uint8_t inlineCapacity = 0) :
+        next(n), bySeqno(itm.getBySeqno()), flags(itm.getFlags()),
+        version(0), inlineCap(inlineCapacity), inlineLen(0),
+        inlineExtLen(0) {
+        // Not visible to optimistic readers yet, the factory turns the
+        // version on once the value is set up.
+        optimisticReads = false;
         cas = itm.getCas();
         exptime = itm.getExptime();
         deleted = false;
@@ -530,6 +655,7 @@ private:
         keylen = itm.getNKey();
         revSeqno = itm.getRevSeqno();
         conflictResMode = itm.getConflictResMode();
+        assignValue(itm.getValue());
 
         if (setDirty) {
             markDirty();
@@ -558,14 +684,77 @@ private:
     rel_time_t         lock_expiry;    //!< getl lock expiration
     uint32_t           exptime;        //!< Expiration time of this item.
     uint32_t           flags;          // 4 bytes
+    uint32_t           keyHash;        //!< HashTable::hash() of the key
+    //! Seqlock version of the fields above, see HashTable::optimisticGet
+    AtomicValue<uint32_t> version;
     bool               _isDirty  :  1; // 1 bit
     bool               deleted   :  1;
     bool               newCacheItem : 1;
+    //! Whether version is kept, see HashTable::hasOptimisticReads()
+    bool               optimisticReads : 1;
     uint8_t            conflictResMode : 2;
     uint8_t            nru       :  2; //!< True if referenced since last sweep
+    //! Bytes reserved for an inline value after the key, 0 if none
+    uint8_t            inlineCap;
+    //! Length of the inline value as Blob::length() counts it, 0 if none
+    uint8_t            inlineLen;
+    uint8_t            inlineExtLen;   //!< Extended meta length of it
     uint8_t            keylen;
     char               keybytes[1];    //!< The key itself.
 
+    /**
+     * Bytes allocated for a StoredValue with the given key length and
+     * inline capacity.
+     */
+    static size_t allocSize(size_t nkey, size_t capacity) {
+        return offsetof(StoredValue, keybytes) + nkey + capacity;
+    }
+
+    /**
+     * The inline value follows the key: the flex meta code, the extended
+     * meta data and the value, laid out the way Blob::getBlob() has them.
+     */
+    char *getInlineBytes() {
+        return keybytes + keylen;
+    }
+
+    const char *getInlineBytes() const {
+        return keybytes + keylen;
+    }
+
+    static Blob *newBlobFromInline(const char *bytes, uint8_t len,
+                                   uint8_t extLen) {
+        return Blob::New(bytes + FLEX_DATA_OFFSET + extLen,
+                         len - FLEX_DATA_OFFSET - extLen,
+                         reinterpret_cast<uint8_t *>(
+                             const_cast<char *>(bytes + FLEX_DATA_OFFSET)),
+                         extLen);
+    }
+
+    /**
+     * The version a change to this value bumps, NULL if the hash table
+     * holding it isn't read optimistically.
+     */
+    AtomicValue<uint32_t> *writeVersion() {
+        return optimisticReads ? &version : NULL;
+    }
+
+    /**
+     * Take a new value, copying it inline if it fits in the space reserved
+     * at creation; bigger ones stay in their Blob.
+     */
+    void assignValue(const value_t &val) {
+        if (val.get() != NULL && val->length() <= inlineCap) {
+            std::memcpy(getInlineBytes(), val->getBlob(), val->length());
+            inlineLen = static_cast<uint8_t>(val->length());
+            inlineExtLen = val->getExtLen();
+            value.reset();
+        } else {
+            value = val;
+            inlineLen = 0;
+        }
+    }
+
     static void increaseMetaDataSize(HashTable &ht, EPStats &st, size_t by);
     static void reduceMetaDataSize(HashTable &ht, EPStats &st, size_t by);
     static void increaseCacheSize(HashTable &ht, size_t by);
@@ -573,6 +762,7 @@ private:
     static bool hasAvailableSpace(EPStats&, const Item &item,
                                   bool isReplication=false);
     static double mutation_mem_threshold;
+    static size_t inlineValueSize;
 
     DISALLOW_COPY_AND_ASSIGN(StoredValue);
 };
@@ -738,7 +928,15 @@ public:
     /**
      * Create a new StoredValueFactory of the given type.
      */
-    StoredValueFactory(EPStats &s) : stats(&s) { }
+    StoredValueFactory(EPStats &s) : stats(&s), arena(NULL) { }
+
+    /**
+     * Allocate from the given arena from now on, NULL for the general
+     * purpose allocator.
+     */
+    void setArena(SlabArena *a) {
+        arena = a;
+    }
 
     /**
      * Create a new StoredValue with the given item.
@@ -756,29 +954,129 @@ public:
 private:
 
     StoredValue* newStoredValue(const Item &itm, StoredValue *n, HashTable &ht,
-                                bool setDirty) {
-        // Do not consider the size of the char pointer (keybytes)
-        // that is used to hold the key
-        size_t base = sizeof(StoredValue) - sizeof(char);
-
-        const std::string &key = itm.getKey();
-        if (key.length() >= 256) {
-            throw std::invalid_argument("StoredValueFactory::newStoredValue: "
-                    "item key length (which is " + std::to_string(key.length()) +
-                    "is greater than 256");
+                                bool setDirty);
+
+    EPStats                *stats;
+    SlabArena              *arena;
+};
+
+/**
+ * Hash functions a HashTable can place its keys with (ht_hash_function).
+ */
+enum ht_hash_function_t {
+    HT_HASH_DJB2,   //!< Byte at a time DJB2/xor, the historical one
+    HT_HASH_MURMUR3 //!< MurmurHash3 (x86_32), four bytes at a time
+};
+
+/**
+ * How a HashTable indexes the values within a hash bucket (ht_index).
+ */
+enum ht_index_t {
+    HT_INDEX_CHAINED, //!< A linked list through StoredValue::next
+    HT_INDEX_TAGGED   //!< A HashTagGroup in front of the list
+};
+
+/**
+ * A small group of slots in front of a hash bucket's chain, used by the
+ * tagged index.
+ *
+ * Each slot holds a value and a one byte tag: the top bit marks the slot
+ * as used and the low seven bits come from the top of the key hash (the
+ * bucket number comes from its low bits). A lookup compares the wanted
+ * tag against all eight tags of the group at once and only touches the
+ * StoredValues whose tag matched, so most misses and most collisions in
+ * the bucket are rejected by reading the 8 byte tag word alone. With the
+ * eight slot pointers the group takes 72 bytes, so it spans two cache
+ * lines and a match may cost a second one.
+ *
+ * Values that do not fit into the group spill over into the regular
+ * chain. A removed value leaves a hole rather than pulling one back from
+ * the chain, so a snapshot of the slots taken by a visitor stays valid
+ * while it deletes the value it is looking at.
+ */
+struct HashTagGroup {
+    static const size_t width = 8;
+
+    //! Average number of values per bucket the tagged index is sized for
+    static const size_t targetLoad = 4;
+
+    static uint8_t tagForHash(int h) {
+        return static_cast<uint8_t>(0x80 |
+                                    ((static_cast<uint32_t>(h) >> 25) & 0x7f));
+    }
+
+    /**
+     * Get the slots whose tag may be the given one, as a mask with the top
+     * bit of each matching slot's byte set. It may report a false match
+     * next to a real one, never misses one.
+     */
+    uint64_t match(uint8_t tag) const {
+        const uint64_t x = tags ^ (lowBits * tag);
+        return (x - lowBits) & ~x & highBits;
+    }
+
+    //! Mask of the unused slots, in the same form as match()
+    uint64_t empty() const {
+        return ~tags & highBits;
+    }
+
+    //! Slot number of the lowest bit set in a match() or empty() mask
+    static size_t slotOf(uint64_t mask) {
+#ifdef __GNUC__
+        return static_cast<size_t>(__builtin_ctzll(mask)) >> 3;
+#else
+        size_t i = 0;
+        while (!(mask & (0x80ULL << (i * 8)))) {
+            ++i;
         }
+        return i;
+#endif
+    }
 
-        size_t len = key.length() + base;
+    /**
+     * Put the value into a free slot.
+     *
+     * @return false if the group is full
+     */
+    bool insert(StoredValue *v, int h) {
+        uint64_t free = empty();
+        if (!free) {
+            return false;
+        }
+        size_t i = slotOf(free);
+        slots[i] = v;
+        tags |= static_cast<uint64_t>(tagForHash(h)) << (i * 8);
+        return true;
+    }
 
-        StoredValue *t = new (::operator new(len))
-                         StoredValue(itm, n, *stats, ht, setDirty);
-        std::memcpy(t->keybytes, key.data(), key.length());
-        return t;
+    /**
+     * Clear the slot holding the value.
+     *
+     * @return false if the value is not in the group
+     */
+    bool remove(const StoredValue *v) {
+        for (size_t i = 0; i < width; ++i) {
+            if (slots[i] == v) {
+                slots[i] = NULL;
+                tags &= ~(0xffULL << (i * 8));
+                return true;
+            }
+        }
+        return false;
     }
 
-    EPStats                *stats;
+    static const uint64_t lowBits = 0x0101010101010101ULL;
+    static const uint64_t highBits = 0x8080808080808080ULL;
+
+    uint64_t     tags;
+    StoredValue *slots[width];
 };
 
+static_assert(sizeof(HashTagGroup) == sizeof(uint64_t) +
+                                      HashTagGroup::width *
+                                      sizeof(StoredValue *),
+              "HashTagGroup should hold only its tag word and slots");
+
 /**
  * A container of StoredValue instances.
  */
@@ -830,18 +1128,40 @@ public:
      * @param st the global stats reference
      * @param s the number of hash table buckets
      * @param l the number of locks in the hash table
-     */
-    HashTable(EPStats &st, size_t s = 0, size_t l = 0) :
+     * @param hf the hash function to place keys with
+     * @param idx how the values within a bucket are indexed
+     * @param optimistic whether optimisticGet() may read without locking
+     */
+    HashTable(EPStats &st, size_t s = 0, size_t l = 0,
+              ht_hash_function_t hf = getDefaultHashFunction(),
+              ht_index_t idx = getDefaultIndex(),
+              bool optimistic = getDefaultOptimisticReads(),
+              bool slab = getDefaultSlabAllocator()) :
         maxDeletedRevSeqno(0), numTotalItems(0),
         numNonResidentItems(0), numEjects(0),
         memSize(0), cacheSize(0), metaDataMemory(0), stats(st),
         valFact(st), visitors(0), numItems(0), numResizes(0),
-        numTempItems(0)
+        numTempItems(0), hashFunction(hf), index(idx), nextSize(0),
+        migrated(0), nextValues(NULL), nextGroups(NULL),
+        stripeVersions(NULL), tableVersion(0), arena(NULL)
     {
         size = HashTable::getNumBuckets(s);
         n_locks = HashTable::getNumLocks(l);
         values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
+        groups = NULL;
+        if (index == HT_INDEX_TAGGED) {
+            groups = static_cast<HashTagGroup*>(calloc(size,
+                                                       sizeof(HashTagGroup)));
+        }
         mutexes = new Mutex[n_locks];
+        if (optimistic) {
+            stripeVersions = new StripeVersion[n_locks]();
+            ReadEpoch::enable();
+        }
+        if (slab) {
+            arena = new SlabArena(stats);
+            valFact.setArena(arena);
+        }
         activeState = true;
     }
 
@@ -856,14 +1176,21 @@ public:
 #endif
         }
         delete []mutexes;
+        delete []stripeVersions;
         free(values);
         values = NULL;
+        free(groups);
+        groups = NULL;
     }
 
     size_t memorySize() {
         return sizeof(HashTable)
             + (size * sizeof(StoredValue*))
-            + (n_locks * sizeof(Mutex));
+            + (groups ? size * sizeof(HashTagGroup) : 0)
+            + (nextSize * sizeof(StoredValue*))
+            + (nextGroups ? nextSize * sizeof(HashTagGroup) : 0)
+            + (n_locks * sizeof(Mutex))
+            + (stripeVersions ? n_locks * sizeof(StripeVersion) : 0);
     }
 
     /**
@@ -956,6 +1283,17 @@ public:
      */
     size_t getNumResizes() { return numResizes; }
 
+    /**
+     * Get the number of buckets a resize in progress is moving the
+     * values to, 0 if the hash table isn't being resized.
+     */
+    size_t getResizeTarget() { return nextSize; }
+
+    /**
+     * Get the number of buckets a resize in progress has moved so far.
+     */
+    size_t getResizeMigrated() { return migrated; }
+
     /**
      * Get the number of temp. items within this hash table.
      */
@@ -968,6 +1306,10 @@ public:
 
     /**
      * Resize to the specified size.
+     *
+     * The values are moved over to the new buckets incrementally, so
+     * operations on the hash table aren't held up for the whole resize,
+     * only the calling thread is.
      */
     void resize(size_t to);
 
@@ -983,10 +1325,33 @@ public:
                     "non-active object");
         }
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        return unlocked_find(key, bucket_num, false, trackReference);
+        int h = hash(key);
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        return unlocked_find(key, bucket_num, h, false, trackReference);
     }
 
+    /**
+     * Get a copy of a live, resident item without taking the bucket lock
+     * (ht_optimistic_reads).
+     *
+     * The lookup walks the bucket under a ReadEpoch::Guard and validates
+     * what it read against the seqlock versions of the table, of the lock
+     * stripe and of the value. It gives up rather than wait for a writer.
+     *
+     * @param key the key to find
+     * @param vbucket the vbucket of the item returned
+     * @param hideLockedCas return -1 as the CAS of a locked item
+     * @param trackReference true if the access counts for the NRU
+     * @param bySeqno output parameter to receive the item's seqno
+     * @param nru output parameter to receive the item's NRU value
+     * @return a new item, or NULL if the caller has to take the locked
+     *         path: the item is missing, deleted, temporary, not resident,
+     *         expired, needs its NRU updated or kept changing underneath
+     */
+    Item *optimisticGet(const std::string &key, uint16_t vbucket,
+                        bool hideLockedCas, bool trackReference,
+                        int64_t &bySeqno, uint8_t &nru);
+
     /**
      * Find a resident item
      *
@@ -1028,8 +1393,10 @@ public:
                         bool hasMetaData = true, item_eviction_policy_t policy = VALUE_ONLY,
                         uint8_t nru=0xff) {
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num, true, false);
+        int h = hash(val.getKey());
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        StoredValue *v = unlocked_find(val.getKey(), bucket_num, h, true,
+                                       false);
         return unlocked_set(v, val, cas, allowExisting, hasMetaData, policy, nru);
     }
 
@@ -1111,9 +1478,8 @@ public:
         } else if (cas != 0) {
             rv = NOT_FOUND;
         } else {
-            int bucket_num = getBucketForHash(hash(itm.getKey()));
-            v = valFact(itm, values[bucket_num], *this);
-            values[bucket_num] = v;
+            v = valFact(itm, NULL, *this);
+            linkValue(v, getBucketForHash(v->getKeyHash()));
             ++numItems;
             ++numTotalItems;
             if (nru <= MAX_NRU_VALUE && !v->isTempItem()) {
@@ -1167,8 +1533,10 @@ public:
                     "non-active object");
         }
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(val.getKey(), &bucket_num);
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num, true, false);
+        int h = hash(val.getKey());
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        StoredValue *v = unlocked_find(val.getKey(), bucket_num, h, true,
+                                       false);
         return unlocked_add(bucket_num, v, val, policy, isDirty, storeVal);
     }
 
@@ -1225,8 +1593,9 @@ public:
                     "non-active object");
         }
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        StoredValue *v = unlocked_find(key, bucket_num, false, false);
+        int h = hash(key);
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        StoredValue *v = unlocked_find(key, bucket_num, h, false, false);
         return unlocked_softDelete(v, cas, policy);
     }
 
@@ -1308,25 +1677,21 @@ public:
      *
      * @param key the key of the item to find
      * @param bucket_num the bucket number
+     * @param h the hash of the key the bucket was locked for
      * @param wantsDeleted true if soft deleted items should be returned
      *
      * @return a pointer to a StoredValue -- NULL if not found
      */
-    StoredValue *unlocked_find(const std::string &key, int bucket_num,
+    StoredValue *unlocked_find(const std::string &key, int bucket_num, int h,
                                bool wantsDeleted=false, bool trackReference=true) {
-        StoredValue *v = values[bucket_num];
-        while (v) {
-            if (v->hasKey(key)) {
-                if (trackReference && !v->isDeleted()) {
-                    v->referenced();
-                }
-                if (wantsDeleted || !v->isDeleted()) {
-                    return v;
-                } else {
-                    return NULL;
-                }
+        StoredValue *v = findInBucket(key, bucket_num, h);
+        if (v) {
+            if (trackReference && !v->isDeleted()) {
+                v->referenced();
+            }
+            if (wantsDeleted || !v->isDeleted()) {
+                return v;
             }
-            v = v->next;
         }
         return NULL;
     }
@@ -1344,6 +1709,12 @@ public:
             throw std::logic_error("HashTable::hash: Cannot call on a "
                     "non-active object");
         }
+        if (hashFunction == HT_HASH_MURMUR3) {
+            uint32_t h;
+            MurmurHash3_x86_32(str, static_cast<int>(len), 5381, &h);
+            return static_cast<int>(h);
+        }
+
         int h=5381;
 
         for(size_t i=0; i < len; i++) {
@@ -1370,8 +1741,13 @@ public:
      * @return a locked LockHolder
      */
     inline LockHolder getLockedBucket(int bucket) {
-        LockHolder rv(mutexes[mutexForBucket(bucket)]);
-        return rv;
+        while (true) {
+            size_t m = mutexForBucket(bucket);
+            LockHolder rv(mutexes[m]);
+            if (m == mutexForBucket(bucket)) {
+                return rv;
+            }
+        }
     }
 
     /**
@@ -1389,8 +1765,11 @@ public:
                         "Cannot call on a non-active object");
             }
             *bucket = getBucketForHash(h);
-            LockHolder rv(mutexes[mutexForBucket(*bucket)]);
-            if (*bucket == getBucketForHash(h)) {
+            size_t m = mutexForBucket(*bucket);
+            LockHolder rv(mutexes[m]);
+            // A resize may have moved the value (or finished) meanwhile.
+            if (*bucket == getBucketForHash(h) &&
+                m == mutexForBucket(*bucket)) {
                 return rv;
             }
         }
@@ -1428,63 +1807,34 @@ public:
      *
      * @param key the key to delete
      * @param bucket_num the bucket to look in (must already be locked)
+     * @param h the hash of the key the bucket was locked for
      * @return true if an object was deleted, false otherwise
      */
-    bool unlocked_del(const std::string &key, int bucket_num) {
+    bool unlocked_del(const std::string &key, int bucket_num, int h) {
         if (!isActive()) {
             throw std::logic_error("HashTable::unlocked_del: Cannot call on a "
                     "non-active object");
         }
-        StoredValue *v = values[bucket_num];
-
-        // Special case empty bucket.
+        StoredValue *v = findInBucket(key, bucket_num, h);
         if (!v) {
             return false;
         }
 
-        // Special case the first one
-        if (v->hasKey(key)) {
-            if (!v->isDeleted() && v->isLocked(ep_current_time())) {
-                return false;
-            }
-
-            values[bucket_num] = v->next;
-            StoredValue::reduceCacheSize(*this, v->size());
-            StoredValue::reduceMetaDataSize(*this, stats, v->metaDataSize());
-            if (v->isTempItem()) {
-                --numTempItems;
-            } else {
-                decrNumItems();
-                decrNumTotalItems();
-            }
-            delete v;
-            return true;
+        if (!v->isDeleted() && v->isLocked(ep_current_time())) {
+            return false;
         }
 
-        while (v->next) {
-            if (v->next->hasKey(key)) {
-                StoredValue *tmp = v->next;
-                if (!tmp->isDeleted() && tmp->isLocked(ep_current_time())) {
-                    return false;
-                }
-
-                v->next = v->next->next;
-                StoredValue::reduceCacheSize(*this, tmp->size());
-                StoredValue::reduceMetaDataSize(*this, stats, tmp->metaDataSize());
-                if (tmp->isTempItem()) {
-                    --numTempItems;
-                } else {
-                    decrNumItems();
-                    decrNumTotalItems();
-                }
-                delete tmp;
-                return true;
-            } else {
-                v = v->next;
-            }
+        unlinkValue(v, bucket_num);
+        StoredValue::reduceCacheSize(*this, v->size());
+        StoredValue::reduceMetaDataSize(*this, stats, v->metaDataSize());
+        if (v->isTempItem()) {
+            --numTempItems;
+        } else {
+            decrNumItems();
+            decrNumTotalItems();
         }
-
-        return false;
+        delete v;
+        return true;
     }
 
     /**
@@ -1495,8 +1845,9 @@ public:
      */
     bool del(const std::string &key) {
         int bucket_num(0);
-        LockHolder lh = getLockedBucket(key, &bucket_num);
-        return unlocked_del(key, bucket_num);
+        int h = hash(key);
+        LockHolder lh = getLockedBucket(h, &bucket_num);
+        return unlocked_del(key, bucket_num, h);
     }
 
     /**
@@ -1563,6 +1914,64 @@ public:
      */
     static void setDefaultNumLocks(size_t);
 
+    /**
+     * Set the default hash function by its configuration name
+     * ("djb2", "murmur3"); unknown names are ignored.
+     */
+    static void setDefaultHashFunction(const std::string &name);
+
+    static ht_hash_function_t getDefaultHashFunction() {
+        return defaultHashFunction;
+    }
+
+    ht_hash_function_t getHashFunction() const {
+        return hashFunction;
+    }
+
+    /**
+     * Set the default bucket index by its configuration name
+     * ("chained", "tagged"); unknown names are ignored.
+     */
+    static void setDefaultIndex(const std::string &name);
+
+    static ht_index_t getDefaultIndex() {
+        return defaultIndex;
+    }
+
+    ht_index_t getIndex() const {
+        return index;
+    }
+
+    /**
+     * Set whether new hash tables support optimisticGet().
+     */
+    static void setDefaultOptimisticReads(bool to);
+
+    static bool getDefaultOptimisticReads() {
+        return defaultOptimisticReads;
+    }
+
+    bool hasOptimisticReads() const {
+        return stripeVersions != NULL;
+    }
+
+    /**
+     * Set whether new hash tables allocate their StoredValues from an
+     * arena of their own.
+     */
+    static void setDefaultSlabAllocator(bool to);
+
+    static bool getDefaultSlabAllocator() {
+        return defaultSlabAllocator;
+    }
+
+    /**
+     * Get the arena the StoredValues are allocated from, NULL if none.
+     */
+    const SlabArena *getArena() const {
+        return arena;
+    }
+
     /**
      * Get the max deleted revision seqno seen so far.
      */
@@ -1618,6 +2027,8 @@ private:
     AtomicValue<size_t> size;
     size_t               n_locks;
     StoredValue        **values;
+    //! Tag groups in front of values, NULL unless the index is tagged.
+    HashTagGroup        *groups;
     Mutex               *mutexes;
     EPStats&             stats;
     StoredValueFactory   valFact;
@@ -1625,13 +2036,175 @@ private:
     AtomicValue<size_t>       numItems;
     AtomicValue<size_t>       numResizes;
     AtomicValue<size_t>       numTempItems;
+    const ht_hash_function_t  hashFunction;
+    const ht_index_t          index;
     bool                 activeState;
 
+    /*
+     * State of a resize in progress. The values are moved over one old
+     * bucket at a time, holding only the locks of that bucket and of the
+     * new buckets they go to, so front-end operations keep going. Old
+     * buckets below {migrated} are empty and their values live in the
+     * next* arrays; bucket numbers from {size} upwards address those.
+     * The arrays are only swapped with all locks held.
+     */
+    //! Serializes resizes, clear() and the start of visits.
+    Mutex                     resizeMutex;
+    AtomicValue<size_t>       nextSize;
+    AtomicValue<size_t>       migrated;
+    StoredValue             **nextValues;
+    HashTagGroup             *nextGroups;
+
+    /*
+     * Seqlock versions for optimisticGet(), NULL unless enabled. A lock
+     * stripe's version is odd while a value is linked into or unlinked
+     * from one of its buckets; tableVersion while the bucket arrays are
+     * swapped or cleared.
+     */
+    struct StripeVersion {
+        AtomicValue<uint32_t> version;
+        char pad[64 - sizeof(AtomicValue<uint32_t>)];
+    };
+    StripeVersion            *stripeVersions;
+    AtomicValue<uint32_t>     tableVersion;
+
+    //! Where the StoredValues live, NULL for the general purpose allocator
+    SlabArena                *arena;
+
     static size_t                 defaultNumBuckets;
     static size_t                 defaultNumLocks;
+    static ht_hash_function_t     defaultHashFunction;
+    static ht_index_t             defaultIndex;
+    static bool                   defaultOptimisticReads;
+    static bool                   defaultSlabAllocator;
 
     int getBucketForHash(int h) {
-        return abs(h % static_cast<int>(size));
+        const int sz = static_cast<int>(size);
+        const int next = static_cast<int>(nextSize);
+        int bucket = abs(h % sz);
+        if (next != 0 && static_cast<size_t>(bucket) < migrated) {
+            bucket = sz + abs(h % next);
+        }
+        return bucket;
+    }
+
+    StoredValue *&bucketHead(int bucket_num) {
+        if (static_cast<size_t>(bucket_num) < size) {
+            return values[bucket_num];
+        }
+        return nextValues[bucket_num - size];
+    }
+
+    HashTagGroup *bucketGroup(int bucket_num) {
+        if (!groups) {
+            return NULL;
+        }
+        if (static_cast<size_t>(bucket_num) < size) {
+            return &groups[bucket_num];
+        }
+        return &nextGroups[bucket_num - size];
+    }
+
+    void migrateBucket(size_t bucket_num);
+
+    //! Version of the bucket's lock stripe, NULL without optimistic reads
+    AtomicValue<uint32_t> *stripeVersion(int bucket_num) {
+        if (!stripeVersions) {
+            return NULL;
+        }
+        return &stripeVersions[mutexForBucket(bucket_num)].version;
+    }
+
+    /**
+     * Find the value for the key in a locked bucket, deleted or not.
+     *
+     * @param h the hash of the key, matched against the tags of the
+     *          bucket's group with the tagged index
+     */
+    StoredValue *findInBucket(const std::string &key, int bucket_num,
+                              int h) {
+        const HashTagGroup *g = bucketGroup(bucket_num);
+        if (g) {
+            uint64_t m = g->match(HashTagGroup::tagForHash(h));
+            while (m) {
+                StoredValue *v = g->slots[HashTagGroup::slotOf(m)];
+                if (v && v->hasKey(key)) {
+                    return v;
+                }
+                m &= m - 1;
+            }
+        }
+        StoredValue *v = bucketHead(bucket_num);
+        while (v) {
+            if (v->hasKey(key)) {
+                return v;
+            }
+            v = v->next;
+        }
+        return NULL;
+    }
+
+    /**
+     * Add a new value to a locked bucket.
+     */
+    void linkValue(StoredValue *v, int bucket_num) {
+        VersionWriteGuard sg(stripeVersion(bucket_num));
+        HashTagGroup *g = bucketGroup(bucket_num);
+        if (g && g->insert(v, v->getKeyHash())) {
+            v->next = NULL;
+            return;
+        }
+        StoredValue *&head = bucketHead(bucket_num);
+        v->next = head;
+        head = v;
+    }
+
+    /**
+     * Take a value out of a locked bucket; the value itself is left alone.
+     */
+    void unlinkValue(StoredValue *v, int bucket_num) {
+        VersionWriteGuard sg(stripeVersion(bucket_num));
+        HashTagGroup *g = bucketGroup(bucket_num);
+        if (g && g->remove(v)) {
+            return;
+        }
+        StoredValue **p = &bucketHead(bucket_num);
+        while (*p) {
+            if (*p == v) {
+                *p = v->next;
+                return;
+            }
+            p = &(*p)->next;
+        }
+    }
+
+    /**
+     * Call f for every value of a locked bucket until it returns false.
+     * f may unlink and delete the value it was given.
+     *
+     * @return false if f stopped the iteration
+     */
+    template <typename F>
+    bool forEachInBucket(int bucket_num, F f) {
+        const HashTagGroup *g = bucketGroup(bucket_num);
+        if (g) {
+            StoredValue *slots[HashTagGroup::width];
+            std::memcpy(slots, g->slots, sizeof(slots));
+            for (size_t i = 0; i < HashTagGroup::width; ++i) {
+                if (slots[i] && !f(slots[i])) {
+                    return false;
+                }
+            }
+        }
+        StoredValue *v = bucketHead(bucket_num);
+        while (v) {
+            StoredValue *tmp = v->next;
+            if (!f(v)) {
+                return false;
+            }
+            v = tmp;
+        }
+        return true;
     }
 
     inline size_t mutexForBucket(size_t bucket_num) {
@@ -1639,6 +2212,11 @@ private:
             throw std::logic_error("HashTable::mutexForBucket: Cannot call on a "
                     "non-active object");
         }
+        const size_t sz = size;
+        if (bucket_num >= sz) {
+            // A bucket of the table being resized into.
+            bucket_num -= sz;
+        }
         return bucket_num % n_locks;
     }
 
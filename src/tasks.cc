@@ -18,6 +18,7 @@
 
 #include "bgfetcher.h"
 #include "ep_engine.h"
+#include "expiry_notifier.h"
 #include "flusher.h"
 #include "tasks.h"
 #include "warmup.h"
@@ -138,6 +139,11 @@ bool FlusherTask::run() {
     return flusher->step(this);
 }
 
+bool VBucketFlushTask::run() {
+    flusher->flushVBucket(vbid, isHighPriority);
+    return false;
+}
+
 bool VBSnapshotTask::run() {
     engine->getEpStore()->snapshotVBuckets(priority, shardID);
     return false;
@@ -181,6 +187,15 @@ bool MultiBGFetcherTask::run() {
     return bgfetcher->run(this);
 }
 
+bool VBucketBGFetchTask::run() {
+    bgfetcher->fetchVBucket(vbid);
+    return false;
+}
+
+bool ExpiryNotifierTask::run() {
+    return notifier->run(this);
+}
+
 bool FlushAllTask::run() {
     engine->getEpStore()->reset();
     return false;
@@ -28,6 +28,7 @@
 
 // Read IO tasks
 TASK(MultiBGFetcherTask, 0)
+TASK(VBucketBGFetchTask, 0)
 TASK(FetchAllKeysTask, 0)
 TASK(Warmup, 0)
 TASK(WarmupInitialize, 0)
@@ -46,6 +47,7 @@ TASK(VKeyStatBGFetchTask, 3)
 TASK(BackfillDiskLoad, 1)
 TASK(BGFetchCallback, 1)
 TASK(AccessScanner, 3)
+TASK(HashTableSnapshotTask, 3)
 TASK(VBucketVisitorTask, 3)
 TASK(ActiveStreamCheckpointProcessorTask, 5)
 TASK(BackfillManagerTask, 8)
@@ -60,6 +62,7 @@ TASK(VBStatePersistTaskHigh, 2)
 TASK(VBSnapshotTaskHigh, 2)
 TASK(FlushAllTask, 3)
 TASK(FlusherTask, 5)
+TASK(VBucketFlushTask, 5)
 TASK(VBStatePersistTaskLow, 9)
 TASK(VBSnapshotTaskLow, 9)
 TASK(DaemonVBSnapshotTask, 9)
@@ -71,6 +74,7 @@ TASK(Processor, 0)
 TASK(ConnNotifierCallback, 5)
 TASK(ConnectionReaperCallback, 6)
 TASK(ClosedUnrefCheckpointRemoverTask, 6)
+TASK(ExpiryNotifierTask, 6)
 TASK(ClosedUnrefCheckpointRemoverVisitorTask, 6)
 TASK(VBucketMemoryDeletionTask, 6)
 TASK(StatCheckpointTask, 7)
@@ -78,6 +82,7 @@ TASK(ItemPager, 7)
 TASK(ExpiredItemPager, 7)
 TASK(ItemPagerVisitor, 7)
 TASK(ExpiredItemPagerVisitor, 7)
+TASK(ExpiryIndexPager, 7)
 TASK(DefragmenterTask, 7)
 TASK(ConnManager, 8)
 TASK(WorkLoadMonitor, 10)
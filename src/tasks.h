@@ -51,6 +51,7 @@ class BgFetcher;
 class CompareTasksByDueDate;
 class CompareTasksByPriority;
 class EventuallyPersistentEngine;
+class ExpiryNotifier;
 class Flusher;
 class Warmup;
 class Taskable;
@@ -222,6 +223,34 @@ private:
     std::string desc;
 };
 
+/**
+ * A task for persisting the items of one vbucket, dispatched by the
+ * flusher of its shard (flusher_parallelism).
+ */
+class VBucketFlushTask : public GlobalTask {
+public:
+    VBucketFlushTask(EventuallyPersistentEngine *e, Flusher* f, uint16_t vb,
+                     bool highPriority, bool completeBeforeShutdown = true)
+        : GlobalTask(e, TaskId::VBucketFlushTask, 0, completeBeforeShutdown),
+          flusher(f), vbid(vb), isHighPriority(highPriority) {
+        std::stringstream ss;
+        ss<<"Flushing vbucket "<<vbid;
+        desc = ss.str();
+    }
+
+    bool run();
+
+    std::string getDescription() {
+        return desc;
+    }
+
+private:
+    Flusher* flusher;
+    uint16_t vbid;
+    bool isHighPriority;
+    std::string desc;
+};
+
 /**
  * A task for persisting VBucket state changes to disk and creating new
  * VBucket database files.
@@ -437,6 +466,53 @@ private:
     BgFetcher *bgfetcher;
 };
 
+/**
+ * A task fetching the pending items of one vbucket, next to those of the
+ * other vbuckets of the shard (bg_fetch_parallelism).
+ */
+class VBucketBGFetchTask : public GlobalTask {
+public:
+    VBucketBGFetchTask(EventuallyPersistentEngine *e, BgFetcher *b,
+                       uint16_t vb, bool completeBeforeShutdown = true)
+        : GlobalTask(e, TaskId::VBucketBGFetchTask, 0, completeBeforeShutdown),
+          bgfetcher(b), vbid(vb) {
+        std::stringstream ss;
+        ss<<"Fetching items of vbucket "<<vbid;
+        desc = ss.str();
+    }
+
+    bool run();
+
+    std::string getDescription() {
+        return desc;
+    }
+
+private:
+    BgFetcher *bgfetcher;
+    uint16_t vbid;
+    std::string desc;
+};
+
+/**
+ * A task for sending queued expiry notifications in batches.
+ */
+class ExpiryNotifierTask : public GlobalTask {
+public:
+    ExpiryNotifierTask(EventuallyPersistentEngine *e, ExpiryNotifier *n,
+                       bool completeBeforeShutdown = false)
+        : GlobalTask(e, TaskId::ExpiryNotifierTask, 0, completeBeforeShutdown),
+          notifier(n) {}
+
+    bool run();
+
+    std::string getDescription() {
+        return std::string("Sending expiry notifications");
+    }
+
+private:
+    ExpiryNotifier *notifier;
+};
+
 /**
  * A task that performs the bucket flush operation.
  */
@@ -17,6 +17,7 @@
 
 #include "config.h"
 
+#include <algorithm>
 #include <functional>
 #include <list>
 #include <set>
@@ -109,6 +110,11 @@ std::ostream& operator <<(std::ostream &out, const VBucketFilter &filter)
 
 size_t VBucket::chkFlushTimeout = MIN_CHK_FLUSH_TIMEOUT;
 
+// Write coalescing starts at 1ms, and goes on while one mutation in four
+// at least replaced a queued one.
+static const hrtime_t MIN_COALESCE_DELAY = 1000000;
+static const size_t COALESCE_REWRITE_SHARE = 4;
+
 const vbucket_state_t VBucket::ACTIVE =
                      static_cast<vbucket_state_t>(htonl(vbucket_state_active));
 const vbucket_state_t VBucket::REPLICA =
@@ -407,6 +413,39 @@ void VBucket::adjustCheckpointFlushTimeout(size_t wall_time) {
     }
 }
 
+bool VBucket::deferFlush(hrtime_t now, hrtime_t maxAge) {
+    hrtime_t delay = std::min(coalesceDelay, maxAge);
+    if (delay == 0) {
+        return false;
+    }
+    if (coalesceSince == 0) {
+        coalesceSince = now;
+    }
+    return now - coalesceSince < delay;
+}
+
+void VBucket::adaptCoalesceDelay(size_t persisted, size_t deduped,
+                                 hrtime_t maxAge) {
+    size_t dedup = dirtyQueueDedup.load();
+    size_t absorbed = dedup - coalesceDedupBase + deduped;
+    coalesceDedupBase = dedup;
+    coalesceSince = 0;
+
+    if (maxAge == 0) {
+        coalesceDelay = 0;
+    } else if (persisted == 0) {
+        return;
+    } else if (absorbed * COALESCE_REWRITE_SHARE >= persisted) {
+        coalesceDelay = std::min(std::max(coalesceDelay * 2,
+                                          MIN_COALESCE_DELAY), maxAge);
+    } else {
+        coalesceDelay /= 2;
+        if (coalesceDelay < MIN_COALESCE_DELAY) {
+            coalesceDelay = 0;
+        }
+    }
+}
+
 size_t VBucket::getHighPriorityChkSize() {
     return numHpChks.load();
 }
@@ -22,6 +22,7 @@
 
 #include "bloomfilter.h"
 #include "checkpoint.h"
+#include "expiry_index.h"
 #include "failover-table.h"
 #include "kvstore.h"
 #include "stored-value.h"
@@ -165,6 +166,7 @@ public:
         ht(st),
         checkpointManager(st, i, chkConfig, lastSeqno, lastSnapStart,
                           lastSnapEnd, cb, chkId),
+        expiryIndex(st),
         failovers(table),
         opsCreate(0),
         opsUpdate(0),
@@ -176,6 +178,7 @@ public:
         dirtyQueueDrain(0),
         dirtyQueueAge(0),
         dirtyQueuePendingWrites(0),
+        dirtyQueueDedup(0),
         metaDataDisk(0),
         numExpiredItems(0),
         fileSpaceUsed(0),
@@ -191,11 +194,15 @@ public:
         takeover_backed_up(false),
         persisted_snapshot_start(lastSnapStart),
         persisted_snapshot_end(lastSnapEnd),
+        failoversJSONGeneration(0),
         numHpChks(0),
         shard(kvshard),
         bFilter(NULL),
         tempFilter(NULL),
-        rollbackItemCount(0)
+        rollbackItemCount(0),
+        coalesceDelay(0),
+        coalesceSince(0),
+        coalesceDedupBase(0)
     {
         backfill.isBackfillPhase = false;
         pendingOpsStart = 0;
@@ -248,6 +255,20 @@ public:
         range.end = persisted_snapshot_end;
     }
 
+    /**
+     * The failover table in json format for the vbucket state the flusher
+     * persists. It is copied from the table again only once that changed.
+     * Only for the flusher, which holds the vbucket's flush lock.
+     */
+    const std::string &getFailoversJSON() {
+        const uint64_t generation = failovers->getGeneration();
+        if (generation != failoversJSONGeneration) {
+            failoversJSON = failovers->toJSON();
+            failoversJSONGeneration = generation;
+        }
+        return failoversJSON;
+    }
+
     uint64_t getMaxCas() {
         return max_cas;
     }
@@ -391,11 +412,19 @@ public:
         return true;
     }
     void getBackfillItems(std::vector<queued_item> &items) {
+        BatchLimit unlimited(0, 0);
+        getBackfillItems(items, unlimited);
+    }
+    //! Takes the backfill items, in order, until the limit is reached
+    void getBackfillItems(std::vector<queued_item> &items,
+                          BatchLimit &limit) {
         LockHolder lh(backfill.mutex);
-        size_t num_items = backfill.items.size();
-        while (!backfill.items.empty()) {
+        size_t num_items = 0;
+        while (!backfill.items.empty() && !limit.isReached()) {
             items.push_back(backfill.items.front());
+            limit.add(backfill.items.front());
             backfill.items.pop();
+            ++num_items;
         }
         stats.memOverhead.fetch_sub(num_items * sizeof(queued_item));
     }
@@ -518,6 +547,27 @@ public:
         return rollbackItemCount.load(std::memory_order_relaxed);
     }
 
+    /**
+     * Whether the flusher should hold back the writes of this vbucket for
+     * now, so further rewrites of its hot keys are coalesced in the
+     * checkpoints (flusher_coalesce_max_age). The writes are held back
+     * for the coalescing delay at most, counted from the first time the
+     * flusher was told to wait, and never beyond maxAge.
+     */
+    bool deferFlush(hrtime_t now, hrtime_t maxAge);
+
+    /**
+     * Adapt the coalescing delay to a batch just flushed: double it while
+     * a fair share of the mutations replaced queued ones, halve it
+     * otherwise.
+     *
+     * @param persisted items written by the batch
+     * @param deduped items of the batch dropped for a later one
+     * @param maxAge upper bound of the delay
+     */
+    void adaptCoalesceDelay(size_t persisted, size_t deduped,
+                            hrtime_t maxAge);
+
     static const vbucket_state_t ACTIVE;
     static const vbucket_state_t REPLICA;
     static const vbucket_state_t PENDING;
@@ -525,6 +575,7 @@ public:
 
     HashTable         ht;
     CheckpointManager checkpointManager;
+    ExpiryIndex       expiryIndex;
     struct {
         Mutex mutex;
         std::queue<queued_item> items;
@@ -549,6 +600,8 @@ public:
     AtomicValue<size_t>  dirtyQueueDrain;
     AtomicValue<uint64_t> dirtyQueueAge;
     AtomicValue<size_t>  dirtyQueuePendingWrites;
+    //! Mutations which replaced an item still queued for persistence
+    AtomicValue<size_t>  dirtyQueueDedup;
     AtomicValue<size_t>  metaDataDisk;
 
     AtomicValue<size_t>  numExpiredItems;
@@ -594,6 +647,10 @@ private:
     uint64_t persisted_snapshot_start;
     uint64_t persisted_snapshot_end;
 
+    // Copy of the failover table for the flusher, see getFailoversJSON()
+    std::string failoversJSON;
+    uint64_t failoversJSONGeneration;
+
     Mutex hpChksMutex;
     std::list<HighPriorityVBEntry> hpChks;
     AtomicValue<size_t> numHpChks; // size of list hpChks (to avoid MB-9434)
@@ -605,6 +662,12 @@ private:
 
     AtomicValue<uint64_t> rollbackItemCount;
 
+    // Write coalescing of the flusher, see deferFlush(); only touched by
+    // the flusher with the vbucket's flush lock held.
+    hrtime_t coalesceDelay;
+    hrtime_t coalesceSince;
+    size_t coalesceDedupBase;
+
     static size_t chkFlushTimeout;
 
     DISALLOW_COPY_AND_ASSIGN(VBucket);
@@ -17,21 +17,35 @@
 
 #include "warmup.h"
 
+#include <algorithm>
 #include <limits>
 #include <string>
 #include <utility>
 #include <array>
 #include <random>
 
+#include "access_log.h"
 #include "common.h"
 #include "connmap.h"
 #include "ep_engine.h"
 #include "failover-table.h"
+#include "ht_snapshot.h"
 #include "mutation_log.h"
 #define STATWRITER_NAMESPACE warmup
 #include "statwriter.h"
 #undef STATWRITER_NAMESPACE
 
+// The single pass warmup loads values decompressed, but the files only
+// tell how much space the (snappy compressed) documents take on disk.
+// Assume they inflate this much when loaded, which covers all but highly
+// repetitive documents; a load that runs out of memory anyway fails
+// warmup rather than dropping keys.
+static const size_t SINGLE_PASS_INFLATE_RATIO = 4;
+
+// What a loaded item costs besides its key and value
+static const size_t SINGLE_PASS_ITEM_OVERHEAD =
+    sizeof(StoredValue) + sizeof(Blob) + FLEX_DATA_OFFSET;
+
 struct WarmupCookie {
     WarmupCookie(EventuallyPersistentStore *s, Callback<GetValue>&c) :
         cb(c), epstore(s),
@@ -94,6 +108,29 @@ static bool batchWarmupCallback(uint16_t vbId,
     }
 }
 
+/**
+ * Fetch a batch of keys read from a sorted access log, leaving out the
+ * ones no longer in the hash table (deleted since the log was written).
+ */
+static bool accessLogBatchCallback(uint16_t vbId,
+                                   std::vector<std::pair<std::string,
+                                   uint64_t> > &fetches,
+                                   void *arg)
+{
+    WarmupCookie *c = static_cast<WarmupCookie *>(arg);
+    RCPtr<VBucket> vb = c->epstore->getVBucket(vbId);
+    if (!vb) {
+        return true;
+    }
+
+    auto last = std::remove_if(fetches.begin(), fetches.end(),
+                    [&vb](const std::pair<std::string, uint64_t> &f) {
+                        return vb->ht.find(f.first, false) == NULL;
+                    });
+    fetches.erase(last, fetches.end());
+    return fetches.empty() || batchWarmupCallback(vbId, fetches, arg);
+}
+
 static bool warmupCallback(void *arg, uint16_t vb, const std::string &key)
 {
     WarmupCookie *cookie = static_cast<WarmupCookie*>(arg);
@@ -182,7 +219,8 @@ bool WarmupState::legalTransition(int to) const {
     case CreateVBuckets:
         return (to == EstimateDatabaseItemCount);
     case EstimateDatabaseItemCount:
-        return (to == KeyDump || to == CheckForAccessLog);
+        return (to == KeyDump || to == CheckForAccessLog ||
+                to == LoadingKVPairs);
     case KeyDump:
         return (to == LoadingKVPairs || to == CheckForAccessLog);
     case CheckForAccessLog:
@@ -191,7 +229,7 @@ bool WarmupState::legalTransition(int to) const {
     case LoadingAccessLog:
         return (to == Done || to == LoadingData);
     case LoadingKVPairs:
-        return (to == Done);
+        return (to == Done || to == KeyDump);
     case LoadingData:
         return (to == Done);
 
@@ -206,14 +244,64 @@ std::ostream& operator <<(std::ostream &out, const WarmupState &state)
     return out;
 }
 
+/* The name of a warmup phase in the stats of the time spent in it */
+static const char *phaseStatName(int phase) {
+    switch (phase) {
+    case WarmupState::Initialize:
+        return "initialize_time";
+    case WarmupState::CreateVBuckets:
+        return "create_vbuckets_time";
+    case WarmupState::EstimateDatabaseItemCount:
+        return "estimate_count_time";
+    case WarmupState::KeyDump:
+        return "key_dump_time";
+    case WarmupState::CheckForAccessLog:
+        return "check_access_log_time";
+    case WarmupState::LoadingAccessLog:
+        return "load_access_log_time";
+    case WarmupState::LoadingKVPairs:
+        return "load_kv_pairs_time";
+    case WarmupState::LoadingData:
+        return "load_data_time";
+    default:
+        return "unknown_time";
+    }
+}
+
 void LoadStorageKVPairCallback::callback(GetValue &val) {
     Item *i = val.getValue();
     bool stopLoading = false;
+    bool stopScan = false;
+    bool duplicate = false;
     if (i != NULL && !epstore.getWarmup()->isComplete()) {
         RCPtr<VBucket> vb = vbuckets.getBucket(i->getVBucketId());
         if (!vb) {
             return;
         }
+
+        if (replay) {
+            // Drop the version from the snapshot, the one on disk is newer
+            int bucket_num(0);
+            int key_hash = vb->ht.hash(i->getKey());
+            LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
+            StoredValue *v = vb->ht.unlocked_find(i->getKey(), bucket_num,
+                                                  key_hash, true, false);
+            if (v) {
+                if (!v->isResident() && !v->isDeleted() && !v->isTempItem()) {
+                    vb->ht.decrNumNonResidentItems();
+                }
+                vb->ht.unlocked_del(i->getKey(), bucket_num, key_hash);
+            }
+            lh.unlock();
+
+            if (i->isDeleted()) {
+                delete i;
+                val.setValue(NULL);
+                setStatus(ENGINE_SUCCESS);
+                return;
+            }
+        }
+
         bool succeeded(false);
         int retry = 2;
         item_eviction_policy_t policy = epstore.getItemEvictionPolicy();
@@ -250,10 +338,19 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
                     "Value changed in memory before restore from disk. "
                     "Ignored disk value for: %s.", i->getKey().c_str());
                 ++stats.warmDups;
+                duplicate = true;
                 succeeded = true;
                 break;
             case NOT_FOUND:
                 succeeded = true;
+                // Under value eviction the key dump already indexed the
+                // keys whose values are loaded later.
+                if (i->getExptime() != 0 && epstore.isExpiryIndexEnabled() &&
+                    (policy == FULL_EVICTION ||
+                     warmupState == WarmupState::KeyDump ||
+                     warmupState == WarmupState::LoadingKVPairs)) {
+                    vb->expiryIndex.add(i->getKey(), i->getExptime());
+                }
                 break;
             default:
                 abort();
@@ -267,25 +364,54 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
             stopLoading = epstore.maybeEnableTraffic();
         }
 
-        switch (warmupState) {
-            case WarmupState::KeyDump:
-                if (stats.warmOOM) {
-                    epstore.getWarmup()->setOOMFailure();
-                    stopLoading = true;
-                } else {
-                    ++stats.warmedUpKeys;
-                }
-                break;
-            case WarmupState::LoadingData:
-            case WarmupState::LoadingAccessLog:
-                if (epstore.getItemEvictionPolicy() == FULL_EVICTION) {
+        if (replay) {
+            // Counted once the whole vbucket is restored
+        } else {
+            switch (warmupState) {
+                case WarmupState::KeyDump:
+                    if (stats.warmOOM) {
+                        epstore.getWarmup()->setOOMFailure();
+                        stopLoading = true;
+                    } else if (!duplicate) {
+                        // A key a single pass loaded before falling back
+                        // is counted already
+                        ++stats.warmedUpKeys;
+                    }
+                    break;
+                case WarmupState::LoadingData:
+                case WarmupState::LoadingAccessLog:
+                    if (epstore.getItemEvictionPolicy() == FULL_EVICTION) {
+                        ++stats.warmedUpKeys;
+                    }
+                    ++stats.warmedUpValues;
+                    break;
+                case WarmupState::LoadingKVPairs:
+                    // Without a key dump before, a key that did not fit
+                    // is not in memory at all. A single pass then falls
+                    // back to dumping the keys first.
+                    if (stats.warmOOM &&
+                        epstore.getItemEvictionPolicy() == VALUE_ONLY) {
+                        if (epstore.getWarmup()->isSinglePass()) {
+                            epstore.getWarmup()->setSinglePassFallback();
+                            stopScan = true;
+                        } else {
+                            epstore.getWarmup()->setOOMFailure();
+                            stopLoading = true;
+                        }
+                    } else if (epstore.getWarmup()->hasSinglePassFallback()) {
+                        // Another scan ran out of memory
+                        ++stats.warmedUpKeys;
+                        ++stats.warmedUpValues;
+                        stopScan = true;
+                    } else {
+                        ++stats.warmedUpKeys;
+                        ++stats.warmedUpValues;
+                    }
+                    break;
+                default:
                     ++stats.warmedUpKeys;
-                }
-                ++stats.warmedUpValues;
-                break;
-            default:
-                ++stats.warmedUpKeys;
-                ++stats.warmedUpValues;
+                    ++stats.warmedUpValues;
+            }
         }
     } else {
         stopLoading = true;
@@ -306,6 +432,9 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
             "Engine warmup is complete, request to stop "
             "loading remaining database");
         setStatus(ENGINE_ENOMEM);
+    } else if (stopScan) {
+        // ENGINE_ENOMEM stops the scan, warmup goes on
+        setStatus(ENGINE_ENOMEM);
     } else {
         setStatus(ENGINE_SUCCESS);
     }
@@ -345,9 +474,11 @@ void LoadValueCallback::callback(CacheLookup &lookup)
         }
 
         int bucket_num(0);
-        LockHolder lh = vb->ht.getLockedBucket(lookup.getKey(), &bucket_num);
+        int key_hash = vb->ht.hash(lookup.getKey());
+        LockHolder lh = vb->ht.getLockedBucket(key_hash, &bucket_num);
 
-        StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num);
+        StoredValue *v = vb->ht.unlocked_find(lookup.getKey(), bucket_num,
+                                              key_hash, false, true);
         if (v && v->isResident()) {
             setStatus(ENGINE_KEY_EEXISTS);
             return;
@@ -369,9 +500,18 @@ Warmup::Warmup(EventuallyPersistentStore& st)
       startTime(0),
       metadata(0),
       warmup(0),
+      phaseStart(0),
       threadtask_count(0),
+      scanTaskCount(0),
+      vbsScanned(0),
+      vbsToScan(0),
+      snapshotVbs(0),
+      snapshotItems(0),
       estimateTime(0),
       estimatedItemCount(std::numeric_limits<size_t>::max()),
+      estimatedDataSize(0),
+      singlePass(false),
+      singlePassFallback(false),
       cleanShutdown(true),
       corruptAccessLog(false),
       warmupComplete(false),
@@ -386,6 +526,17 @@ Warmup::Warmup(EventuallyPersistentStore& st)
     for (size_t i = 0; i < num_shards; i++) {
         shardKeyDumpStatus[i] = false;
     }
+    phaseTimes = new AtomicValue<hrtime_t>[WarmupState::Done];
+    for (int i = 0; i < WarmupState::Done; i++) {
+        phaseTimes[i].store(0);
+    }
+    const size_t num_vbs = store.vbMap.getSize();
+    restoredVbs = new AtomicValue<bool>[num_vbs];
+    loadedVbs = new AtomicValue<bool>[num_vbs];
+    for (size_t i = 0; i < num_vbs; i++) {
+        restoredVbs[i].store(false);
+        loadedVbs[i].store(false);
+    }
 }
 
 void Warmup::addToTaskSet(size_t taskId) {
@@ -402,6 +553,9 @@ Warmup::~Warmup() {
     delete [] shardVbStates;
     delete [] shardVbIds;
     delete [] shardKeyDumpStatus;
+    delete [] phaseTimes;
+    delete [] restoredVbs;
+    delete [] loadedVbs;
 }
 
 void Warmup::setEstimatedWarmupCount(size_t to)
@@ -416,6 +570,7 @@ size_t Warmup::getEstimatedItemCount()
 
 void Warmup::start(void)
 {
+    phaseStart.store(gethrtime());
     step();
 }
 
@@ -533,6 +688,7 @@ void Warmup::scheduleEstimateDatabaseItemCount()
     threadtask_count = 0;
     estimateTime = 0;
     estimatedItemCount = 0;
+    estimatedDataSize = 0;
     for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
         ExTask task = new WarmupEstimateDatabaseItemCount(store, i, this);
         ExecutorPool::get()->schedule(task, READER_TASK_IDX);
@@ -543,6 +699,7 @@ void Warmup::estimateDatabaseItemCount(uint16_t shardId)
 {
     hrtime_t st = gethrtime();
     size_t item_count = 0;
+    size_t data_size = 0;
 
     const std::vector<uint16_t> &vbs = shardVbIds[shardId];
     std::vector<uint16_t>::const_iterator it = vbs.begin();
@@ -556,31 +713,97 @@ void Warmup::estimateDatabaseItemCount(uint16_t shardId)
             vb->fileSpaceUsed = info.spaceUsed;
         }
         item_count += info.itemCount;
+        data_size += info.spaceUsed * SINGLE_PASS_INFLATE_RATIO +
+                     info.itemCount * SINGLE_PASS_ITEM_OVERHEAD;
     }
 
     estimatedItemCount.fetch_add(item_count);
+    estimatedDataSize.fetch_add(data_size);
     estimateTime.fetch_add(gethrtime() - st);
 
     if (++threadtask_count == store.vbMap.getNumShards()) {
         if (store.getItemEvictionPolicy() == VALUE_ONLY) {
-            transition(WarmupState::KeyDump);
+            if (isSinglePassPossible()) {
+                LOG(EXTENSION_LOG_NOTICE, "Warmup: %" PRIu64 " bytes of data "
+                    "expected to fit in memory, loading keys and values "
+                    "at once", uint64_t(estimatedDataSize.load()));
+                singlePass = true;
+                transition(WarmupState::LoadingKVPairs);
+            } else {
+                transition(WarmupState::KeyDump);
+            }
         } else {
             transition(WarmupState::CheckForAccessLog);
         }
     }
 }
 
-void Warmup::scheduleKeyDump()
+bool Warmup::isSinglePassPossible()
+{
+    EPStats &stats = store.getEPEngine().getEpStats();
+    if (!store.getEPEngine().getConfiguration().isWarmupSinglePass() ||
+        stats.warmupNumReadCap.load() < 1.0) {
+        return false;
+    }
+    // Below the low water mark no value is ejected while loading, and below
+    // the memory threshold traffic would only be enabled once all of the
+    // values are loaded anyway; a key dump first gains nothing then.
+    double expected = static_cast<double>(stats.getTotalMemoryUsed()) +
+                      static_cast<double>(estimatedDataSize.load());
+    double limit = std::min(static_cast<double>(stats.mem_low_wat.load()),
+                            stats.getMaxDataSize() *
+                            stats.warmupMemUsedCap.load());
+    return expected < limit;
+}
+
+Warmup::scan_parts_t Warmup::splitScan()
 {
+    size_t parallelism =
+        store.getEPEngine().getConfiguration().getWarmupParallelism();
+    if (parallelism == 0) {
+        // Spread the reader threads over the shards
+        parallelism = ExecutorPool::get()->getNumReaders() /
+                      store.vbMap.getNumShards();
+    }
+    parallelism = std::max(parallelism, size_t(1));
+
+    scan_parts_t parts;
+    size_t numVbs = 0;
+    for (size_t i = 0; i < store.vbMap.getNumShards(); i++) {
+        const std::vector<uint16_t> &vbs = shardVbIds[i];
+        size_t n = std::min(parallelism, std::max(vbs.size(), size_t(1)));
+        size_t first = parts.size();
+        parts.resize(first + n);
+        // Deal the vbuckets out in turn, so every part keeps the
+        // active vbuckets ahead of the replicas
+        for (size_t j = 0; j < vbs.size(); j++) {
+            parts[first + j % n].second.push_back(vbs[j]);
+        }
+        for (size_t j = first; j < parts.size(); j++) {
+            parts[j].first = i;
+        }
+        numVbs += vbs.size();
+    }
+
     threadtask_count = 0;
-    for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
-        ExTask task = new WarmupKeyDump(store, i, this);
+    scanTaskCount = parts.size();
+    vbsScanned = 0;
+    vbsToScan = numVbs;
+    return parts;
+}
+
+void Warmup::scheduleKeyDump()
+{
+    scan_parts_t parts = splitScan();
+    for (size_t i = 0; i < parts.size(); i++) {
+        ExTask task = new WarmupKeyDump(store, parts[i].first,
+                                        parts[i].second, this);
         ExecutorPool::get()->schedule(task, READER_TASK_IDX);
     }
-
 }
 
-void Warmup::keyDumpforShard(uint16_t shardId)
+void Warmup::keyDumpforShard(uint16_t shardId,
+                             const std::vector<uint16_t> &vbIds)
 {
     KVStore* kvstore = store.getROUnderlyingByShard(shardId);
     LoadStorageKVPairCallback *load_cb =
@@ -588,9 +811,15 @@ void Warmup::keyDumpforShard(uint16_t shardId)
     std::shared_ptr<Callback<GetValue> > cb(load_cb);
     std::shared_ptr<Callback<CacheLookup> > cl(new NoLookupCallback());
 
-    std::vector<uint16_t>::iterator itr = shardVbIds[shardId].begin();
+    std::vector<uint16_t>::const_iterator itr = vbIds.begin();
 
-    for (; itr != shardVbIds[shardId].end(); ++itr) {
+    for (; itr != vbIds.end(); ++itr) {
+        // Loaded before a single pass fell back to here
+        if (restoredVbs[*itr] || loadedVbs[*itr] ||
+            restoreFromSnapshot(shardId, *itr)) {
+            ++vbsScanned;
+            continue;
+        }
         ScanContext* ctx = kvstore->initScanContext(cb, cl, *itr, 0,
                                                     DocumentFilter::NO_DELETES,
                                                     ValueFilter::KEYS_ONLY);
@@ -598,11 +827,12 @@ void Warmup::keyDumpforShard(uint16_t shardId)
             kvstore->scan(ctx);
             kvstore->destroyScanContext(ctx);
         }
+        ++vbsScanned;
     }
 
     shardKeyDumpStatus[shardId] = true;
 
-    if (++threadtask_count == store.vbMap.getNumShards()) {
+    if (++threadtask_count == scanTaskCount) {
         bool success = false;
         for (size_t i = 0; i < store.vbMap.getNumShards(); i++) {
             if (shardKeyDumpStatus[i]) {
@@ -663,50 +893,45 @@ void Warmup::checkForAccessLog()
 
 void Warmup::scheduleLoadingAccessLog()
 {
-    threadtask_count = 0;
-    for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadAccessLog(store, i, this);
+    scan_parts_t parts = splitScan();
+    for (size_t i = 0; i < parts.size(); i++) {
+        ExTask task = new WarmupLoadAccessLog(store, parts[i].first,
+                                              parts[i].second, this);
         ExecutorPool::get()->schedule(task, READER_TASK_IDX);
     }
 }
 
-void Warmup::loadingAccessLog(uint16_t shardId)
+void Warmup::loadingAccessLog(uint16_t shardId,
+                              const std::vector<uint16_t> &vbIds)
 {
     LoadStorageKVPairCallback *load_cb =
         new LoadStorageKVPairCallback(store, true, state.getState());
     bool success = false;
     hrtime_t stTime = gethrtime();
-    if (store.accessLog[shardId]->exists()) {
+
+    // Fall back to the previous file if the current one is unusable
+    std::string curr = store.accessLog[shardId]->getLogFile();
+    std::string logs[] = { curr, curr + ".old" };
+    for (size_t i = 0; i < 2 && !success; ++i) {
         try {
-            store.accessLog[shardId]->open();
-            if (doWarmup(*(store.accessLog[shardId]),
-                         shardVbStates[shardId], *load_cb) != (size_t)-1) {
-                success = true;
+            size_t loaded;
+            if (AccessLog::isAccessLog(logs[i])) {
+                AccessLogReader log(logs[i]);
+                loaded = doWarmup(log, vbIds, *load_cb);
+            } else {
+                // Written by an older version
+                MutationLog log(logs[i]);
+                if (!log.exists()) {
+                    continue;
+                }
+                log.open(true);
+                loaded = doWarmup(log, vbIds, *load_cb);
             }
+            success = loaded != (size_t)-1;
         } catch (MutationLog::ReadException &e) {
             corruptAccessLog = true;
-            LOG(EXTENSION_LOG_WARNING, "Error reading warmup access log:  %s",
-                    e.what());
-        }
-    }
-
-    if (!success) {
-        // Do we have the previous file?
-        std::string nm = store.accessLog[shardId]->getLogFile();
-        nm.append(".old");
-        MutationLog old(nm);
-        if (old.exists()) {
-            try {
-                old.open();
-                if (doWarmup(old, shardVbStates[shardId],
-                             *load_cb) != (size_t)-1) {
-                    success = true;
-                }
-            } catch (MutationLog::ReadException &e) {
-                corruptAccessLog = true;
-                LOG(EXTENSION_LOG_WARNING, "Error reading old access log:  %s",
-                        e.what());
-            }
+            LOG(EXTENSION_LOG_WARNING, "Error reading warmup access log "
+                "'%s':  %s", logs[i].c_str(), e.what());
         }
     }
 
@@ -722,7 +947,7 @@ void Warmup::loadingAccessLog(uint16_t shardId)
     }
 
     delete load_cb;
-    if (++threadtask_count == store.vbMap.getNumShards()) {
+    if (++threadtask_count == scanTaskCount) {
         if (!store.maybeEnableTraffic()) {
             transition(WarmupState::LoadingData);
         } else {
@@ -732,13 +957,15 @@ void Warmup::loadingAccessLog(uint16_t shardId)
     }
 }
 
-size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
-                        vbucket_state> &vbmap, Callback<GetValue> &cb)
+size_t Warmup::doWarmup(MutationLog &lf, const std::vector<uint16_t> &vbIds,
+                        Callback<GetValue> &cb)
 {
     MutationLogHarvester harvester(lf, &store.getEPEngine());
-    std::map<uint16_t, vbucket_state>::const_iterator it;
-    for (it = vbmap.begin(); it != vbmap.end(); ++it) {
-        harvester.setVBucket(it->first);
+    for (auto vbid : vbIds) {
+        // The values of a restored vbucket are in memory already
+        if (!restoredVbs[vbid]) {
+            harvester.setVBucket(vbid);
+        }
     }
 
     hrtime_t st = gethrtime();
@@ -759,6 +986,7 @@ size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
     } else {
         harvester.apply(&cookie, &warmupCallback);
     }
+    vbsScanned.fetch_add(vbIds.size());
     end = gethrtime();
     LOG(EXTENSION_LOG_DEBUG,
         "Populated log in %s with(l: %ld, s: %ld, e: %ld)",
@@ -767,23 +995,60 @@ size_t Warmup::doWarmup(MutationLog &lf, const std::map<uint16_t,
     return cookie.loaded;
 }
 
+size_t Warmup::doWarmup(AccessLogReader &log,
+                        const std::vector<uint16_t> &vbIds,
+                        Callback<GetValue> &cb)
+{
+    setEstimatedWarmupCount(log.total());
+
+    // Nothing is gathered up front, the keys of each vbucket are fetched
+    // as their blocks are read.
+    hrtime_t st = gethrtime();
+    WarmupCookie cookie(&store, cb);
+    size_t batchSize =
+        store.getEPEngine().getConfiguration().getWarmupBatchSize();
+    for (auto vbid : vbIds) {
+        bool more = true;
+        // The values of a restored vbucket are in memory already
+        if (!restoredVbs[vbid]) {
+            if (store.multiBGFetchEnabled()) {
+                more = log.apply(vbid, batchSize, &cookie,
+                                 &accessLogBatchCallback);
+            } else {
+                more = log.apply(vbid, &cookie, &warmupCallback);
+            }
+        }
+        ++vbsScanned;
+        if (!more) {
+            break;
+        }
+    }
+    hrtime_t end = gethrtime();
+    LOG(EXTENSION_LOG_DEBUG,
+        "Populated log in %s with(l: %ld, s: %ld, e: %ld)",
+        hrtime2text(end - st).c_str(), cookie.loaded, cookie.skipped,
+        cookie.error);
+    return cookie.loaded;
+}
+
 void Warmup::scheduleLoadingKVPairs()
 {
-    // We reach here only if keyDump didn't return SUCCESS or if
-    // in case of Full Eviction. Either way, set estimated value
-    // count equal to the estimated item count, as very likely no
-    // keys have been warmed up at this point.
+    // We reach here only if keyDump didn't return SUCCESS, in case of
+    // Full Eviction, or if the data fits in memory under value eviction.
+    // Either way, set estimated value count equal to the estimated item
+    // count, as very likely no keys have been warmed up at this point.
     setEstimatedWarmupCount(estimatedItemCount);
 
-    threadtask_count = 0;
-    for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadingKVPairs(store, i, this);
+    scan_parts_t parts = splitScan();
+    for (size_t i = 0; i < parts.size(); i++) {
+        ExTask task = new WarmupLoadingKVPairs(store, parts[i].first,
+                                               parts[i].second, this);
         ExecutorPool::get()->schedule(task, READER_TASK_IDX);
     }
-
 }
 
-void Warmup::loadKVPairsforShard(uint16_t shardId)
+void Warmup::loadKVPairsforShard(uint16_t shardId,
+                                 const std::vector<uint16_t> &vbIds)
 {
     bool maybe_enable_traffic = false;
     scan_error_t errorCode = scan_success;
@@ -800,21 +1065,26 @@ void Warmup::loadKVPairsforShard(uint16_t shardId)
     std::shared_ptr<Callback<CacheLookup> >
         cl(new LoadValueCallback(store.vbMap, state.getState()));
 
-    std::vector<uint16_t>::iterator itr = shardVbIds[shardId].begin();
-    for (; itr != shardVbIds[shardId].end(); ++itr) {
+    std::vector<uint16_t>::const_iterator itr = vbIds.begin();
+    for (; itr != vbIds.end(); ++itr) {
+        if (restoreFromSnapshot(shardId, *itr)) {
+            ++vbsScanned;
+            continue;
+        }
         ScanContext* ctx = kvstore->initScanContext(cb, cl, *itr, 0,
                                                     DocumentFilter::NO_DELETES,
                                                     ValueFilter::VALUES_DECOMPRESSED);
         if (ctx) {
             errorCode = kvstore->scan(ctx);
             kvstore->destroyScanContext(ctx);
-            if (errorCode == scan_again) { // ENGINE_ENOMEM
-                // skip loading remaining VBuckets as memory limit was reached
-                break;
-            }
+        }
+        ++vbsScanned;
+        if (errorCode == scan_again) { // ENGINE_ENOMEM
+            // skip loading remaining VBuckets as memory limit was reached
+            break;
         }
     }
-    if (++threadtask_count == store.vbMap.getNumShards()) {
+    if (++threadtask_count == scanTaskCount) {
         transition(WarmupState::Done);
     }
 }
@@ -824,14 +1094,16 @@ void Warmup::scheduleLoadingData()
     size_t estimatedCount = store.getEPEngine().getEpStats().warmedUpKeys;
     setEstimatedWarmupCount(estimatedCount);
 
-    threadtask_count = 0;
-    for (size_t i = 0; i < store.vbMap.shards.size(); i++) {
-        ExTask task = new WarmupLoadingData(store, i, this);
+    scan_parts_t parts = splitScan();
+    for (size_t i = 0; i < parts.size(); i++) {
+        ExTask task = new WarmupLoadingData(store, parts[i].first,
+                                            parts[i].second, this);
         ExecutorPool::get()->schedule(task, READER_TASK_IDX);
     }
 }
 
-void Warmup::loadDataforShard(uint16_t shardId)
+void Warmup::loadDataforShard(uint16_t shardId,
+                              const std::vector<uint16_t> &vbIds)
 {
     scan_error_t errorCode = scan_success;
 
@@ -842,26 +1114,123 @@ void Warmup::loadDataforShard(uint16_t shardId)
     std::shared_ptr<Callback<CacheLookup> >
         cl(new LoadValueCallback(store.vbMap, state.getState()));
 
-    std::vector<uint16_t>::iterator itr = shardVbIds[shardId].begin();
-    for (; itr != shardVbIds[shardId].end(); ++itr) {
+    std::vector<uint16_t>::const_iterator itr = vbIds.begin();
+    for (; itr != vbIds.end(); ++itr) {
+        if (restoredVbs[*itr]) {
+            ++vbsScanned;
+            continue;
+        }
         ScanContext* ctx = kvstore->initScanContext(cb, cl, *itr, 0,
                                                     DocumentFilter::NO_DELETES,
                                                     ValueFilter::VALUES_DECOMPRESSED);
         if (ctx) {
             errorCode = kvstore->scan(ctx);
             kvstore->destroyScanContext(ctx);
-            if (errorCode == scan_again) { // ENGINE_ENOMEM
-                // skip loading remaining VBuckets as memory limit was reached
-                break;
+            if (errorCode == scan_success) {
+                loadedVbs[*itr] = true;
             }
         }
+        ++vbsScanned;
+        if (errorCode == scan_again) { // ENGINE_ENOMEM
+            // skip loading remaining VBuckets as memory limit was reached
+            break;
+        }
     }
 
-    if (++threadtask_count == store.vbMap.getNumShards()) {
-        transition(WarmupState::Done);
+    if (++threadtask_count == scanTaskCount) {
+        if (hasSinglePassFallback()) {
+            EPStats &stats = store.getEPEngine().getEpStats();
+            LOG(EXTENSION_LOG_WARNING, "Warmup: values did not fit in memory "
+                "in a single pass, loading the keys of the remaining "
+                "vbuckets first");
+            // Nothing failed for good yet
+            stats.warmOOM = 0;
+            singlePass = false;
+            transition(WarmupState::KeyDump);
+        } else {
+            transition(WarmupState::Done);
+        }
     }
 }
 
+bool Warmup::restoreFromSnapshot(uint16_t shardId, uint16_t vbid)
+{
+    Configuration &config = store.getEPEngine().getConfiguration();
+    if (!config.isHtSnapshot()) {
+        return false;
+    }
+
+    RCPtr<VBucket> vb = store.getVBucket(vbid);
+    std::map<uint16_t, vbucket_state>::iterator it =
+        shardVbStates[shardId].find(vbid);
+    if (!vb || it == shardVbStates[shardId].end() ||
+        it->second.failovers.empty()) {
+        return false;
+    }
+
+    HashTableSnapshot snapshot(config.getDbname(), vbid);
+    if (!snapshot.isValid()) {
+        return false;
+    }
+
+    // The snapshot has to be of the history on disk (with no reset since),
+    // hold nothing that is not persisted, and no deletion to replay may be
+    // purged yet.
+    const vbucket_state &vbs = it->second;
+    const HashTableSnapshot::Header &hdr = snapshot.getHeader();
+    FailoverTable table(vbs.failovers,
+                        store.getEPEngine().getMaxFailoverEntries());
+    if (hdr.vbid != vbid || hdr.vbUuid != table.getLatestUUID() ||
+        hdr.resetGeneration != vbs.resetGeneration ||
+        hdr.maxSeqno > static_cast<uint64_t>(vbs.highSeqno) ||
+        vbs.purgeSeqno > hdr.startSeqno) {
+        LOG(EXTENSION_LOG_NOTICE, "Warmup: hash table snapshot of vb %" PRIu16
+            " does not match its data on disk, ignored", vbid);
+        return false;
+    }
+
+    hrtime_t st = gethrtime();
+    bool success = snapshot.load(*vb, store.getItemEvictionPolicy(),
+                                 store.isExpiryIndexEnabled());
+    if (success) {
+        KVStore* kvstore = store.getROUnderlyingByShard(shardId);
+        std::shared_ptr<Callback<GetValue> >
+            cb(new LoadStorageKVPairCallback(store, false,
+                                             WarmupState::LoadingKVPairs,
+                                             true));
+        std::shared_ptr<Callback<CacheLookup> > cl(new NoLookupCallback());
+        ScanContext* ctx = kvstore->initScanContext(cb, cl, vbid,
+                                                    hdr.startSeqno + 1,
+                                                    DocumentFilter::ALL_ITEMS,
+                                                    ValueFilter::VALUES_DECOMPRESSED);
+        success = ctx && kvstore->scan(ctx) == scan_success;
+        kvstore->destroyScanContext(ctx);
+    }
+
+    if (!success) {
+        LOG(EXTENSION_LOG_WARNING, "Warmup: failed to restore the hash table "
+            "snapshot of vb %" PRIu16 ", loading it from disk", vbid);
+        size_t total = vb->ht.numTotalItems;
+        vb->ht.clear();
+        vb->ht.numTotalItems = total;
+        return false;
+    }
+
+    EPStats &stats = store.getEPEngine().getEpStats();
+    size_t numItems = vb->ht.getNumItems();
+    stats.warmedUpKeys.fetch_add(numItems);
+    stats.warmedUpValues.fetch_add(numItems -
+                                   vb->ht.getNumInMemoryNonResItems());
+    restoredVbs[vbid] = true;
+    ++snapshotVbs;
+    snapshotItems.fetch_add(numItems);
+
+    LOG(EXTENSION_LOG_INFO, "Warmup: restored %" PRIu64 " items of vb %"
+        PRIu16 " from its hash table snapshot in %s", uint64_t(numItems),
+        vbid, hrtime2text(gethrtime() - st).c_str());
+    return true;
+}
+
 void Warmup::scheduleCompletion() {
     ExTask task = new WarmupCompletion(store, this);
     ExecutorPool::get()->schedule(task, READER_TASK_IDX);
@@ -923,6 +1292,9 @@ void Warmup::step() {
 void Warmup::transition(int to, bool force) {
     int old = state.getState();
     if (old != WarmupState::Done) {
+        hrtime_t now = gethrtime();
+        phaseTimes[old].fetch_add(now - phaseStart.load());
+        phaseStart.store(now);
         state.transition(to, force);
         step();
     }
@@ -988,17 +1360,84 @@ void Warmup::addStats(ADD_STAT add_stat, const void *c) const
             addStat("access_log", "corrupt", add_stat, c);
         }
 
+        if (store.getItemEvictionPolicy() == VALUE_ONLY) {
+            addStat("strategy", singlePass.load() ? "single_pass" :
+                                                    "two_phase", add_stat, c);
+        }
+        for (int phase = WarmupState::Initialize; phase < WarmupState::Done;
+             ++phase) {
+            hrtime_t p_time = phaseTimes[phase].load();
+            if (p_time > 0) {
+                addStat(phaseStatName(phase), p_time / 1000, add_stat, c);
+            }
+        }
+
         size_t warmupCount = estimatedWarmupCount.load();
         if (warmupCount ==  std::numeric_limits<size_t>::max()) {
             addStat("estimated_value_count", "unknown", add_stat, c);
         } else {
             addStat("estimated_value_count", warmupCount, add_stat, c);
         }
+
+        if (store.getEPEngine().getConfiguration().isHtSnapshot()) {
+            addStat("snapshot_vbuckets", snapshotVbs.load(), add_stat, c);
+            addStat("snapshot_items", snapshotItems.load(), add_stat, c);
+        }
+
+        size_t toScan = vbsToScan.load();
+        if (toScan > 0) {
+            addStat("vbuckets_scanned", vbsScanned.load(), add_stat, c);
+            addStat("vbuckets_to_scan", toScan, add_stat, c);
+        }
+
+        double progress = getScanProgress();
+        if (progress >= 0) {
+            addStat("progress", uint64_t(progress * 100), add_stat, c);
+            if (progress > 0) {
+                hrtime_t elapsed = gethrtime() - phaseStart.load();
+                addStat("eta", uint64_t(elapsed * (1 - progress) / progress
+                                        / 1000), add_stat, c);
+            }
+        }
    } else {
         addStat(NULL, "disabled", add_stat, c);
     }
 }
 
+double Warmup::getScanProgress() const
+{
+    if (warmupComplete.load()) {
+        return -1;
+    }
+
+    EPStats &stats = store.getEPEngine().getEpStats();
+    size_t done;
+    size_t total;
+    switch (state.getState()) {
+    case WarmupState::KeyDump:
+        done = stats.warmedUpKeys;
+        total = estimatedItemCount.load();
+        break;
+    case WarmupState::LoadingKVPairs:
+    case WarmupState::LoadingData:
+        done = stats.warmedUpValues;
+        total = estimatedWarmupCount.load();
+        break;
+    default:
+        return -1;
+    }
+
+    if (total == 0 || total == std::numeric_limits<size_t>::max()) {
+        // No estimate of the items, go by the vbuckets scanned
+        done = vbsScanned.load();
+        total = vbsToScan.load();
+        if (total == 0) {
+            return -1;
+        }
+    }
+    return std::min(double(done) / total, 1.0);
+}
+
 /* In the case of CouchKVStore, all vbucket states of all the shards are stored
  * in a single instance. ForestKVStore stores only the vbucket states specific
  * to that shard. Hence the vbucket states of all the shards need to be
@@ -30,6 +30,7 @@
 #include <unordered_set>
 #include <vector>
 
+class AccessLogReader;
 
 class WarmupState {
 public:
@@ -71,15 +72,22 @@ private:
  */
 class LoadStorageKVPairCallback : public Callback<GetValue> {
 public:
+    /**
+     * @param _replay true if the items are the changes on top of a restored
+     *        hash table snapshot, so they replace what is there, and
+     *        deletions are applied
+     */
     LoadStorageKVPairCallback(EventuallyPersistentStore& ep,
-                              bool _maybeEnableTraffic, int _warmupState)
+                              bool _maybeEnableTraffic, int _warmupState,
+                              bool _replay = false)
         : vbuckets(ep.vbMap),
           stats(ep.getEPEngine().getEpStats()),
           epstore(ep),
           startTime(ep_real_time()),
           hasPurged(false),
           maybeEnableTraffic(_maybeEnableTraffic),
-          warmupState(_warmupState) {}
+          warmupState(_warmupState),
+          replay(_replay) {}
 
     void callback(GetValue &val);
 
@@ -98,6 +106,7 @@ private:
     bool        hasPurged;
     bool        maybeEnableTraffic;
     int         warmupState;
+    bool        replay;
 };
 
 class LoadValueCallback : public Callback<CacheLookup> {
@@ -138,8 +147,11 @@ public:
         warmup.store(gethrtime() + gethrtime_period() - startTime);
     }
 
-    size_t doWarmup(MutationLog &lf, const std::map<uint16_t,
-                    vbucket_state> &vbmap, Callback<GetValue> &cb);
+    size_t doWarmup(MutationLog &lf, const std::vector<uint16_t> &vbIds,
+                    Callback<GetValue> &cb);
+
+    size_t doWarmup(AccessLogReader &log, const std::vector<uint16_t> &vbIds,
+                    Callback<GetValue> &cb);
 
     bool isComplete() { return warmupComplete.load(); }
 
@@ -155,17 +167,36 @@ public:
 
     bool hasOOMFailure() { return warmupOOMFailure.load(); }
 
+    bool isSinglePass() { return singlePass.load(); }
+
+    /**
+     * Give up on a single pass whose values did not fit in memory after
+     * all; the vbuckets not loaded yet get a key dump and their values
+     * are loaded as memory allows.
+     */
+    void setSinglePassFallback() { singlePassFallback.store(true); }
+
+    bool hasSinglePassFallback() { return singlePassFallback.load(); }
+
     void initialize();
     void createVBuckets(uint16_t shardId);
     void estimateDatabaseItemCount(uint16_t shardId);
-    void keyDumpforShard(uint16_t shardId);
+    void keyDumpforShard(uint16_t shardId,
+                         const std::vector<uint16_t> &vbIds);
     void checkForAccessLog();
-    void loadingAccessLog(uint16_t shardId);
-    void loadKVPairsforShard(uint16_t shardId);
-    void loadDataforShard(uint16_t shardId);
+    void loadingAccessLog(uint16_t shardId,
+                          const std::vector<uint16_t> &vbIds);
+    void loadKVPairsforShard(uint16_t shardId,
+                             const std::vector<uint16_t> &vbIds);
+    void loadDataforShard(uint16_t shardId,
+                          const std::vector<uint16_t> &vbIds);
     void done();
 
 private:
+    // The vbuckets each scan task reads, along with their shard
+    typedef std::vector<std::pair<uint16_t, std::vector<uint16_t> > >
+        scan_parts_t;
+
     template <typename T>
     void addStat(const char *nm, const T &val, ADD_STAT add_stat, const void *c) const;
 
@@ -176,6 +207,22 @@ private:
 
     void populateShardVbStates();
 
+    /* True if all of the data is expected to fit in memory, so keys and
+       values are better loaded in one scan under value eviction */
+    bool isSinglePassPossible();
+
+    /* Split the vbuckets of every shard into warmup_parallelism parts to
+       be scanned by tasks of their own, and reset the scan progress */
+    scan_parts_t splitScan();
+
+    /* Fraction of the current scan phase done, or -1 outside of one */
+    double getScanProgress() const;
+
+    /* Restore the hash table of a vbucket from its snapshot and replay the
+       changes persisted since. False if there is no usable snapshot, the
+       vbucket is then to be loaded from disk as usual */
+    bool restoreFromSnapshot(uint16_t shardId, uint16_t vbid);
+
     void scheduleInitialize();
     void scheduleCreateVBuckets();
     void scheduleEstimateDatabaseItemCount();
@@ -199,14 +246,31 @@ private:
     AtomicValue<hrtime_t> startTime;
     AtomicValue<hrtime_t> metadata;
     AtomicValue<hrtime_t> warmup;
+    // When the current phase started, and the time spent in each phase
+    AtomicValue<hrtime_t> phaseStart;
+    AtomicValue<hrtime_t> *phaseTimes;
 
     std::map<uint16_t, vbucket_state> *shardVbStates;
     AtomicValue<size_t> threadtask_count;
+    // Tasks, and vbuckets, of the scan phase running
+    AtomicValue<size_t> scanTaskCount;
+    AtomicValue<size_t> vbsScanned;
+    AtomicValue<size_t> vbsToScan;
+    // VBuckets restored from hash table snapshots, skipped by later phases
+    AtomicValue<bool> *restoredVbs;
+    // VBuckets whose keys a single pass loaded, before falling back
+    AtomicValue<bool> *loadedVbs;
+    AtomicValue<size_t> snapshotVbs;
+    AtomicValue<size_t> snapshotItems;
     bool *shardKeyDumpStatus;
     std::vector<uint16_t> *shardVbIds;
 
     AtomicValue<hrtime_t> estimateTime;
     AtomicValue<size_t> estimatedItemCount;
+    // Bytes of memory the data on disk is expected to take
+    AtomicValue<size_t> estimatedDataSize;
+    AtomicValue<bool> singlePass;
+    AtomicValue<bool> singlePassFallback;
     bool cleanShutdown;
     bool corruptAccessLog;
     AtomicValue<bool> warmupComplete;
@@ -298,27 +362,31 @@ private:
 class WarmupKeyDump : public GlobalTask {
 public:
     WarmupKeyDump(EventuallyPersistentStore &st,
-                  uint16_t sh, Warmup *w) :
+                  uint16_t sh, const std::vector<uint16_t> &vbs,
+                  Warmup *w) :
         GlobalTask(&st.getEPEngine(), TaskId::WarmupKeyDump, 0, false),
         _shardId(sh),
+        _vbIds(vbs),
         _warmup(w) {
         _warmup->addToTaskSet(uid);
     }
 
     std::string getDescription() {
         std::stringstream ss;
-        ss<<"Warmup - key dump: shard "<<_shardId;
+        ss<<"Warmup - key dump: shard "<<_shardId
+          <<" ("<<_vbIds.size()<<" vbuckets)";
         return ss.str();
     }
 
     bool run() {
-        _warmup->keyDumpforShard(_shardId);
+        _warmup->keyDumpforShard(_shardId, _vbIds);
         _warmup->removeFromTaskSet(uid);
         return false;
     }
 
 private:
     uint16_t _shardId;
+    std::vector<uint16_t> _vbIds;
     Warmup* _warmup;
 };
 
@@ -350,81 +418,93 @@ private:
 class WarmupLoadAccessLog : public GlobalTask {
 public:
     WarmupLoadAccessLog(EventuallyPersistentStore &st,
-                        uint16_t sh, Warmup *w) :
+                        uint16_t sh, const std::vector<uint16_t> &vbs,
+                        Warmup *w) :
         GlobalTask(&st.getEPEngine(), TaskId::WarmupLoadAccessLog, 0, false),
         _shardId(sh),
+        _vbIds(vbs),
         _warmup(w) {
         _warmup->addToTaskSet(uid);
     }
 
     std::string getDescription() {
         std::stringstream ss;
-        ss<<"Warmup - loading access log: shard "<<_shardId;
+        ss<<"Warmup - loading access log: shard "<<_shardId
+          <<" ("<<_vbIds.size()<<" vbuckets)";
         return ss.str();
     }
 
     bool run() {
-        _warmup->loadingAccessLog(_shardId);
+        _warmup->loadingAccessLog(_shardId, _vbIds);
         _warmup->removeFromTaskSet(uid);
         return false;
     }
 
 private:
     uint16_t _shardId;
+    std::vector<uint16_t> _vbIds;
     Warmup* _warmup;
 };
 
 class WarmupLoadingKVPairs : public GlobalTask {
 public:
     WarmupLoadingKVPairs(EventuallyPersistentStore &st,
-                         uint16_t sh, Warmup *w) :
+                         uint16_t sh, const std::vector<uint16_t> &vbs,
+                         Warmup *w) :
         GlobalTask(&st.getEPEngine(), TaskId::WarmupLoadingKVPairs, 0, false),
         _shardId(sh),
+        _vbIds(vbs),
         _warmup(w) {
         _warmup->addToTaskSet(uid);
     }
 
     std::string getDescription() {
         std::stringstream ss;
-        ss<<"Warmup - loading KV Pairs: shard "<<_shardId;
+        ss<<"Warmup - loading KV Pairs: shard "<<_shardId
+          <<" ("<<_vbIds.size()<<" vbuckets)";
         return ss.str();
     }
 
     bool run() {
-        _warmup->loadKVPairsforShard(_shardId);
+        _warmup->loadKVPairsforShard(_shardId, _vbIds);
         _warmup->removeFromTaskSet(uid);
         return false;
     }
 
 private:
     uint16_t _shardId;
+    std::vector<uint16_t> _vbIds;
     Warmup* _warmup;
 };
 
 class WarmupLoadingData : public GlobalTask {
 public:
     WarmupLoadingData(EventuallyPersistentStore &st,
-                      uint16_t sh, Warmup *w) :
+                      uint16_t sh, const std::vector<uint16_t> &vbs,
+                      Warmup *w) :
         GlobalTask(&st.getEPEngine(), TaskId::WarmupLoadingData, 0, false),
         _shardId(sh),
+        _vbIds(vbs),
         _warmup(w) {
         _warmup->addToTaskSet(uid);
     }
 
     std::string getDescription() {
         std::stringstream ss;
-        ss<<"Warmup - loading data: shard "<<_shardId;
+        ss<<"Warmup - loading data: shard "<<_shardId
+          <<" ("<<_vbIds.size()<<" vbuckets)";
         return ss.str();
     }
 
     bool run() {
-        _warmup->loadDataforShard(_shardId);
+        _warmup->loadDataforShard(_shardId, _vbIds);
         _warmup->removeFromTaskSet(uid);
         return false;
     }
 
 private:
     uint16_t _shardId;
+    std::vector<uint16_t> _vbIds;
     Warmup* _warmup;
 };
 
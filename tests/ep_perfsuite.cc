@@ -38,6 +38,11 @@
 #include <algorithm>
 #include <iterator>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
 #include "ep_testsuite_common.h"
 #include "ep_test_apis.h"
 
@@ -990,6 +995,28 @@ static enum test_result perf_multi_thread_latency(engine_test_t* test) {
                                                      10000/* documents */);
 }
 
+// Hash bucket lock contention; run with and without ht_optimistic_reads.
+static enum test_result perf_multi_thread_latency_8(engine_test_t* test) {
+    return perf_latency_baseline_multi_thread_bucket(test,
+                                                     1, /* bucket */
+                                                     8, /* threads */
+                                                     10000/* documents */);
+}
+
+static enum test_result perf_multi_thread_latency_16(engine_test_t* test) {
+    return perf_latency_baseline_multi_thread_bucket(test,
+                                                     1, /* bucket */
+                                                     16, /* threads */
+                                                     10000/* documents */);
+}
+
+static enum test_result perf_multi_thread_latency_32(engine_test_t* test) {
+    return perf_latency_baseline_multi_thread_bucket(test,
+                                                     1, /* bucket */
+                                                     32, /* threads */
+                                                     10000/* documents */);
+}
+
 static enum test_result perf_latency_dcp_impact(ENGINE_HANDLE *h,
                                                 ENGINE_HANDLE_V1 *h1) {
     // Spin up a DCP replication background thread, then start the normal
@@ -1035,6 +1062,364 @@ static enum test_result perf_latency_tap_impact(ENGINE_HANDLE *h,
 }
 
 
+/* Drain whatever expiry notifications are waiting on the socket, returns
+ * the number of datagrams read.
+ */
+static size_t drain_expiry_notifications(int sock, int flags, size_t& bytes) {
+    char buf[65536];
+    size_t received = 0;
+    ssize_t len;
+    while ((len = recv(sock, buf, sizeof(buf), flags)) > 0) {
+        ++received;
+        bytes += len;
+    }
+    return received;
+}
+
+/*
+ * Expire num_docs items (on access) with the given expiry_format and count
+ * the notifications arriving on a local UDP socket standing in for the
+ * notification consumer. Returns notifications per second, from the first
+ * expiring get to the last datagram received.
+ */
+static double perf_expiry_notifications_core(ENGINE_HANDLE *h,
+                                             ENGINE_HANDLE_V1 *h1,
+                                             const char* format,
+                                             const std::string& key_prefix,
+                                             const std::string& data,
+                                             uint8_t datatype,
+                                             size_t num_docs,
+                                             size_t& avg_size) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    cb_assert(sock >= 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    cb_assert(bind(sock, (sockaddr*)&addr, sizeof(addr)) == 0);
+    socklen_t addrlen = sizeof(addr);
+    cb_assert(getsockname(sock, (sockaddr*)&addr, &addrlen) == 0);
+    int rcvbuf = 16 * 1024 * 1024;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    timeval tv = {1, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    const std::string port = std::to_string(ntohs(addr.sin_port));
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_format", format),
+          "Failed to set expiry_format");
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_host", "127.0.0.1"),
+          "Failed to set expiry_host");
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_port", port.c_str()),
+          "Failed to set expiry_port");
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < num_docs; i++) {
+        keys.push_back(key_prefix + std::to_string(i));
+    }
+    for (auto& key : keys) {
+        item* it = NULL;
+        checkeq(ENGINE_SUCCESS,
+                storeCasVb11(h, h1, NULL, OPERATION_SET, key.c_str(),
+                             data.c_str(), data.length(), 0, &it, 0,
+                             /*vBucket*/0, /*exp*/10, datatype),
+                "Failed to store a value");
+        h1->release(h, NULL, it);
+    }
+    testHarness.time_travel(11);
+
+    size_t received = 0;
+    size_t bytes = 0;
+    const hrtime_t start = gethrtime();
+    for (size_t i = 0; i < keys.size(); i++) {
+        item* it = NULL;
+        checkeq(ENGINE_KEY_ENOENT,
+                h1->get(h, NULL, &it, keys[i].c_str(), keys[i].size(), 0),
+                "Expected the item to be expired");
+        // Keep the socket buffer from overflowing while expiring.
+        if ((i & 63) == 63) {
+            received += drain_expiry_notifications(sock, MSG_DONTWAIT, bytes);
+        }
+    }
+    hrtime_t end = gethrtime();
+    while (received < num_docs) {
+        size_t n = drain_expiry_notifications(sock, MSG_DONTWAIT, bytes);
+        if (n == 0) {
+            // Block (up to SO_RCVTIMEO) for the notifier to catch up.
+            n = drain_expiry_notifications(sock, 0, bytes);
+            if (n == 0) {
+                break;
+            }
+        }
+        received += n;
+        end = gethrtime();
+    }
+
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_port", "0"),
+          "Failed to reset expiry_port");
+    close(sock);
+
+    checkeq(num_docs, received, "Lost expiry notifications");
+    avg_size = received ? bytes / received : 0;
+    return received * 1e9 / (end - start);
+}
+
+/* Benchmark expiry notifications per second for each expiry_format and
+ * document type.
+ */
+static enum test_result perf_expiry_notifications(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    // Only timing the notification path, not considering persistence.
+    stop_persistence(h, h1);
+
+    const size_t num_docs = ITERATIONS / 10;
+    const std::string raw(200, 'x');
+    std::string json("{\"name\":\"expiry\",\"padding\":\"");
+    json.append(170, 'y');
+    json.append("\"}");
+
+    int printed = printf("\n\n=== Expiry notifications - %" PRIu64 " items",
+                         uint64_t(num_docs));
+    fillLineWith('=', 88-printed);
+    printf("\n\n  %-8s %-6s %14s %12s\n\n", "Format", "Body",
+           "Notif/s", "Avg bytes");
+
+    const char* formats[] = {"json", "binary"};
+    int run = 0;
+    for (auto format : formats) {
+        for (int j = 0; j < 2; j++) {
+            const bool is_json = (j == 0);
+            size_t avg_size = 0;
+            const std::string prefix = std::to_string(run++) + "_";
+            double rate = perf_expiry_notifications_core(
+                    h, h1, format, prefix, is_json ? json : raw,
+                    is_json ? PROTOCOL_BINARY_DATATYPE_JSON :
+                              PROTOCOL_BINARY_RAW_BYTES,
+                    num_docs, avg_size);
+            printf("  %-8s %-6s %14.0f %12zu\n", format,
+                   is_json ? "JSON" : "RAW", rate, avg_size);
+        }
+    }
+    printf("\n");
+    return SUCCESS;
+}
+
+/* Sum a kvstore stat over the read-write stores of all shards. */
+static size_t get_rw_kvstore_stat(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                  const std::string &name) {
+    size_t total = 0;
+    for (int shard = 0; shard < 4; shard++) {
+        const std::string stat = "rw_" + std::to_string(shard) + ":" + name;
+        total += get_int_stat_or_default(h, h1, 0, stat.c_str(), "kvstore");
+    }
+    return total;
+}
+
+/* Time one flush of num_docs documents, stored while persistence was
+ * stopped, in documents per second.
+ */
+static double perf_flush_throughput_core(ENGINE_HANDLE *h,
+                                         ENGINE_HANDLE_V1 *h1,
+                                         const std::string &data,
+                                         size_t num_docs) {
+    stop_persistence(h, h1);
+    for (size_t i = 0; i < num_docs; i++) {
+        const std::string key = "flush_" + std::to_string(i);
+        item* it = NULL;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.c_str(), data.c_str(),
+                      &it),
+                "Failed to store a value");
+        h1->release(h, NULL, it);
+    }
+
+    const hrtime_t start = gethrtime();
+    start_persistence(h, h1);
+    wait_for_flusher_to_settle(h, h1);
+    const hrtime_t end = gethrtime();
+    return num_docs * 1e9 / (end - start);
+}
+
+/* Benchmark the flusher on inserts and on updates of the same keys, along
+ * with how many keys had to be looked up in the database file first.
+ */
+static enum test_result perf_flush_throughput(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    const size_t num_docs = ITERATIONS / 10;
+    const std::string data(200, 'x');
+
+    int printed = printf("\n\n=== Flush throughput - %" PRIu64 " items",
+                         uint64_t(num_docs));
+    fillLineWith('=', 88-printed);
+    printf("\n\n  %-8s %14s %14s %14s\n\n", "Phase", "Docs/s",
+           "Lookups", "Skipped");
+
+    const char* phases[] = {"insert", "update"};
+    for (auto phase : phases) {
+        const size_t lookups = get_rw_kvstore_stat(h, h1, "docinfo_lookups");
+        const size_t skipped = get_rw_kvstore_stat(h, h1,
+                                                   "docinfo_lookups_skipped");
+        double rate = perf_flush_throughput_core(h, h1, data, num_docs);
+        printf("  %-8s %14.0f %14zu %14zu\n", phase, rate,
+               get_rw_kvstore_stat(h, h1, "docinfo_lookups") - lookups,
+               get_rw_kvstore_stat(h, h1, "docinfo_lookups_skipped") -
+                   skipped);
+    }
+    printf("\n");
+    return SUCCESS;
+}
+
+/* Distribution of key indices 0..n-1 with a Zipfian skew (s = 1): index
+ * i is drawn with a probability proportional to 1 / (i + 1).
+ */
+class ZipfianDistribution {
+public:
+    ZipfianDistribution(size_t n)
+        : cdf(n), uniform(0.0, 1.0) {
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += 1.0 / (i + 1);
+            cdf[i] = sum;
+        }
+        for (auto &c : cdf) {
+            c /= sum;
+        }
+    }
+
+    template< class Generator >
+    size_t operator()(Generator& g) {
+        auto it = std::lower_bound(cdf.begin(), cdf.end(), uniform(g));
+        return std::min(static_cast<size_t>(it - cdf.begin()),
+                        cdf.size() - 1);
+    }
+
+private:
+    // Cumulative probability of each index
+    std::vector<double> cdf;
+
+    std::uniform_real_distribution<double> uniform;
+};
+
+/* Benchmark the writes the flusher does for a steady stream of updates to
+ * Zipfian distributed keys, where a few keys take most of the updates;
+ * flusher_coalesce_max_age lets those coalesce before they are written.
+ */
+static enum test_result perf_flush_coalescing(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    const size_t num_keys = 1000;
+    const size_t num_mutations = ITERATIONS / 5;
+    // Mutations per ms, ~20k/s
+    const size_t pace = 20;
+    const std::string data(100, 'x');
+
+    std::mt19937 gen(42);
+    ZipfianDistribution zipf(num_keys);
+
+    wait_for_flusher_to_settle(h, h1);
+    const size_t persisted = get_int_stat(h, h1, "ep_total_persisted");
+    const hrtime_t start = gethrtime();
+    for (size_t i = 0; i < num_mutations; i++) {
+        const std::string key = "zipf_" + std::to_string(zipf(gen));
+        item* it = NULL;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.c_str(), data.c_str(),
+                      &it),
+                "Failed to store a value");
+        h1->release(h, NULL, it);
+        if ((i + 1) % pace == 0) {
+            usleep(1000);
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+    const hrtime_t end = gethrtime();
+    const size_t written = get_int_stat(h, h1, "ep_total_persisted") -
+                           persisted;
+
+    int printed = printf("\n\n=== Flush coalescing - %" PRIu64 " mutations "
+                         "of %" PRIu64 " Zipfian keys, max age %d ms",
+                         uint64_t(num_mutations), uint64_t(num_keys),
+                         get_int_stat(h, h1, "ep_flusher_coalesce_max_age"));
+    fillLineWith('=', 88-printed);
+    // Mutations/doc of this run, ep_mutations_per_persist since the start
+    printf("\n\n  %-14s %14s %18s %12s\n\n", "Docs written",
+           "Mutations/doc", "Per persist (all)", "Time (ms)");
+    printf("  %-14zu %14.2f %18s %12.1f\n", written,
+           written ? double(num_mutations) / written : 0.0,
+           get_str_stat(h, h1, "ep_mutations_per_persist").c_str(),
+           (end - start) / 1e6);
+    printf("\n");
+    return SUCCESS;
+}
+
+/* Benchmark how long the disk queues take to drain when one vbucket of a
+ * shard holds most of the items (say after a replica catch-up) and the
+ * others of the shard a few each; with flusher_parallelism the small ones
+ * need not wait for the big one.
+ */
+static enum test_result perf_flush_skewed(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    const uint16_t num_vbuckets = 8;
+    const size_t big_docs = ITERATIONS / 10;
+    const size_t small_docs = 100;
+    const std::string data(200, 'x');
+
+    for (uint16_t vb = 1; vb < num_vbuckets; vb++) {
+        check(set_vbucket_state(h, h1, vb, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    stop_persistence(h, h1);
+    for (uint16_t vb = 0; vb < num_vbuckets; vb++) {
+        const size_t num_docs = (vb == 0) ? big_docs : small_docs;
+        for (size_t i = 0; i < num_docs; i++) {
+            const std::string key = "skew_" + std::to_string(vb) + "_" +
+                                    std::to_string(i);
+            item* it = NULL;
+            checkeq(ENGINE_SUCCESS,
+                    store(h, h1, NULL, OPERATION_SET, key.c_str(),
+                          data.c_str(), &it, 0, vb),
+                    "Failed to store a value");
+            h1->release(h, NULL, it);
+        }
+    }
+
+    const hrtime_t start = gethrtime();
+    start_persistence(h, h1);
+    bool drained = false;
+    while (!drained) {
+        drained = true;
+        for (uint16_t vb = 1; vb < num_vbuckets && drained; vb++) {
+            const std::string stat = "vb_" + std::to_string(vb) +
+                                     ":queue_size";
+            const std::string group = "vbucket-details " + std::to_string(vb);
+            drained = get_int_stat(h, h1, stat.c_str(), group.c_str()) == 0;
+        }
+        if (!drained) {
+            usleep(100);
+        }
+    }
+    const hrtime_t small_end = gethrtime();
+    wait_for_flusher_to_settle(h, h1);
+    const hrtime_t end = gethrtime();
+
+    int printed = printf("\n\n=== Skewed flush - %" PRIu64 " + %d x %" PRIu64
+                         " items, parallelism %d", uint64_t(big_docs),
+                         num_vbuckets - 1, uint64_t(small_docs),
+                         get_int_stat(h, h1, "ep_flusher_parallelism"));
+    fillLineWith('=', 88-printed);
+    printf("\n\n  %-28s %14s\n\n", "Drained", "Time (ms)");
+    printf("  %-28s %14.1f\n", "small vbuckets",
+           (small_end - start) / 1e6);
+    printf("  %-28s %14.1f\n", "ep_queue_size", (end - start) / 1e6);
+    printf("\n");
+    return SUCCESS;
+}
+
 /*****************************************************************************
  * List of testcases
  *****************************************************************************/
@@ -1082,6 +1467,30 @@ BaseTestCase testsuite_testcases[] = {
                    NULL, NULL,
                    "backend=couchdb;ht_size=393209",
                    prepare, cleanup),
+        TestCaseV2("Multi thread latency (8 threads)",
+                   perf_multi_thread_latency_8, NULL, NULL,
+                   "backend=couchdb;ht_size=393209",
+                   prepare, cleanup),
+        TestCaseV2("Multi thread latency (8 threads, optimistic reads)",
+                   perf_multi_thread_latency_8, NULL, NULL,
+                   "backend=couchdb;ht_size=393209;ht_optimistic_reads=true",
+                   prepare, cleanup),
+        TestCaseV2("Multi thread latency (16 threads)",
+                   perf_multi_thread_latency_16, NULL, NULL,
+                   "backend=couchdb;ht_size=393209",
+                   prepare, cleanup),
+        TestCaseV2("Multi thread latency (16 threads, optimistic reads)",
+                   perf_multi_thread_latency_16, NULL, NULL,
+                   "backend=couchdb;ht_size=393209;ht_optimistic_reads=true",
+                   prepare, cleanup),
+        TestCaseV2("Multi thread latency (32 threads)",
+                   perf_multi_thread_latency_32, NULL, NULL,
+                   "backend=couchdb;ht_size=393209",
+                   prepare, cleanup),
+        TestCaseV2("Multi thread latency (32 threads, optimistic reads)",
+                   perf_multi_thread_latency_32, NULL, NULL,
+                   "backend=couchdb;ht_size=393209;ht_optimistic_reads=true",
+                   prepare, cleanup),
 
         TestCase("DCP impact on front-end latency", perf_latency_dcp_impact,
                  test_setup, teardown,
@@ -1093,6 +1502,43 @@ BaseTestCase testsuite_testcases[] = {
                  "backend=couchdb;ht_size=393209",
                  prepare, cleanup),
 
+        TestCase("Expiry notification throughput", perf_expiry_notifications,
+                 test_setup, teardown,
+                 "backend=couchdb;ht_size=393209",
+                 prepare, cleanup),
+
+        TestCase("Flush throughput", perf_flush_throughput,
+                 test_setup, teardown,
+                 "backend=couchdb;ht_size=393209",
+                 prepare, cleanup),
+
+        TestCase("Flush throughput (full eviction)", perf_flush_throughput,
+                 test_setup, teardown,
+                 "backend=couchdb;ht_size=393209;"
+                 "item_eviction_policy=full_eviction",
+                 prepare, cleanup),
+
+        TestCase("Skewed flush", perf_flush_skewed,
+                 test_setup, teardown,
+                 "backend=couchdb;ht_size=393209;max_num_shards=1",
+                 prepare, cleanup),
+
+        TestCase("Skewed flush (parallel)", perf_flush_skewed,
+                 test_setup, teardown,
+                 "backend=couchdb;ht_size=393209;max_num_shards=1;"
+                 "flusher_parallelism=4",
+                 prepare, cleanup),
+
+        TestCase("Flush coalescing (Zipfian)", perf_flush_coalescing,
+                 test_setup, teardown,
+                 "backend=couchdb;ht_size=393209",
+                 prepare, cleanup),
+
+        TestCase("Flush coalescing (Zipfian, 50ms window)",
+                 perf_flush_coalescing, test_setup, teardown,
+                 "backend=couchdb;ht_size=393209;flusher_coalesce_max_age=50",
+                 prepare, cleanup),
+
         TestCase(NULL, NULL, NULL, NULL,
                  "backend=couchdb", prepare, cleanup)
 };
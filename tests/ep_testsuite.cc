@@ -20,9 +20,13 @@
 
 #include "config.h"
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include <condition_variable>
 #include <cstdlib>
@@ -855,6 +859,251 @@ static enum test_result test_expiry(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_expiry_index_one_entry_per_key(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    const char *key = "test_expiry_index";
+    item *itm = NULL;
+
+    for (int i = 0; i < 10; ++i) {
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key, "value", &itm,
+                      0, 0, 3600 + i),
+                "Failed set.");
+        h1->release(h, NULL, itm);
+    }
+    checkeq(1, get_int_stat(h, h1, "ep_expiry_index_size"),
+            "Expected one index entry after overwriting the key");
+
+    touch(h, h1, key, 0, 7200);
+    checkeq(PROTOCOL_BINARY_RESPONSE_SUCCESS, last_status.load(),
+            "Failed touch.");
+    checkeq(1, get_int_stat(h, h1, "ep_expiry_index_size"),
+            "Expected one index entry after touching the key");
+
+    checkeq(ENGINE_SUCCESS, del(h, h1, key, 0, 0), "Failed delete.");
+    checkeq(0, get_int_stat(h, h1, "ep_expiry_index_size"),
+            "Expected the index entry to go with the key");
+    checkeq(0, get_int_stat(h, h1, "ep_expiry_index_memory"),
+            "Expected an empty index to use no memory");
+
+    checkeq(ENGINE_SUCCESS,
+            store(h, h1, NULL, OPERATION_SET, key, "value", &itm, 0, 0, 3600),
+            "Failed set.");
+    h1->release(h, NULL, itm);
+    checkeq(1, get_int_stat(h, h1, "ep_expiry_index_size"),
+            "Expected an index entry for the key");
+    checkeq(ENGINE_SUCCESS,
+            store(h, h1, NULL, OPERATION_SET, key, "value", &itm, 0, 0, 0),
+            "Failed set.");
+    h1->release(h, NULL, itm);
+    checkeq(0, get_int_stat(h, h1, "ep_expiry_index_size"),
+            "Expected no index entry for a key that does not expire");
+
+    return SUCCESS;
+}
+
+static enum test_result test_expiry_index_pager(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    // The full-scan pager does not run in the hour of the test
+    const char *key = "test_expiry_index_pager";
+    item *itm = NULL;
+    checkeq(ENGINE_SUCCESS,
+            store(h, h1, NULL, OPERATION_SET, key, "value", &itm, 0, 0, 2),
+            "Failed set.");
+    h1->release(h, NULL, itm);
+    checkeq(1, get_int_stat(h, h1, "ep_expiry_index_size"),
+            "Expected an index entry for the key");
+
+    testHarness.time_travel(3);
+    wait_for_stat_to_be(h, h1, "ep_expired_pager", 1);
+    checkeq(0, get_int_stat(h, h1, "ep_expired_access"),
+            "Expected the item to expire without an access");
+    checkeq(0, get_int_stat(h, h1, "ep_expiry_index_size"),
+            "Expected the index entry to go with the item");
+    checkeq(0, get_int_stat(h, h1, "curr_items"),
+            "Expected the item to be gone");
+
+    return SUCCESS;
+}
+
+static enum test_result test_expiry_index_replica_promotion(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    const char *key = "test_expiry_index_replica";
+    item *itm = NULL;
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    checkeq(ENGINE_SUCCESS,
+            store(h, h1, NULL, OPERATION_SET, key, "value", &itm, 0, 1, 2),
+            "Failed set.");
+    h1->release(h, NULL, itm);
+    check(set_vbucket_state(h, h1, 1, vbucket_state_replica),
+          "Failed to set vbucket state.");
+
+    // A replica keeps the due entry, the index pager runs every second
+    testHarness.time_travel(3);
+    sleep(2);
+    checkeq(0, get_int_stat(h, h1, "ep_expired_pager"),
+            "Expected no expiry on a replica");
+    checkeq(1, get_int_stat(h, h1, "ep_expiry_index_size"),
+            "Expected the replica to keep the index entry");
+
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+    wait_for_stat_to_be(h, h1, "ep_expired_pager", 1);
+    checkeq(0, get_int_stat(h, h1, "ep_expiry_index_size"),
+            "Expected the index entry to go with the item");
+
+    return SUCCESS;
+}
+
+static std::string recv_expiry_notification(int sock, sockaddr_in *from) {
+    char buf[65536];
+    socklen_t fromlen = sizeof(*from);
+    ssize_t len = recvfrom(sock, buf, sizeof(buf), 0, (sockaddr*)from,
+                           &fromlen);
+    check(len > 0, "Expected an expiry notification");
+    return std::string(buf, len);
+}
+
+static enum test_result test_expiry_journal_replay(ENGINE_HANDLE *h,
+                                                   ENGINE_HANDLE_V1 *h1) {
+    // Local UDP socket standing in for the notification consumer
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    check(sock >= 0, "Failed to create consumer socket");
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    check(bind(sock, (sockaddr*)&addr, sizeof(addr)) == 0,
+          "Failed to bind consumer socket");
+    socklen_t addrlen = sizeof(addr);
+    check(getsockname(sock, (sockaddr*)&addr, &addrlen) == 0,
+          "Failed to get consumer address");
+    timeval tv = {10, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    const std::string port = std::to_string(ntohs(addr.sin_port));
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_host", "127.0.0.1"),
+          "Failed to set expiry_host");
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_port", port.c_str()),
+          "Failed to set expiry_port");
+
+    // The journal may be left over from an earlier run
+    const uint64_t base = get_ull_stat(h, h1, "ep_expiry_notify_seqno");
+    const char *keys[] = {"key0", "key1", "key2"};
+    for (auto key : keys) {
+        item *it = NULL;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key, "somevalue", &it, 0, 0,
+                      2),
+                "Failed set.");
+        h1->release(h, NULL, it);
+    }
+    testHarness.time_travel(3);
+    for (auto key : keys) {
+        item *it = NULL;
+        checkeq(ENGINE_KEY_ENOENT,
+                h1->get(h, NULL, &it, key, strlen(key), 0),
+                "Item didn't expire");
+    }
+
+    sockaddr_in engine;
+    for (int i = 0; i < 3; ++i) {
+        std::string n = recv_expiry_notification(sock, &engine);
+        std::string seqno = "\"seqno\":" + std::to_string(base + i + 1) +
+                            ",";
+        check(n.find(seqno) != std::string::npos, "Unexpected seqno");
+        check(n.find(keys[i]) != std::string::npos, "Unexpected key");
+        check(n.find("\"replay\"") == std::string::npos,
+              "Unexpected replay flag");
+    }
+
+    // Pretend the last two were lost
+    std::string req = "replay " + std::to_string(base + 2) + " " +
+                      std::to_string(base + 3);
+    check(sendto(sock, req.data(), req.size(), 0, (sockaddr*)&engine,
+                 sizeof(engine)) == (ssize_t)req.size(),
+          "Failed to send replay request");
+    for (int i = 1; i < 3; ++i) {
+        std::string n = recv_expiry_notification(sock, &engine);
+        std::string seqno = "\"seqno\":" + std::to_string(base + i + 1) +
+                            ",";
+        check(n.find(seqno) != std::string::npos, "Unexpected replay seqno");
+        check(n.find(keys[i]) != std::string::npos, "Unexpected replay key");
+        check(n.find("\"replay\":true") != std::string::npos,
+              "Expected replay flag");
+    }
+    wait_for_stat_to_be(h, h1, "ep_expiry_notify_replayed", 2);
+
+    std::string ack = "ack " + std::to_string(base + 3);
+    check(sendto(sock, ack.data(), ack.size(), 0, (sockaddr*)&engine,
+                 sizeof(engine)) == (ssize_t)ack.size(),
+          "Failed to send ack");
+    wait_for_stat_to_be(h, h1, "ep_expiry_notify_acked_seqno", base + 3);
+
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_port", "0"),
+          "Failed to reset expiry_port");
+    close(sock);
+    return SUCCESS;
+}
+
+static enum test_result test_expiry_notify_overflow(ENGINE_HANDLE *h,
+                                                    ENGINE_HANDLE_V1 *h1) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    check(sock >= 0, "Failed to create consumer socket");
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    check(bind(sock, (sockaddr*)&addr, sizeof(addr)) == 0,
+          "Failed to bind consumer socket");
+    socklen_t addrlen = sizeof(addr);
+    check(getsockname(sock, (sockaddr*)&addr, &addrlen) == 0,
+          "Failed to get consumer address");
+
+    const std::string port = std::to_string(ntohs(addr.sin_port));
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_host", "127.0.0.1"),
+          "Failed to set expiry_host");
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_port", port.c_str()),
+          "Failed to set expiry_port");
+
+    const char *keys[] = {"key0", "key1"};
+    for (auto key : keys) {
+        item *it = NULL;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key, "somevalue", &it, 0, 0,
+                      2),
+                "Failed set.");
+        h1->release(h, NULL, it);
+    }
+    testHarness.time_travel(3);
+    for (auto key : keys) {
+        item *it = NULL;
+        checkeq(ENGINE_KEY_ENOENT,
+                h1->get(h, NULL, &it, key, strlen(key), 0),
+                "Item didn't expire");
+    }
+
+    // No room in the queue, so dropped before being numbered
+    checkeq(2, get_int_stat(h, h1, "ep_expiry_notify_overflow"),
+            "Expected both notifications counted as overflow");
+    checkeq(0, get_int_stat(h, h1, "ep_expiry_notify_queued"),
+            "Expected no notification queued");
+    checkeq(0, get_int_stat(h, h1, "ep_expiry_notify_seqno"),
+            "Expected no notification numbered");
+
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "expiry_port", "0"),
+          "Failed to reset expiry_port");
+    close(sock);
+    return SUCCESS;
+}
+
 static enum test_result test_expiry_loader(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     const char *key = "test_expiry_loader";
     const char *data = "some test data here.";
@@ -1914,6 +2163,152 @@ static enum test_result test_io_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_vbstate_writes(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    wait_for_flusher_to_settle(h, h1);
+    h1->reset_stats(h, NULL);
+    checkeq(0, get_int_stat(h, h1, "rw_0:vbstate_writes", "kvstore"),
+            "Expected reset stats to set vbstate_writes to zero");
+
+    // The snapshot range moves with every batch, so every commit of the
+    // flusher writes the vbucket state along.
+    for (int i = 0; i < 3; ++i) {
+        item *itm = NULL;
+        std::string key("key" + std::to_string(i));
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.c_str(), "value", &itm),
+                "Failed set.");
+        h1->release(h, NULL, itm);
+        wait_for_flusher_to_settle(h, h1);
+        checkeq(i + 1, get_int_stat(h, h1, "rw_0:vbstate_writes", "kvstore"),
+                "Expected the vbucket state written with every commit");
+    }
+
+    return SUCCESS;
+}
+
+static enum test_result test_flusher_group_sync(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    check(set_vbucket_state(h, h1, 1, vbucket_state_active),
+          "Failed to set vbucket state.");
+
+    const int num_keys = 10;
+    for (uint16_t vbid = 0; vbid < 2; ++vbid) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream ss;
+            ss << "key" << ii;
+            checkeq(ENGINE_SUCCESS,
+                    store(h, h1, NULL, OPERATION_SET, ss.str().c_str(),
+                          "value", NULL, 0, vbid),
+                    "Failed to store an item.");
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // Reported persisted only after the sync round of the flusher.
+    wait_for_stat_to_be(h, h1, "vb_0:last_persisted_seqno", num_keys,
+                        "vbucket-seqno");
+    wait_for_stat_to_be(h, h1, "vb_1:last_persisted_seqno", num_keys,
+                        "vbucket-seqno");
+
+    // Synced by the flusher rather than at every commit.
+    int rounds = 0;
+    int files = 0;
+    bool timed = false;
+    for (const auto &stat : get_all_stats(h, h1, "kvtimings")) {
+        size_t pos = stat.first.find(":groupCommitSize_");
+        if (pos != std::string::npos) {
+            // Bins are named <prefix>_<start>,<end>
+            int start = std::stoi(stat.first.substr(pos + 17));
+            rounds += std::stoi(stat.second);
+            files += start * std::stoi(stat.second);
+        }
+        timed = timed ||
+                stat.first.find(":groupCommitSync_") != std::string::npos;
+    }
+    check(rounds > 0, "Expected a flusher sync round");
+    check(files >= 2, "Expected the files of both vbuckets synced");
+    check(timed, "Expected the groupCommitSync histogram");
+
+    evict_key(h, h1, "key0", 1, "Ejected.");
+    check_key_value(h, h1, "key0", "value", 5, 1);
+
+    return SUCCESS;
+}
+
+static enum test_result test_flusher_parallelism(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    const uint16_t num_vbuckets = 8;
+    for (uint16_t vbid = 1; vbid < num_vbuckets; ++vbid) {
+        check(set_vbucket_state(h, h1, vbid, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+
+    // Several rounds of updates to the same keys, flushed by tasks of
+    // their own vbucket each.
+    const int num_keys = 10;
+    for (int round = 0; round < 3; ++round) {
+        for (uint16_t vbid = 0; vbid < num_vbuckets; ++vbid) {
+            for (int ii = 0; ii < num_keys; ++ii) {
+                std::stringstream key, value;
+                key << "key" << ii;
+                value << "value" << round;
+                checkeq(ENGINE_SUCCESS,
+                        store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                              value.str().c_str(), NULL, 0, vbid),
+                        "Failed to store an item.");
+            }
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    for (uint16_t vbid = 0; vbid < num_vbuckets; ++vbid) {
+        std::stringstream stat;
+        stat << "vb_" << vbid << ":last_persisted_seqno";
+        wait_for_stat_to_be(h, h1, stat.str().c_str(), 3 * num_keys,
+                            "vbucket-seqno");
+    }
+
+    // The last revision is the one on disk.
+    evict_key(h, h1, "key0", 5, "Ejected.");
+    check_key_value(h, h1, "key0", "value2", 6, 5);
+
+    return SUCCESS;
+}
+
+static enum test_result test_flusher_batch_limit(ENGINE_HANDLE *h,
+                                                 ENGINE_HANDLE_V1 *h1) {
+    wait_for_flusher_to_settle(h, h1);
+    int commits = get_int_stat(h, h1, "ep_commit_num");
+
+    // Queued while the flusher is stopped, then written 10 at a time.
+    stop_persistence(h, h1);
+    const int num_keys = 95;
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream key;
+        key << "key" << ii;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                      "value", NULL, 0, 0),
+                "Failed to store an item.");
+    }
+    start_persistence(h, h1);
+    wait_for_flusher_to_settle(h, h1);
+
+    checkeq(num_keys, get_int_stat(h, h1, "vb_0:last_persisted_seqno",
+                                   "vbucket-seqno"),
+            "Expected all of the items persisted");
+    check(get_int_stat(h, h1, "ep_flusher_batches_split") >= num_keys / 10,
+          "Expected the batch to be split");
+    check(get_int_stat(h, h1, "ep_commit_num") - commits > num_keys / 10,
+          "Expected a commit per batch");
+
+    evict_key(h, h1, "key94", 0, "Ejected.");
+    check_key_value(h, h1, "key94", "value", 5, 0);
+
+    return SUCCESS;
+}
+
 static enum test_result test_vb_file_stats(ENGINE_HANDLE *h,
                                         ENGINE_HANDLE_V1 *h1) {
     wait_for_flusher_to_settle(h, h1);
@@ -2003,6 +2398,88 @@ static enum test_result test_bg_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static enum test_result test_bg_fetch_parallelism(ENGINE_HANDLE *h,
+                                                  ENGINE_HANDLE_V1 *h1) {
+    const uint16_t num_vbuckets = 8;
+    for (uint16_t vbid = 1; vbid < num_vbuckets; ++vbid) {
+        check(set_vbucket_state(h, h1, vbid, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+
+    const int num_keys = 10;
+    for (uint16_t vbid = 0; vbid < num_vbuckets; ++vbid) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream key, value;
+            key << "key" << ii;
+            value << "value" << vbid;
+            checkeq(ENGINE_SUCCESS,
+                    store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                          value.str().c_str(), NULL, 0, vbid),
+                    "Failed to store an item.");
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    h1->reset_stats(h, NULL);
+    for (uint16_t vbid = 0; vbid < num_vbuckets; ++vbid) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream key;
+            key << "key" << ii;
+            evict_key(h, h1, key.str().c_str(), vbid, "Ejected.");
+        }
+    }
+
+    // Hold the bg fetcher back until every vbucket has fetches queued.
+    check(set_param(h, h1, protocol_binary_engine_param_flush,
+                    "bg_fetch_delay", "1"),
+          "Failed to set bg_fetch_delay");
+    std::vector<const void *> cookies;
+    for (uint16_t vbid = 0; vbid < num_vbuckets; ++vbid) {
+        const void *cookie = testHarness.create_cookie();
+        testHarness.set_ewouldblock_handling(cookie, false);
+        cookies.push_back(cookie);
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream key;
+            key << "key" << ii;
+            item *itm = NULL;
+            checkeq(ENGINE_EWOULDBLOCK,
+                    h1->get(h, cookie, &itm, key.str().c_str(),
+                            key.str().length(), vbid),
+                    "Expected the get to wait for a bg fetch");
+        }
+    }
+    wait_for_stat_to_be(h, h1, "ep_bg_fetched", num_vbuckets * num_keys);
+    for (auto cookie : cookies) {
+        testHarness.destroy_cookie(cookie);
+    }
+
+    // The fetcher hands vbuckets to tasks of their own while it has lanes
+    // left, and reads the rest itself meanwhile.
+    check(get_int_stat(h, h1, "ep_bg_fetch_tasks") >= 3,
+          "Expected three vbuckets read by tasks of their own");
+
+    // Every value is the one of its vbucket.
+    for (uint16_t vbid = 0; vbid < num_vbuckets; ++vbid) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream key, value;
+            key << "key" << ii;
+            value << "value" << vbid;
+            check_key_value(h, h1, key.str().c_str(), value.str().c_str(),
+                            value.str().length(), vbid);
+        }
+    }
+    checkeq(num_vbuckets * num_keys, get_int_stat(h, h1, "ep_bg_fetched"),
+            "Expected every item fetched once");
+
+    bool found = false;
+    for (const auto &stat : get_all_stats(h, h1, "timings")) {
+        found = found || stat.first.compare(0, 14, "bg_fetch_disk_") == 0;
+    }
+    check(found, "Expected the bg_fetch_disk histogram");
+
+    return SUCCESS;
+}
+
 static enum test_result test_bg_meta_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     item *itm = NULL;
     h1->reset_stats(h, NULL);
@@ -2930,6 +3407,283 @@ static enum test_result test_warmup_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1
     return SUCCESS;
 }
 
+static enum test_result test_warmup_parallelism(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    const uint16_t num_vbuckets = 8;
+    for (uint16_t vbid = 1; vbid < num_vbuckets; ++vbid) {
+        check(set_vbucket_state(h, h1, vbid, vbucket_state_active),
+              "Failed to set vbucket state.");
+    }
+
+    const int num_keys = 10;
+    for (uint16_t vbid = 0; vbid < num_vbuckets; ++vbid) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream key, value;
+            key << "key" << ii;
+            value << "value" << vbid;
+            checkeq(ENGINE_SUCCESS,
+                    store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                          value.str().c_str(), NULL, 0, vbid),
+                    "Failed to store an item.");
+        }
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // The single shard is scanned by 4 tasks of 2 vbuckets each.
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    auto warmup_stats = get_all_stats(h, h1, "warmup");
+    checkeq(num_vbuckets,
+            std::stoi(warmup_stats.at("ep_warmup_vbuckets_to_scan")),
+            "Expected every vbucket to scan");
+    checkeq(num_vbuckets,
+            std::stoi(warmup_stats.at("ep_warmup_vbuckets_scanned")),
+            "Expected every vbucket scanned");
+    checkeq(num_vbuckets * num_keys,
+            std::stoi(warmup_stats.at("ep_warmup_value_count")),
+            "Expected every value loaded");
+    check(warmup_stats.find("ep_warmup_eta") == warmup_stats.end(),
+          "Expected no ETA once warmup completed");
+
+    for (uint16_t vbid = 0; vbid < num_vbuckets; ++vbid) {
+        for (int ii = 0; ii < num_keys; ++ii) {
+            std::stringstream key, value;
+            key << "key" << ii;
+            value << "value" << vbid;
+            check_key_value(h, h1, key.str().c_str(), value.str().c_str(),
+                            value.str().length(), vbid);
+        }
+    }
+
+    return SUCCESS;
+}
+
+static enum test_result test_warmup_ht_snapshot(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 100;
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream key, value;
+        key << "key" << ii;
+        value << "value" << ii;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                      value.str().c_str(), NULL),
+                "Failed to store an item.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // A clean shutdown writes the snapshot, which warmup restores.
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    checkeq(1, get_int_stat(h, h1, "ep_warmup_snapshot_vbuckets", "warmup"),
+            "Expected vbucket 0 restored from its snapshot");
+    checkeq(num_keys,
+            get_int_stat(h, h1, "ep_warmup_snapshot_items", "warmup"),
+            "Expected every item restored from the snapshot");
+    checkeq(num_keys, get_int_stat(h, h1, "ep_warmup_value_count", "warmup"),
+            "Expected every value warmed up");
+
+    // Change the data after the snapshot, and crash so the snapshot stays
+    // behind the data on disk.
+    for (int ii = 0; ii < 10; ++ii) {
+        std::stringstream key, value;
+        key << "key" << ii;
+        value << "newvalue" << ii;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                      value.str().c_str(), NULL),
+                "Failed to update an item.");
+    }
+    for (int ii = 10; ii < 20; ++ii) {
+        std::stringstream key;
+        key << "key" << ii;
+        checkeq(ENGINE_SUCCESS, del(h, h1, key.str().c_str(), 0, 0),
+                "Failed to delete an item.");
+    }
+    for (int ii = num_keys; ii < num_keys + 10; ++ii) {
+        std::stringstream key, value;
+        key << "key" << ii;
+        value << "value" << ii;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                      value.str().c_str(), NULL),
+                "Failed to store an item.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, true);
+    wait_for_warmup_complete(h, h1);
+    checkeq(1, get_int_stat(h, h1, "ep_warmup_snapshot_vbuckets", "warmup"),
+            "Expected vbucket 0 restored from its snapshot");
+
+    // Key -> value and CAS, or empty if the key is not found
+    auto collect = [&h, &h1]() {
+        std::map<std::string, std::pair<std::string, uint64_t> > items;
+        for (int ii = 0; ii < num_keys + 10; ++ii) {
+            std::stringstream key;
+            key << "key" << ii;
+            item *it = NULL;
+            item_info info;
+            info.nvalue = 1;
+            if (h1->get(h, NULL, &it, key.str().c_str(), key.str().length(),
+                        0) == ENGINE_SUCCESS) {
+                check(h1->get_item_info(h, NULL, it, &info),
+                      "Failed to get item info");
+                items[key.str()] = std::make_pair(
+                    std::string(static_cast<char*>(info.value[0].iov_base),
+                                info.value[0].iov_len),
+                    info.cas);
+                h1->release(h, NULL, it);
+            }
+        }
+        return items;
+    };
+    auto restored = collect();
+    checkeq(size_t(num_keys), restored.size(),
+            "Expected the deleted keys gone and the new ones there");
+    checkeq(std::string("newvalue0"), restored["key0"].first,
+            "Expected the update after the snapshot");
+
+    // A full warmup from disk has to end up with the same state.
+    std::string config(testHarness.get_current_testcase()->cfg);
+    config = config + "ht_snapshot=false";
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              config.c_str(),
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    check(get_all_stats(h, h1, "warmup").count("ep_warmup_snapshot_vbuckets")
+          == 0, "Expected no snapshot restored");
+
+    auto loaded = collect();
+    check(restored == loaded,
+          "Expected the restored items to match a full warmup from disk");
+
+    return SUCCESS;
+}
+
+static enum test_result test_warmup_ht_snapshot_flush_all(ENGINE_HANDLE *h,
+                                                          ENGINE_HANDLE_V1 *h1) {
+    const int num_keys = 100;
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream key;
+        key << "key" << ii;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.str().c_str(), "old",
+                      NULL),
+                "Failed to store an item.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    // Leave a snapshot of the old data behind.
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+    checkeq(1, get_int_stat(h, h1, "ep_warmup_snapshot_vbuckets", "warmup"),
+            "Expected vbucket 0 restored from its snapshot");
+
+    // Seqnos start over after the flush; write past those of the snapshot
+    // with other keys and crash, so no new snapshot is written.
+    checkeq(ENGINE_SUCCESS, h1->flush(h, NULL, 0), "Failed to flush");
+    wait_for_flusher_to_settle(h, h1);
+    const int num_new_keys = num_keys + 50;
+    for (int ii = 0; ii < num_new_keys; ++ii) {
+        std::stringstream key;
+        key << "new" << ii;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.str().c_str(), "new",
+                      NULL),
+                "Failed to store an item.");
+    }
+    wait_for_flusher_to_settle(h, h1);
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, true);
+    wait_for_warmup_complete(h, h1);
+    checkeq(0, get_int_stat(h, h1, "ep_warmup_snapshot_vbuckets", "warmup"),
+            "Expected the snapshot from before the flush ignored");
+    checkeq(num_new_keys, get_int_stat(h, h1, "curr_items"),
+            "Expected only the items stored after the flush");
+    for (int ii = 0; ii < num_keys; ++ii) {
+        std::stringstream key;
+        key << "key" << ii;
+        checkeq(ENGINE_KEY_ENOENT, verify_key(h, h1, key.str().c_str()),
+                "Expected the flushed key to stay gone");
+    }
+    check_key_value(h, h1, "new0", "new", 3);
+
+    return SUCCESS;
+}
+
+static enum test_result test_warmup_single_pass(ENGINE_HANDLE *h,
+                                                ENGINE_HANDLE_V1 *h1) {
+    item *it = NULL;
+    for (int i = 0; i < 100; ++i) {
+        std::stringstream key;
+        key << "key-" << i;
+        checkeq(ENGINE_SUCCESS,
+                store(h, h1, NULL, OPERATION_SET, key.str().c_str(),
+                      "somevalue", &it),
+                "Error setting.");
+        h1->release(h, NULL, it);
+    }
+
+    // The data fits in memory, keys and values are loaded in one scan.
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.get_current_testcase()->cfg,
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    auto warmup_stats = get_all_stats(h, h1, "warmup");
+    checkeq(std::string("single_pass"), warmup_stats.at("ep_warmup_strategy"),
+            "Expected a single pass warmup");
+    checkeq(100, std::stoi(warmup_stats.at("ep_warmup_key_count")),
+            "Expected 100 keys loaded after warmup");
+    checkeq(100, std::stoi(warmup_stats.at("ep_warmup_value_count")),
+            "Expected 100 values loaded after warmup");
+    check(warmup_stats.find("ep_warmup_load_kv_pairs_time") !=
+          warmup_stats.end(), "Found no time of loading k/v pairs");
+    check(warmup_stats.find("ep_warmup_key_dump_time") == warmup_stats.end(),
+          "Expected no key dump");
+    check_key_value(h, h1, "key-99", "somevalue", 9);
+
+    // Unless turned off.
+    std::string config(testHarness.get_current_testcase()->cfg);
+    config = config + "warmup_single_pass=false";
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              config.c_str(),
+                              true, false);
+    wait_for_warmup_complete(h, h1);
+
+    warmup_stats = get_all_stats(h, h1, "warmup");
+    checkeq(std::string("two_phase"), warmup_stats.at("ep_warmup_strategy"),
+            "Expected a two phase warmup");
+    checkeq(100, std::stoi(warmup_stats.at("ep_warmup_value_count")),
+            "Expected 100 values loaded after warmup");
+    check(warmup_stats.find("ep_warmup_key_dump_time") != warmup_stats.end(),
+          "Found no time of the key dump");
+    check(warmup_stats.find("ep_warmup_load_data_time") != warmup_stats.end(),
+          "Found no time of loading data");
+
+    return SUCCESS;
+}
+
 static enum test_result test_warmup_with_threshold(ENGINE_HANDLE *h,
                                                    ENGINE_HANDLE_V1 *h1) {
     item *it = NULL;
@@ -5893,6 +6647,8 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "vb_0:min_depth",
                 "vb_0:reported",
                 "vb_0:resized",
+                "vb_0:resize_migrated",
+                "vb_0:resize_target",
                 "vb_0:size",
                 "vb_0:state"
             }},
@@ -5976,6 +6732,7 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "vb_0:num_conn_cursors",
                 "vb_0:num_items_for_persistence",
                 "vb_0:num_open_checkpoint_items",
+                "vb_0:num_staged_items",
                 "vb_0:open_checkpoint_id",
                 "vb_0:persisted_checkpoint_id",
                 "vb_0:persistence:cursor_checkpoint_id",
@@ -5992,6 +6749,7 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "vb_0:num_conn_cursors",
                 "vb_0:num_items_for_persistence",
                 "vb_0:num_open_checkpoint_items",
+                "vb_0:num_staged_items",
                 "vb_0:open_checkpoint_id",
                 "vb_0:persisted_checkpoint_id",
                 "vb_0:persistence:cursor_checkpoint_id",
@@ -6161,9 +6919,11 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "ep_bfilter_key_count",
                 "ep_bfilter_residency_threshold",
                 "ep_bg_fetch_delay",
+                "ep_bg_fetch_parallelism",
                 "ep_chk_max_items",
                 "ep_chk_period",
                 "ep_chk_remover_stime",
+                "ep_chk_staging_slots",
                 "ep_compaction_exp_mem_threshold",
                 "ep_compaction_write_queue_cap",
                 "ep_config_file",
@@ -6172,6 +6932,7 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "ep_cursor_dropping_lower_mark",
                 "ep_cursor_dropping_upper_mark",
                 "ep_data_traffic_enabled",
+                "ep_db_handle_cache_size",
                 "ep_dbname",
                 "ep_dcp_backfill_byte_limit",
                 "ep_dcp_conn_buffer_size",
@@ -6199,12 +6960,30 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "ep_exp_pager_enabled",
                 "ep_exp_pager_initial_run_time",
                 "ep_exp_pager_stime",
+                "ep_exp_index_enabled",
+                "ep_exp_index_stime",
+                "ep_expiry_format",
+                "ep_expiry_journal_max_size",
+                "ep_expiry_journal_path",
+                "ep_expiry_notify_queue_cap",
                 "ep_failpartialwarmup",
                 "ep_flushall_enabled",
+                "ep_flusher_batch_max_bytes",
+                "ep_flusher_batch_max_items",
+                "ep_flusher_coalesce_max_age",
+                "ep_flusher_group_sync",
+                "ep_flusher_group_sync_max",
+                "ep_flusher_parallelism",
                 "ep_getl_default_timeout",
                 "ep_getl_max_timeout",
+                "ep_ht_hash_function",
+                "ep_ht_index",
+                "ep_ht_inline_value_size",
                 "ep_ht_locks",
+                "ep_ht_optimistic_reads",
                 "ep_ht_size",
+                "ep_ht_snapshot",
+                "ep_ht_snapshot_interval",
                 "ep_initfile",
                 "ep_item_eviction_policy",
                 "ep_item_num_based_new_chk",
@@ -6229,6 +7008,7 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "ep_replication_throttle_cap_pcnt",
                 "ep_replication_throttle_queue_cap",
                 "ep_replication_throttle_threshold",
+                "ep_slab_allocator",
                 "ep_tap_ack_grace_period",
                 "ep_tap_ack_initial_sequence_number",
                 "ep_tap_ack_interval",
@@ -6247,7 +7027,9 @@ static enum test_result test_mb19687_fixed(ENGINE_HANDLE* h,
                 "ep_warmup",
                 "ep_warmup_batch_size",
                 "ep_warmup_min_items_threshold",
-                "ep_warmup_min_memory_threshold"
+                "ep_warmup_min_memory_threshold",
+                "ep_warmup_parallelism",
+                "ep_warmup_single_pass"
             }
         },
         {"workload",
@@ -6597,8 +7379,23 @@ BaseTestCase testsuite_testcases[] = {
                  prepare, cleanup),
         TestCase("expiry", test_expiry, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("expiry index keeps one entry per key",
+                 test_expiry_index_one_entry_per_key, test_setup, teardown,
+                 "exp_index_enabled=true", prepare, cleanup),
+        TestCase("expiry index pager", test_expiry_index_pager, test_setup,
+                 teardown, "exp_index_enabled=true", prepare, cleanup),
+        TestCase("expiry index replica promotion",
+                 test_expiry_index_replica_promotion, test_setup, teardown,
+                 "exp_index_enabled=true", prepare, cleanup),
         TestCase("expiry_loader", test_expiry_loader, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("expiry journal replay", test_expiry_journal_replay,
+                 test_setup, teardown,
+                 "expiry_journal_path=./ep_testsuite_expiry.journal",
+                 prepare, cleanup),
+        TestCase("expiry notify queue overflow", test_expiry_notify_overflow,
+                 test_setup, teardown, "expiry_notify_queue_cap=0",
+                 prepare, cleanup),
         TestCase("expiration on compaction", test_expiration_on_compaction,
                  test_setup, teardown, "exp_pager_enabled=false",
                  prepare, cleanup),
@@ -6682,12 +7479,25 @@ BaseTestCase testsuite_testcases[] = {
                  prepare, cleanup),
         TestCase("io stats", test_io_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("vbucket state writes", test_vbstate_writes, test_setup,
+                 teardown, NULL, prepare, cleanup),
+        TestCase("flusher group sync", test_flusher_group_sync, test_setup,
+                 teardown, "flusher_group_sync=true", prepare, cleanup),
+        TestCase("flusher parallelism", test_flusher_parallelism, test_setup,
+                 teardown, "max_num_shards=1;flusher_parallelism=4", prepare,
+                 cleanup),
+        TestCase("flusher batch limit", test_flusher_batch_limit,
+                 test_setup, teardown, "flusher_batch_max_items=10", prepare,
+                 cleanup),
         TestCase("file stats", test_vb_file_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
         TestCase("file stats post warmup", test_vb_file_stats_after_warmup,
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("bg stats", test_bg_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
+        TestCase("bg fetch parallelism", test_bg_fetch_parallelism,
+                 test_setup, teardown,
+                 "max_num_shards=1;bg_fetch_parallelism=4", prepare, cleanup),
         TestCase("bg meta stats", test_bg_meta_stats, test_setup, teardown,
                  NULL, prepare, cleanup),
         TestCase("mem stats", test_mem_stats, test_setup, teardown,
@@ -6700,6 +7510,16 @@ BaseTestCase testsuite_testcases[] = {
                  test_setup, teardown, NULL, prepare, cleanup),
         TestCase("warmup stats", test_warmup_stats, test_setup,
                  teardown, NULL, prepare, cleanup),
+        TestCase("warmup single pass", test_warmup_single_pass, test_setup,
+                 teardown, NULL, prepare, cleanup),
+        TestCase("warmup parallelism", test_warmup_parallelism, test_setup,
+                 teardown, "max_num_shards=1;warmup_parallelism=4", prepare,
+                 cleanup),
+        TestCase("warmup from hash table snapshot", test_warmup_ht_snapshot,
+                 test_setup, teardown, "ht_snapshot=true", prepare, cleanup),
+        TestCase("warmup from hash table snapshot after flush_all",
+                 test_warmup_ht_snapshot_flush_all, test_setup, teardown,
+                 "ht_snapshot=true;flushall_enabled=true", prepare, cleanup),
         TestCase("warmup with threshold", test_warmup_with_threshold,
                  test_setup, teardown,
                  "warmup_min_items_threshold=1", prepare, cleanup),
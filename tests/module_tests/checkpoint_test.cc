@@ -759,6 +759,170 @@ TEST_F(CheckpointTest, CursorMovement) {
 
 }
 
+// Test that repeated updates of the same keys, which leave gaps in the
+// checkpoint queue until it is compacted, keep the cursors in place.
+TEST_F(CheckpointTest, DedupCompaction) {
+    const size_t num_keys = 10;
+    queued_item qi;
+    for (size_t ii = 0; ii < num_keys; ii++) {
+        qi.reset(new Item("key" + std::to_string(ii), vbucket->getId(),
+                          queue_op_set, /*revSeq*/0, /*bySeq*/0));
+        EXPECT_TRUE(manager->queueDirty(vbucket, qi, true));
+    }
+
+    std::vector<queued_item> items;
+    manager->getAllItemsForCursor(CheckpointManager::pCursorName, items);
+    EXPECT_EQ(num_keys + 1, items.size());
+
+    /* Enough updates for the cleared slots to be compacted several times */
+    const uint64_t rounds = 4 * CheckpointQueue::BLOCK_SIZE / num_keys;
+    for (uint64_t round = 1; round <= rounds; round++) {
+        for (size_t ii = 0; ii < num_keys; ii++) {
+            qi.reset(new Item("key" + std::to_string(ii), vbucket->getId(),
+                              queue_op_set, /*revSeq*/round, /*bySeq*/0));
+            manager->queueDirty(vbucket, qi, true);
+        }
+    }
+    EXPECT_EQ(num_keys + 1, manager->getNumOpenChkItems());
+
+    items.clear();
+    manager->getAllItemsForCursor(CheckpointManager::pCursorName, items);
+    std::set<std::string> keys;
+    for (size_t ii = 0; ii < items.size(); ii++) {
+        if (items[ii]->getOperation() != queue_op_set) {
+            continue;
+        }
+        EXPECT_EQ(rounds, items[ii]->getRevSeqno());
+        keys.insert(items[ii]->getKey());
+    }
+    EXPECT_EQ(num_keys, keys.size());
+}
+
+// Measure the queueDirty throughput and the checkpoint memory overhead per
+// queued item, for unique keys and for updates of a smaller set of keys.
+TEST_F(CheckpointTest, QueueDirtyBenchmark) {
+    checkpoint_config = CheckpointConfig(MAX_CHECKPOINT_PERIOD,
+                                         MAX_CHECKPOINT_ITEMS,
+                                         /*numCheckpoints*/2,
+                                         /*itemBased*/true,
+                                         /*keepClosed*/false,
+                                         /*enableMerge*/false);
+    createManager();
+
+    const size_t num_keys = MAX_CHECKPOINT_ITEMS - 1;
+    std::vector<queued_item> queued;
+    queued.reserve(num_keys);
+    for (size_t ii = 0; ii < num_keys; ii++) {
+        queued.push_back(queued_item(new Item("key" + std::to_string(ii),
+                                              vbucket->getId(), queue_op_set,
+                                              /*revSeq*/0, /*bySeq*/0)));
+    }
+
+    size_t overhead = global_stats.memOverhead.load();
+    hrtime_t start = gethrtime();
+    for (size_t ii = 0; ii < num_keys; ii++) {
+        manager->queueDirty(vbucket, queued[ii], true);
+    }
+    hrtime_t end = gethrtime();
+    EXPECT_EQ(1, manager->getNumCheckpoints());
+
+    double duration_s = (end - start) / double(1000 * 1000 * 1000);
+    RecordProperty("unique_items_per_sec", size_t(num_keys / duration_s));
+    RecordProperty("bytes_per_item",
+                   (global_stats.memOverhead.load() - overhead) / num_keys);
+
+    /* Every update replaces the item queued for its key */
+    const size_t num_updates = 10 * num_keys;
+    const size_t hot_keys = 1000;
+    start = gethrtime();
+    for (size_t ii = 0; ii < num_updates; ii++) {
+        queued_item qi(new Item(queued[ii % hot_keys]->getKey(),
+                                vbucket->getId(), queue_op_set,
+                                /*revSeq*/ii, /*bySeq*/0));
+        manager->queueDirty(vbucket, qi, true);
+    }
+    end = gethrtime();
+    EXPECT_EQ(num_keys + 1, manager->getNumOpenChkItems());
+
+    duration_s = (end - start) / double(1000 * 1000 * 1000);
+    RecordProperty("updates_per_sec", size_t(num_updates / duration_s));
+}
+
+struct bench_set_args {
+    CheckpointManager *manager;
+    RCPtr<VBucket> vbucket;
+    size_t id;
+};
+
+extern "C" {
+static void launch_bench_set_thread(void *arg) {
+    struct bench_set_args *args = static_cast<struct bench_set_args *>(arg);
+    for (int i = 0; i < NUM_ITEMS; ++i) {
+        queued_item qi(new Item("key-" + std::to_string(args->id) + "-" +
+                                std::to_string(i),
+                                args->vbucket->getId(), queue_op_set, 0, 0));
+        args->manager->queueDirty(args->vbucket, qi, true);
+    }
+}
+}
+
+/* Threads queueing mutations of their own keys into a single vbucket, with
+ * the given number of staging slots (0 = every writer takes the lock).
+ */
+class ConcurrentQueueDirtyBenchmark : public ::testing::TestWithParam<size_t> {
+};
+
+TEST_P(ConcurrentQueueDirtyBenchmark, SingleVBucket) {
+    EPStats stats;
+    CheckpointConfig config(MAX_CHECKPOINT_PERIOD, MAX_CHECKPOINT_ITEMS,
+                            /*numCheckpoints*/2, /*itemBased*/true,
+                            /*keepClosed*/false, /*enableMerge*/false,
+                            /*stagingSlots*/GetParam());
+    std::shared_ptr<Callback<uint16_t> > cb(new DummyCB());
+    RCPtr<VBucket> vbucket(new VBucket(0, vbucket_state_active, stats, config,
+                                       NULL, 0, 0, 0, NULL, cb));
+    CheckpointManager manager(stats, 0, config, /*lastSeqno*/0,
+                              /*lastSnapStart*/0, /*lastSnapEnd*/0, cb);
+
+    struct bench_set_args args[NUM_SET_THREADS];
+    cb_thread_t set_threads[NUM_SET_THREADS];
+    hrtime_t start = gethrtime();
+    for (size_t i = 0; i < NUM_SET_THREADS; ++i) {
+        args[i].manager = &manager;
+        args[i].vbucket = vbucket;
+        args[i].id = i;
+        EXPECT_EQ(0, cb_create_thread(&set_threads[i], launch_bench_set_thread,
+                                      &args[i], 0));
+    }
+    for (size_t i = 0; i < NUM_SET_THREADS; ++i) {
+        EXPECT_EQ(0, cb_join_thread(set_threads[i]));
+    }
+    hrtime_t end = gethrtime();
+
+    /* Every mutation is in the checkpoints, in seqno order */
+    std::vector<queued_item> items;
+    manager.getAllItemsForCursor(CheckpointManager::pCursorName, items);
+    size_t sets = 0;
+    int64_t lastSeqno = 0;
+    for (size_t i = 0; i < items.size(); ++i) {
+        if (items[i]->getOperation() != queue_op_set) {
+            continue;
+        }
+        ++sets;
+        EXPECT_LT(lastSeqno, items[i]->getBySeqno());
+        lastSeqno = items[i]->getBySeqno();
+    }
+    EXPECT_EQ(NUM_SET_THREADS * NUM_ITEMS, sets);
+    EXPECT_EQ(NUM_SET_THREADS * NUM_ITEMS, manager.getHighSeqno());
+
+    double duration_s = (end - start) / double(1000 * 1000 * 1000);
+    RecordProperty("items_per_sec",
+                   size_t(NUM_SET_THREADS * NUM_ITEMS / duration_s));
+}
+
+INSTANTIATE_TEST_CASE_P(StagingSlots, ConcurrentQueueDirtyBenchmark,
+                        ::testing::Values(0, 4096));
+
 /* static storage for environment variable set by putenv(). */
 static char allow_no_stats_env[] = "ALLOW_NO_STATS_UPDATE=yeah";
 
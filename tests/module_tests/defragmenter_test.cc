@@ -190,6 +190,53 @@ TEST_F(DefragmenterBenchmarkTest, DefragAge10_20ms) {
 }
 
 
+/* Populate a vbucket, delete every other document - the pattern that leaves
+ * memory fragmented - and destroy the vbucket, with the StoredValues taken
+ * from the general purpose allocator or from a slab arena.
+ */
+class SlabAllocatorBenchmarkTest : public ::testing::TestWithParam<bool> {
+};
+
+TEST_P(SlabAllocatorBenchmarkTest, PopulateDeleteDestroy) {
+    const bool slab = GetParam();
+    const size_t ndocs = 500000;
+    EPStats stats;
+    CheckpointConfig config;
+    std::shared_ptr<Callback<uint16_t> > cb(new DummyCB());
+    HashTable::setDefaultSlabAllocator(slab);
+    std::unique_ptr<VBucket> vbucket(new VBucket(0, vbucket_state_active,
+                                                 stats, config, nullptr, 0, 0,
+                                                 0, nullptr, cb));
+    HashTable::setDefaultSlabAllocator(false);
+
+    size_t populateRate = populateVbucket(*vbucket, ndocs);
+    RecordProperty("items_per_sec", populateRate);
+
+    hrtime_t start = gethrtime();
+    for (size_t i = 0; i < ndocs; i += 2) {
+        std::stringstream ss;
+        ss << "key" << i;
+        vbucket->ht.del(ss.str());
+    }
+    ReadEpoch::drain();
+    double duration_s = (gethrtime() - start) / double(1000 * 1000 * 1000);
+    RecordProperty("deletes_per_sec", size_t(ndocs / 2 / duration_s));
+    if (slab) {
+        RecordProperty("slab_reserved_bytes",
+                       stats.slabReservedBytes.load());
+        RecordProperty("slab_used_bytes", stats.slabUsedBytes.load());
+    }
+
+    start = gethrtime();
+    vbucket.reset();
+    ReadEpoch::drain();
+    RecordProperty("destroy_usec", size_t((gethrtime() - start) / 1000));
+}
+
+INSTANTIATE_TEST_CASE_P(GeneralPurposeAndSlab, SlabAllocatorBenchmarkTest,
+                        ::testing::Bool());
+
+
 /* Return how many bytes the memory allocator has mapped in RAM - essentially
  * application-allocated bytes plus memory in allocators own data structures
  * & freelists. This is an approximation of the the application's RSS.
@@ -24,6 +24,8 @@
 
 #include <algorithm>
 #include <limits>
+#include <memory>
+#include <thread>
 
 #include "threadtests.h"
 
@@ -320,6 +322,46 @@ TEST_F(HashTableTest, ConcurrentAccessResize) {
     getCompletedThreads(4, &gen);
 }
 
+// Worst case latency of a lookup while another thread resizes the
+// hash table; every key must stay visible throughout.
+TEST_F(HashTableTest, ResizeLatency) {
+    const int nkeys = 500000;
+    HashTable h(global_stats, 12289, 47);
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+
+    std::atomic<bool> done(false);
+    hrtime_t resizeTime = 0;
+    std::thread resizer([&h, &done, &resizeTime]() {
+        hrtime_t start = gethrtime();
+        h.resize(786433);
+        resizeTime = gethrtime() - start;
+        done = true;
+    });
+
+    hrtime_t worst = 0;
+    size_t ops = 0;
+    size_t missing = 0;
+    while (!done) {
+        const std::string &key = keys[ops++ % nkeys];
+        hrtime_t start = gethrtime();
+        if (!h.find(key)) {
+            ++missing;
+        }
+        worst = std::max(worst, gethrtime() - start);
+    }
+    resizer.join();
+
+    EXPECT_EQ(0, missing);
+    EXPECT_EQ(786433, h.getSize());
+    EXPECT_EQ(0, h.getResizeTarget());
+    verifyFound(h, keys);
+
+    RecordProperty("resize_us", size_t(resizeTime / 1000));
+    RecordProperty("lookups_during_resize", ops);
+    RecordProperty("worst_lookup_us", size_t(worst / 1000));
+}
+
 TEST_F(HashTableTest, AutoResize) {
     HashTable h(global_stats, 5, 3);
 
@@ -379,6 +421,293 @@ TEST_F(HashTableTest, DepthCounting) {
     EXPECT_GT(depthCounter.max, 1000);
 }
 
+static std::vector<std::string> generateSubscriberKeys(int num) {
+    std::vector<std::string> rv;
+    for (int i = 0; i < num; i++) {
+        rv.push_back("subscriber:7916" + std::to_string(1000000 + i) +
+                     ":profile");
+    }
+    return rv;
+}
+
+TEST_F(HashTableTest, HashFunctions) {
+    const ht_hash_function_t functions[] = {HT_HASH_DJB2, HT_HASH_MURMUR3};
+    for (auto hf : functions) {
+        HashTable h(global_stats, 5, 3, hf);
+        EXPECT_EQ(hf, h.getHashFunction());
+        std::vector<std::string> keys = generateSubscriberKeys(1000);
+        storeMany(h, keys);
+        verifyFound(h, keys);
+
+        // Moving the values around relies on the cached key hash
+        h.resize(1031);
+        verifyFound(h, keys);
+        EXPECT_EQ(1000, count(h));
+    }
+}
+
+// Chain depth distribution and lookup rate of each hash function for
+// keys sharing a long common prefix.
+TEST_F(HashTableTest, HashFunctionDistribution) {
+    const int nkeys = 200000;
+    const size_t nbuckets = 49157;
+    std::vector<std::string> keys = generateSubscriberKeys(nkeys);
+
+    const ht_hash_function_t functions[] = {HT_HASH_DJB2, HT_HASH_MURMUR3};
+    const char *names[] = {"djb2", "murmur3"};
+    int maxDepth[2];
+    for (int f = 0; f < 2; f++) {
+        HashTable h(global_stats, nbuckets, 47, functions[f]);
+        storeMany(h, keys);
+
+        HashTableDepthStatVisitor depthCounter;
+        h.visitDepth(depthCounter);
+        maxDepth[f] = depthCounter.max;
+
+        hrtime_t start = gethrtime();
+        for (const auto& key : keys) {
+            ASSERT_TRUE(h.find(key));
+        }
+        hrtime_t elapsed = gethrtime() - start;
+
+        std::string name(names[f]);
+        RecordProperty(name + "_min_depth", depthCounter.min);
+        RecordProperty(name + "_max_depth", depthCounter.max);
+        RecordProperty(name + "_lookups_per_sec",
+                       size_t(nkeys * 1e9 / elapsed));
+    }
+
+    // ~4 items per bucket on average; a well distributed hash stays
+    // within a small multiple of that.
+    EXPECT_LT(maxDepth[1], 20);
+}
+
+class PauseResumeCounter : public PauseResumeHashTableVisitor {
+public:
+    PauseResumeCounter() : count(0) {}
+
+    bool visit(StoredValue& v) {
+        (void)v;
+        ++count;
+        return true;
+    }
+
+    size_t count;
+};
+
+TEST_F(HashTableTest, TaggedIndex) {
+    size_t initialSize = global_stats.currentSize.load();
+    // Few buckets so most values spill over from the tag groups.
+    HashTable h(global_stats, 5, 3, HT_HASH_MURMUR3, HT_INDEX_TAGGED);
+    EXPECT_EQ(HT_INDEX_TAGGED, h.getIndex());
+    const int nkeys = 1000;
+
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+    verifyFound(h, keys);
+    EXPECT_EQ(nkeys, count(h));
+
+    HashTableDepthStatVisitor depthCounter;
+    h.visitDepth(depthCounter);
+    EXPECT_EQ(nkeys, depthCounter.size);
+
+    PauseResumeCounter prc;
+    HashTable::Position pos;
+    while (pos != h.endPosition()) {
+        pos = h.pauseResumeVisit(prc, pos);
+    }
+    EXPECT_EQ(nkeys, prc.count);
+
+    // Delete every other key, leaving holes in the groups.
+    std::vector<std::string> deleted;
+    for (int i = 0; i < nkeys; i += 2) {
+        EXPECT_TRUE(h.del(keys[i]));
+        deleted.push_back(keys[i]);
+    }
+    EXPECT_EQ(nkeys / 2, count(h));
+    for (int i = 0; i < nkeys; i++) {
+        EXPECT_EQ(i % 2 == 1, h.find(keys[i]) != NULL);
+    }
+
+    // Refill the holes, then move everything around.
+    storeMany(h, deleted);
+    EXPECT_EQ(nkeys, count(h));
+    h.resize();
+    verifyFound(h, keys);
+    h.resize(6143);
+    verifyFound(h, keys);
+    EXPECT_EQ(nkeys, count(h));
+
+    for (const auto& key : keys) {
+        h.del(key);
+    }
+    EXPECT_EQ(0, count(h));
+    EXPECT_EQ(initialSize, global_stats.currentSize.load());
+}
+
+// Lookup rate of the chained and tagged index for keys which are, and
+// are not, in the table.
+TEST_F(HashTableTest, TaggedIndexLookups) {
+    const int nkeys = 200000;
+    std::vector<std::string> keys = generateSubscriberKeys(nkeys);
+    std::vector<std::string> missing;
+    for (int i = 0; i < nkeys; i++) {
+        missing.push_back("subscriber:7926" + std::to_string(1000000 + i) +
+                          ":profile");
+    }
+
+    const ht_index_t indexes[] = {HT_INDEX_CHAINED, HT_INDEX_TAGGED};
+    const char *names[] = {"chained", "tagged"};
+    for (int x = 0; x < 2; x++) {
+        HashTable h(global_stats, 5, 47, HT_HASH_MURMUR3, indexes[x]);
+        storeMany(h, keys);
+        h.resize();
+
+        hrtime_t start = gethrtime();
+        for (const auto& key : keys) {
+            ASSERT_TRUE(h.find(key));
+        }
+        hrtime_t hits = gethrtime() - start;
+
+        start = gethrtime();
+        for (const auto& key : missing) {
+            ASSERT_FALSE(h.find(key));
+        }
+        hrtime_t misses = gethrtime() - start;
+
+        std::string name(names[x]);
+        RecordProperty(name + "_buckets", h.getSize());
+        RecordProperty(name + "_hits_per_sec", size_t(nkeys * 1e9 / hits));
+        RecordProperty(name + "_misses_per_sec",
+                       size_t(nkeys * 1e9 / misses));
+    }
+}
+
+// Lock-free gets only return hits on live, resident values, and what they
+// return is consistent while writers and a resize are busy.
+TEST_F(HashTableTest, OptimisticGet) {
+    HashTable h(global_stats, 47, 3, HT_HASH_MURMUR3, HT_INDEX_TAGGED, true);
+    ASSERT_TRUE(h.hasOptimisticReads());
+    const int nkeys = 10000;
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+
+    int64_t seqno;
+    uint8_t nru;
+    // Referencing a new value has to update its NRU under the lock.
+    EXPECT_EQ(NULL, h.optimisticGet(keys[0], 0, false, true, seqno, nru));
+    std::unique_ptr<Item> itm(h.optimisticGet(keys[0], 0, false, false,
+                                              seqno, nru));
+    ASSERT_TRUE(itm.get());
+    EXPECT_EQ(keys[0], itm->getValue()->to_s());
+    for (int i = MIN_NRU_VALUE; i < MAX_NRU_VALUE; i++) {
+        h.find(keys[0]);
+    }
+    itm.reset(h.optimisticGet(keys[0], 0, false, true, seqno, nru));
+    ASSERT_TRUE(itm.get());
+    EXPECT_EQ(MIN_NRU_VALUE, nru);
+
+    EXPECT_EQ(NULL, h.optimisticGet("missing", 0, false, false, seqno, nru));
+    h.softDelete(keys[1], 0);
+    EXPECT_EQ(NULL, h.optimisticGet(keys[1], 0, false, false, seqno, nru));
+    StoredValue *v = h.find(keys[2], false);
+    v->markClean();
+    ASSERT_TRUE(h.unlocked_ejectItem(v, VALUE_ONLY));
+    EXPECT_EQ(NULL, h.optimisticGet(keys[2], 0, false, false, seqno, nru));
+
+    // The value of every key always is the key padded with as many dots
+    // as its flags say.
+    std::atomic<bool> done(false);
+    std::thread writer([&h, &keys, &done]() {
+        for (uint32_t round = 0; !done; ++round) {
+            for (int i = 3; i < nkeys; i++) {
+                uint32_t pad = round % 7;
+                std::string val = keys[i] + std::string(pad, '.');
+                Item it(keys[i].data(), keys[i].length(), pad, 0,
+                        val.data(), val.length());
+                h.set(it);
+            }
+        }
+    });
+    std::thread resizer([&h]() {
+        h.resize(12289);
+        h.resize(769);
+        h.resize(6143);
+    });
+
+    size_t hits = 0;
+    size_t torn = 0;
+    for (int pass = 0; pass < 20; pass++) {
+        for (int i = 3; i < nkeys; i++) {
+            itm.reset(h.optimisticGet(keys[i], 0, false, false, seqno, nru));
+            if (itm.get()) {
+                ++hits;
+                if (itm->getValue()->to_s() !=
+                    keys[i] + std::string(itm->getFlags(), '.')) {
+                    ++torn;
+                }
+            }
+        }
+    }
+    resizer.join();
+    done = true;
+    writer.join();
+
+    EXPECT_EQ(0, torn);
+    EXPECT_LT(0, hits);
+    ReadEpoch::drain();
+    EXPECT_EQ(0, ReadEpoch::getNumPending());
+}
+
+TEST_F(HashTableTest, SlabAllocator) {
+    global_stats.reset();
+    std::unique_ptr<HashTable> h(new HashTable(global_stats, 47, 3,
+                                               HT_HASH_MURMUR3,
+                                               HT_INDEX_CHAINED, false, true));
+    ASSERT_TRUE(h->getArena());
+    const int nkeys = 5000;
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(*h, keys);
+    EXPECT_EQ(nkeys, count(*h));
+
+    // Every StoredValue is in a slot no smaller than the object.
+    size_t objects = 0;
+    for (const auto &k : keys) {
+        StoredValue *v = h->find(k);
+        ASSERT_TRUE(v);
+        ASSERT_TRUE(SlabArena::owns(v));
+        EXPECT_LE(v->getObjectSize(), SlabArena::getSlotSize(v));
+        objects += SlabArena::getSlotSize(v);
+    }
+    EXPECT_EQ(objects, h->getArena()->getUsedBytes());
+    EXPECT_LE(h->getArena()->getUsedBytes(),
+              h->getArena()->getReservedBytes());
+    EXPECT_EQ(h->getArena()->getReservedBytes(),
+              global_stats.slabReservedBytes.load());
+
+    // Deleted values give their slots back for reuse.
+    for (int i = 0; i < nkeys / 2; i++) {
+        EXPECT_TRUE(h->del(keys[i]));
+    }
+    ReadEpoch::drain();
+    EXPECT_GT(objects, h->getArena()->getUsedBytes());
+    std::vector<std::string> again(keys.begin(), keys.begin() + nkeys / 2);
+    storeMany(*h, again);
+    EXPECT_EQ(objects, h->getArena()->getUsedBytes());
+
+    // Cleared in bulk, a new arena takes over.
+    h->clear();
+    EXPECT_EQ(0, count(*h));
+    storeMany(*h, keys);
+    EXPECT_EQ(nkeys, count(*h));
+    EXPECT_TRUE(SlabArena::owns(h->find(keys[0])));
+
+    h.reset();
+    ReadEpoch::drain();
+    EXPECT_EQ(0, global_stats.slabReservedBytes.load());
+    EXPECT_EQ(0, global_stats.slabUsedBytes.load());
+}
+
 TEST_F(HashTableTest, PoisonKey) {
     std::string k("A\\NROBs_oc)$zqJ1C.9?XU}Vn^(LW\"`+K/4lykF[ue0{ram;fvId6h=p&Zb3T~SQ]82'ixDP");
 
@@ -584,6 +913,76 @@ TEST_F(HashTableTest, ItemAge) {
     EXPECT_EQ(1, v->getValue()->getAge());
 }
 
+TEST_F(HashTableTest, InlineValues) {
+    global_stats.reset();
+    StoredValue::setInlineValueSize(32);
+    HashTable ht(global_stats, 5, 1);
+    size_t initialSize = global_stats.currentSize.load();
+
+    const std::string k("inline");
+    Item small(k.data(), k.length(), 0, 0, "counter:1", strlen("counter:1"));
+    EXPECT_EQ(WAS_CLEAN, ht.set(small));
+    StoredValue *v(ht.find(k));
+    ASSERT_TRUE(v);
+    EXPECT_TRUE(v->isValueInline());
+    EXPECT_TRUE(v->isResident());
+    EXPECT_EQ(small.getValue()->length(), v->valuelen());
+    value_t val = v->getValue();
+    EXPECT_EQ(0, memcmp("counter:1", val->getData(), val->vlength()));
+    EXPECT_EQ(small.getValue()->getDataType(), val->getDataType());
+
+    // The same value kept in a Blob costs the Blob on top.
+    StoredValue::setInlineValueSize(0);
+    const std::string k2("blobbed");
+    Item blobbed(k2.data(), k2.length(), 0, 0, "counter:1",
+                 strlen("counter:1"));
+    EXPECT_EQ(WAS_CLEAN, ht.set(blobbed));
+    StoredValue *v2(ht.find(k2));
+    ASSERT_TRUE(v2);
+    EXPECT_FALSE(v2->isValueInline());
+    EXPECT_LT(v->getObjectSize(),
+              v2->getObjectSize() + v2->getValue()->getSize());
+    StoredValue::setInlineValueSize(32);
+
+    // Values that fit keep using the space, bigger ones go to a Blob.
+    Item shorter(k.data(), k.length(), 0, 0, "c:2", strlen("c:2"));
+    EXPECT_EQ(WAS_DIRTY, ht.set(shorter));
+    EXPECT_TRUE(v->isValueInline());
+    EXPECT_EQ(0, memcmp("c:2", v->getValue()->getData(), 3));
+    std::string big(100, 'x');
+    Item bigger(k.data(), k.length(), 0, 0, big.data(), big.length());
+    EXPECT_EQ(WAS_DIRTY, ht.set(bigger));
+    EXPECT_FALSE(v->isValueInline());
+    EXPECT_EQ(big, std::string(v->getValue()->getData(),
+                               v->getValue()->vlength()));
+    EXPECT_EQ(WAS_DIRTY, ht.set(small));
+    EXPECT_TRUE(v->isValueInline());
+
+    // Read without a copy, and straight into an Item.
+    StoredValue::ValueView view = v->getValueView();
+    EXPECT_EQ(std::string("counter:1"), std::string(view.data, view.len));
+    EXPECT_EQ(small.getExtMetaLen(), view.extLen);
+    std::unique_ptr<Item> itm(v->toItem(false, 0));
+    EXPECT_EQ(0, memcmp("counter:1", itm->getData(), itm->getNBytes()));
+    EXPECT_EQ(small.getDataType(), itm->getDataType());
+
+    // Ejected and restored like any other value.
+    v->markClean();
+    EXPECT_TRUE(ht.unlocked_ejectItem(v, VALUE_ONLY));
+    EXPECT_FALSE(v->isResident());
+    EXPECT_FALSE(v->isValueInline());
+    EXPECT_TRUE(v->unlocked_restoreValue(&small, ht));
+    EXPECT_TRUE(v->isValueInline());
+    EXPECT_EQ(0, memcmp("counter:1", v->getValue()->getData(),
+                        v->getValue()->vlength()));
+
+    ht.clear();
+    EXPECT_EQ(0, ht.memSize.load());
+    EXPECT_EQ(0, ht.cacheSize.load());
+    EXPECT_EQ(initialSize, global_stats.currentSize.load());
+    StoredValue::setInlineValueSize(0);
+}
+
 /* static storage for environment variable set by putenv().
  *
  * (This must be static as putenv() essentially 'takes ownership' of
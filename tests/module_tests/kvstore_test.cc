@@ -26,6 +26,8 @@
 
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <algorithm>
+#include <random>
 #include <unordered_map>
 
 extern "C" {
@@ -355,6 +357,272 @@ TEST(CouchKVStoreTest, MB_18580_ENOENT) {
     delete kvstore;
 }
 
+class StatusCallback : public Callback<GetValue> {
+public:
+    StatusCallback() : status(ENGINE_FAILED) { }
+
+    void callback(GetValue &result) {
+        status = result.getStatus();
+        delete result.getValue();
+    }
+
+    ENGINE_ERROR_CODE status;
+};
+
+// Verify database handles are kept open between operations, and not used
+// once the file changed through another handle or was compacted.
+TEST(CouchKVStoreTest, DbHandleCacheTest) {
+    std::string data_dir("/tmp/kvstore-test");
+    CouchbaseDirectoryUtilities::rmrf(data_dir.c_str());
+
+    KVStoreConfig config(1024, 4, data_dir, "couchdb", 0,
+                         /*groupSync*/false, /*dbHandleCacheSize*/16);
+    auto kvstore = setup_kv_store(config);
+    std::unique_ptr<KVStore> rostore(KVStoreFactory::create(config, true));
+
+    uint8_t datatype = PROTOCOL_BINARY_RAW_BYTES;
+    WriteCallback wc;
+    StatsCallback sc;
+    for (int i = 1; i <= 3; i++) {
+        std::string key("key" + std::to_string(i));
+        kvstore->begin();
+        Item item(key.c_str(), key.length(),
+                  0, 0, "value", 5, &datatype, 1, 0, i);
+        kvstore->set(item, wc);
+        EXPECT_TRUE(kvstore->commit(&sc));
+
+        // The reader's handle predates the commit, then it is up to date.
+        for (int j = 0; j < 2; j++) {
+            StatusCallback gc;
+            rostore->get(key, 0, gc);
+            EXPECT_EQ(ENGINE_SUCCESS, gc.status);
+        }
+    }
+
+    std::map<std::string, std::string> stats;
+    kvstore->addStats("", add_stat_callback, &stats);
+    // Opened by the vbucket state snapshot of setup_kv_store only.
+    EXPECT_EQ("1", stats[":db_handle_cache_misses"]);
+    EXPECT_EQ("3", stats[":db_handle_cache_hits"]);
+    EXPECT_EQ("1", stats[":db_handles_open"]);
+
+    stats.clear();
+    rostore->addStats("", add_stat_callback, &stats);
+    EXPECT_EQ("3", stats[":db_handle_cache_misses"]);
+    EXPECT_EQ("3", stats[":db_handle_cache_hits"]);
+    EXPECT_EQ("50", stats[":db_handle_cache_hit_ratio"]);
+
+    std::shared_ptr<Callback<std::string&, bool&> >
+        filter(new BloomFilterCallback());
+    std::shared_ptr<Callback<std::string&, uint64_t&> >
+        expiry(new ExpiryCallback());
+
+    compaction_ctx cctx;
+    cctx.purge_before_seq = 0;
+    cctx.purge_before_ts = 0;
+    cctx.curr_time = 0;
+    cctx.drop_deletes = 0;
+    cctx.db_file_id = 0;
+    cctx.max_purged_seq = 0;
+    cctx.bloomFilterCallback = filter;
+    cctx.expiryCallback = expiry;
+    EXPECT_TRUE(kvstore->compactDB(&cctx, sc));
+
+    // The writer dropped its handle of the old file.
+    stats.clear();
+    kvstore->addStats("", add_stat_callback, &stats);
+    EXPECT_EQ("0", stats[":db_handles_open"]);
+
+    // The reader's handle is of the removed file, it finds the new one.
+    StatusCallback gc;
+    rostore->get("key1", 0, gc);
+    EXPECT_EQ(ENGINE_SUCCESS, gc.status);
+    stats.clear();
+    rostore->addStats("", add_stat_callback, &stats);
+    EXPECT_EQ("4", stats[":db_handle_cache_misses"]);
+}
+
+class ResultCallback : public Callback<mutation_result>,
+                       public Callback<int> {
+public:
+    ResultCallback() : insertion(false), deleted(-1) { }
+
+    void callback(mutation_result &result) {
+        insertion = result.second;
+    }
+
+    void callback(int &result) {
+        deleted = result;
+    }
+
+    bool insertion;
+    int deleted;
+};
+
+// Verify only keys of unknown presence are looked up before a save, and
+// the presence given by the caller is what the callbacks are told.
+TEST(CouchKVStoreTest, DocPresenceTest) {
+    std::string data_dir("/tmp/kvstore-test");
+    CouchbaseDirectoryUtilities::rmrf(data_dir.c_str());
+
+    KVStoreConfig config(1024, 4, data_dir, "couchdb", 0);
+    auto kvstore = setup_kv_store(config);
+
+    StatsCallback sc;
+    ResultCallback known, unknown;
+    Item item1("key1", 4, 0, 0, "value", 5);
+    Item item2("key2", 4, 0, 0, "value", 5);
+    kvstore->begin();
+    kvstore->set(item1, known, DocPresence::NOT_ON_DISK);
+    kvstore->set(item2, unknown);
+    EXPECT_TRUE(kvstore->commit(&sc));
+    EXPECT_TRUE(known.insertion);
+    EXPECT_TRUE(unknown.insertion);
+
+    std::map<std::string, std::string> stats;
+    kvstore->addStats("", add_stat_callback, &stats);
+    EXPECT_EQ("1", stats[":docinfo_lookups"]);
+    EXPECT_EQ("1", stats[":docinfo_lookups_skipped"]);
+
+    // key3 is not on disk, but it is not looked up to find that out.
+    Item item3("key3", 4, 0, 0, "value", 5);
+    kvstore->begin();
+    kvstore->set(item3, known, DocPresence::ON_DISK);
+    kvstore->set(item2, unknown);
+    EXPECT_TRUE(kvstore->commit(&sc));
+    EXPECT_FALSE(known.insertion);
+    EXPECT_FALSE(unknown.insertion);
+
+    kvstore->begin();
+    kvstore->del(item1, known, DocPresence::ON_DISK);
+    kvstore->del(item3, unknown);
+    EXPECT_TRUE(kvstore->commit(&sc));
+    EXPECT_EQ(1, known.deleted);
+    EXPECT_EQ(1, unknown.deleted);
+
+    stats.clear();
+    kvstore->addStats("", add_stat_callback, &stats);
+    EXPECT_EQ("3", stats[":docinfo_lookups"]);
+    EXPECT_EQ("3", stats[":docinfo_lookups_skipped"]);
+}
+
+// Verify the vbucket state local doc is written with every commit, and
+// what is read back is the last state.
+TEST(CouchKVStoreTest, VBStateWriteTest) {
+    std::string data_dir("/tmp/kvstore-test");
+    CouchbaseDirectoryUtilities::rmrf(data_dir.c_str());
+
+    KVStoreConfig config(1024, 4, data_dir, "couchdb", 0);
+    auto kvstore = setup_kv_store(config);
+
+    uint8_t datatype = PROTOCOL_BINARY_RAW_BYTES;
+    WriteCallback wc;
+    StatsCallback sc;
+    for (int i = 1; i <= 2; i++) {
+        std::string key("key" + std::to_string(i));
+        kvstore->begin();
+        Item item(key.c_str(), key.length(), 0, 0, "value", 5,
+                  &datatype, 1, 0, i);
+        kvstore->set(item, wc);
+        EXPECT_TRUE(kvstore->commit(&sc));
+    }
+
+    std::map<std::string, std::string> stats;
+    kvstore->addStats("", add_stat_callback, &stats);
+    // By the snapshot of setup_kv_store and both commits
+    EXPECT_EQ("3", stats[":vbstate_writes"]);
+
+    std::string failoverLog("[{\"id\":1,\"seq\":0}]");
+    vbucket_state state(vbucket_state_active, 0, 0, 2, 0, 2, 2, 0, 0,
+                        failoverLog);
+    EXPECT_TRUE(kvstore->snapshotVBucket(0, state, &sc, false));
+    kvstore->begin();
+    Item item("key3", 4, 0, 0, "value", 5, &datatype, 1, 0, 3);
+    kvstore->set(item, wc);
+    EXPECT_TRUE(kvstore->commit(&sc));
+
+    stats.clear();
+    kvstore->addStats("", add_stat_callback, &stats);
+    // The snapshot only updates the cached state, the commit writes it
+    EXPECT_EQ("4", stats[":vbstate_writes"]);
+
+    kvstore.reset();
+    std::unique_ptr<KVStore> reopened(KVStoreFactory::create(config));
+    vbucket_state *persisted = reopened->getVBucketState(0);
+    ASSERT_NE(nullptr, persisted);
+    EXPECT_EQ(2, persisted->lastSnapStart);
+    EXPECT_EQ(2, persisted->lastSnapEnd);
+}
+
+// Build a batch of nitems set items with keys with a common prefix, each
+// key several revisions on average.
+static std::vector<queued_item> makeWriteBatch(size_t nitems,
+                                               std::mt19937 &gen) {
+    uint8_t datatype = PROTOCOL_BINARY_RAW_BYTES;
+    std::uniform_int_distribution<size_t> keyno(0, nitems / 4);
+    std::vector<queued_item> items;
+    items.reserve(nitems);
+    for (size_t i = 0; i < nitems; ++i) {
+        std::string key("user::" + std::to_string(keyno(gen)));
+        items.push_back(queued_item(new Item(key.c_str(), key.length(),
+                                             0, 0, "value", 5, &datatype,
+                                             1, 0, i + 1)));
+    }
+    return items;
+}
+
+// Verify optimizeWrites() orders a batch exactly as sorting it with
+// CompareQueuedItemsBySeqnoAndKey does.
+TEST(CouchKVStoreTest, OptimizeWritesOrderTest) {
+    std::string data_dir("/tmp/kvstore-test");
+    CouchbaseDirectoryUtilities::rmrf(data_dir.c_str());
+
+    KVStoreConfig config(1024, 4, data_dir, "couchdb", 0);
+    auto kvstore = setup_kv_store(config);
+
+    std::mt19937 gen(17);
+    std::vector<queued_item> items = makeWriteBatch(1000, gen);
+    std::vector<queued_item> expected(items);
+    std::sort(expected.begin(), expected.end(),
+              CompareQueuedItemsBySeqnoAndKey());
+    kvstore->optimizeWrites(items);
+
+    ASSERT_EQ(expected.size(), items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        ASSERT_EQ(expected[i].get(), items[i].get()) << "at " << i;
+    }
+}
+
+// Compare the time optimizeWrites() and std::sort take on large batches.
+// Run with --gtest_also_run_disabled_tests.
+TEST(CouchKVStoreTest, DISABLED_OptimizeWritesBenchmark) {
+    std::string data_dir("/tmp/kvstore-test");
+    CouchbaseDirectoryUtilities::rmrf(data_dir.c_str());
+
+    KVStoreConfig config(1024, 4, data_dir, "couchdb", 0);
+    auto kvstore = setup_kv_store(config);
+
+    std::mt19937 gen(17);
+    for (size_t nitems : {100000, 1000000}) {
+        std::vector<queued_item> items = makeWriteBatch(nitems, gen);
+        std::vector<queued_item> sorted(items);
+
+        hrtime_t start = gethrtime();
+        std::sort(sorted.begin(), sorted.end(),
+                  CompareQueuedItemsBySeqnoAndKey());
+        hrtime_t sortTime = gethrtime() - start;
+
+        start = gethrtime();
+        kvstore->optimizeWrites(items);
+        hrtime_t optimizeTime = gethrtime() - start;
+
+        std::string n(std::to_string(nitems));
+        RecordProperty("sort_us_" + n, size_t(sortTime / 1000));
+        RecordProperty("optimize_writes_us_" + n,
+                       size_t(optimizeTime / 1000));
+    }
+}
+
 class MockCouchRequest : public CouchRequest {
 public:
     class MetaData {
@@ -18,17 +18,21 @@
 #include "config.h"
 
 #include <signal.h>
+#include <sys/stat.h>
 
 #include <algorithm>
+#include <iostream>
 #include <map>
 #include <set>
 #include <stdexcept>
 #include <vector>
 
+#include "access_log.h"
 #include "assert.h"
 #include "mutation_log.h"
 
 #define TMP_LOG_FILE "/tmp/mlt_test.log"
+#define TMP_ALOG_FILE "/tmp/mlt_test.alog"
 
 static void testUnconfigured() {
     MutationLog ml("");
@@ -518,7 +522,291 @@ static void testReadOnly() {
     }
 }
 
-int main(int, char **) {
+typedef std::vector<std::pair<std::string, uint64_t> > alog_batch_t;
+
+static bool alogBatchFun(uint16_t vb, alog_batch_t &batch, void *arg) {
+    std::map<uint16_t, alog_batch_t> *seen =
+        static_cast<std::map<uint16_t, alog_batch_t> *>(arg);
+    (*seen)[vb].insert((*seen)[vb].end(), batch.begin(), batch.end());
+    return true;
+}
+
+static bool alogKeyFun(void *arg, uint16_t vb, const std::string &k) {
+    std::map<uint16_t, alog_batch_t> *seen =
+        static_cast<std::map<uint16_t, alog_batch_t> *>(arg);
+    (*seen)[vb].push_back(std::make_pair(k, 0));
+    return true;
+}
+
+static bool alogStopFun(uint16_t, alog_batch_t &, void *arg) {
+    ++*static_cast<size_t *>(arg);
+    return false;
+}
+
+static void testAccessLog() {
+    remove(TMP_ALOG_FILE);
+
+    {
+        AccessLogWriter log(TMP_ALOG_FILE, 4096);
+        log.open();
+        std::vector<std::pair<uint64_t, std::string> > keys;
+        keys.push_back(std::make_pair(30, "user::1003"));
+        keys.push_back(std::make_pair(10, "user::1001"));
+        keys.push_back(std::make_pair(20, "user::10"));
+        log.addVBucket(3, keys);
+        keys.clear();
+        keys.push_back(std::make_pair(5, "key1"));
+        log.addVBucket(1, keys);
+        keys.clear();
+        log.addVBucket(2, keys);
+        cb_assert(log.getItemsLogged() == 4);
+        log.commit();
+    }
+
+    cb_assert(AccessLog::isAccessLog(TMP_ALOG_FILE));
+
+    AccessLogReader log(TMP_ALOG_FILE);
+    cb_assert(log.total() == 4);
+    cb_assert(log.getNumKeys(1) == 1);
+    cb_assert(log.getNumKeys(2) == 0);
+    cb_assert(log.getNumKeys(3) == 3);
+    cb_assert(log.getVBuckets() == std::vector<uint16_t>({1, 3}));
+
+    // Keys come back in seqno order
+    std::map<uint16_t, alog_batch_t> seen;
+    cb_assert(log.apply(3, 1000, &seen, alogBatchFun));
+    cb_assert(log.apply(2, 1000, &seen, alogBatchFun));
+    cb_assert(seen.size() == 1);
+    alog_batch_t &vb3 = seen[3];
+    cb_assert(vb3.size() == 3);
+    cb_assert(vb3[0] == std::make_pair(std::string("user::1001"),
+                                       uint64_t(10)));
+    cb_assert(vb3[1] == std::make_pair(std::string("user::10"),
+                                       uint64_t(20)));
+    cb_assert(vb3[2] == std::make_pair(std::string("user::1003"),
+                                       uint64_t(30)));
+
+    seen.clear();
+    cb_assert(log.apply(1, &seen, alogKeyFun));
+    cb_assert(seen[1].size() == 1 && seen[1][0].first == "key1");
+
+    size_t calls = 0;
+    cb_assert(!log.apply(3, 1, &calls, alogStopFun));
+    cb_assert(calls == 1);
+
+    // Not the format of a MutationLog
+    remove(TMP_LOG_FILE);
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open();
+        ml.newItem(3, "key1", 1);
+        ml.commit1();
+        ml.commit2();
+    }
+    cb_assert(!AccessLog::isAccessLog(TMP_LOG_FILE));
+    cb_assert(!AccessLog::isAccessLog("/tmp/this/path/does/not/exist"));
+
+    remove(TMP_LOG_FILE);
+    remove(TMP_ALOG_FILE);
+}
+
+static void testAccessLogBlocks() {
+    remove(TMP_ALOG_FILE);
+
+    // Small blocks so every vbucket spans several of them
+    const size_t numKeys = 10000;
+    size_t rawSize = 0;
+    {
+        AccessLogWriter log(TMP_ALOG_FILE, 512);
+        log.open();
+        for (uint16_t vb = 0; vb < 4; ++vb) {
+            std::vector<std::pair<uint64_t, std::string> > keys;
+            for (size_t i = 0; i < numKeys; ++i) {
+                std::string key("customer::" + std::to_string(vb) + "::" +
+                                std::to_string(i));
+                keys.push_back(std::make_pair(numKeys - i, key));
+                rawSize += MutationLogEntry::len(key.length());
+            }
+            log.addVBucket(vb, keys);
+        }
+        log.commit();
+    }
+
+    struct stat st;
+    cb_assert(stat(TMP_ALOG_FILE, &st) == 0);
+    cb_assert(size_t(st.st_size) < rawSize / 2);
+
+    AccessLogReader log(TMP_ALOG_FILE);
+    cb_assert(log.total() == 4 * numKeys);
+    for (uint16_t vb = 0; vb < 4; ++vb) {
+        std::map<uint16_t, alog_batch_t> seen;
+        cb_assert(log.apply(vb, 100, &seen, alogBatchFun));
+        cb_assert(seen[vb].size() == numKeys);
+        for (size_t i = 0; i < numKeys; ++i) {
+            cb_assert(seen[vb][i].second == i + 1);
+            cb_assert(seen[vb][i].first == "customer::" + std::to_string(vb) +
+                      "::" + std::to_string(numKeys - 1 - i));
+        }
+    }
+
+    remove(TMP_ALOG_FILE);
+}
+
+static void testAccessLogBadCRC() {
+    remove(TMP_ALOG_FILE);
+
+    {
+        AccessLogWriter log(TMP_ALOG_FILE, 4096);
+        log.open();
+        std::vector<std::pair<uint64_t, std::string> > keys;
+        keys.push_back(std::make_pair(1, "key1"));
+        keys.push_back(std::make_pair(2, "key2"));
+        log.addVBucket(3, keys);
+        log.commit();
+    }
+
+    // Break the first block, right after the header and its block header
+    int file = open(TMP_ALOG_FILE, O_RDWR, 0666);
+    off_t at = AccessLog::HEADER_SIZE + AccessLog::BLOCK_HEADER_SIZE + 2;
+    cb_assert(lseek(file, at, SEEK_SET) == at);
+    uint8_t b;
+    cb_assert(read(file, &b, sizeof(b)) == 1);
+    cb_assert(lseek(file, at, SEEK_SET) == at);
+    b = ~b;
+    cb_assert(write(file, &b, sizeof(b)) == 1);
+
+    {
+        AccessLogReader log(TMP_ALOG_FILE);
+        std::map<uint16_t, alog_batch_t> seen;
+        try {
+            log.apply(3, 1000, &seen, alogBatchFun);
+            abort();
+        } catch (MutationLog::CRCReadException &e) {
+            // expected
+        }
+        cb_assert(seen.empty());
+    }
+
+    // Break the key count in the header
+    b = 0xff;
+    cb_assert(lseek(file, 20, SEEK_SET) == 20);
+    cb_assert(write(file, &b, sizeof(b)) == 1);
+    close(file);
+
+    try {
+        AccessLogReader log(TMP_ALOG_FILE);
+        abort();
+    } catch (MutationLog::CRCReadException &e) {
+        // expected
+    }
+
+    remove(TMP_ALOG_FILE);
+}
+
+static void testAccessLogUncommitted() {
+    remove(TMP_ALOG_FILE);
+
+    {
+        AccessLogWriter log(TMP_ALOG_FILE, 4096);
+        log.open();
+        std::vector<std::pair<uint64_t, std::string> > keys;
+        keys.push_back(std::make_pair(1, "key1"));
+        log.addVBucket(3, keys);
+    }
+    cb_assert(access(TMP_ALOG_FILE, F_OK) == -1);
+
+    try {
+        AccessLogReader log(TMP_ALOG_FILE);
+        abort();
+    } catch (MutationLog::FileNotFoundException &e) {
+        // expected
+    }
+}
+
+static bool mlBenchFun(uint16_t, alog_batch_t &batch, void *arg) {
+    *static_cast<size_t *>(arg) += batch.size();
+    return true;
+}
+
+/*
+ * Time writing and harvesting numKeys keys over 1024 vbuckets, in the
+ * MutationLog format and in the sorted access log format.
+ */
+static void benchmarkAccessLog(size_t numKeys) {
+    const uint16_t numVbs = 1024;
+    std::vector<std::vector<std::pair<uint64_t, std::string> > > keys(numVbs);
+    for (size_t i = 0; i < numKeys; ++i) {
+        keys[i % numVbs].push_back(
+            std::make_pair(numKeys - i, "user::" + std::to_string(i)));
+    }
+    struct stat st;
+
+    remove(TMP_LOG_FILE);
+    hrtime_t start = gethrtime();
+    {
+        MutationLog ml(TMP_LOG_FILE, 4096);
+        ml.open();
+        for (uint16_t vb = 0; vb < numVbs; ++vb) {
+            for (auto &k : keys[vb]) {
+                ml.newItem(vb, k.second, k.first);
+            }
+        }
+        ml.commit1();
+        ml.commit2();
+    }
+    hrtime_t written = gethrtime();
+    size_t harvested = 0;
+    {
+        MutationLog ml(TMP_LOG_FILE);
+        ml.open(true);
+        MutationLogHarvester h(ml);
+        for (uint16_t vb = 0; vb < numVbs; ++vb) {
+            h.setVBucket(vb);
+        }
+        cb_assert(h.load());
+        harvested = h.total();
+    }
+    hrtime_t end = gethrtime();
+    cb_assert(stat(TMP_LOG_FILE, &st) == 0);
+    std::cout << "MutationLog: " << numKeys << " keys, " << st.st_size
+              << " bytes, write " << hrtime2text(written - start)
+              << ", harvest " << hrtime2text(end - written) << std::endl;
+    cb_assert(harvested >= numKeys);
+    remove(TMP_LOG_FILE);
+
+    remove(TMP_ALOG_FILE);
+    start = gethrtime();
+    {
+        AccessLogWriter log(TMP_ALOG_FILE, 4096);
+        log.open();
+        for (uint16_t vb = 0; vb < numVbs; ++vb) {
+            log.addVBucket(vb, keys[vb]);
+        }
+        log.commit();
+    }
+    written = gethrtime();
+    harvested = 0;
+    {
+        AccessLogReader log(TMP_ALOG_FILE);
+        for (uint16_t vb = 0; vb < numVbs; ++vb) {
+            log.apply(vb, 1000, &harvested, mlBenchFun);
+        }
+    }
+    end = gethrtime();
+    cb_assert(stat(TMP_ALOG_FILE, &st) == 0);
+    std::cout << "AccessLog: " << numKeys << " keys, " << st.st_size
+              << " bytes, write " << hrtime2text(written - start)
+              << ", harvest " << hrtime2text(end - written) << std::endl;
+    cb_assert(harvested == numKeys);
+    remove(TMP_ALOG_FILE);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--benchmark") == 0) {
+        benchmarkAccessLog(argc > 2 ? strtoul(argv[2], NULL, 10) : 10000000);
+        return 0;
+    }
+
     testReadOnly();
     testUnconfigured();
     testSyncSet();
@@ -528,6 +816,10 @@ int main(int, char **) {
     testLoggingBadCRC();
     testLoggingShortRead();
     testYUNOOPEN();
+    testAccessLog();
+    testAccessLogBlocks();
+    testAccessLogBadCRC();
+    testAccessLogUncommitted();
 
     remove(TMP_LOG_FILE);
     return 0;